@@ -193,6 +193,28 @@ nvme_km_LDADD = \
 EXTRA_nvme_km_DEPENDENCIES = \
 	$(KERNEL_MODULE_EXTRA_DEPENDENCIES_SHARED)
 
+#==========
+# Storage benchmark
+
+bin_PROGRAMS += storbench.km
+generate_symbols_list += storbench.km
+generate_kallsym_list += storbench.km
+
+storbench_km_SOURCES = \
+	kernel/storbench/storbench.cc
+
+storbench_km_CXXFLAGS = \
+	$(KERNEL_MODULE_CXXFLAGS_SHARED)
+
+storbench_km_LDFLAGS = \
+	$(call KERNEL_MODULE_LDFLAGS_FN,storbench)
+
+storbench_km_LDADD = \
+	$(KERNEL_MODULE_LDADD_SHARED)
+
+EXTRA_storbench_km_DEPENDENCIES = \
+	$(KERNEL_MODULE_EXTRA_DEPENDENCIES_SHARED)
+
 #==========
 # Kernel unit test module
 
@@ -216,7 +238,10 @@ unittest_km_SOURCES = \
 	kernel/unittest/test_nofault.cc \
 	kernel/unittest/test_block.cc \
 	kernel/unittest/test_filesystem.cc \
-	kernel/unittest/test_pipe.cc
+	kernel/unittest/test_pipe.cc \
+	kernel/unittest/test_zswap.cc \
+	kernel/unittest/test_filemap.cc \
+	kernel/unittest/test_virtio.cc
 
 unittest_km_CXXFLAGS = \
 	$(KERNEL_MODULE_CXXFLAGS_SHARED)
@@ -297,6 +322,50 @@ ide_km_LDADD = \
 EXTRA_ide_km_DEPENDENCIES = \
 	$(KERNEL_MODULE_EXTRA_DEPENDENCIES_SHARED)
 
+#==========
+# RAM backed storage device
+
+bin_PROGRAMS += ramdisk.km
+generate_symbols_list += ramdisk.km
+generate_kallsym_list += ramdisk.km
+
+ramdisk_km_SOURCES = \
+	kernel/device/ramdisk/ramdisk.cc
+
+ramdisk_km_CXXFLAGS = \
+	$(KERNEL_MODULE_CXXFLAGS_SHARED)
+
+ramdisk_km_LDFLAGS = \
+	$(call KERNEL_MODULE_LDFLAGS_FN,ramdisk)
+
+ramdisk_km_LDADD = \
+	$(KERNEL_MODULE_LDADD_SHARED)
+
+EXTRA_ramdisk_km_DEPENDENCIES = \
+	$(KERNEL_MODULE_EXTRA_DEPENDENCIES_SHARED)
+
+#==========
+# Striped and mirrored arrays of storage devices
+
+bin_PROGRAMS += raid.km
+generate_symbols_list += raid.km
+generate_kallsym_list += raid.km
+
+raid_km_SOURCES = \
+	kernel/device/raid/raid.cc
+
+raid_km_CXXFLAGS = \
+	$(KERNEL_MODULE_CXXFLAGS_SHARED)
+
+raid_km_LDFLAGS = \
+	$(call KERNEL_MODULE_LDFLAGS_FN,raid)
+
+raid_km_LDADD = \
+	$(KERNEL_MODULE_LDADD_SHARED)
+
+EXTRA_raid_km_DEPENDENCIES = \
+	$(KERNEL_MODULE_EXTRA_DEPENDENCIES_SHARED)
+
 #==========
 # Shared base virtio layer
 
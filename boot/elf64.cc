@@ -316,6 +316,8 @@ void load_initrd(int initrd_fd, off_t initrd_filesize, elf64_context_t *ctx)
 {
     ELF64_TRACE("Loading initrd...");
 
+    int64_t start_time = systime();
+
     // load initrd at -64TB
     initrd_base = -(UINT64_C(64) << 40);
 
@@ -340,6 +342,11 @@ void load_initrd(int initrd_fd, off_t initrd_filesize, elf64_context_t *ctx)
 
         progress(blk_size, blk_size, ctx);
     }
+
+    // systime ticks are 54.9ms, the kernel reports how long it took to
+    // unpack it, compressed or not
+    ELF64_TRACE("Loaded %" PRId64 " byte initrd in %" PRId64 "ms\n",
+                initrd_size, (systime() - start_time) * 549 / 10);
 }
 
 static void reloc_kernel(uint64_t distance,
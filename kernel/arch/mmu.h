@@ -16,7 +16,7 @@ HIDDEN extern physaddr_t root_physaddr;
 
 //HIDDEN extern void mmu_init(int ap);
 uintptr_t mm_create_process(void);
-void mm_destroy_process(void);
+KERNEL_API void mm_destroy_process(void);
 
 extern "C" isr_context_t *mmu_page_fault_handler(int intr, isr_context_t *ctx);
 
@@ -52,6 +52,7 @@ extern "C" isr_context_t *mmu_page_fault_handler(int intr, isr_context_t *ctx);
 #define PTE_EX_WAIT_BIT     (PTE_AVAIL2_BIT+0)
 #define PTE_EX_FILEMAP_BIT  (PTE_AVAIL2_BIT+1)
 #define PTE_EX_DEMAND_BIT   (PTE_AVAIL2_BIT+2)
+#define PTE_EX_SWAP_BIT     (PTE_AVAIL2_BIT+3)
 
 // Size of multi-bit fields
 #define PTE_PK_BITS         4
@@ -98,6 +99,7 @@ extern "C" isr_context_t *mmu_page_fault_handler(int intr, isr_context_t *ctx);
 #define PTE_EX_WAIT         (1UL << PTE_EX_WAIT_BIT)
 #define PTE_EX_FILEMAP      (1UL << PTE_EX_FILEMAP_BIT)
 #define PTE_EX_DEMAND       (1UL << PTE_EX_DEMAND_BIT)
+#define PTE_EX_SWAP         (1UL << PTE_EX_SWAP_BIT)
 
 //
 // PAT configuration
@@ -309,4 +311,13 @@ static _always_inline bool pte_is_guard(pte_t pte)
             ((PTE_ADDR >> 1) & PTE_ADDR);
 }
 
+// True if the page has been moved out to the compressed swap pool.
+// The physaddr field holds the swap slot number. Entries with the wait
+// bit set are owned by whoever is moving the page in or out
+_const
+static _always_inline bool pte_is_swap(pte_t pte)
+{
+    return (pte & (PTE_PRESENT | PTE_EX_SWAP | PTE_EX_WAIT)) == PTE_EX_SWAP;
+}
+
 __END_DECLS
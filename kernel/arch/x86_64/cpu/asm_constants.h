@@ -32,6 +32,6 @@
 
 #define THREAD_INFO_SIZE            512
 
-#define SYSCALL_COUNT   330
+#define SYSCALL_COUNT   331
 #define SYSCALL_ENOSYS  -81
 #define SYSCALL_RFLAGS  0x202
@@ -233,6 +233,11 @@ int msync(void const *addr, size_t len, int flags)
     return -1;
 }
 
+int mm_device_invalidate(void const *addr, size_t len)
+{
+    return -1;
+}
+
 uintptr_t mm_new_process(process_t *process, bool use64)
 {
     return 0;
@@ -341,6 +346,9 @@ bool mpresent(uintptr_t addr, size_t size)
 #include "nofault.h"
 #include "phys_alloc.h"
 #include "engunit.h"
+#include "zswap.h"
+#include "filemap.h"
+#include "blk_queue.h"
 
 // Allow G bit set in PDPT and PD in recursive page table mapping
 // This causes KVM to throw #PF(reserved_bit_set|present)
@@ -351,6 +359,18 @@ bool mpresent(uintptr_t addr, size_t size)
 #define DEBUG_PAGE_FAULT        0
 #define DEBUG_INVALIDATION      0
 
+// Move cold user pages into the compressed swap pool when memory is low
+#define ENABLE_ZSWAP            1
+
+// Start reclaiming when a user page fault sees fewer free pages than this
+#define ZSWAP_LOW_WATERMARK     1024
+
+// Number of pages to try to reclaim each time
+#define ZSWAP_RECLAIM_BATCH     64
+
+// Number of pages taken out of the page tables per TLB shootdown
+#define ZSWAP_UNMAP_BATCH       16
+
 #if DEBUG_INVALIDATION
 #define TRACE_INVALIDATE(...) printdbg("invl: " __VA_ARGS__)
 #else
@@ -605,6 +625,119 @@ static physaddr_t mmu_alloc_phys()
     return page;
 }
 
+// Allocate a page for a user page fault, pushing cold pages of the
+// current process out to the compressed swap pool if memory is low
+static physaddr_t mmu_alloc_phys_user()
+{
+#if ENABLE_ZSWAP
+    if (unlikely(phys_allocator.get_free_page_count() < ZSWAP_LOW_WATERMARK))
+        mm_swap_reclaim(ZSWAP_RECLAIM_BATCH);
+#endif
+
+    physaddr_t page = phys_allocator.alloc_one();
+
+#if ENABLE_ZSWAP
+    if (unlikely(!page) && mm_swap_reclaim(ZSWAP_RECLAIM_BATCH))
+        page = phys_allocator.alloc_one();
+#endif
+
+    if (unlikely(!page))
+        panic("Out of memory!\n");
+
+    return page;
+}
+
+//
+// Per-process page accounting
+
+// Number of pages currently used for page tables
+static uint64_t mmu_page_table_count;
+
+static void mmu_account(process_t *process, int64_t resident,
+                        int64_t committed, int64_t swapped)
+{
+    if (unlikely(!process))
+        return;
+
+    mm_process_usage_t &usage = process->mem_usage;
+
+    if (resident)
+        atomic_add(&usage.resident_pages, uint64_t(resident));
+
+    if (committed)
+        atomic_add(&usage.committed_pages, uint64_t(committed));
+
+    if (swapped)
+        atomic_add(&usage.swapped_pages, uint64_t(swapped));
+}
+
+// Accumulates page count changes for a range, applied once when done
+struct mmu_usage_delta_t {
+    int64_t resident = 0;
+    int64_t committed = 0;
+    int64_t swapped = 0;
+
+    // A user page table entry was replaced or cleared
+    void removed(pte_t pte, int64_t pages = 1)
+    {
+        if (!pte)
+            return;
+
+        committed -= pages;
+
+        if (pte_is_sysmem(pte))
+            resident -= pages;
+        else if ((pte & (PTE_PRESENT | PTE_EX_SWAP)) == PTE_EX_SWAP)
+            swapped -= pages;
+    }
+
+    void apply(process_t *process) const
+    {
+        mmu_account(process, resident, committed, swapped);
+    }
+};
+
+static _always_inline uint64_t swap_slot_from_pte(pte_t pte)
+{
+    return (pte & PTE_ADDR) >> PTE_ADDR_BIT;
+}
+
+// Returns false if the page contents could not be recovered
+static bool mmu_swap_in(pte_t *ptep, pte_t pte, bool write)
+{
+    uint64_t st = time_ns();
+
+    // Claim the entry, other threads faulting on it wait for PTE_EX_WAIT
+    pte_t claim = pte | PTE_EX_WAIT;
+    if (unlikely(!atomic_cmpxchg_upd(ptep, &pte, claim)))
+        return true;
+
+    physaddr_t page = mmu_alloc_phys_user();
+
+    errno_t err = zswap_load(swap_slot_from_pte(pte), page);
+
+    if (unlikely(err != errno_t::OK)) {
+        printdbg("Swap in failed, slot=%#" PRIx64 ", err=%d\n",
+                 swap_slot_from_pte(pte), int(err));
+        mmu_free_phys(page);
+        atomic_st_rel(ptep, pte);
+        return false;
+    }
+
+    pte_t replacement = (pte & ~PTE_ADDR & ~PTE_EX_SWAP) | page |
+            PTE_PRESENT | PTE_ACCESSED | (write ? PTE_DIRTY : 0);
+
+    // If it was unmapped while we were reading it, nobody wants the page
+    if (likely(atomic_cmpxchg(ptep, claim, replacement) == claim))
+        mmu_account(thread_current_process(), 1, 0, -1);
+    else
+        mmu_free_phys(page);
+
+    zswap_account_fault(time_ns() - st);
+
+    return true;
+}
+
 //
 // Path to PTE
 
@@ -967,7 +1100,9 @@ void mm_phys_clear_init()
     }
 }
 
-static void clear_phys(physaddr_t addr)
+// Point the window at the physical page and return its linear address.
+// Caller must hold the window lock
+static char *phys_window_map(physaddr_t addr)
 {
     size_t index = 0;
     pte_t& pte = clear_phys_state.pte[index << 3];
@@ -991,8 +1126,6 @@ static void clear_phys(physaddr_t addr)
 
     offset = addr - base;
 
-    clear_phys_state_t::scoped_lock lock(clear_phys_state.locks[index]);
-
     linaddr_t window = clear_phys_state_t::addr +
             (index << (3 + clear_phys_state.log2_window_sz));
 
@@ -1005,7 +1138,28 @@ static void clear_phys(physaddr_t addr)
     // Shootdowns for this are never done so just flush that TLB entry
     cpu_page_invalidate(window);
 
-    clear64((char*)window + offset, PAGE_SIZE >> 3);
+    return (char*)window + offset;
+}
+
+static void clear_phys(physaddr_t addr)
+{
+    clear_phys_state_t::scoped_lock lock(clear_phys_state.locks[0]);
+
+    clear64(phys_window_map(addr), PAGE_SIZE >> 3);
+}
+
+void mm_copy_from_phys(void *dst, uintptr_t src_physaddr)
+{
+    clear_phys_state_t::scoped_lock lock(clear_phys_state.locks[0]);
+
+    memcpy(dst, phys_window_map(src_physaddr), PAGE_SIZE);
+}
+
+void mm_copy_to_phys(uintptr_t dst_physaddr, void const *src)
+{
+    clear_phys_state_t::scoped_lock lock(clear_phys_state.locks[0]);
+
+    memcpy(phys_window_map(dst_physaddr), src, PAGE_SIZE);
 }
 
 //
@@ -1033,6 +1187,7 @@ static void mmu_map_page(linaddr_t addr, physaddr_t physaddr, pte_t flags)
                 physaddr_t ptaddr = init_take_page();
                 clear_phys(ptaddr);
                 *ptes[i] = (ptaddr | path_flags) & global_mask;
+                ++mmu_page_table_count;
                 if (i < 3)
                     cpu_page_invalidate(uintptr_t(ptes[i + 1]));
             }
@@ -1118,8 +1273,10 @@ static void mmu_send_tlb_shootdown(bool synchronous = false)
 
     // Wait for the shootdowns to proceed
     if (unlikely(synchronous)) {
+#if DEBUG_INVALIDATION
         uint64_t wait_st = time_ns();
         uint64_t loops = 0;
+#endif
         for (int wait_count = cpu_count - 1; wait_count > 0; pause()) {
             for (uint32_t i = 0; i < cpu_count; ++i) {
                 uint64_t &count = shootdown_counts[i];
@@ -1129,14 +1286,412 @@ static void mmu_send_tlb_shootdown(bool synchronous = false)
                     --wait_count;
                 }
             }
+#if DEBUG_INVALIDATION
             ++loops;
+#endif
         }
+#if DEBUG_INVALIDATION
         uint64_t wait_en = time_ns();
 
-        printdbg("TLB shootdown waited for "
-                 "%" PRIu64 " loops, %ss\n", loops,
-                 engineering_t(wait_en - wait_st, -3).ptr());
+        TRACE_INVALIDATE("TLB shootdown waited for "
+                         "%" PRIu64 " loops, %ss\n", loops,
+                         engineering_t(wait_en - wait_st, -3).ptr());
+#endif
+    }
+}
+
+// Invoked by the kernel linear allocator when a batch of released ranges
+// must be forgotten by every CPU before reuse
+static void mmu_linear_tlb_flush(bool synchronous)
+{
+    mmu_send_tlb_shootdown(synchronous);
+}
+
+//
+// Unmap gather
+
+static mm_unmap_stats_t mmu_unmap_stats;
+
+// Held while scanning for pages to swap out, which keeps pointers into
+// page tables, so munmap must not free page tables concurrently
+static ext::mutex swap_reclaim_lock;
+
+__BEGIN_ANONYMOUS
+
+// Accumulates everything released by an unmap, so other CPUs are told to
+// forget the mappings once, before any of the memory can be reused.
+// Entries are page aligned physical addresses with the log2 page count
+// in the low bits, so a large page is one entry
+class mmu_gather_t {
+public:
+    mmu_gather_t() = default;
+
+    ~mmu_gather_t()
+    {
+        finish();
+    }
+
+    mmu_gather_t(mmu_gather_t const&) = delete;
+    mmu_gather_t &operator=(mmu_gather_t const&) = delete;
+
+    // Queue the 1 << order pages mapped by a removed leaf entry
+    void free_page(physaddr_t addr, unsigned order = 0)
+    {
+        // Can't free demand page entry
+        if (unlikely(!addr || addr == PTE_ADDR))
+            return;
+
+        push(addr | order);
+        page_count += size_t(1) << order;
+    }
+
+    // Queue a page table page that has been unlinked from its parent
+    void free_table(physaddr_t addr)
+    {
+        push(addr);
+        ++table_count;
+    }
+
+    // A removed entry may be cached in another CPU's TLB
+    void set_dirty()
+    {
+        dirty = true;
+    }
+
+    bool is_dirty() const
+    {
+        return dirty;
+    }
+
+    // The caller takes over the shootdown
+    void clear_dirty()
+    {
+        dirty = false;
+    }
+
+    // Nothing is queued to be freed
+    bool empty() const
+    {
+        return !inline_count && !chunks;
+    }
+
+    // Shoot down, then release everything queued so far
+    void finish();
+
+private:
+    struct chunk_t {
+        static constexpr size_t size = 16 << 10;
+        static constexpr size_t capacity =
+                (size - sizeof(chunk_t*) - sizeof(size_t)) /
+                sizeof(physaddr_t);
+
+        chunk_t *next;
+        size_t count;
+        physaddr_t entries[capacity];
+    };
+
+    C_ASSERT(sizeof(chunk_t) <= chunk_t::size);
+
+    void push(physaddr_t entry);
+    static void release(mmu_phys_allocator_t::free_batch_t &free_batch,
+                        physaddr_t const *entries, size_t count);
+
+    physaddr_t inline_entries[64];
+    size_t inline_count = 0;
+    chunk_t *chunks = nullptr;
+    size_t page_count = 0;
+    size_t table_count = 0;
+    bool dirty = false;
+};
+
+void mmu_gather_t::push(physaddr_t entry)
+{
+    if (likely(inline_count < countof(inline_entries))) {
+        inline_entries[inline_count++] = entry;
+        return;
+    }
+
+    if (!chunks || chunks->count == chunk_t::capacity) {
+        // Kernel mmap never frees anything, so it can't recurse into here.
+        // Chunks are not taken from the heap because the heap unmaps
+        void *mem = mmap(nullptr, chunk_t::size, PROT_READ | PROT_WRITE,
+                         MAP_POPULATE);
+
+        if (unlikely(mem == MAP_FAILED)) {
+            // Out of memory, do what we have so far and start over
+            finish();
+            inline_entries[inline_count++] = entry;
+            return;
+        }
+
+        chunk_t *chunk = (chunk_t*)mem;
+        chunk->next = chunks;
+        chunk->count = 0;
+        chunks = chunk;
     }
+
+    chunks->entries[chunks->count++] = entry;
+}
+
+void mmu_gather_t::release(mmu_phys_allocator_t::free_batch_t &free_batch,
+                           physaddr_t const *entries, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        physaddr_t base = entries[i] & -PAGE_SIZE;
+        size_t pages = size_t(1) << (entries[i] & PAGE_MASK);
+
+        for (size_t p = 0; p < pages; ++p)
+            free_batch.free(base + (p << PAGE_SCALE));
+    }
+}
+
+void mmu_gather_t::finish()
+{
+    if (!inline_count && !chunks && !dirty)
+        return;
+
+    atomic_inc(&mmu_unmap_stats.gather_count);
+
+    if (dirty) {
+        // Waiting for the other CPUs is only possible with irqs enabled
+        mmu_send_tlb_shootdown(cpu_irq_is_enabled());
+        atomic_inc(&mmu_unmap_stats.shootdown_count);
+    }
+
+    dirty = false;
+
+    mmu_phys_allocator_t::free_batch_t free_batch(phys_allocator);
+
+    release(free_batch, inline_entries, inline_count);
+    inline_count = 0;
+
+    while (chunks) {
+        chunk_t *chunk = chunks;
+        chunks = chunk->next;
+        release(free_batch, chunk->entries, chunk->count);
+        munmap(chunk, chunk_t::size);
+    }
+
+    free_batch.flush();
+
+    atomic_add(&mmu_unmap_stats.page_count, page_count);
+    atomic_add(&mmu_unmap_stats.table_count, table_count);
+    atomic_add(&mmu_page_table_count, -table_count);
+    page_count = 0;
+    table_count = 0;
+}
+
+__END_ANONYMOUS
+
+void mm_get_unmap_stats(mm_unmap_stats_t *stats)
+{
+    stats->gather_count = atomic_ld_acq(&mmu_unmap_stats.gather_count);
+    stats->shootdown_count = atomic_ld_acq(&mmu_unmap_stats.shootdown_count);
+    stats->page_count = atomic_ld_acq(&mmu_unmap_stats.page_count);
+    stats->table_count = atomic_ld_acq(&mmu_unmap_stats.table_count);
+}
+
+//
+// User file mappings
+
+// Fault in a page of a user file mapping from the file page cache.
+// Returns false if the address is not in a file mapping,
+// or the page could not be read
+static bool mmu_filemap_fault(pte_t *ptep, pte_t pte,
+                              linaddr_t fault_addr, bool write)
+{
+    filemap_fault_t info;
+
+    if (unlikely(!filemap_lookup(thread_current_process(),
+                                 fault_addr, &info)))
+        return false;
+
+    void *cache_page = (!write || info.writable)
+            ? filemap_get_page(info.cache, info.index)
+            : nullptr;
+
+    if (unlikely(!cache_page)) {
+        filemap_release(info.cache);
+        return false;
+    }
+
+    physaddr_t page = mphysaddr(cache_page);
+
+    pte_t replacement = (pte & ~PTE_ADDR) | PTE_PRESENT | PTE_ACCESSED;
+
+    if (info.shared) {
+        // Every shared mapping writes into the cache page. Reads map it
+        // read only, so the first write is seen and the page is synced
+        // before I/O that bypasses the cache
+        phys_allocator.addref(page);
+
+        if (write) {
+            filemap_mark_dirty(info.cache, info.index);
+            replacement |= PTE_DIRTY;
+        } else {
+            replacement &= ~PTE_WRITABLE;
+        }
+    } else if (write) {
+        // Private mapping written before it was read, copy right away
+        page = mmu_alloc_phys_user();
+
+        mm_copy_to_phys(page, cache_page);
+
+        replacement |= PTE_DIRTY;
+    } else {
+        // Private mapping shares the cache page until it is written
+        phys_allocator.addref(page);
+
+        replacement &= ~PTE_WRITABLE;
+    }
+
+    replacement |= page;
+
+    // Update PTE and restart instruction
+    if (likely(atomic_cmpxchg(ptep, pte, replacement) == pte)) {
+        mmu_account(thread_current_process(), 1, 0, 0);
+    } else {
+        // Another thread beat us to it
+        mmu_free_phys(page);
+        cpu_page_invalidate(fault_addr);
+    }
+
+    filemap_release(info.cache);
+
+    return true;
+}
+
+// Handle a write to a present, write protected file page. A private page
+// still shared with the page cache gets a private copy. A shared page was
+// mapped read only by a read fault, or, like a private copy, was write
+// protected by mprotect, and only needs to become writable (a shared page
+// is recorded as written first). Returns false if the mapping does not
+// allow writes
+static bool mmu_filemap_cow(pte_t *ptep, pte_t pte, linaddr_t fault_addr)
+{
+    filemap_fault_t info;
+
+    if (unlikely(!filemap_lookup(thread_current_process(),
+                                 fault_addr, &info)))
+        return false;
+
+    void *cache_page = info.writable
+            ? filemap_get_page(info.cache, info.index)
+            : nullptr;
+
+    if (unlikely(!cache_page)) {
+        filemap_release(info.cache);
+        return false;
+    }
+
+    if (info.shared || (pte & PTE_ADDR) != mphysaddr(cache_page)) {
+        if (info.shared)
+            filemap_mark_dirty(info.cache, info.index);
+
+        // Writes go to the page already mapped, other CPUs can only
+        // hold the read only translation, which just faults again
+        pte_t replacement = pte | PTE_WRITABLE | PTE_ACCESSED | PTE_DIRTY;
+
+        if (likely(atomic_cmpxchg_upd(ptep, &pte, replacement)))
+            cpu_page_invalidate(fault_addr);
+    } else {
+        // The read only PTE points at the cache page, copy it from there
+        physaddr_t copy = mmu_alloc_phys_user();
+
+        mm_copy_to_phys(copy, cache_page);
+
+        pte_t replacement = (pte & ~PTE_ADDR) | copy |
+                PTE_WRITABLE | PTE_ACCESSED | PTE_DIRTY;
+
+        if (likely(atomic_cmpxchg_upd(ptep, &pte, replacement))) {
+            // Other threads may still be reading through
+            // the read only translation
+            cpu_page_invalidate(fault_addr);
+            mmu_send_tlb_shootdown();
+
+            mmu_free_phys(pte & PTE_ADDR);
+        } else {
+            // It changed underneath us, let the instruction fault again
+            mmu_free_phys(copy);
+        }
+    }
+
+    filemap_release(info.cache);
+
+    return true;
+}
+
+// Write dirty pages of shared file mappings in [st,en) back to the file
+static int mmu_filemap_sync(linaddr_t st, linaddr_t en)
+{
+    process_t *process = thread_current_process();
+
+    if (!filemap_any(process))
+        return 0;
+
+    ext::vector<linaddr_t> dirty;
+
+    pte_t *ptes[4];
+
+    for (linaddr_t addr = st; addr < en; ) {
+        ptes_from_addr(ptes, addr);
+        int present_mask = ptes_present(ptes);
+
+        if ((present_mask & 0x07) != 0x07) {
+            // Skip the whole missing table
+            size_t skip_shift = !(present_mask & 1)
+                    ? 12 + 9 * 3
+                    : !(present_mask & 2)
+                    ? 12 + 9 * 2
+                    : 12 + 9;
+
+            addr = (addr + (linaddr_t(1) << skip_shift)) &
+                    -(linaddr_t(1) << skip_shift);
+            continue;
+        }
+
+        pte_t pte = *ptes[3];
+
+        if ((pte & (PTE_PRESENT | PTE_DIRTY | PTE_EX_FILEMAP)) ==
+                (PTE_PRESENT | PTE_DIRTY | PTE_EX_FILEMAP)) {
+            // Clean it before writing it, so a store that races
+            // with the writeback dirties it again
+            atomic_and(ptes[3], ~PTE_DIRTY);
+            cpu_page_invalidate(addr);
+
+            if (unlikely(!dirty.push_back(addr)))
+                return -int(errno_t::ENOMEM);
+        }
+
+        addr += PAGE_SIZE;
+    }
+
+    if (dirty.empty())
+        return 0;
+
+    // Other CPUs must stop writing through the dirty translations
+    mmu_send_tlb_shootdown(cpu_irq_is_enabled());
+
+    int result = 0;
+
+    for (linaddr_t addr : dirty) {
+        filemap_fault_t info;
+
+        if (!filemap_lookup(process, addr, &info))
+            continue;
+
+        // Private pages are copies, they are never written back
+        errno_t err = info.shared
+                ? filemap_writeback(info.cache, info.index)
+                : errno_t::OK;
+
+        filemap_release(info.cache);
+
+        if (unlikely(err != errno_t::OK && result == 0))
+            result = -int(err);
+    }
+
+    return result;
 }
 
 static intptr_t mmu_device_from_addr(linaddr_t rounded_addr)
@@ -1228,9 +1783,9 @@ start_over:
                 (pte & (PTE_WRITABLE | PTE_EX_DEMAND | PTE_EX_WAIT)) ==
                 PTE_EX_DEMAND) {
 
-            physaddr_t page = phys_allocator.alloc_one();
-
-            assert(page != 0);
+            physaddr_t page = fault_addr < 0x800000000000
+                    ? mmu_alloc_phys_user()
+                    : mmu_alloc_phys();
 
             for (;;) {
                 pte_t replacement = (pte & ~PTE_ADDR & ~PTE_EX_DEMAND) |
@@ -1241,8 +1796,11 @@ start_over:
                         (zeros_page | PTE_WRITABLE));
 
                 // Restart instruction if PTE update completes successfully
-                if (likely(atomic_cmpxchg_upd(ptes[3], &pte, replacement)))
+                if (likely(atomic_cmpxchg_upd(ptes[3], &pte, replacement))) {
+                    if (fault_addr < 0x800000000000)
+                        mmu_account(thread_current_process(), 1, 0, 0);
                     return ctx;
+                }
 
                 if (unlikely(!((pte &
                         (PTE_WRITABLE | PTE_EX_DEMAND | PTE_EX_WAIT)) ==
@@ -1255,6 +1813,15 @@ start_over:
             }
         }
 
+        // If it is a write to a private file page that is still shared
+        // with the page cache, give it a private copy and continue
+        if ((err_code & CTX_ERRCODE_PF_W) &&
+                fault_addr < 0x800000000000 &&
+                (pte & (PTE_WRITABLE | PTE_EX_FILEMAP | PTE_EX_DEMAND)) ==
+                PTE_EX_FILEMAP &&
+                mmu_filemap_cow(ptes[3], pte, fault_addr))
+            return ctx;
+
         // It is a not a lazy shootdown, if
         //  - there was a reserved bit violation, or,
         //  - there was a protection key violation, or,
@@ -1276,10 +1843,28 @@ start_over:
 
     // If the page table exists
     if (present_mask == 0x07) {
-        // If it is lazy allocated
-        if ((pte & (PTE_ADDR | PTE_EX_DEVICE)) == PTE_ADDR) {
+        if (pte_is_swap(pte)) {
+            // Bring the page back from the compressed swap pool,
+            // unhandled exception if the contents could not be recovered
+            return likely(mmu_swap_in(ptes[3], pte,
+                                      err_code & CTX_ERRCODE_PF_W))
+                    ? ctx
+                    : nullptr;
+        } else if ((pte & (PTE_ADDR | PTE_EX_FILEMAP | PTE_EX_DEVICE)) ==
+                   (PTE_ADDR | PTE_EX_FILEMAP)) {
+            // User file mapping, map the page from the file page cache,
+            // unhandled exception if it could not be read
+            return likely(mmu_filemap_fault(ptes[3], pte, fault_addr,
+                                            err_code & CTX_ERRCODE_PF_W))
+                    ? ctx
+                    : nullptr;
+        } else if ((pte & (PTE_ADDR | PTE_EX_DEVICE)) == PTE_ADDR) {
+            // It is lazy allocated
+
             // Allocate a page
-            physaddr_t page = mmu_alloc_phys();
+            physaddr_t page = fault_addr < 0x800000000000
+                    ? mmu_alloc_phys_user()
+                    : mmu_alloc_phys();
 
             assert(page != 0);
 
@@ -1306,7 +1891,10 @@ start_over:
                     (zeros_page | PTE_WRITABLE));
 
             // Update PTE and restart instruction
-            if (unlikely(atomic_cmpxchg(ptes[3], pte, replacement) != pte)) {
+            if (likely(atomic_cmpxchg(ptes[3], pte, replacement) == pte)) {
+                if (fault_addr < 0x800000000000)
+                    mmu_account(thread_current_process(), 1, 0, 0);
+            } else {
                 // Another thread beat us to it
                 mmu_free_phys(page);
                 page = 0;
@@ -1358,9 +1946,22 @@ start_over:
             mapping->active_read = mapping_offset;
             lock.unlock();
 
-            int io_result = mapping->callback(
-                        mapping->context, (void*)rounded_addr,
-                        mapping_offset, 0x10000, true, false);
+            int io_result;
+
+            {
+                // Reads the handler makes are batched, and all arrive
+                // before anything is marked present
+                blk_plug_t plug(true);
+
+                io_result = mapping->callback(
+                            mapping->context, (void*)rounded_addr,
+                            mapping_offset, 0x10000, true, false);
+
+                errno_t err = plug.wait();
+
+                if (io_result >= 0 && unlikely(err != errno_t::OK))
+                    io_result = -int(err);
+            }
 
             if (likely(io_result >= 0)) {
                 // Mark the range present from end to start
@@ -2100,7 +2701,9 @@ static pte_t *mm_create_pagetables_aligned(
                         (zeros_page | PTE_WRITABLE));
 
                 pte_t previous = atomic_cmpxchg(base + i, old, replacement);
-                if (unlikely(previous != old)) {
+                if (likely(previous == old)) {
+                    atomic_inc(&mmu_page_table_count);
+                } else {
                     assert(pte_is_sysmem(previous));
                     free_batch.free(page);
                 }
@@ -2138,8 +2741,9 @@ KERNEL_API void *mm_alloc_space(size_t size)
 void *mmap(void *addr, size_t len, int prot,
                   int flags, int fd, off_t offset)
 {
-    (void)offset;
-    assert(offset == 0);
+    // File offsets must be page aligned, and need a file
+    if (unlikely(offset < 0 || (offset & PAGE_MASK) || (offset && fd < 0)))
+        return MAP_FAILED;
 
     // Fail on invalid protection mask
     if (unlikely(prot != (prot & (PROT_READ | PROT_WRITE | PROT_EXEC))))
@@ -2156,6 +2760,10 @@ void *mmap(void *addr, size_t len, int prot,
     if (unlikely((flags & MAP_USER) && (flags & user_prohibited)))
         return MAP_FAILED;
 
+    if (unlikely((flags & (MAP_SHARED | MAP_PRIVATE)) ==
+                 (MAP_SHARED | MAP_PRIVATE)))
+        return MAP_FAILED;
+
     if (unlikely(len == 0))
         return nullptr;
 
@@ -2179,11 +2787,19 @@ void *mmap(void *addr, size_t len, int prot,
     page_flags |= zero_if_false(flags & MAP_PHYSICAL,
                                 PTE_EX_PHYSICAL | PTE_PRESENT);
 
+    // User file mappings fault pages in from the file page cache,
+    // kernel file mappings go through the device mapping path
     page_flags |= zero_if_false(fd >= 0 && !(flags & MAP_DEVICE),
-                                PTE_EX_FILEMAP | PTE_EX_DEVICE);
+                                (flags & MAP_USER)
+                                ? PTE_EX_FILEMAP
+                                : PTE_EX_FILEMAP | PTE_EX_DEVICE);
+
+    bool const user_filemap = (page_flags &
+            (PTE_EX_FILEMAP | PTE_EX_DEVICE)) == PTE_EX_FILEMAP;
 
-    // Force nocommit if filemapping
+    // Force nocommit if filemapping, pages come from the file
     flags |= zero_if_false(page_flags & PTE_EX_FILEMAP, MAP_NOCOMMIT);
+    flags &= ~zero_if_false(page_flags & PTE_EX_FILEMAP, MAP_POPULATE);
 
     if (likely(!(flags & MAP_WEAKORDER))) {
         page_flags |= zero_if_false(flags & MAP_NOCACHE, PTE_PCD);
@@ -2279,10 +2895,27 @@ void *mmap(void *addr, size_t len, int prot,
                          " address space took %" PRIu64 " cycles\n",
                          len, cpu_rdtsc() - profile_linear_st) );
 
+    if (user_filemap) {
+        // Register the file range before any page of it can fault
+        process_t *process = thread_current_process();
+
+        filemap_remove(process, linear_addr, linear_addr + len);
+
+        errno_t err = filemap_insert(process, linear_addr, len, fd, offset,
+                                     flags & MAP_SHARED, prot & PROT_WRITE);
+
+        if (unlikely(err != errno_t::OK)) {
+            allocator->release_linear(linear_addr, len);
+            return MAP_FAILED;
+        }
+    }
+
     assert(linear_addr > 0x100000);
 
     mmu_phys_allocator_t::free_batch_t free_batch(phys_allocator);
 
+    mmu_usage_delta_t usage;
+
     if (likely(!usable_early_mem_ranges)) {
         // Normal operation
 
@@ -2320,6 +2953,9 @@ void *mmap(void *addr, size_t len, int prot,
                     PTE_PRESENT)
                     free_batch.free(old & PTE_ADDR);
 
+                usage.removed(old);
+                ++usage.resident;
+
                 return true;
             });
 
@@ -2366,20 +3002,26 @@ void *mmap(void *addr, size_t len, int prot,
                     pte = atomic_xchg(base_pte, pte);
 
                     ++ofs;
+                    ++usage.resident;
                 } else if (paddr && MAP_STACK ==
                            (flags & (MAP_STACK | MAP_NOCOMMIT))) {
                     // Commit last page
 
                     pte = atomic_xchg(base_pte + --end, pte);
+                    ++usage.resident;
                 }
 
                 if (unlikely(pte_is_sysmem(pte)))
                     free_batch.free(pte & PTE_ADDR);
+
+                usage.removed(pte);
             }
 
             pte_t demand_fill;
 
-            if (!(flags & MAP_DEVICE))
+            if (user_filemap && (prot & (PROT_READ | PROT_WRITE)))
+                demand_fill = page_flags | PTE_ADDR;
+            else if (!(flags & MAP_DEVICE))
                 demand_fill = (page_flags & ~PTE_WRITABLE) |
                         ((prot & (PROT_READ | PROT_WRITE))
                         ? (zeros_page | PTE_PRESENT | PTE_EX_DEMAND)
@@ -2398,6 +3040,8 @@ void *mmap(void *addr, size_t len, int prot,
 
                 if (unlikely(pte_is_sysmem(pte)))
                     free_batch.free(pte & PTE_ADDR);
+
+                usage.removed(pte);
             }
         } else if (flags & MAP_PHYSICAL) {
 
@@ -2528,6 +3172,11 @@ void *mmap(void *addr, size_t len, int prot,
 
     assert(linear_addr > 0x100000);
 
+    if (flags & MAP_USER) {
+        usage.committed += len >> PAGE_SCALE;
+        usage.apply(thread_current_process());
+    }
+
     PROFILE_MMAP_ONLY( printdbg("mmap of %zd bytes took %" PRIu64 " cycles\n",
                                 len, cpu_rdtsc() - profile_st); )
 
@@ -2623,6 +3272,11 @@ void *mremap(
             if (unlikely(pte_is_sysmem(pte)))
                 free_batch.free(pte & PTE_ADDR);
         }
+
+        if (low)
+            mmu_account(thread_current_process(),
+                        0, new_size >> PAGE_SCALE, 0);
+
         return (void*)old_st;
     }
 
@@ -2648,9 +3302,52 @@ void *mremap(
             free_batch.free(pte & PTE_ADDR);
     }
 
+    if (low)
+        mmu_account(thread_current_process(),
+                    0, (new_size - old_size) >> PAGE_SCALE, 0);
+
     return (void*)new_st;
 }
 
+// Unlink and queue the page tables of every 2MB region entirely inside
+// [st,en). The caller has already cleared all of their entries
+static void mmu_unmap_tables(mmu_gather_t &gather, linaddr_t st, linaddr_t en)
+{
+    ext::unique_lock<ext::mutex> lock(swap_reclaim_lock, ext::defer_lock_t());
+
+    // Leaving empty tables behind is harmless, don't wait for reclaim
+    if (!lock.try_lock())
+        return;
+
+    pte_t *ptes[4];
+
+    for (linaddr_t addr = (st + (1 << 21) - 1) & -(1 << 21);
+         addr + (1 << 21) <= en; addr += (1 << 21)) {
+        ptes_from_addr(ptes, addr);
+
+        if ((ptes_present(ptes) & 0x7) != 0x7 ||
+                (*ptes[2] & PTE_PAGESIZE))
+            continue;
+
+        // Something raced in a new mapping, keep the table
+        pte_t const *pt = ptes[3];
+        pte_t combined = 0;
+        for (size_t i = 0; i < 512; ++i)
+            combined |= pt[i];
+
+        if (combined)
+            continue;
+
+        pte_t pde = atomic_xchg(ptes[2], 0);
+
+        // Forget the recursive mapping of the table itself
+        cpu_page_invalidate(uintptr_t(ptes[3]));
+
+        gather.free_table(pde & PTE_ADDR);
+        gather.set_dirty();
+    }
+}
+
 int munmap(void *addr, size_t size)
 {
     __asan_freeN_noabort(addr, size);
@@ -2662,14 +3359,20 @@ int munmap(void *addr, size_t size)
     size += misalignment;
     size = round_up(size);
 
+    linaddr_t const st = a;
+    bool const kernel = st >= 0x800000000000U;
+
+    // Dirty shared file pages go back to the file before they disappear
+    if (!kernel)
+        mmu_filemap_sync(st, st + size);
+
     pte_t *ptes[4];
     ptes_from_addr(ptes, a);
 
-    mmu_phys_allocator_t::free_batch_t free_batch(phys_allocator);
+    mmu_gather_t gather;
 
-    pte_t combined_pte = 0;
+    mmu_usage_delta_t usage;
 
-    size_t freed = 0;
     int present_mask = ptes_present(ptes);
     for (size_t ofs = 0; ofs < size; ) {
         size_t distance = 0;
@@ -2680,30 +3383,22 @@ int munmap(void *addr, size_t size)
                 // PT page level is present, 4KB mapping
                 pte = atomic_xchg(ptes[3], 0);
 
-                combined_pte |= pte;
+                if (pte_is_sysmem(pte))
+                    gather.free_page(pte & PTE_ADDR);
+                else if (pte_is_swap(pte))
+                    zswap_release(swap_slot_from_pte(pte));
 
-                if (pte_is_sysmem(pte)) {
-                    physaddr_t physaddr = pte & PTE_ADDR;
-
-                    free_batch.free(physaddr);
-                    ++freed;
-                }
+                usage.removed(pte);
 
                 distance = PAGE_SIZE;
             } else {
                 // 2MB mapping
                 pte = atomic_xchg(ptes[2], 0);
 
-                combined_pte |= pte;
+                if ((pte & (PTE_EX_PHYSICAL | PTE_PRESENT)) == PTE_PRESENT)
+                    gather.free_page(pte & (PTE_ADDR & -(1 << 21)), 9);
 
-                if ((pte & (PTE_EX_PHYSICAL | PTE_PRESENT)) == PTE_PRESENT) {
-                    physaddr_t physaddr = pte & (PTE_ADDR & -(1 << 21));
-
-                    for (physaddr_t i = 0; i < (1 << 21); i += PAGE_SIZE)
-                        free_batch.free(physaddr + i);
-                }
-
-                freed += ((pte & PTE_PRESENT) != 0) * 512;
+                usage.removed(pte, 512);
 
                 distance = (1 << 21);
             }
@@ -2714,14 +3409,8 @@ int munmap(void *addr, size_t size)
                 // 1GB mapping
                 pte = atomic_xchg(ptes[1], 0);
 
-                combined_pte |= pte;
-
-                if ((pte & (PTE_EX_PHYSICAL | PTE_PRESENT)) == PTE_PRESENT) {
-                    physaddr_t physaddr = pte & (PTE_ADDR & -(1 << 30));
-
-                    for (physaddr_t i = 0; i < (1 << 30); i += PAGE_SIZE)
-                        free_batch.free(physaddr + i);
-                }
+                if ((pte & (PTE_EX_PHYSICAL | PTE_PRESENT)) == PTE_PRESENT)
+                    gather.free_page(pte & (PTE_ADDR & -(1 << 30)), 18);
             }
             distance = (1 << 30);
         } else {
@@ -2729,10 +3418,12 @@ int munmap(void *addr, size_t size)
         }
 
         if (likely(pte & PTE_PRESENT)) {
-            if (likely(pte & PTE_ACCESSED))
+            if (likely(pte & PTE_ACCESSED)) {
                 cpu_page_invalidate(a);
-            else
+                gather.set_dirty();
+            } else {
                 TRACE_INVALIDATE("Skipped an invlpg!\n");
+            }
         }
 
         assert(distance != 0);
@@ -2744,22 +3435,39 @@ int munmap(void *addr, size_t size)
             present_mask = ptes_present(ptes);
     }
 
-    free_batch.flush();
+    if (kernel) {
+        // Freed pages can't be reused while another CPU may still reach
+        // them. A range that frees nothing, like a physical mapping, only
+        // needs other CPUs to forget it before the linear allocator hands
+        // it out again, so that shootdown is batched with other ranges
+        bool tlb_dirty = gather.is_dirty() && gather.empty();
 
-    if (freed) {
-        if (combined_pte & PTE_ACCESSED)
-            mmu_send_tlb_shootdown();
-        else
-            TRACE_INVALIDATE("Skipped a tlb shootdown!\n");
+        if (tlb_dirty)
+            gather.clear_dirty();
+
+        gather.finish();
+
+        linear_allocator.release_linear(st, size, tlb_dirty);
+
+        return 0;
     }
 
-    contiguous_allocator_t *allocator =
-            (a < 0x800000000000U) ?
-                (contiguous_allocator_t*)
-                thread_current_process()->get_allocator()
-            : &linear_allocator;
+    mmu_unmap_tables(gather, st, st + size);
+
+    if (!gather.is_dirty())
+        TRACE_INVALIDATE("Skipped a tlb shootdown!\n");
+
+    // One shootdown, then everything goes back to the physical allocator
+    gather.finish();
+
+    usage.apply(thread_current_process());
 
-    allocator->release_linear((linaddr_t)addr - misalignment, size);
+    filemap_remove(thread_current_process(), st, st + size);
+
+    contiguous_allocator_t *allocator = (contiguous_allocator_t*)
+            thread_current_process()->get_allocator();
+
+    allocator->release_linear(st, size);
 
     return 0;
 }
@@ -2808,6 +3516,18 @@ int mprotect(void *addr, size_t len, int prot)
     // invalidating the
     pte_t clr_bits = set_bits ^ (no_exec | PTE_PRESENT | PTE_WRITABLE);
 
+    process_t *process = linaddr_t(addr) < 0x800000000000
+            ? thread_current_process()
+            : nullptr;
+
+    // The write fault on a file page looks here to decide whether to allow
+    // the write, so update it before any PTE becomes writable
+    if (process && filemap_any(process) &&
+            unlikely(filemap_protect(process, linaddr_t(addr),
+                                     linaddr_t(addr) + len,
+                                     prot & PROT_WRITE) != errno_t::OK))
+        return -1;
+
     pte_t *pt[4];
     ptes_from_addr(pt, linaddr_t(addr));
     pte_t *end = pt[3] + (len >> PAGE_SCALE);
@@ -2846,7 +3566,23 @@ int mprotect(void *addr, size_t len, int prot)
                     replacement = (expect & ~clr_bits & ~PTE_ADDR) |
                             (prot & PTE_WRITABLE ? PTE_EX_DEMAND : 0) |
                             ((PTE_ADDR >> 1) & PTE_ADDR);
-            } else
+            } else if (pte_is_swap(expect))
+                // Change permission bits but leave it not present,
+                // the fault that brings it back in makes it present
+                replacement = (expect & ~clr_bits & ~PTE_PRESENT) |
+                        (set_bits & ~PTE_PRESENT);
+            else if ((expect & (PTE_PRESENT | PTE_EX_FILEMAP)) ==
+                     PTE_EX_FILEMAP)
+                // File page not faulted in yet, same as swap
+                replacement = (expect & ~clr_bits & ~PTE_PRESENT) |
+                        (set_bits & ~PTE_PRESENT);
+            else if (expect & PTE_EX_FILEMAP)
+                // A private page may still be the page cache page, so
+                // writes are never allowed here. The write fault makes
+                // the page writable or copies it, as the mapping now says
+                replacement = (expect & ~clr_bits) |
+                        (set_bits & ~PTE_WRITABLE);
+            else
                 // Just change permission bits
                 replacement = (expect & ~clr_bits) | set_bits;
 
@@ -2983,6 +3719,9 @@ int madvise(void *addr, size_t len, int advice)
 
     mmu_phys_allocator_t::free_batch_t free_batch(phys_allocator);
 
+    bool const user = linaddr_t(addr) < 0x800000000000;
+    mmu_usage_delta_t usage;
+
     bool any_invalidate = false;
 
     while (pt[3] < end && pte_list_present(pt)) {
@@ -3010,6 +3749,22 @@ int madvise(void *addr, size_t len, int advice)
                     need_invalidate = (bool)(expect & PTE_ACCESSED);
 
                     free_batch.free(page);
+                    --usage.resident;
+                } else if (pte_is_swap(expect)) {
+                    // Replace with demand paged entry, drop the swap copy
+                    replacement = (expect & ~PTE_ADDR & ~PTE_WRITABLE &
+                                   ~PTE_EX_SWAP) |
+                            ((expect & PTE_WRITABLE) ? PTE_EX_DEMAND : 0) |
+                            PTE_PRESENT |
+                            zeros_page;
+
+                    if (unlikely(!atomic_cmpxchg_upd(
+                                     pt[3], &expect, replacement))) {
+                        continue;
+                    }
+
+                    zswap_release(swap_slot_from_pte(expect));
+                    --usage.swapped;
                 }
                 break;
             } else if (order_bits == pte_t(0)) {
@@ -3031,31 +3786,42 @@ int madvise(void *addr, size_t len, int advice)
                     mmap_device_mapping_t *mapping =
                             mm_dev_mappings[device_index];
 
+                    // Start the reads of every missing range as one
+                    // batch, then wait for all of them
+                    blk_plug_t plug(true);
+
                     int io_result = present_ranges([&](linaddr_t base,
                                                    size_t range_len) -> int  {
                         uintptr_t mapping_offset = base -
                             linaddr_t(mapping->range.get());
 
-                        int io_result = mapping->callback(
+                        return mapping->callback(
                                     mapping->context, (void*)base,
                                     mapping_offset, range_len,
                                     true, false);
+                    }, linaddr_t(addr), len, false);
 
-                        if (likely(io_result >= 0)) {
-                            pte_t *ptes[4];
-                            ptes_from_addr(ptes, base);
-                            for (size_t i = range_len >> PAGE_SIZE_BIT;
-                                    i > 0; --i) {
-                                atomic_or(ptes[3] + (i - 1), PTE_PRESENT);
-                            }
-                        }
+                    errno_t err = plug.wait();
 
-                        return io_result;
-                    }, linaddr_t(addr), len, false);
+                    if (io_result >= 0 && unlikely(err != errno_t::OK))
+                        io_result = -int(err);
 
                     if (unlikely(io_result < 0))
                         return io_result;
 
+                    // The same ranges are still not present
+                    present_ranges([&](linaddr_t base,
+                                       size_t range_len) -> int  {
+                        pte_t *ptes[4];
+                        ptes_from_addr(ptes, base);
+                        for (size_t i = range_len >> PAGE_SIZE_BIT;
+                                i > 0; --i) {
+                            atomic_or(ptes[3] + (i - 1), PTE_PRESENT);
+                        }
+
+                        return 0;
+                    }, linaddr_t(addr), len, false);
+
                     return 0;
                 }
 
@@ -3081,8 +3847,10 @@ int madvise(void *addr, size_t len, int advice)
 
                         // If updating PTE succeeded, we want the page
                         if (likely(atomic_cmpxchg_upd(&pt[3][idx],
-                                   &pte, replacement)))
+                                   &pte, replacement))) {
+                            ++usage.resident;
                             return true;
+                        }
 
                         // Unlikely racing change, retry...
                     }
@@ -3131,6 +3899,9 @@ int madvise(void *addr, size_t len, int advice)
     else
         TRACE_INVALIDATE("Skipped a TLB shootdown!\n");
 
+    if (user)
+        usage.apply(thread_current_process());
+
     return 0;
 }
 
@@ -3147,6 +3918,10 @@ int msync(void const *addr, size_t len, int flags)
     if (unlikely(len == 0))
         return 0;
 
+    // User file mappings write back synchronously either way
+    if (rounded_addr < 0x800000000000)
+        return mmu_filemap_sync(rounded_addr, rounded_addr + len);
+
     intptr_t device = mmu_device_from_addr(rounded_addr);
 
     if (unlikely(device < 0))
@@ -3171,6 +3946,86 @@ int msync(void const *addr, size_t len, int flags)
     return result;
 }
 
+int mm_device_invalidate(void const *addr, size_t len)
+{
+    if (unlikely(len == 0))
+        return 0;
+
+    intptr_t device = mmu_device_from_addr(linaddr_t(addr) & -PAGE_SIZE);
+
+    if (unlikely(device < 0))
+        return -int(errno_t::EFAULT);
+
+    mmap_device_mapping_t *mapping = mm_dev_mappings[device];
+
+    // Widen to the 64KB units the fault handler reads, so a unit is
+    // never partly present when it is read back in
+    linaddr_t base = linaddr_t(mapping->range.get());
+    linaddr_t st = base + ((linaddr_t(addr) - base) & -0x10000);
+    linaddr_t en = base + ((linaddr_t(addr) + len - base + 0xFFFF) & -0x10000);
+    linaddr_t mapping_end = base + round_up(mapping->range.size());
+
+    if (en > mapping_end)
+        en = mapping_end;
+
+    // Present pages may be newer than the device
+    int status = msync((void*)st, en - st, MS_ASYNC);
+
+    if (unlikely(status < 0))
+        return status;
+
+    ext::unique_lock<ext::mutex> lock(mapping->lock);
+
+    while (mapping->active_read >= 0)
+        mapping->done_cond.wait(lock);
+
+    mmu_phys_allocator_t::free_batch_t free_batch(phys_allocator);
+
+    pte_t *ptes[4];
+
+    // One unit at a time, the pages can't be freed until no CPU
+    // can still reach them through a stale TLB entry
+    for (linaddr_t unit = st; unit < en; unit += 0x10000) {
+        ptes_from_addr(ptes, unit);
+
+        if (unlikely((ptes_present(ptes) & 0x7) != 0x7))
+            continue;
+
+        bool any_present = false;
+
+        for (size_t i = 0; i < (0x10000 >> PAGE_SCALE); ++i) {
+            pte_t expect = ptes[3][i];
+
+            if (!(expect & PTE_PRESENT))
+                continue;
+
+            // Back to the state mmap left it in, it is committed
+            // again on the next access
+            pte_t replacement = (expect & ~(PTE_ADDR | PTE_PRESENT |
+                                            PTE_ACCESSED | PTE_DIRTY)) |
+                    PTE_ADDR;
+
+            if (unlikely(!atomic_cmpxchg_upd(ptes[3] + i,
+                                             &expect, replacement))) {
+                --i;
+                continue;
+            }
+
+            cpu_page_invalidate(unit + (i << PAGE_SCALE));
+
+            free_batch.free(expect & PTE_ADDR);
+            any_present = true;
+        }
+
+        if (any_present) {
+            mmu_send_tlb_shootdown(true);
+            free_batch.flush();
+        }
+    }
+
+    return 0;
+}
+
 uintptr_t mphysaddr(void volatile const *addr)
 {
     linaddr_t linaddr = linaddr_t(addr);
@@ -3417,6 +4272,47 @@ static int mm_dev_map_search(void const *v, void const *k, void *s)
     return 0;
 }
 
+// Walk the page tables of each device mapping, counting present pages.
+// Only the range is copied under the lock, the walk may take a while
+uint64_t mm_get_device_cache_pages()
+{
+    uint64_t total = 0;
+
+    for (size_t i = 0; ; ++i) {
+        linaddr_t base = 0;
+        size_t size = 0;
+
+        mm_dev_mapping_scoped_lock lock(mm_dev_mapping_lock);
+
+        if (i >= mm_dev_mappings.size())
+            break;
+
+        mmap_device_mapping_t *mapping = mm_dev_mappings[i];
+
+        if (mapping) {
+            base = linaddr_t(mapping->range.get());
+            size = round_up(mapping->range.size());
+        }
+
+        lock.unlock();
+
+        if (!size)
+            continue;
+
+        present_ranges([&](linaddr_t, size_t range_len) -> int {
+            total += range_len >> PAGE_SCALE;
+            return 0;
+        }, base, size);
+    }
+
+    return total;
+}
+
+uint64_t mm_get_page_table_count()
+{
+    return atomic_ld_acq(&mmu_page_table_count);
+}
+
 
 uintptr_t mm_alloc_hole(size_t size)
 {
@@ -3429,6 +4325,17 @@ void mm_free_hole(uintptr_t addr, size_t size)
     hole_allocator.release_linear(addr, size);
 }
 
+// Drivers map and unmap windows and threads map stacks constantly,
+// cache those ranges per-CPU once the CPU count is known
+static void mmu_linear_cache_init(void *)
+{
+    linear_allocator.enable_cpu_cache(thread_stack_range_size(0),
+                                      mmu_linear_tlb_flush);
+}
+
+REGISTER_CALLOUT(mmu_linear_cache_init, nullptr,
+                 callout_type_t::smp_online, "000");
+
 void *mmap_window(size_t size)
 {
     size = round_up(size);
@@ -3544,6 +4451,169 @@ int munlock(void const *addr, size_t len)
     return 0;
 }
 
+//
+// Compressed swap
+
+struct swap_candidate_t {
+    linaddr_t addr;
+    pte_t *ptep;
+    pte_t pte;
+};
+
+// Each page in the batch has already been made not present, with the wait
+// bit set. Returns the number of pages freed
+static size_t mm_swap_out_batch(swap_candidate_t *batch, size_t count)
+{
+    // Make sure no CPU can still write through a stale TLB entry
+    for (size_t i = 0; i < count; ++i)
+        cpu_page_invalidate(batch[i].addr);
+
+    mmu_send_tlb_shootdown(true);
+
+    mmu_phys_allocator_t::free_batch_t free_batch(phys_allocator);
+
+    size_t freed = 0;
+    int64_t swapped = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        swap_candidate_t &item = batch[i];
+
+        physaddr_t page = item.pte & PTE_ADDR;
+        pte_t claim = (item.pte & ~PTE_PRESENT) | PTE_EX_WAIT;
+
+        int64_t slot = zswap_store(page);
+
+        pte_t replacement;
+
+        if (slot >= 0) {
+            replacement = (item.pte & ~PTE_ADDR & ~PTE_PRESENT &
+                           ~PTE_ACCESSED & ~PTE_DIRTY) |
+                    PTE_EX_SWAP | (pte_t(slot) << PTE_ADDR_BIT);
+        } else {
+            // Put it back, looking recently used so it isn't retried soon
+            replacement = item.pte | PTE_ACCESSED;
+        }
+
+        if (likely(atomic_cmpxchg(item.ptep, claim, replacement) == claim)) {
+            if (slot >= 0) {
+                free_batch.free(page);
+                ++freed;
+                ++swapped;
+            }
+        } else {
+            // It was unmapped while we had it, nothing refers to it now
+            if (slot >= 0)
+                zswap_release(slot);
+            free_batch.free(page);
+            ++freed;
+        }
+    }
+
+    // munmap does not count claimed pages as resident, so every freed
+    // page is accounted here
+    mmu_account(thread_current_process(), -int64_t(freed), 0, swapped);
+
+    return freed;
+}
+
+size_t mm_swap_reclaim(size_t count)
+{
+    // Reclaiming blocks
+    if (unlikely(!cpu_irq_is_enabled()))
+        return 0;
+
+    process_t *process = thread_current_process();
+
+    if (unlikely(!process))
+        return 0;
+
+    ext::unique_lock<ext::mutex> lock(swap_reclaim_lock, ext::defer_lock_t());
+
+    // Another thread is already reclaiming, or we recursed into here
+    // from an allocation made while reclaiming
+    if (!lock.try_lock())
+        return 0;
+
+    swap_candidate_t batch[ZSWAP_UNMAP_BATCH];
+    size_t batch_count = 0;
+    size_t freed = 0;
+
+    linaddr_t const st = process_t::min_addr;
+    linaddr_t const en = process_t::max_addr;
+
+    linaddr_t addr = process->swap_hand;
+    if (addr < st || addr >= en)
+        addr = st;
+
+    // Clock scan, a page is taken if its accessed bit is still clear
+    // when the hand comes back around to it. Stop after passing the
+    // end of the address space twice
+    pte_t *ptes[4];
+    for (int laps = 0; freed + batch_count < count; ) {
+        if (addr >= en) {
+            addr = st;
+            if (++laps == 2)
+                break;
+        }
+
+        ptes_from_addr(ptes, addr);
+        int present_mask = ptes_present(ptes);
+
+        // Skip whole tables that are not present, and large pages
+        int skip_shift;
+        if (unlikely(!(present_mask & 1)))
+            skip_shift = 12 + 9 * 3;
+        else if (unlikely(!(present_mask & 2)))
+            skip_shift = 12 + 9 * 2;
+        else if (!(present_mask & 4))
+            skip_shift = (*ptes[1] & PTE_PAGESIZE)
+                    ? 12 + 9 * 2
+                    : 12 + 9;
+        else if (*ptes[2] & PTE_PAGESIZE)
+            skip_shift = 12 + 9;
+        else
+            skip_shift = 0;
+
+        if (skip_shift) {
+            addr = (addr + (linaddr_t(1) << skip_shift)) &
+                    -(linaddr_t(1) << skip_shift);
+            continue;
+        }
+
+        pte_t pte = *ptes[3];
+
+        // Only private anonymous user pages, not locked or pinned
+        if (pte_is_sysmem(pte) && (pte & PTE_USER) &&
+                !(pte & PTE_EX_LOCKED) &&
+                phys_allocator.get_refcount(pte & PTE_ADDR) == 1) {
+            if (pte & PTE_ACCESSED) {
+                // Give it a second chance
+                atomic_and(ptes[3], ~PTE_ACCESSED);
+            } else {
+                pte_t claim = (pte & ~PTE_PRESENT) | PTE_EX_WAIT;
+
+                if (atomic_cmpxchg_upd(ptes[3], &pte, claim)) {
+                    batch[batch_count++] = { addr, ptes[3], pte };
+
+                    if (batch_count == countof(batch)) {
+                        freed += mm_swap_out_batch(batch, batch_count);
+                        batch_count = 0;
+                    }
+                }
+            }
+        }
+
+        addr += PAGE_SIZE;
+    }
+
+    if (batch_count)
+        freed += mm_swap_out_batch(batch, batch_count);
+
+    process->swap_hand = addr;
+
+    return freed;
+}
+
 uintptr_t mm_new_process(process_t *process, bool use64)
 {
     // Allocate a page directory
@@ -3553,6 +4623,8 @@ uintptr_t mm_new_process(process_t *process, bool use64)
     // Copy upper memory mappings into new page directory
     ext::copy(master_pagedir + 256, master_pagedir + 512, dir + 256);
 
+    atomic_inc(&mmu_page_table_count);
+
     // Get the physical address for the new process page directory
     physaddr_t dir_physaddr = mphysaddr(dir);
 
@@ -3576,73 +4648,62 @@ void mm_destroy_process()
 
     assert(dir != root_physaddr);
 
-    unsigned path[4];
-    pte_t *ptes[4];
+    // Write back shared file pages while they are still mapped
+    mmu_filemap_sync(0, 0x800000000000);
 
-    ext::vector<physaddr_t> pending_frees;
-    pending_frees.reserve(4);
+    // No thread uses this address space any more, but another CPU may
+    // still have it loaded or cached, so the pages are shot down once
+    // before they are freed
+    mmu_gather_t gather;
+    gather.set_dirty();
 
-    mmu_phys_allocator_t::free_batch_t free_batch(phys_allocator);
+    // Walk the user half through the recursive mapping, one table at a
+    // time, skipping anything not present
+    for (size_t i0 = 0; i0 < 256; ++i0) {
+        pte_t pml4e = PT0_PTR[i0];
 
-    for (linaddr_t addr = 0; addr <= 0x800000000000; ) {
-        for (physaddr_t physaddr : pending_frees)
-            free_batch.free(physaddr);
-        pending_frees.clear();
-        free_batch.flush();
+        if (!(pml4e & PTE_PRESENT))
+            continue;
 
-        if (addr == 0x800000000000)
-            break;
+        for (size_t i1 = 0; i1 < 512; ++i1) {
+            size_t n1 = (i0 << 9) + i1;
+            pte_t pdpte = PT1_PTR[n1];
 
-        int present_mask = addr_present(addr, path, ptes);
-
-        if ((present_mask & 0xF) == 0xF &&
-                !(*ptes[3] & (PTE_EX_PHYSICAL | PTE_EX_DEVICE)))
-            if (unlikely(!pending_frees.push_back(*ptes[3] & PTE_ADDR)))
-                panic_oom();
-        if (unlikely(path[3] == 511)) {
-            if ((present_mask & 0x7) == 0x7 &&
-                    !(*ptes[3] & (PTE_EX_PHYSICAL | PTE_EX_DEVICE)))
-                if (unlikely(!pending_frees.push_back(*ptes[2] & PTE_ADDR)))
-                    panic_oom();
-            if (path[2] == 511) {
-                if ((present_mask & 0x3) == 0x3 &&
-                        !(*ptes[3] & (PTE_EX_PHYSICAL | PTE_EX_DEVICE)))
-                    if (unlikely(!pending_frees.push_back(*ptes[1] & PTE_ADDR)))
-                        panic_oom();
-                if (path[1] == 511) {
-                    if ((present_mask & 0x1) == 0x1 &&
-                            !(*ptes[3] & (PTE_EX_PHYSICAL | PTE_EX_DEVICE)))
-                        if (unlikely(!pending_frees.push_back(
-                                         *ptes[0] & PTE_ADDR)))
-                            panic_oom();
-                }
-            }
-        }
+            if (!(pdpte & PTE_PRESENT) || (pdpte & PTE_PAGESIZE))
+                continue;
 
-        // If level 0 is not present, advance 512GB (2^39)
-        if (unlikely(!(present_mask & 1))) {
-            addr += 1L << (12 + (9*3));
-            continue;
-        }
+            for (size_t i2 = 0; i2 < 512; ++i2) {
+                size_t n2 = (n1 << 9) + i2;
+                pte_t pde = PT2_PTR[n2];
 
-        // If level 1 is not present, advance 1GB   (2^30)
-        if (unlikely(!(present_mask & 2))) {
-            addr += 1L << (12 + (9*2));
-            continue;
-        }
+                if (!(pde & PTE_PRESENT) || (pde & PTE_PAGESIZE))
+                    continue;
 
-        // If level 2 is not present, advance 2MB   (2^21)
-        if (unlikely(!(present_mask & 4))) {
-            addr += 1L << (12 + (9*1));
-            continue;
+                pte_t const *pt = PT3_PTR + (n2 << 9);
+
+                for (size_t i3 = 0; i3 < 512; ++i3) {
+                    pte_t pte = pt[i3];
+
+                    if (pte_is_sysmem(pte))
+                        gather.free_page(pte & PTE_ADDR);
+                    else if (pte_is_swap(pte))
+                        zswap_release(swap_slot_from_pte(pte));
+                }
+
+                gather.free_table(pde & PTE_ADDR);
+            }
+
+            gather.free_table(pdpte & PTE_ADDR);
         }
 
-        addr += 1L << (12 + (9*0)); // 2^12
+        gather.free_table(pml4e & PTE_ADDR);
     }
 
     cpu_page_directory_set(root_physaddr);
 
-    free_batch.free(dir);
+    gather.free_table(dir);
+
+    gather.finish();
 }
 
 void mm_init_process(process_t *process, bool use64)
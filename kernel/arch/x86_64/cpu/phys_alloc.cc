@@ -74,6 +74,7 @@ physaddr_t mmu_phys_allocator_t::alloc_one()
 
     // Advance first free to next free
     next_free = new_next;
+    --free_page_count;
 
     lock_.unlock();
 
@@ -133,7 +134,8 @@ void mmu_phys_allocator_t::adjref_virtual_range(
         for (size_t i = 0; i < count; ++i) {
             physaddr_t addr = *ptes[3] & PTE_ADDR;
 
-            if (addr && addr != PTE_ADDR) {
+            // Swapped out pages have a slot number there, not an address
+            if (addr && addr != PTE_ADDR && !pte_is_swap(*ptes[3])) {
                 entry_t index = index_from_addr(addr);
                 assert(index < highest_usable);
                 assert(entries[index] & used_mask);
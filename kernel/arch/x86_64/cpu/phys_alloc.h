@@ -113,6 +113,13 @@ public:
         return free_page_count;
     }
 
+    // Not locked, the answer may be stale by the time it is used
+    _always_inline entry_t get_refcount(physaddr_t addr) const noexcept
+    {
+        entry_t entry = entries[index_from_addr(addr)];
+        return (entry & used_mask) ? (entry & ~used_mask) : 0;
+    }
+
     _always_inline uint64_t get_phys_mem_size() const noexcept
     {
         return highest_usable;
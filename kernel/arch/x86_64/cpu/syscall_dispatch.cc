@@ -14,6 +14,7 @@
 #include "syscall/sys_render.h"
 #include "syscall/sys_framebuffer.h"
 #include "syscall/sys_signal.h"
+#include "syscall/sys_meminfo.h"
 
 long sys_unimplemented()
 {
@@ -254,7 +255,7 @@ syscall_handler_t *syscall_handlers[SYSCALL_COUNT] = {
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_epoll_ctl_old,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_epoll_wait_old,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_remap_file_pages,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_getdents64,
+    (syscall_handler_t*)(void*)sys_getdents64,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_set_tid_address,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_restart_syscall,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_semtimedop,
@@ -372,7 +373,8 @@ syscall_handler_t *syscall_handlers[SYSCALL_COUNT] = {
     (syscall_handler_t*)(void*)sys_join,
     (syscall_handler_t*)(void*)sys_detach,
     (syscall_handler_t*)(void*)sys_is_joinable,
-    (syscall_handler_t*)(void*)sys_sigreturn
+    (syscall_handler_t*)(void*)sys_sigreturn,
+    (syscall_handler_t*)(void*)sys_meminfo
     //(syscall_handler_t*)(void*)sys_,
 };
 
@@ -257,6 +257,22 @@ void thread_startup(thread_fn_t fn, void *p, thread_t id)
 }
 
 static constexpr size_t stack_guard_size = (8<<10);
+static constexpr size_t default_stack_size = (16<<10);
+
+static uint64_t thread_stack_bytes;
+
+uint64_t thread_stack_usage()
+{
+    return atomic_ld_acq(&thread_stack_bytes);
+}
+
+size_t thread_stack_range_size(size_t stack_size)
+{
+    if (stack_size == 0)
+        stack_size = default_stack_size;
+
+    return stack_guard_size + stack_size + stack_guard_size;
+}
 
 // Allocate a stack with a large guard region at both ends and
 // return a pointer to the end of the middle committed part
@@ -298,6 +314,8 @@ static char *thread_allocate_stack(
 
     memset(guard0_en, fill, stack_size);
 
+    atomic_add(&thread_stack_bytes, stack_size);
+
     return guard1_st;
 }
 
@@ -329,8 +347,8 @@ static thread_t thread_create_with_state(
         thread_priority_t priority, bool user, bool is_float)
 {
     if (stack_size == 0)
-        stack_size = 16 << 10;
-    else if (stack_size < (16 << 10))
+        stack_size = default_stack_size;
+    else if (stack_size < default_stack_size)
         return -1;
 
     thread_info_t *thread = nullptr;
@@ -886,6 +904,9 @@ static void thread_free_stacks(thread_info_t *thread)
         assert(stk != nullptr);
         assert(stk_sz != 0);
         munmap(stk, stk_sz);
+
+        atomic_add(&thread_stack_bytes,
+                   -(stk_sz - stack_guard_size * 2));
     }
 
     // The xsave stack
@@ -905,6 +926,9 @@ static void thread_free_stacks(thread_info_t *thread)
         assert(stk != nullptr);
         assert(stk_sz != 0);
         munmap(stk, stk_sz);
+
+        atomic_add(&thread_stack_bytes,
+                   -(stk_sz - stack_guard_size * 2));
     }
 }
 
@@ -1832,6 +1856,20 @@ void *thread_set_exception_top(void *chain)
     return old;
 }
 
+void *thread_get_blk_plug()
+{
+    return this_thread()->blk_plug;
+}
+
+void *thread_set_blk_plug(void *plug)
+{
+    thread_info_t *thread = this_thread();
+
+    void *old = thread->blk_plug;
+    thread->blk_plug = plug;
+    return old;
+}
+
 size_t thread_cls_alloc()
 {
     size_t next;
@@ -35,6 +35,13 @@ void thread_exit(int exitcode);
 
 void thread_clear_busy(void *outgoing);
 
+// Size of the address range reserved for a kernel thread stack of
+// stack_size bytes (0 means default), including the guard regions
+size_t thread_stack_range_size(size_t stack_size);
+
+// Bytes of committed kernel thread and xsave stack, excluding guards
+uint64_t thread_stack_usage();
+
 // CPU-local storage
 size_t thread_cls_alloc(void);
 void *thread_cls_get(size_t slot);
@@ -62,7 +69,7 @@ static _always_inline process_t *fast_cur_process()
     return *(process_t**)((char*)thread_info + THREAD_INFO_PROCESS_OFS);
 }
 
-void thread_set_process(int tid, process_t *process);
+KERNEL_API void thread_set_process(int tid, process_t *process);
 
 extern uint32_t cpu_count;
 
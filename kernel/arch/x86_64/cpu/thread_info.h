@@ -27,8 +27,10 @@ struct alignas(256) thread_info_t {
 
     // --- cache line --- shared line
 
-    // 2 64-bit pointers
-    uint64_t reserved3[2];
+    // Innermost block I/O plug held by the thread
+    void *blk_plug;
+
+    uint64_t reserved3[1];
 
     // Owning process
     process_t *process;
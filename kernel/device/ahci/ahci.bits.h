@@ -588,6 +588,106 @@
 #define AHCI_HC_HC_HR_SET(r,n) \
     ((r) = ((r) & ~AHCI_HC_HC_HR) | AHCI_HC_HC_HR_n((n)))
 
+//
+// AHCI_HC_CCC: 3.1.6 Command completion coalescing control
+
+
+// Timeout value in milliseconds
+#define AHCI_HC_CCC_TV_BIT        16
+
+// Command completions
+#define AHCI_HC_CCC_CC_BIT        8
+
+// Interrupt (vector) used for coalesced completions
+#define AHCI_HC_CCC_INT_BIT       3
+
+// Enable
+#define AHCI_HC_CCC_EN_BIT        0
+
+
+// Timeout value in milliseconds
+#define AHCI_HC_CCC_TV_BITS       16
+
+// Command completions
+#define AHCI_HC_CCC_CC_BITS       8
+
+// Interrupt (vector) used for coalesced completions
+#define AHCI_HC_CCC_INT_BITS      5
+
+// Enable
+#define AHCI_HC_CCC_EN_BITS       1
+
+// Timeout value in milliseconds
+#define AHCI_HC_CCC_TV_MASK       ((1U << AHCI_HC_CCC_TV_BITS)-1)
+
+// Command completions
+#define AHCI_HC_CCC_CC_MASK       ((1U << AHCI_HC_CCC_CC_BITS)-1)
+
+// Interrupt (vector) used for coalesced completions
+#define AHCI_HC_CCC_INT_MASK      ((1U << AHCI_HC_CCC_INT_BITS)-1)
+
+// Enable
+#define AHCI_HC_CCC_EN_MASK       ((1U << AHCI_HC_CCC_EN_BITS)-1)
+
+// Timeout value in milliseconds
+#define AHCI_HC_CCC_TV            (AHCI_HC_CCC_TV_MASK << AHCI_HC_CCC_TV_BIT)
+
+// Command completions
+#define AHCI_HC_CCC_CC            (AHCI_HC_CCC_CC_MASK << AHCI_HC_CCC_CC_BIT)
+
+// Interrupt (vector) used for coalesced completions
+#define AHCI_HC_CCC_INT           (AHCI_HC_CCC_INT_MASK << AHCI_HC_CCC_INT_BIT)
+
+// Enable
+#define AHCI_HC_CCC_EN            (AHCI_HC_CCC_EN_MASK << AHCI_HC_CCC_EN_BIT)
+
+
+// Timeout value in milliseconds
+#define AHCI_HC_CCC_TV_n(n)       ((n) << AHCI_HC_CCC_TV_BIT)
+
+// Command completions
+#define AHCI_HC_CCC_CC_n(n)       ((n) << AHCI_HC_CCC_CC_BIT)
+
+// Interrupt (vector) used for coalesced completions
+#define AHCI_HC_CCC_INT_n(n)      ((n) << AHCI_HC_CCC_INT_BIT)
+
+// Enable
+#define AHCI_HC_CCC_EN_n(n)       ((n) << AHCI_HC_CCC_EN_BIT)
+
+
+// Timeout value in milliseconds
+#define AHCI_HC_CCC_TV_GET(n) \
+    (((n) >> AHCI_HC_CCC_TV_BIT) & AHCI_HC_CCC_TV_MASK)
+
+// Command completions
+#define AHCI_HC_CCC_CC_GET(n) \
+    (((n) >> AHCI_HC_CCC_CC_BIT) & AHCI_HC_CCC_CC_MASK)
+
+// Interrupt (vector) used for coalesced completions
+#define AHCI_HC_CCC_INT_GET(n) \
+    (((n) >> AHCI_HC_CCC_INT_BIT) & AHCI_HC_CCC_INT_MASK)
+
+// Enable
+#define AHCI_HC_CCC_EN_GET(n) \
+    (((n) >> AHCI_HC_CCC_EN_BIT) & AHCI_HC_CCC_EN_MASK)
+
+
+// Timeout value in milliseconds
+#define AHCI_HC_CCC_TV_SET(r,n) \
+    ((r) = ((r) & ~AHCI_HC_CCC_TV) | AHCI_HC_CCC_TV_n((n)))
+
+// Command completions
+#define AHCI_HC_CCC_CC_SET(r,n) \
+    ((r) = ((r) & ~AHCI_HC_CCC_CC) | AHCI_HC_CCC_CC_n((n)))
+
+// Interrupt (vector) used for coalesced completions
+#define AHCI_HC_CCC_INT_SET(r,n) \
+    ((r) = ((r) & ~AHCI_HC_CCC_INT) | AHCI_HC_CCC_INT_n((n)))
+
+// Enable
+#define AHCI_HC_CCC_EN_SET(r,n) \
+    ((r) = ((r) & ~AHCI_HC_CCC_EN) | AHCI_HC_CCC_EN_n((n)))
+
 //
 // AHCI_HP_IS: 3.3.5 PxIS Port interrupt status
 
@@ -814,11 +814,15 @@ enum struct slot_op_t : uint8_t {
 struct slot_request_t {
     uint64_t lba;
     iocp_t *callback;
+
+    // The buffer, either data or a list of segments
     void *data;
+    storage_seg_t const *segs;
+    size_t seg_count;
+
     size_t count;
     slot_op_t op;
     bool fua;
-    bool save_ncq;
 };
 
 struct hba_port_info_t {
@@ -829,6 +833,12 @@ struct hba_port_info_t {
     uint32_t cmd_issued = 0;
     uint32_t slot_mask = 0;
 
+    // Slots with a command built but not yet issued to the HBA
+    uint32_t issue_pending = 0;
+
+    // The subset of issue_pending that are NCQ commands (need PxSACT)
+    uint32_t issue_pending_ncq = 0;
+
     slot_request_t slot_requests[32] = {};
 
     // Wake every time a slot is released
@@ -851,6 +861,11 @@ struct hba_port_info_t {
     bool non_ncq_pending = false;
 
     bool use_ncq = false;
+
+    // NCQ was turned off to replay commands after an error,
+    // turn it back on when the port drains
+    bool ncq_suspended = false;
+
     bool use_fua = false;
     bool use_48bit = false;
     bool use_trim = false;
@@ -866,6 +881,21 @@ struct hba_port_info_t {
 #define AHCI_PE_DBC_BIT     1
 #define AHCI_PE_DBC_n(n)    ((n)-1)
 
+// Command completion coalescing, raise one interrupt after this many
+// completions on the coalesced ports, or after the timeout expires with
+// any pending. 0 disables coalescing, which gives the lowest latency
+#define AHCI_CCC_COMPLETIONS    0
+#define AHCI_CCC_TIMEOUT_MS     1
+
+// Most sectors one command can transfer
+#define AHCI_MAX_SECTORS_48BIT  65536
+#define AHCI_MAX_SECTORS_28BIT  256
+
+// Per port interrupt enables that signal a command completion
+#define AHCI_HP_IE_COMPLETION \
+    (AHCI_HP_IE_DHRE | AHCI_HP_IE_PSE | AHCI_HP_IE_DSE | \
+    AHCI_HP_IE_SDBE | AHCI_HP_IE_DPE)
+
 class ahci_if_factory_t final
     : public storage_if_factory_t
 {
@@ -888,6 +918,7 @@ public:
     bool init(const pci_dev_iterator_t &pci_dev);
 
     unsigned io(size_t port_num, slot_request_t &request);
+    errno_t submit_plan(size_t port_num, disk_io_plan_t *plan);
     errno_t cancel_io(size_t port_num, iocp_t *iocp);
 
     int port_flush(unsigned port_num, iocp_t *iocp);
@@ -900,8 +931,10 @@ public:
     void configure_48bit(unsigned port_num, bool enable);
     void configure_fua(unsigned port_num, bool enable);
 
+    // A non-NCQ command passes the barrier it raised in port_stall_ncq
     int8_t slot_wait(hba_port_info_t &pi,
-                     hba_port_info_t::scoped_lock &hold_port_lock);
+                     hba_port_info_t::scoped_lock &hold_port_lock,
+                     bool non_ncq = false);
 
 private:
     STORAGE_IF_IMPL
@@ -909,12 +942,23 @@ private:
     using port_lock_type = hba_port_info_t::lock_type;
     using scoped_port_lock = hba_port_info_t::scoped_lock;
 
-    bool port_stall_ncq(hba_port_info_t &pi, scoped_port_lock &port_lock);
+    // Wait until the port is idle and block further NCQ commands until
+    // the non-NCQ command the caller is about to issue completes
+    void port_stall_ncq(unsigned port_num, scoped_port_lock &port_lock);
 
     bool port_is_offline(unsigned port_num);
 
+    // With defer = true, the commands are left for issue_pending_slots
     unsigned io_locked(unsigned port_num, slot_request_t &request,
-                       scoped_port_lock &hold_port_lock);
+                       scoped_port_lock &hold_port_lock,
+                       bool defer = false);
+
+    size_t build_fis(hba_port_info_t &pi, slot_request_t const &request,
+                     uint8_t slot, hba_cmd_cfis_t &cfis,
+                     atapi_fis_t &atapifis, bool &ncq);
+
+    // Issue every deferred command on the port. Must be holding port lock
+    void issue_pending_slots(unsigned port_num);
 
     bool supports_64bit();
     void slot_release(unsigned port_num, int slot);
@@ -933,18 +977,22 @@ private:
 
     void bios_handoff();
 
+    void configure_ccc();
+
     int8_t slot_acquire(hba_port_info_t& pi,
-                        scoped_port_lock &hold_port_lock);
+                        scoped_port_lock &hold_port_lock,
+                        bool non_ncq);
 
     void cmd_issue(unsigned port_num, unsigned slot,
                    hba_cmd_cfis_t const *cfis, atapi_fis_t const *atapi_fis,
                    size_t fis_size, hba_prdt_ent_t const *prdts,
-                   size_t ranges_count);
+                   size_t ranges_count, bool defer = false);
 
-    void mmio_write_sata_act(hba_port_t volatile *port, unsigned slot);
-    void mmio_write_command_issue(hba_port_t volatile *port, unsigned slot);
+    void mmio_write_sata_act(hba_port_t volatile *port, uint32_t slots);
+    void mmio_write_command_issue(hba_port_t volatile *port, uint32_t slots);
     uint32_t mmio_read_port_intr_status(hba_port_t volatile *port);
     uint32_t mmio_read_cmd_issue(hba_port_t volatile *port);
+    uint32_t mmio_read_sata_act(hba_port_t volatile *port);
     uint32_t mmio_read_sata_err(hba_port_t volatile *port);
     uint32_t mmio_read_taskfile_data(hba_port_t volatile *port);
 
@@ -957,8 +1005,19 @@ private:
 
     pci_irq_range_t irq_range = {};
     uint32_t ports_impl_mask = 0;
+
+    // Ports whose completions are coalesced, and the intr_status
+    // bit that reports the coalesced interrupt
+    uint32_t ccc_ports = 0;
+    uint8_t ccc_intr = 0;
+
     uint8_t num_cmd_slots = 0;
     bool use_msi = false;
+
+    // Each port (and the coalesced interrupt) has its own MSI vector,
+    // the vector number is the intr_status bit
+    bool per_port_irq = false;
+
     bool support_ncq = false;
     bool use_64 = false;
     bool bypass_offline = false;
@@ -977,7 +1036,20 @@ private:
     errno_t io(void *data, int64_t count,
            uint64_t lba, bool fua, slot_op_t op, iocp_t *iocp);
 
+    errno_t segs_io(storage_seg_t const *segs, size_t seg_count,
+                    uint64_t lba, bool fua, slot_op_t op, iocp_t *iocp);
+
+    errno_t submit_plan(disk_io_plan_t *plan) override final;
+
+    errno_t readv_async(storage_seg_t const *segs, size_t seg_count,
+                        uint64_t lba, iocp_t *iocp) override final;
+
+    errno_t writev_async(storage_seg_t const *segs, size_t seg_count,
+                         uint64_t lba, bool fua,
+                         iocp_t *iocp) override final;
+
     ahci_if_t *iface;
+    uint64_t block_count;
     unsigned port;
     bool is_atapi;
 };
@@ -1016,11 +1088,16 @@ void ahci_if_t::slot_release(unsigned port_num, int slot)
 // Returns -1 if all slots are in use
 // Must be holding port lock
 int8_t ahci_if_t::slot_acquire(hba_port_info_t& pi,
-                               scoped_port_lock& hold_port_lock)
+                               scoped_port_lock& hold_port_lock,
+                               bool non_ncq)
 {
     // Wait for non-NCQ command to finish
-    while (unlikely(pi.use_ncq && pi.non_ncq_pending))
+    while (unlikely(pi.use_ncq && pi.non_ncq_pending && !non_ncq)) {
+        // The IRQ handler treats unissued slots as finished,
+        // issue them before dropping the lock
+        issue_pending_slots(&pi - port_info);
         pi.non_ncq_done_cond.wait(hold_port_lock);
+    }
 
     // Build bitmask of slots in use
     uint32_t busy_mask = pi.cmd_issued;
@@ -1047,6 +1124,11 @@ uint32_t ahci_if_t::mmio_read_cmd_issue(hba_port_t volatile *port)
     return port->cmd_issue;
 }
 
+uint32_t ahci_if_t::mmio_read_sata_act(hba_port_t volatile *port)
+{
+    return port->sata_act;
+}
+
 uint32_t ahci_if_t::mmio_read_sata_err(hba_port_t volatile *port)
 {
     return port->sata_err;
@@ -1071,126 +1153,114 @@ void ahci_if_t::handle_port_irq(unsigned port_num)
     // Read MMIO once
     uint32_t port_intr_status = mmio_read_port_intr_status(port);
 
-    // Read command slot interrupt status
-    uint8_t slot;
+    // A slot is finished when it was issued to the HBA and the HBA has
+    // cleared both its PxCI bit and, for NCQ commands, its PxSACT bit.
+    // This works for NCQ and non-NCQ commands mixed on the same port
+    uint32_t port_busy = mmio_read_cmd_issue(port) |
+            mmio_read_sata_act(port);
 
-    if (pi->use_ncq) {
-        // Handle all successes first
-        // Bitmask of slots where valid_slot && issued==1 && sata_act==0
-        for (uint32_t done_slots = pi->slot_mask & pi->cmd_issued &
-             (pi->cmd_issued ^ port->sata_act);
-             done_slots; done_slots &= ~(UINT32_C(1) << slot)) {
-            slot = bit_lsb_set(done_slots);
-
-            int error = (port->sata_err != 0);
-            assert(error == 0);
-
-            slot_request_t &request = pi->slot_requests[slot];
-
-            if (likely(request.callback)) {
-                request.callback->set_result(
-                            !error ? dgos::err_sz_pair_t{
-                                     errno_t::OK, request.count }
-                                   : dgos::err_sz_pair_t{
-                                     errno_t::EIO, request.count });
-
-                // Invoke completion callback
-                assert(callback_count < countof(pending_callbacks));
-                pending_callbacks[callback_count++] = request.callback;
-                request.callback = nullptr;
-            }
+    uint32_t done_slots = pi->slot_mask & pi->cmd_issued &
+            ~pi->issue_pending & ~port_busy;
 
-            slot_release(port_num, slot);
-        }
+    int error = 0;
 
-        if (unlikely(port_intr_status & AHCI_HP_IS_TFES)) {
-            /// Handle failure by
-            ///  - stopping DMA engine,
-            ///  - disabling ncq
-            ///  - resetting port
-            ///  - starting DMA engine
-            ///  - rebuilding issue queue (for non-NCQ completion)
-            ///  - reissuing all outstanding commands
-            /// This is to make command execution sequential, to get precise
-            /// error information
-            port_stop(port_num);
-            port_reset(port_num);
-            pi->use_ncq = false;
-            port_start(port_num);
-
-            // Free up all ports and reinitialize issue_queue
-            uint32_t pending_mask = pi->cmd_issued;
-            pi->cmd_issued = 0;
-
-            // Take a snapshot of all pending commands
-            slot_request_t pending[32];
-            C_ASSERT(sizeof(pending) == sizeof(pi->slot_requests));
-            ext::copy(ext::begin(pi->slot_requests),
-                      ext::end(pi->slot_requests), pending);
-
-            // Reissue each command in order
-            for (uint8_t reissue = 0; reissue < num_cmd_slots; ++reissue) {
-                if (!(pending_mask & (UINT32_C(1) << reissue)))
-                    continue;
+    // If task file error status on a non-NCQ command
+    if (unlikely((port_intr_status & AHCI_HP_IS_TFES) && !pi->use_ncq)) {
+        uint32_t taskfile_data = mmio_read_taskfile_data(port);
+        assert(taskfile_data & AHCI_HP_TFD_SERR);
 
-                slot_request_t &request = pending[reissue];
+        // Taskfile error
+        error = (taskfile_data >> AHCI_HP_TFD_ERR_BIT) &
+                AHCI_HP_TFD_ERR_MASK;
 
-                io_locked(port_num, request, hold_port_lock);
-            }
-        }
-    } else {
-        uint32_t issue_changed = (pi->cmd_issued ^ mmio_read_cmd_issue(port)) &
-                pi->slot_mask;
+        uint32_t sata_err = mmio_read_sata_err(port);
 
-        while (issue_changed) {
-            slot = bit_lsb_set(issue_changed);
+        AHCI_TRACE("Error: port=%u, err=%#x, sata_err=%#x\n",
+                   port_num, error, sata_err);
+    }
 
-            issue_changed &= ~(UINT32_C(1) << slot);
+    if (unlikely(error != 0)) {
+        AHCI_TRACE("Error %d on interface=%p port=%zu\n",
+                   error, (void*)this, pi - port_info);
+    }
 
-            slot_request_t &request = pi->slot_requests[slot];
+    // Read command slot interrupt status
+    uint8_t slot;
 
-            int error = 0;
+    for ( ; done_slots; done_slots &= ~(UINT32_C(1) << slot)) {
+        slot = bit_lsb_set(done_slots);
 
-            // If task file error status
-            if (unlikely(port_intr_status & AHCI_HP_IS_TFES)) {
-                uint32_t taskfile_data = mmio_read_taskfile_data(port);
-                assert(taskfile_data & AHCI_HP_TFD_SERR);
+        slot_request_t &request = pi->slot_requests[slot];
 
-                // Taskfile error
-                error = (taskfile_data >> AHCI_HP_TFD_ERR_BIT) &
-                        AHCI_HP_TFD_ERR_MASK;
+        if (likely(request.callback)) {
+            request.callback->set_result(
+                        !error ? dgos::err_sz_pair_t{
+                                 errno_t::OK, request.count }
+                               : dgos::err_sz_pair_t{
+                                 errno_t::EIO, request.count });
+
+            // Invoke completion callback
+            assert(callback_count < countof(pending_callbacks));
+            pending_callbacks[callback_count++] = request.callback;
+            request.callback = nullptr;
+        }
 
-                uint32_t sata_err = mmio_read_sata_err(port);
+        slot_release(port_num, slot);
 
-                AHCI_TRACE("Error: port=%u, err=%#x, sata_err=%#x\n",
-                           port_num, error, sata_err);
-            }
+        // Let NCQ commands through again
+        if (int(request.op) > int(slot_op_t::non_ncq) &&
+                pi->non_ncq_pending) {
+            pi->non_ncq_pending = false;
+            pi->non_ncq_done_cond.notify_all();
+        }
+    }
 
-            if (unlikely(error != 0)) {
-                AHCI_TRACE("Error %d on interface=%p port=%zu\n",
-                           error, (void*)this, pi - port_info);
-            }
+    if (unlikely((port_intr_status & AHCI_HP_IS_TFES) && pi->use_ncq)) {
+        /// Handle failure by
+        ///  - stopping DMA engine,
+        ///  - disabling ncq
+        ///  - resetting port
+        ///  - starting DMA engine
+        ///  - rebuilding issue queue (for non-NCQ completion)
+        ///  - reissuing all outstanding commands
+        /// This is to make command execution sequential, to get precise
+        /// error information. NCQ is turned back on when the port drains
+        port_stop(port_num);
+        port_reset(port_num);
+        pi->use_ncq = false;
+        pi->ncq_suspended = true;
+        port_start(port_num);
 
-            if (likely(request.callback)) {
-                request.callback->set_result(
-                            !error ? dgos::err_sz_pair_t{
-                                     errno_t::OK, request.count }
-                                   : dgos::err_sz_pair_t{
-                                     errno_t::EIO, request.count });
-
-                // Invoke completion callback
-                assert(callback_count < countof(pending_callbacks));
-                pending_callbacks[callback_count++] = request.callback;
-                request.callback = nullptr;
-            }
+        // Every command still in a slot is issued again as a non-NCQ
+        // command, in the same slot, keeping its PRDT
+        uint32_t pending_mask = pi->cmd_issued & pi->slot_mask;
+        pi->issue_pending = 0;
+        pi->issue_pending_ncq = 0;
 
-            slot_release(port_num, slot);
+        // Reissue each command in order
+        for (uint8_t reissue = 0; reissue < num_cmd_slots; ++reissue) {
+            if (!(pending_mask & (UINT32_C(1) << reissue)))
+                continue;
 
-            if (pi->use_ncq && int(request.op) > int(slot_op_t::non_ncq)) {
-                pi->non_ncq_pending = false;
-                pi->non_ncq_done_cond.notify_all();
-            }
+            slot_request_t &request = pi->slot_requests[reissue];
+
+            hba_cmd_cfis_t cfis;
+            atapi_fis_t atapifis;
+            bool ncq;
+
+            size_t fis_size = build_fis(*pi, request, reissue,
+                                        cfis, atapifis, ncq);
+
+            cmd_issue(port_num, reissue, &cfis, nullptr, fis_size,
+                      pi->cmd_tbl[reissue].prdts,
+                      pi->cmd_hdr[reissue].prdtl, true);
         }
+
+        issue_pending_slots(port_num);
+    } else if (unlikely(pi->ncq_suspended &&
+                        !(pi->cmd_issued & pi->slot_mask))) {
+        pi->ncq_suspended = false;
+        pi->use_ncq = true;
     }
 
     // Acknowledge slot interrupt
@@ -1250,13 +1320,29 @@ void ahci_if_t::irq_handler(int irq_ofs)
     unsigned port;
     uint32_t accumulated_acks = 0;
 
+    uint32_t intr_status = mmio_read_intr_status();
+
+    // Only look at the port that owns this vector, the other ports
+    // are handled by their own vector, possibly on another CPU
+    if (per_port_irq)
+        intr_status &= UINT32_C(1) << irq_ofs;
+
     // Loop for each set bit
-    for (uint32_t intr_status = mmio_read_intr_status();
-         intr_status != 0; intr_status &= ~(UINT32_C(1) << port)) {
+    for ( ; intr_status != 0; intr_status &= ~(UINT32_C(1) << port)) {
         // Set bit number is port number
         port = bit_lsb_set(intr_status);
 
-        handle_port_irq(port);
+        if (unlikely(ccc_ports && port == ccc_intr)) {
+            // Coalesced completions, check every coalesced port
+            unsigned ccc_port;
+            for (uint32_t ccc = ccc_ports; ccc != 0;
+                 ccc &= ~(UINT32_C(1) << ccc_port)) {
+                ccc_port = bit_lsb_set(ccc);
+                handle_port_irq(ccc_port);
+            }
+        } else {
+            handle_port_irq(port);
+        }
 
         // Acknowledge the interrupt on the port
         accumulated_acks |= UINT32_C(1) << port;
@@ -1351,24 +1437,84 @@ void ahci_if_t::configure_fua(unsigned port_num, bool enable)
 void ahci_if_t::configure_ncq(unsigned port_num, bool enable,
                               uint8_t queue_depth)
 {
-    AHCI_TRACE("port[%u]: NCQ support: %s\n", port_num,
-               enable ? "yes" : "no");
-    port_info[port_num].use_ncq = enable && support_ncq;
-    port_info[port_num].queue_depth = queue_depth;
+    enable = enable && support_ncq;
+
+    // The drive and the HBA both limit the number of commands in flight
+    uint8_t depth = enable
+            ? ext::min(queue_depth, num_cmd_slots)
+            : num_cmd_slots;
+
+    AHCI_TRACE("port[%u]: NCQ support: %s, depth %u\n", port_num,
+               enable ? "yes" : "no", depth);
+
+    hba_port_info_t &pi = port_info[port_num];
+
+    pi.use_ncq = enable;
+    pi.queue_depth = depth;
 
     // Use queue depth to mark all unsupported tags permanently busy
-    if (queue_depth < 32 && enable) {
+    if (depth < 32) {
         // Mark all unsupported slots permanently busy
-        port_info[port_num].cmd_issued |= ~UINT32_C(0) << queue_depth;
+        pi.cmd_issued |= ~UINT32_C(0) << depth;
 
         // Setup mask of usable slots (which is all the ones not marked above)
-        port_info[port_num].slot_mask = ~(~UINT32_C(0) << queue_depth);
+        pi.slot_mask = ~(~UINT32_C(0) << depth);
     } else {
         // All slots enabled
-        port_info[port_num].slot_mask = ~UINT32_C(0);
+        pi.slot_mask = ~UINT32_C(0);
     }
 }
 
+// Coalesce the completion interrupts of every port that has a drive,
+// if the HBA supports it and it is enabled with AHCI_CCC_COMPLETIONS
+void ahci_if_t::configure_ccc()
+{
+    if (AHCI_CCC_COMPLETIONS == 0 || !(mmio_base->cap & AHCI_HC_CAP_CCCS))
+        return;
+
+    uint32_t ports = 0;
+
+    unsigned port_num;
+    for (uint32_t impl = ports_impl_mask; impl != 0;
+         impl &= ~(UINT32_C(1) << port_num)) {
+        port_num = bit_lsb_set(impl);
+
+        if (port_info[port_num].cmd_hdr && !port_info[port_num].is_atapi)
+            ports |= UINT32_C(1) << port_num;
+    }
+
+    if (!ports)
+        return;
+
+    uint32_t ccc_ctl = mm_rd(mmio_base->ccc_ctl);
+
+    // The thresholds may only be changed while it is disabled
+    AHCI_HC_CCC_EN_SET(ccc_ctl, 0);
+    mm_wr(mmio_base->ccc_ctl, ccc_ctl);
+
+    AHCI_HC_CCC_CC_SET(ccc_ctl, AHCI_CCC_COMPLETIONS);
+    AHCI_HC_CCC_TV_SET(ccc_ctl, AHCI_CCC_TIMEOUT_MS);
+    mm_wr(mmio_base->ccc_ctl, ccc_ctl);
+
+    mm_wr(mmio_base->ccc_pts, ports);
+
+    // Completions on coalesced ports only interrupt through CCC,
+    // errors still interrupt through the port
+    for (uint32_t ccc = ports; ccc != 0; ccc &= ~(UINT32_C(1) << port_num)) {
+        port_num = bit_lsb_set(ccc);
+        mm_and(mmio_base->ports[port_num].intr_en, ~AHCI_HP_IE_COMPLETION);
+    }
+
+    ccc_intr = AHCI_HC_CCC_INT_GET(ccc_ctl);
+    ccc_ports = ports;
+
+    AHCI_HC_CCC_EN_SET(ccc_ctl, 1);
+    mm_wr(mmio_base->ccc_ctl, ccc_ctl);
+
+    AHCI_TRACE("Coalescing ports %#x, %u completions or %ums, intr %u\n",
+               ports, AHCI_CCC_COMPLETIONS, AHCI_CCC_TIMEOUT_MS, ccc_intr);
+}
+
 ahci_if_t::ahci_if_t()
 {
 }
@@ -1445,16 +1591,38 @@ bool ahci_if_t::init(pci_dev_iterator_t const& pci_dev)
 
     rebase();
 
+    // One vector per port, the intr_status bit number selects the vector,
+    // plus the coalescing one (which is above the implemented ports)
+    uint32_t vector_mask = ports_impl_mask;
+    if (AHCI_CCC_COMPLETIONS && (cap & AHCI_HC_CAP_CCCS))
+        vector_mask |= UINT32_C(1) <<
+                AHCI_HC_CCC_INT_GET(mm_rd(mmio_base->ccc_ctl));
+
+    unsigned vector_count = bit_msb_set(vector_mask) + 1;
+
+    // Spread the ports across the CPUs
+    size_t cpu_count = thread_get_cpu_count();
+    int target_cpus[32];
+    for (unsigned i = 0; i < vector_count; ++i)
+        target_cpus[i] = i % cpu_count;
+
     // Try to use MSI IRQ
-    use_msi = pci_try_msi_irq(pci_dev, &irq_range, 0, false, 1,
-                              &ahci_if_t::irq_handler, "ahci");
+    use_msi = pci_try_msi_irq(pci_dev, &irq_range, 0, true, vector_count,
+                              &ahci_if_t::irq_handler, "ahci", target_cpus);
 
     if (use_msi)
         pci_set_irq_unmask(pci_dev, true);
 
-    AHCI_TRACE("Using IRQs %s=%d, base=%u, count=%u\n",
+    // With fewer messages than ports, the HBA either reverts to a single
+    // message (MRSM) or shares the last one, either way, scan every port
+    per_port_irq = use_msi && irq_range.count >= int(vector_count) &&
+            !(mm_rd(mmio_base->host_ctl) & AHCI_HC_HC_MRSM);
+
+    AHCI_TRACE("Using IRQs %s=%d, base=%u, count=%u, per port=%d\n",
                irq_range.msix ? "msix" : "msi", use_msi,
-               irq_range.base, irq_range.count);
+               irq_range.base, irq_range.count, per_port_irq);
+
+    configure_ccc();
 
     return true;
 }
@@ -1470,6 +1638,41 @@ unsigned ahci_if_t::io(size_t port_num, slot_request_t &request)
     return expect_count;
 }
 
+errno_t ahci_if_t::submit_plan(size_t port_num, disk_io_plan_t *plan)
+{
+    ext::vector<unsigned> expect;
+
+    if (unlikely(!expect.resize(plan->count)))
+        return errno_t::ENOMEM;
+
+    // Build every command under one hold of the port lock,
+    // then write PxSACT and PxCI once for all of them
+    scoped_port_lock hold_port_lock(port_info[port_num].lock);
+
+    for (uint32_t i = 0; i < plan->count; ++i) {
+        disk_vec_t const &item = plan->vec[i];
+
+        slot_request_t request{};
+        request.data = item.data;
+        request.count = item.count;
+        request.lba = item.lba;
+        request.op = item.write ? slot_op_t::write : slot_op_t::read;
+        request.fua = item.fua;
+        request.callback = item.iocp;
+
+        expect[i] = io_locked(port_num, request, hold_port_lock, true);
+    }
+
+    issue_pending_slots(port_num);
+
+    hold_port_lock.unlock();
+
+    for (uint32_t i = 0; i < plan->count; ++i)
+        plan->vec[i].iocp->set_expect(expect[i]);
+
+    return errno_t::OK;
+}
+
 errno_t ahci_if_t::cancel_io(size_t port_num, iocp_t *iocp)
 {
     hba_port_info_t& port = port_info[port_num];
@@ -1488,46 +1691,41 @@ errno_t ahci_if_t::cancel_io(size_t port_num, iocp_t *iocp)
     return errno_t::OK;
 }
 
-bool ahci_if_t::port_stall_ncq(hba_port_info_t &pi,
+void ahci_if_t::port_stall_ncq(unsigned port_num,
                                scoped_port_lock &port_lock)
 {
-    bool save_ncq = false;
-
-    if (pi.use_ncq) {
-        if (!pi.non_ncq_pending)
-            pi.non_ncq_pending = true;
+    hba_port_info_t &pi = port_info[port_num];
 
-        // Wait for all slots to become available
-        while (pi.cmd_issued & pi.slot_mask)
-            pi.idle_cond.wait(port_lock);
+    if (!pi.use_ncq)
+        return;
 
-        // Disable NCQ for duration of flush
-        save_ncq = pi.use_ncq;
-        pi.use_ncq = false;
+    // One non-NCQ command at a time
+    while (pi.non_ncq_pending) {
+        issue_pending_slots(port_num);
+        pi.non_ncq_done_cond.wait(port_lock);
     }
 
-    return save_ncq;
+    pi.non_ncq_pending = true;
+
+    // Deferred commands will never finish if they are never issued
+    issue_pending_slots(port_num);
+
+    // Wait for all slots to become available
+    while (pi.cmd_issued & pi.slot_mask)
+        pi.idle_cond.wait(port_lock);
 }
 
 int ahci_if_t::port_flush(unsigned port_num, iocp_t *iocp)
 {
     hba_port_info_t &pi = port_info[port_num];
     scoped_port_lock hold_port_lock(pi.lock);
-    bool save_ncq = port_stall_ncq(pi, hold_port_lock);
-
-    slot_request_t request = pi.slot_requests[0];
+    port_stall_ncq(port_num, hold_port_lock);
 
-    request = {};
+    slot_request_t request{};
     request.op = slot_op_t::flush;
     request.callback = iocp;
-    request.save_ncq = save_ncq;
-
-    io(port_num, request);
 
-    if (save_ncq)
-        pi.use_ncq = save_ncq;
-
-    return 0;
+    return io_locked(port_num, request, hold_port_lock);
 }
 
 int ahci_if_t::port_trim(unsigned port_num,
@@ -1535,22 +1733,15 @@ int ahci_if_t::port_trim(unsigned port_num,
 {
     hba_port_info_t &pi = port_info[port_num];
     scoped_port_lock hold_port_lock(pi.lock);
-    bool save_ncq = port_stall_ncq(pi, hold_port_lock);
-
-    slot_request_t request = pi.slot_requests[0];
+    port_stall_ncq(port_num, hold_port_lock);
 
-    request = {};
+    slot_request_t request{};
     request.op = slot_op_t::trim;
     request.callback = iocp;
     request.data = data;
     request.count = size >> 9;
 
-    io(port_num, request);
-
-    if (save_ncq)
-        pi.use_ncq = save_ncq;
-
-    return 0;
+    return io_locked(port_num, request, hold_port_lock);
 }
 
 void ahci_if_t::port_set_offline(unsigned port_num, bool offline)
@@ -1564,14 +1755,16 @@ void ahci_if_t::port_set_offline(unsigned port_num, bool offline)
 
 // Acquire a slot, waiting if necessary
 int8_t ahci_if_t::slot_wait(hba_port_info_t &pi,
-                            scoped_port_lock& hold_port_lock)
+                            scoped_port_lock& hold_port_lock,
+                            bool non_ncq)
 {
     int8_t slot;
     for (;;) {
-        slot = slot_acquire(pi, hold_port_lock);
+        slot = slot_acquire(pi, hold_port_lock, non_ncq);
         if (slot >= 0)
             break;
 
+        issue_pending_slots(&pi - port_info);
         pi.slotalloc_avail.wait(hold_port_lock);
     }
 
@@ -1591,10 +1784,121 @@ bool ahci_if_t::port_is_offline(unsigned port_num)
     return is_offline;
 }
 
+// Build the command FIS for one chunk, whose lba and count are in request.
+// Returns the FIS size, sets ncq if it is an NCQ command
+size_t ahci_if_t::build_fis(hba_port_info_t &pi, slot_request_t const &request,
+                            uint8_t slot, hba_cmd_cfis_t &cfis,
+                            atapi_fis_t &atapifis, bool &ncq)
+{
+    size_t fis_size;
+
+    memset(&cfis, 0, sizeof(cfis));
+
+    ncq = false;
+
+    if (unlikely(request.op == slot_op_t::identify)) {
+        fis_size = sizeof(cfis.h2d);
+
+        cfis.h2d = {};
+
+        cfis.h2d.fis_type = FIS_TYPE_REG_H2D;
+        cfis.h2d.ctl = AHCI_FIS_CTL_CMD;
+
+        cfis.h2d.command = !pi.is_atapi
+                ? ata_cmd_t::IDENTIFY
+                : ata_cmd_t::IDENTIFY_PACKET;
+        cfis.h2d.set_lba(pi.is_atapi ? 512 << 8 : 0);
+        cfis.h2d.set_count(0);
+        cfis.h2d.feature_lo = 0;
+
+        cfis.d2h.device = 0;
+    } else if (unlikely(request.op == slot_op_t::flush)) {
+        fis_size = sizeof(cfis.h2d);
+
+        cfis.h2d = {};
+        cfis.h2d.fis_type = FIS_TYPE_REG_H2D;
+        cfis.h2d.ctl = AHCI_FIS_CTL_CMD;
+
+        cfis.h2d.command = pi.use_48bit
+                ? ata_cmd_t::CACHE_FLUSH_EXT
+                : ata_cmd_t::CACHE_FLUSH;
+    } else if (unlikely(request.op == slot_op_t::trim)) {
+        fis_size = sizeof(cfis.h2d);
+
+        cfis.h2d = {};
+        cfis.h2d.fis_type = FIS_TYPE_REG_H2D;
+        cfis.h2d.ctl = AHCI_FIS_CTL_CMD;
+
+        cfis.h2d.command = ata_cmd_t::DATA_SET_MGMT;
+
+        // bit 0 = TRIM (it is the only one defined, new command in ACS-2)
+        cfis.h2d.set_feature(1);
+        cfis.h2d.set_count((request.count << pi.log2_sector_size) >> 9);
+    } else if (pi.use_ncq) {
+        fis_size = sizeof(cfis.ncq);
+
+        cfis.ncq = {};
+        cfis.ncq.fis_type = FIS_TYPE_REG_H2D;
+        cfis.ncq.ctl = AHCI_FIS_CTL_CMD;
+
+        // NCQ is always 48 bit so no need to check pi.use_48bit
+        cfis.ncq.command = request.op == slot_op_t::read
+                ? ata_cmd_t::READ_DMA_NCQ
+                : ata_cmd_t::WRITE_DMA_NCQ;
+        cfis.ncq.set_lba(request.lba);
+        cfis.ncq.set_count(request.count);
+        cfis.ncq.tag = AHCI_FIS_TAG_TAG_n(slot);
+        cfis.ncq.fua = AHCI_FIS_FUA_LBA |
+                (request.fua ? AHCI_FIS_FUA_FUA : 0);
+        cfis.ncq.prio = 0;
+        cfis.ncq.aux = 0;
+
+        ncq = true;
+    } else if (pi.is_atapi) {
+        fis_size = sizeof(cfis.h2d);
+
+        cfis.h2d = {};
+        cfis.h2d.fis_type = FIS_TYPE_REG_H2D;
+        cfis.h2d.ctl = AHCI_FIS_CTL_CMD;
+        cfis.h2d.command = ata_cmd_t::PACKET;
+
+        atapifis.set(ATAPI_CMD_READ, request.lba, request.count, 1);
+        // DMA and DMADIR
+        cfis.h2d.feature_lo = 1 | ((request.op == slot_op_t::read) << 2);
+        cfis.h2d.set_count(0);
+        cfis.h2d.set_lba(2048 << 16);
+        cfis.d2h.device = 0;
+    } else {
+        fis_size = sizeof(cfis.h2d);
+
+        cfis.h2d = {};
+        cfis.h2d.fis_type = FIS_TYPE_REG_H2D;
+        cfis.h2d.ctl = AHCI_FIS_CTL_CMD;
+
+        cfis.h2d.command = request.op == slot_op_t::read
+                ? (pi.use_48bit
+                   ? ata_cmd_t::READ_DMA_EXT
+                   : ata_cmd_t::READ_DMA)
+                : (pi.use_48bit
+                   ? ata_cmd_t::WRITE_DMA_EXT
+                   : ata_cmd_t::WRITE_DMA);
+
+        assert(request.lba < (UINT64_C(1) << 48));
+        cfis.h2d.set_lba(request.lba);
+        cfis.h2d.set_count(request.count);
+        cfis.h2d.feature_lo = 1;
+
+        // LBA
+        cfis.h2d.device = request.fua ? AHCI_FIS_FUA_LBA : 0;
+    }
+
+    return fis_size;
+}
+
 // Expects interrupts disabled
 // Returns the number of async completions to expect
 unsigned ahci_if_t::io_locked(unsigned port_num, slot_request_t &request,
-                              scoped_port_lock& hold_port_lock)
+                              scoped_port_lock& hold_port_lock, bool defer)
 {
     mmphysrange_t ranges[AHCI_CMD_TBL_ENT_MAX_PRD];
     size_t ranges_count;
@@ -1614,16 +1918,38 @@ unsigned ahci_if_t::io_locked(unsigned port_num, slot_request_t &request,
         return 0;
     }
 
-    void *data = request.data;
-    uint32_t lba = request.lba;
-    uint32_t count = request.count;
+    // A plain buffer is a list of one segment
+    storage_seg_t one_seg{
+        request.data, 0, size_t(request.count) << pi.log2_sector_size
+    };
+
+    storage_seg_t const *segs = request.segs;
+    size_t seg_count = request.seg_count;
+
+    if (!segs && request.data) {
+        segs = &one_seg;
+        seg_count = 1;
+    }
+
+    size_t offset = 0;
+    uint64_t lba = request.lba;
+    uint64_t count = request.count;
+
+    bool non_ncq = int(request.op) > int(slot_op_t::non_ncq);
 
-    unsigned chunks;
-    for (chunks = 0; count > 0; ++chunks) {
-        if (likely(request.data != nullptr)) {
-            ranges_count = mphysranges(
-                        ranges, countof(ranges), request.data,
-                        request.count << pi.log2_sector_size,
+    // NCQ commands are always 48 bit
+    uint64_t max_blocks = pi.use_ncq || pi.use_48bit
+            ? AHCI_MAX_SECTORS_48BIT
+            : AHCI_MAX_SECTORS_28BIT;
+
+    // Commands without data (flush) are issued once
+    unsigned chunks = 0;
+    size_t transferred_blocks;
+    do {
+        if (likely(segs != nullptr)) {
+            ranges_count = storage_seg_physranges(
+                        ranges, countof(ranges), segs, seg_count, offset,
+                        ext::min(count, max_blocks) << pi.log2_sector_size,
                         4 << 20);
         } else {
             ranges_count = 0;
@@ -1639,123 +1965,41 @@ unsigned ahci_if_t::io_locked(unsigned port_num, slot_request_t &request,
             transferred += ranges[i].size;
         }
 
-        size_t transferred_blocks = transferred >> pi.log2_sector_size;
+        transferred_blocks = transferred >> pi.log2_sector_size;
 
         // Wait for a slot
-        uint8_t slot = slot_wait(pi, hold_port_lock);
+        uint8_t slot = slot_wait(pi, hold_port_lock, non_ncq);
+
+        // The slot describes only this chunk, the buffer is only
+        // described by the PRDT, so it can be replayed after an error
+        slot_request_t &chunk = pi.slot_requests[slot];
+        chunk = request;
+        chunk.data = nullptr;
+        chunk.segs = nullptr;
+        chunk.seg_count = 0;
+        chunk.lba = lba;
+        chunk.count = segs ? transferred_blocks : request.count;
 
         hba_cmd_cfis_t cfis;
-        size_t fis_size;
-
-        memset(&cfis, 0, sizeof(cfis));
-
         atapi_fis_t atapifis;
+        bool ncq;
 
-        if (unlikely(request.op == slot_op_t::identify)) {
-            fis_size = sizeof(cfis.h2d);
-
-            cfis.h2d = {};
-
-            cfis.h2d.fis_type = FIS_TYPE_REG_H2D;
-            cfis.h2d.ctl = AHCI_FIS_CTL_CMD;
-
-            cfis.h2d.command = !pi.is_atapi
-                    ? ata_cmd_t::IDENTIFY
-                    : ata_cmd_t::IDENTIFY_PACKET;
-            cfis.h2d.set_lba(pi.is_atapi ? 512 << 8 : 0);
-            cfis.h2d.set_count(0);
-            cfis.h2d.feature_lo = 0;
-
-            cfis.d2h.device = 0;
-        } else if (unlikely(request.op == slot_op_t::flush)) {
-            fis_size = sizeof(cfis.h2d);
-
-            cfis.h2d = {};
-            cfis.h2d.fis_type = FIS_TYPE_REG_H2D;
-            cfis.h2d.ctl = AHCI_FIS_CTL_CMD;
-
-            cfis.h2d.command = pi.use_48bit
-                    ? ata_cmd_t::CACHE_FLUSH_EXT
-                    : ata_cmd_t::CACHE_FLUSH;
-        } else if (unlikely(request.op == slot_op_t::trim)) {
-            fis_size = sizeof(cfis.h2d);
-
-            cfis.h2d = {};
-            cfis.h2d.fis_type = FIS_TYPE_REG_H2D;
-            cfis.h2d.ctl = AHCI_FIS_CTL_CMD;
-
-            cfis.h2d.command = ata_cmd_t::DATA_SET_MGMT;
-
-            // bit 0 = TRIM (it is the only one defined, new command in ACS-2)
-            cfis.h2d.set_feature(1);
-            cfis.h2d.set_count(transferred >> 9);
-        } else if (pi.use_ncq) {
-            fis_size = sizeof(cfis.ncq);
-
-            cfis.ncq = {};
-            cfis.ncq.fis_type = FIS_TYPE_REG_H2D;
-            cfis.ncq.ctl = AHCI_FIS_CTL_CMD;
-
-            // NCQ is always 48 bit so no need to check pi.use_48bit
-            cfis.ncq.command = request.op == slot_op_t::read
-                    ? ata_cmd_t::READ_DMA_NCQ
-                    : ata_cmd_t::WRITE_DMA_NCQ;
-            cfis.ncq.set_lba(request.lba);
-            cfis.ncq.set_count(transferred_blocks);
-            cfis.ncq.tag = AHCI_FIS_TAG_TAG_n(slot);
-            cfis.ncq.fua = AHCI_FIS_FUA_LBA |
-                    (request.fua ? AHCI_FIS_FUA_FUA : 0);
-            cfis.ncq.prio = 0;
-            cfis.ncq.aux = 0;
-        } else if (pi.is_atapi) {
-            fis_size = sizeof(cfis.h2d);
-
-            cfis.h2d = {};
-            cfis.h2d.fis_type = FIS_TYPE_REG_H2D;
-            cfis.h2d.ctl = AHCI_FIS_CTL_CMD;
-            cfis.h2d.command = ata_cmd_t::PACKET;
-
-            atapifis.set(ATAPI_CMD_READ, request.lba, transferred_blocks, 1);
-            // DMA and DMADIR
-            cfis.h2d.feature_lo = 1 | ((request.op == slot_op_t::read) << 2);
-            cfis.h2d.set_count(0);
-            cfis.h2d.set_lba(2048 << 16);
-            cfis.d2h.device = 0;
-        } else {
-            fis_size = sizeof(cfis.h2d);
-
-            cfis.h2d = {};
-            cfis.h2d.fis_type = FIS_TYPE_REG_H2D;
-            cfis.h2d.ctl = AHCI_FIS_CTL_CMD;
-
-            cfis.h2d.command = request.op == slot_op_t::read
-                    ? (pi.use_48bit
-                       ? ata_cmd_t::READ_DMA_EXT
-                       : ata_cmd_t::READ_DMA)
-                    : (pi.use_48bit
-                       ? ata_cmd_t::WRITE_DMA_EXT
-                       : ata_cmd_t::WRITE_DMA);
-
-            assert(request.lba < (UINT64_C(1) << 48));
-            cfis.h2d.set_lba(request.lba);
-            cfis.h2d.set_count(transferred_blocks);
-            cfis.h2d.feature_lo = 1;
-
-            // LBA
-            cfis.h2d.device = request.fua ? AHCI_FIS_FUA_LBA : 0;
-        }
+        size_t fis_size = build_fis(pi, chunk, slot, cfis, atapifis, ncq);
 
-        pi.slot_requests[slot] = request;
+        if (ncq)
+            pi.issue_pending_ncq |= UINT32_C(1) << slot;
 
         cmd_issue(port_num, slot, &cfis,
                   (request.op == slot_op_t::read &&
                    pi.is_atapi) ? &atapifis : nullptr,
-                  fis_size, prdts, ranges_count);
+                  fis_size, prdts, ranges_count, defer);
 
-        data = (char*)data + transferred;
+        ++chunks;
+
+        offset += transferred;
         lba += transferred_blocks;
         count -= transferred_blocks;
-    }
+    } while (segs && count > 0 && transferred_blocks);
 
     return chunks;
 }
@@ -1763,10 +2007,10 @@ unsigned ahci_if_t::io_locked(unsigned port_num, slot_request_t &request,
 // Must be holding port lock
 void ahci_if_t::cmd_issue(unsigned port_num, unsigned slot,
         hba_cmd_cfis_t const *cfis, atapi_fis_t const *atapi_fis,
-        size_t fis_size, hba_prdt_ent_t const *prdts, size_t ranges_count)
+        size_t fis_size, hba_prdt_ent_t const *prdts, size_t ranges_count,
+        bool defer)
 {
     hba_port_info_t *pi = port_info + port_num;
-    hba_port_t volatile *port = mmio_base->ports + port_num;
 
     hba_cmd_hdr_t *cmd_hdr = pi->cmd_hdr + slot;
     hba_cmd_tbl_ent_t *cmd_tbl_ent = pi->cmd_tbl + slot;
@@ -1790,18 +2034,40 @@ void ahci_if_t::cmd_issue(unsigned port_num, unsigned slot,
     cmd_hdr->prdbc = 0;
     cmd_hdr->prdtl = ranges_count;
 
-    if (pi->use_ncq)
-        mmio_write_sata_act(port, slot);
+    pi->issue_pending |= (UINT32_C(1) << slot);
 
-    mmio_write_command_issue(port, slot);
+    if (!defer)
+        issue_pending_slots(port_num);
+}
+
+// Must be holding port lock
+void ahci_if_t::issue_pending_slots(unsigned port_num)
+{
+    hba_port_info_t *pi = port_info + port_num;
+    hba_port_t volatile *port = mmio_base->ports + port_num;
+
+    uint32_t slots = pi->issue_pending;
+
+    if (!slots)
+        return;
+
+    pi->issue_pending = 0;
+
+    // Only the NCQ commands have a PxSACT bit
+    if (pi->issue_pending_ncq)
+        mmio_write_sata_act(port, pi->issue_pending_ncq);
+
+    pi->issue_pending_ncq = 0;
+
+    mmio_write_command_issue(port, slots);
 }
 
 // Measured in KVM 3950X about 2.5µs, with spikes up to 17µs
 void ahci_if_t::mmio_write_sata_act(
-        hba_port_t volatile *port, unsigned slot)
+        hba_port_t volatile *port, uint32_t slots)
 {
 //    uint64_t st = time_ns();
-    mm_wr(port->sata_act, (UINT32_C(1) << slot));
+    mm_wr(port->sata_act, slots);
 //    uint64_t en = time_ns();
 //    uint64_t el = en - st;
 //    printdbg("Write sata-act %ss\n", engineering_t(el, -3).ptr());
@@ -1809,10 +2075,10 @@ void ahci_if_t::mmio_write_sata_act(
 
 // Measured KVM 3950X 6µs-11µs
 void ahci_if_t::mmio_write_command_issue(
-        hba_port_t volatile *port, unsigned slot)
+        hba_port_t volatile *port, uint32_t slots)
 {
 //    uint64_t st = time_ns();
-    mm_wr(port->cmd_issue, (UINT32_C(1) << slot));
+    mm_wr(port->cmd_issue, slots);
 //    uint64_t en = time_ns();
 //    uint64_t el = en - st;
 //    printdbg("AHCI write command issue %ss\n", engineering_t(el, -3).ptr());
@@ -2173,6 +2439,10 @@ bool ahci_dev_t::init(ahci_if_t *parent, unsigned dev_port, bool dev_is_atapi)
                              identify->max_queue_minus1 + 1);
 
         iface->configure_fua(port, identify->support_fua_ext);
+
+        block_count = identify->support_ext48bit
+                ? identify->max_lba_ext48bit
+                : identify->max_lba;
     }
 
     return true;
@@ -2187,7 +2457,7 @@ errno_t ahci_dev_t::io(
         uint64_t lba, bool fua, slot_op_t op,
         iocp_t *iocp)
 {
-    slot_request_t request;
+    slot_request_t request{};
     request.data = data;
     request.count = count;
     request.lba = lba;
@@ -2202,6 +2472,58 @@ errno_t ahci_dev_t::io(
     return errno_t::OK;
 }
 
+// The PRDT takes the segments directly, split into commands by io_locked
+errno_t ahci_dev_t::segs_io(
+        storage_seg_t const *segs, size_t seg_count,
+        uint64_t lba, bool fua, slot_op_t op, iocp_t *iocp)
+{
+    unsigned log2_sector_size = iface->get_log2_sector_size(port);
+    size_t sector_mask = (size_t(1) << log2_sector_size) - 1;
+    size_t size = 0;
+
+    for (size_t i = 0; i < seg_count; ++i) {
+        // The HBA transfers words
+        uintptr_t addr = segs[i].data
+                ? uintptr_t(segs[i].data)
+                : segs[i].physaddr;
+
+        if (unlikely(!segs[i].size || (segs[i].size & sector_mask) ||
+                     (addr & 1)))
+            return errno_t::EINVAL;
+
+        size += segs[i].size;
+    }
+
+    if (unlikely(!size))
+        return errno_t::EINVAL;
+
+    slot_request_t request{};
+    request.segs = segs;
+    request.seg_count = seg_count;
+    request.count = size >> log2_sector_size;
+    request.lba = lba;
+    request.op = op;
+    request.fua = fua;
+    request.callback = iocp;
+
+    int expect = iface->io(port, request);
+
+    iocp->set_expect(expect);
+
+    return errno_t::OK;
+}
+
+errno_t ahci_dev_t::submit_plan(disk_io_plan_t *plan)
+{
+    errno_t err = iface->submit_plan(port, plan);
+
+    // Could not even start, fall back to one request at a time
+    if (unlikely(err != errno_t::OK))
+        return storage_dev_base_t::submit_plan(plan);
+
+    return errno_t::OK;
+}
+
 errno_t ahci_dev_t::cancel_io(iocp_t *iocp)
 {
     return iface->cancel_io(port, iocp);
@@ -2222,6 +2544,20 @@ errno_t ahci_dev_t::write_async(
     return io((void*)data, count, lba, fua, slot_op_t::write, iocp);
 }
 
+errno_t ahci_dev_t::readv_async(
+        storage_seg_t const *segs, size_t seg_count,
+        uint64_t lba, iocp_t *iocp)
+{
+    return segs_io(segs, seg_count, lba, false, slot_op_t::read, iocp);
+}
+
+errno_t ahci_dev_t::writev_async(
+        storage_seg_t const *segs, size_t seg_count,
+        uint64_t lba, bool fua, iocp_t *iocp)
+{
+    return segs_io(segs, seg_count, lba, fua, slot_op_t::write, iocp);
+}
+
 errno_t ahci_dev_t::trim_async(
         int64_t count, uint64_t lba,
         iocp_t *)
@@ -2254,6 +2590,9 @@ long ahci_dev_t::info(storage_dev_info_t key)
     case STORAGE_INFO_NAME:
         return long("AHCI");
 
+    case STORAGE_INFO_BLOCKCOUNT:
+        return long(block_count);
+
     default:
         return 0;
     }
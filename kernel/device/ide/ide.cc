@@ -1291,6 +1291,9 @@ long ide_dev_t::info(storage_dev_info_t key)
     case STORAGE_INFO_NAME:
         return long("IDE");
 
+    case STORAGE_INFO_BLOCKCOUNT:
+        return !is_atapi ? long(chan->unit_data[slave].max_lba) : 0;
+
     default:
         return -1;
     }
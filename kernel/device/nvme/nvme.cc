@@ -32,6 +32,16 @@ PCI_DRIVER_BY_CLASS(
 #define NVME_TRACE(...) ((void)0)
 #endif
 
+// List area each command slot has to itself, 16 PRP entries or 8 SGL
+// descriptors, used when a transfer's list fits
+#define NVME_SLOT_LIST_BYTES    128
+
+// Pages each queue has for lists too long for a slot's own area
+#define NVME_LIST_PAGES         16
+
+// Largest transfer of one command. MDTS may lower it
+#define NVME_MAX_TRANSFER       (size_t(2) << 20)
+
 int module_main(int argc, char const * const * argv)
 {
     return 0;
@@ -92,7 +102,7 @@ nvme_cmd_t nvme_cmd_t::create_sub_queue(
 // Create a "create completion queue" command
 nvme_cmd_t nvme_cmd_t::create_cmp_queue(
         void *addr, uint32_t size,
-        uint16_t cqid, uint16_t intr)
+        uint16_t cqid, uint16_t intr, bool ien)
 {
     nvme_cmd_t cmd{};
 
@@ -109,7 +119,7 @@ nvme_cmd_t nvme_cmd_t::create_cmp_queue(
 
     cmd.cmd_dword_10[1] =
             NVME_CMD_CCQ_CDW11_IV_n(intr) |
-            NVME_CMD_CCQ_CDW11_IEN_n(1) |
+            NVME_CMD_CCQ_CDW11_IEN_n(ien) |
             NVME_CMD_CCQ_CDW11_PC_n(1);
 
     return cmd;
@@ -290,6 +300,7 @@ public:
         , mask(0)
         , head(0)
         , tail(0)
+        , rung_tail(0)
         , phase(true)
     {
     }
@@ -340,15 +351,25 @@ public:
         return next(tail) == head;
     }
 
+    // Pass ring = false to defer the doorbell write to a later ring()
     template<typename... Args>
-    uint32_t enqueue(T&& item)
+    uint32_t enqueue(T&& item, bool ring = true)
     {
         size_t index = tail;
         entries[tail] = ext::move(item);
-        phase ^= set_tail(next(tail));
+        phase ^= set_tail(next(tail), ring);
         return index;
     }
 
+    // Tell the controller about entries enqueued without ringing
+    void ring()
+    {
+        if (tail_doorbell && rung_tail != tail) {
+            rung_tail = tail;
+            *tail_doorbell = tail;
+        }
+    }
+
     T& at_tail(size_t tail_offset, bool& ret_phase)
     {
         uint32_t index = (tail + tail_offset) & mask;
@@ -408,6 +429,7 @@ public:
             dequeue();
         head = 0;
         tail = 0;
+        rung_tail = 0;
     }
 
 private:
@@ -430,14 +452,14 @@ private:
     }
 
     // Returns 1 if the queue wrapped
-    bool set_tail(uint32_t new_tail)
+    bool set_tail(uint32_t new_tail, bool ring = true)
     {
         bool wrapped = new_tail < tail;
 
         tail = new_tail;
 
-        if (tail_doorbell)
-            *tail_doorbell = tail;
+        if (ring)
+            this->ring();
 
         return wrapped;
     }
@@ -448,6 +470,9 @@ private:
     uint32_t mask;
     uint32_t head;
     uint32_t tail;
+
+    // Tail last written to the doorbell
+    uint32_t rung_tail;
     bool phase;
 };
 
@@ -561,7 +586,10 @@ enum struct nvme_op_t : uint8_t {
 };
 
 struct nvme_request_t {
-    void *data;
+    // The buffer, only used while the commands are built
+    storage_seg_t const *segs;
+    size_t seg_count;
+
     int64_t count;
     uint64_t lba;
     iocp_t *iocp;
@@ -577,6 +605,9 @@ class nvme_queue_state_t {
 public:
     nvme_queue_state_t()
         : prp_lists(nullptr)
+        , list_pages(nullptr)
+        , list_page_free(NO_PAGE)
+        , list_page_free_count(0)
         , ready(false)
     {
     }
@@ -600,19 +631,38 @@ public:
     template<typename T>
     void submit_multiple();
 
+    // Pass ring = false to leave the command for ring_doorbell
     bool submit_cmd(nvme_cmd_t&& cmd,
                     nvme_callback_t::member_t callback = nullptr,
                     void *data = nullptr,
                     int64_t timeout_time = INT64_MAX,
-                    mmphysrange_t *ranges = nullptr,
-                    size_t range_count = 0);
+                    bool ring = true);
+
+    // Submit a command transferring size bytes, offset bytes into the
+    // segments, filling in its PRP entries, or SGL if sgl is true. Lists
+    // too long for the slot's own area take pages from the queue, waiting
+    // for some if there are none free
+    bool submit_io(nvme_cmd_t&& cmd,
+                   nvme_callback_t::member_t callback, void *data,
+                   storage_seg_t const *segs, size_t seg_count,
+                   size_t offset, size_t size, bool sgl,
+                   bool ring = true);
+
+    void ring_doorbell();
 
-    void advance_head(uint16_t new_head, bool need_lock);
+    // The command in slot cmd_id completed, and the controller consumed
+    // the submission queue up to new_head
+    void advance_head(uint16_t new_head, uint16_t cmd_id, bool need_lock);
 
     void invoke_completion(nvme_if_t* owner, nvme_cmp_t& packet,
                            uint16_t cmd_id, int status_type, int status);
 
-    void process_completions(nvme_if_t *nvme_if, nvme_queue_state_t *queues);
+    // Returns the number of completions handled
+    size_t process_completions(nvme_if_t *nvme_if,
+                               nvme_queue_state_t *queues);
+
+    // Peek at the next completion without the lock
+    bool completion_pending() const;
 
     nvme_cmd_t *sub_queue_ptr();
 
@@ -629,14 +679,34 @@ private:
     bool wait_sub_queue_not_full_until(
             scoped_lock &lock_, int64_t timeout_time);
 
-    ext::vector<nvme_cmp_t> cmp_buf;
+    void fill_prp_locked(nvme_cmd_t &cmd, uint32_t index,
+                         storage_seg_t const *segs, size_t seg_count,
+                         size_t offset, size_t size, size_t entry_count);
+
+    void fill_sgl_locked(nvme_cmd_t &cmd, uint32_t index,
+                         storage_seg_t const *segs, size_t seg_count,
+                         size_t offset, size_t size, size_t desc_count);
+
+    // Take a page from the pool and hold it for the command in a slot
+    void *take_list_page_locked(uint32_t index);
+
+    static constexpr uint8_t NO_PAGE = 0xFF;
 
     ext::vector<nvme_callback_t> cmp_handlers;
     uint64_t *prp_lists;
 
+    // Pool of list pages. Free pages, and the pages held by each slot,
+    // are linked through list_page_next
+    char *list_pages;
+    uint8_t list_page_next[NVME_LIST_PAGES];
+    uint8_t list_page_free;
+    uint8_t list_page_free_count;
+    ext::vector<uint8_t> slot_list_page;
+
     lock_type lock;
     ext::condition_variable not_full;
     ext::condition_variable not_empty;
+    ext::condition_variable list_page_freed;
     bool ready;
 };
 
@@ -666,7 +736,24 @@ private:
 
     uint32_t volatile* doorbell_ptr(bool completion, size_t queue);
 
-    unsigned io(uint8_t ns, nvme_request_t &request, uint8_t log2_sectorsize);
+    // I/O queue used by the current CPU
+    size_t io_queue_index();
+
+    // Polled I/O queue used by the current CPU, if poll_queue_count != 0
+    size_t poll_queue_index();
+
+    // Process every polled queue, returns true if anything completed
+    bool poll_completions();
+
+    // Returns the number of completions to expect. With ring = false,
+    // the doorbell is left for ring_doorbell
+    unsigned io(uint8_t ns, nvme_request_t &request, uint8_t log2_sectorsize,
+                size_t queue_index, bool ring = true);
+
+    // True if the segments can be described with PRPs or an SGL
+    bool segs_supported(storage_seg_t const *segs, size_t seg_count) const;
+
+    void ring_doorbell(size_t queue_index);
 
     errno_t cancel_io(nvme_dev_t *dev, iocp_t *iocp);
 
@@ -726,6 +813,21 @@ private:
     size_t queue_count;
     size_t max_queues;
 
+    // The admin queue and the interrupt driven I/O queues come first,
+    // then the polled I/O queues, which have interrupts disabled
+    size_t irq_queue_count;
+    size_t poll_queue_count;
+
+    // CAP.MPSMIN in bytes, the unit of MDTS
+    size_t min_page_size;
+
+    // Largest transfer of one command
+    size_t max_transfer;
+
+    // SGLs are supported, and whether they need dword alignment
+    bool sgl_supported;
+    bool sgl_dword_aligned;
+
     uintptr_t queue_memory_physaddr;
     void* queue_memory;
 
@@ -750,7 +852,8 @@ private:
 
 class nvme_dev_t : public storage_dev_base_t {
 public:
-    void init(nvme_if_t *parent, uint8_t ns, uint8_t log2_sectorsize);
+    void init(nvme_if_t *parent, uint8_t ns, uint8_t log2_sectorsize,
+              uint64_t block_count);
 
 private:
     STORAGE_DEV_IMPL
@@ -758,7 +861,22 @@ private:
     errno_t io(void *data, int64_t count,
                uint64_t lba, bool fua, nvme_op_t op, iocp_t *iocp);
 
+    errno_t segs_io(storage_seg_t const *segs, size_t seg_count,
+                    uint64_t lba, bool fua, nvme_op_t op, iocp_t *iocp);
+
+    errno_t submit_plan(disk_io_plan_t *plan) override final;
+
+    errno_t readv_async(storage_seg_t const *segs, size_t seg_count,
+                        uint64_t lba, iocp_t *iocp) override final;
+
+    errno_t writev_async(storage_seg_t const *segs, size_t seg_count,
+                         uint64_t lba, bool fua,
+                         iocp_t *iocp) override final;
+
+    bool poll_completions() override final;
+
     nvme_if_t *parent;
+    uint64_t block_count;
     uint8_t ns;
     uint8_t log2_sectorsize;
 };
@@ -832,12 +950,18 @@ bool nvme_if_t::init(pci_dev_iterator_t const &pci_dev)
     // Enable bus master DMA, enable MMIO, disable port I/O
     pci_adj_control_bits(pci_dev, PCI_CMD_BME | PCI_CMD_MSE, PCI_CMD_IOSE);
 
-    size_t requested_queue_count = thread_get_cpu_count() + 1;
+    size_t cpu_count = thread_get_cpu_count();
+
+    // The admin queue and an interrupt driven queue for each CPU
+    size_t requested_irq_queue_count = cpu_count + 1;
+
+    // And a polled queue for each CPU, for BLK_REQ_HIPRI requests
+    size_t requested_queue_count = requested_irq_queue_count + cpu_count;
 
     size_t requested_vector_count = 1;
 
-    if (pci_max_vectors(pci_dev) >= int(requested_queue_count))
-        requested_vector_count = requested_queue_count;
+    if (pci_max_vectors(pci_dev) >= int(requested_irq_queue_count))
+        requested_vector_count = requested_irq_queue_count;
 
     // The admin queue is queue[0],
     // and the I/O command queue for CPU 0 is queue[1],
@@ -875,6 +999,12 @@ bool nvme_if_t::init(pci_dev_iterator_t const &pci_dev)
     // Read the CSTS.RDY timeout value from CAP.TO
     uint64_t timeout_ms = NVME_CAP_TO_GET(cap) * 500;
 
+    // Until identify says otherwise
+    min_page_size = size_t(4096) << NVME_CAP_MPSMIN_GET(cap);
+    max_transfer = NVME_MAX_TRANSFER;
+    sgl_supported = false;
+    sgl_dword_aligned = false;
+
     uint64_t timeout_time = milliseconds_from_now(timeout_ms);
 
     // 7.6.1 2) Wait for the controller to indicate that any previous
@@ -898,6 +1028,8 @@ bool nvme_if_t::init(pci_dev_iterator_t const &pci_dev)
             queue_slots * sizeof(nvme_cmp_t);
 
     queue_count = 1;
+    irq_queue_count = 1;
+    poll_queue_count = 0;
     queue_bytes *= requested_queue_count;
 
     queue_memory_physaddr = mm_alloc_contiguous(queue_bytes);
@@ -1009,9 +1141,15 @@ bool nvme_if_t::init(pci_dev_iterator_t const &pci_dev)
     if (unlikely(status != errno_t::OK))
         return error_occurred();
 
-    queue_count = ext::min(requested_queue_count, max_queues);
+    irq_queue_count = ext::min(requested_irq_queue_count, max_queues);
+
+    // Polled queues only get what is left over
+    poll_queue_count = ext::min(cpu_count, max_queues - irq_queue_count);
 
-    NVME_TRACE("Allocated queue count %zu\n", queue_count - 1);
+    queue_count = irq_queue_count + poll_queue_count;
+
+    NVME_TRACE("Allocated queue count %zu, %zu polled\n",
+               queue_count - 1, poll_queue_count);
 
     for (size_t i = 1; i < queue_count; ++i) {
         nvme_queue_state_t& queue = queues[i];
@@ -1058,8 +1196,13 @@ bool nvme_if_t::init(pci_dev_iterator_t const &pci_dev)
 
     // Create completion queues
     for (size_t i = 1; i < queue_count; ++i) {
+        bool polled = i >= irq_queue_count;
+
         int vector;
-        if (irq_range.msix && irq_range.count == 2) {
+        if (polled) {
+            // Unused, interrupts are disabled
+            vector = 0;
+        } else if (irq_range.msix && irq_range.count == 2) {
             // MSI-X with 2 vectors, dedicated vector for admin queue
             vector = i;
         } else {
@@ -1069,7 +1212,8 @@ bool nvme_if_t::init(pci_dev_iterator_t const &pci_dev)
 
         bool ok = admin_queue.submit_cmd(nvme_cmd_t::create_cmp_queue(
                                               queues[i].cmp_queue_ptr(),
-                                              queue_slots, i, vector),
+                                              queue_slots, i, vector,
+                                              !polled),
                                           &nvme_if_t::empty_handler,
                                           &blocking_iocp, timeout_time);
 
@@ -1077,11 +1221,14 @@ bool nvme_if_t::init(pci_dev_iterator_t const &pci_dev)
             return timeout_occurred();
     }
 
-    // Create submission queues
+    // Create submission queues, polled ones with high priority,
+    // which matters if weighted round robin was enabled
     for (size_t i = 1; i < queue_count; ++i) {
+        uint8_t prio = i >= irq_queue_count ? 1 : 2;
+
         bool ok = admin_queue.submit_cmd(nvme_cmd_t::create_sub_queue(
                                              queues[i].sub_queue_ptr(),
-                                             queue_slots, i, i, 2),
+                                             queue_slots, i, i, prio),
                                          &nvme_if_t::empty_handler,
                                          &blocking_iocp, timeout_time);
 
@@ -1262,7 +1409,8 @@ void nvme_if_t::identify_ns_handler(
 
     ext::unique_ptr<nvme_dev_t> drive(new (ext::nothrow) nvme_dev_t{});
 
-    drive->init(this, namespaces[ctx->cur_ns], log2_sectorsize);
+    drive->init(this, namespaces[ctx->cur_ns], log2_sectorsize,
+                ns_ident->nsze);
 
     if (unlikely(!ctx->list.push_back(drive)))
         panic_oom();
@@ -1300,6 +1448,20 @@ void nvme_if_t::identify_ctrl_handler(
 
     host_memory_buffer_size = identify->hmpre;
 
+    // MDTS is a power of two multiple of the minimum page size, 0 means
+    // there is no limit
+    if (identify->mdts && identify->mdts < 32) {
+        max_transfer = ext::min(max_transfer,
+                                min_page_size << identify->mdts);
+    }
+
+    uint32_t sgls = identify->sgls & NVME_SGLS_SUPPORT_MASK;
+    sgl_supported = sgls != 0;
+    sgl_dword_aligned = sgls == NVME_SGLS_SUPPORT_DWORD;
+
+    NVME_TRACE("max transfer %zuKB, SGL %ssupported\n",
+               max_transfer >> 10, sgl_supported ? "" : "not ");
+
     munmap(identify, 4096);
 
     if (iocp)
@@ -1339,11 +1501,13 @@ ext::vector<storage_dev_base_t*> nvme_if_t::detect_devices()
 }
 
 void nvme_dev_t::init(nvme_if_t *parent,
-                      uint8_t ns, uint8_t log2_sectorsize)
+                      uint8_t ns, uint8_t log2_sectorsize,
+                      uint64_t block_count)
 {
     this->parent = parent;
     this->ns = ns;
     this->log2_sectorsize = log2_sectorsize;
+    this->block_count = block_count;
 }
 
 void nvme_dev_t::cleanup_dev()
@@ -1380,7 +1544,8 @@ void nvme_if_t::irq_handler(int irq_offset)
         queue.process_completions(this, queues);
     } else {
         // Fallback to vector that is not shared across CPUs
-        for (size_t i = irq_offset; i < queue_count; i += irq_range.count) {
+        for (size_t i = irq_offset; i < irq_queue_count;
+             i += irq_range.count) {
             nvme_queue_state_t& queue = queues[i];
             queue.process_completions(this, queues);
         }
@@ -1393,46 +1558,121 @@ uint32_t volatile* nvme_if_t::doorbell_ptr(bool completion, size_t queue)
     return doorbells + ((queue << doorbell_shift) + completion);
 }
 
-unsigned nvme_if_t::io(uint8_t ns, nvme_request_t &request,
-                       uint8_t log2_sectorsize)
+size_t nvme_if_t::io_queue_index()
 {
     uint32_t cur_cpu = thread_cpu_number();
 
-    int queue_index;
+    // Queue 0 is the admin queue
+    if (cur_cpu < irq_queue_count - 1)
+        return cur_cpu + 1;
+
+    return cur_cpu % (irq_queue_count - 1) + 1;
+}
+
+size_t nvme_if_t::poll_queue_index()
+{
+    return irq_queue_count + thread_cpu_number() % poll_queue_count;
+}
+
+bool nvme_if_t::poll_completions()
+{
+    size_t count = 0;
+
+    // The waiter may have migrated since submitting, check them all
+    for (size_t i = irq_queue_count; i < queue_count; ++i) {
+        nvme_queue_state_t& queue = queues[i];
+
+        if (queue.completion_pending())
+            count += queue.process_completions(this, queues);
+    }
+
+    return count != 0;
+}
+
+void nvme_if_t::ring_doorbell(size_t queue_index)
+{
+    queues[queue_index].ring_doorbell();
+}
 
-    if (cur_cpu < queue_count - 1)
-        queue_index = cur_cpu + 1;
-    else
-        queue_index = cur_cpu % (queue_count - 1) + 1;
+static uintptr_t nvme_seg_addr(storage_seg_t const &seg)
+{
+    return seg.data ? uintptr_t(seg.data) : seg.physaddr;
+}
 
-    size_t bytes = request.count << log2_sectorsize;
+// PRPs can only describe segments that meet on page boundaries
+static bool nvme_segs_prp_ok(storage_seg_t const *segs, size_t seg_count)
+{
+    for (size_t i = 0; i < seg_count; ++i) {
+        uintptr_t st = nvme_seg_addr(segs[i]);
+        uintptr_t en = st + segs[i].size;
+
+        if ((i > 0 && (st & (PAGE_SIZE - 1))) ||
+                (i + 1 < seg_count && (en & (PAGE_SIZE - 1))))
+            return false;
+    }
+
+    return true;
+}
+
+static bool nvme_segs_dword_aligned(storage_seg_t const *segs,
+                                    size_t seg_count)
+{
+    for (size_t i = 0; i < seg_count; ++i) {
+        if ((nvme_seg_addr(segs[i]) | segs[i].size) & 3)
+            return false;
+    }
+
+    return true;
+}
+
+bool nvme_if_t::segs_supported(storage_seg_t const *segs,
+                               size_t seg_count) const
+{
+    return nvme_segs_prp_ok(segs, seg_count) ||
+            (sgl_supported && (!sgl_dword_aligned ||
+                               nvme_segs_dword_aligned(segs, seg_count)));
+}
 
+unsigned nvme_if_t::io(uint8_t ns, nvme_request_t &request,
+                       uint8_t log2_sectorsize,
+                       size_t queue_index, bool ring)
+{
     uint32_t expect = 0;
 
+    // Whole sectors, no more than the controller takes in one command
+    size_t max_chunk = max_transfer & -(size_t(1) << log2_sectorsize);
+
+    bool prp_ok = nvme_segs_prp_ok(request.segs, request.seg_count);
+    bool sgl_ok = sgl_supported &&
+            (!sgl_dword_aligned ||
+             nvme_segs_dword_aligned(request.segs, request.seg_count));
+
+    assert(prp_ok || sgl_ok);
+
+    size_t offset = 0;
+
     while (request.count > 0) {
         ++expect;
 
-        size_t chunk;
-        size_t lba_count;
-        size_t range_count;
-        mmphysrange_t ranges[16];
+        size_t chunk = 0;
+        size_t lba_count = 0;
+        size_t chunk_offset = offset;
+        uint64_t chunk_lba = request.lba;
         nvme_cmd_t cmd;
 
         switch (request.op) {
         case nvme_op_t::read:
         case nvme_op_t::write:
-            chunk = ext::min(bytes, size_t(0x10000));
-            range_count = mphysranges(ranges, countof(ranges),
-                                      request.data, chunk, PAGE_SIZE);
+            chunk = ext::min(size_t(request.count) << log2_sectorsize,
+                             max_chunk);
 
             lba_count = chunk >> log2_sectorsize;
             request.count -= lba_count;
-            request.data = (char*)request.data +
-                    (lba_count << log2_sectorsize);
+            request.lba += lba_count;
+            offset += chunk;
             break;
 
         case nvme_op_t::flush:
-            range_count = 0;
             request.count = 0;
             break;
 
@@ -1443,18 +1683,18 @@ unsigned nvme_if_t::io(uint8_t ns, nvme_request_t &request,
         switch (request.op) {
         case nvme_op_t::read:
             cmd = nvme_cmd_t::create_read(
-                    request.lba, lba_count, ns);
+                    chunk_lba, lba_count, ns);
             break;
 
         case nvme_op_t::write:
             cmd = nvme_cmd_t::create_write(
-                    request.lba, lba_count, ns, request.fua);
+                    chunk_lba, lba_count, ns, request.fua);
             break;
 
         case nvme_op_t::trim:
             // Trim stores some state in the request
             cmd = nvme_cmd_t::create_trim(
-                    request.lba, lba_count, request.range, ns);
+                    chunk_lba, lba_count, request.range, ns);
             break;
 
         case nvme_op_t::flush:
@@ -1463,10 +1703,26 @@ unsigned nvme_if_t::io(uint8_t ns, nvme_request_t &request,
 
         }
 
+        // An SGL is worth it when PRPs would need a list,
+        // it takes one descriptor per physically contiguous run.
+        // It is the only way to describe segments PRPs can't
+        bool sgl = false;
+
+        if (chunk && sgl_ok) {
+            mmphysrange_t first;
+            storage_seg_physranges(&first, 1, request.segs, request.seg_count,
+                                   chunk_offset, chunk, chunk);
+
+            size_t page_ofs = first.physaddr & (PAGE_SIZE - 1);
+            sgl = !prp_ok || page_ofs + chunk > 2 * PAGE_SIZE;
+        }
+
+        // Ring once, after the last chunk
         nvme_queue_state_t& queue = queues[queue_index];
-        queue.submit_cmd(ext::move(cmd), &nvme_if_t::io_handler, request.iocp,
-                         INT64_MAX,
-                         ranges, range_count);
+        queue.submit_io(ext::move(cmd), &nvme_if_t::io_handler, request.iocp,
+                        request.segs, request.seg_count,
+                        chunk_offset, chunk, sgl,
+                        ring && request.count == 0);
     }
 
     return expect;
@@ -1563,20 +1819,91 @@ errno_t nvme_dev_t::io(
         void *data, int64_t count, uint64_t lba,
         bool fua, nvme_op_t op, iocp_t *iocp)
 {
+   storage_seg_t seg{ data, 0, size_t(count) << log2_sectorsize };
+
+   return segs_io(&seg, data ? 1 : 0, lba, fua, op, iocp);
+}
+
+errno_t nvme_dev_t::segs_io(
+        storage_seg_t const *segs, size_t seg_count,
+        uint64_t lba, bool fua, nvme_op_t op, iocp_t *iocp)
+{
+   size_t size = 0;
+
+   for (size_t i = 0; i < seg_count; ++i)
+       size += segs[i].size;
+
+   if (unlikely(size & ((size_t(1) << log2_sectorsize) - 1)))
+       return errno_t::EINVAL;
+
    nvme_request_t request;
-   request.data = data;
-   request.count = count;
+   request.segs = segs;
+   request.seg_count = seg_count;
+   request.count = size >> log2_sectorsize;
    request.lba = lba;
    request.op = op;
    request.fua = fua;
    request.iocp = iocp;
 
-   int expect = parent->io(ns, request, log2_sectorsize);
+   int expect = parent->io(ns, request, log2_sectorsize,
+                           parent->io_queue_index());
    iocp->set_expect(expect);
 
    return errno_t::OK;
 }
 
+errno_t nvme_dev_t::submit_plan(disk_io_plan_t *plan)
+{
+    // Queue every command, then ring the doorbell once for all of them.
+    // Polled requests go to a polled queue, if there are any
+    size_t queue_index = parent->io_queue_index();
+    size_t poll_index = parent->poll_queue_count
+            ? parent->poll_queue_index()
+            : queue_index;
+
+    bool ring_io = false;
+    bool ring_poll = false;
+
+    for (uint32_t i = 0; i < plan->count; ++i) {
+        disk_vec_t const &item = plan->vec[i];
+
+        bool polled = item.hipri && poll_index != queue_index;
+
+        storage_seg_t seg{
+            item.data, 0, size_t(item.count) << log2_sectorsize
+        };
+
+        nvme_request_t request;
+        request.segs = &seg;
+        request.seg_count = 1;
+        request.count = item.count;
+        request.lba = item.lba;
+        request.op = item.write ? nvme_op_t::write : nvme_op_t::read;
+        request.fua = item.fua;
+        request.iocp = item.iocp;
+
+        int expect = parent->io(ns, request, log2_sectorsize,
+                                polled ? poll_index : queue_index, false);
+        item.iocp->set_expect(expect);
+
+        ring_poll |= polled;
+        ring_io |= !polled;
+    }
+
+    if (ring_io)
+        parent->ring_doorbell(queue_index);
+
+    if (ring_poll)
+        parent->ring_doorbell(poll_index);
+
+    return errno_t::OK;
+}
+
+bool nvme_dev_t::poll_completions()
+{
+    return parent->poll_completions();
+}
+
 errno_t nvme_dev_t::cancel_io(iocp_t *iocp)
 {
     return parent->cancel_io(this, iocp);
@@ -1598,6 +1925,29 @@ errno_t nvme_dev_t::write_async(
     return io((void*)data, count, lba, fua, nvme_op_t::write, iocp);
 }
 
+// Segments that meet off page boundaries need SGL support, without it
+// they are issued one at a time
+errno_t nvme_dev_t::readv_async(
+        storage_seg_t const *segs, size_t seg_count,
+        uint64_t lba, iocp_t *iocp)
+{
+    if (unlikely(!parent->segs_supported(segs, seg_count)))
+        return storage_dev_base_t::readv_async(segs, seg_count, lba, iocp);
+
+    return segs_io(segs, seg_count, lba, false, nvme_op_t::read, iocp);
+}
+
+errno_t nvme_dev_t::writev_async(
+        storage_seg_t const *segs, size_t seg_count,
+        uint64_t lba, bool fua, iocp_t *iocp)
+{
+    if (unlikely(!parent->segs_supported(segs, seg_count)))
+        return storage_dev_base_t::writev_async(segs, seg_count,
+                                                lba, fua, iocp);
+
+    return segs_io(segs, seg_count, lba, fua, nvme_op_t::write, iocp);
+}
+
 errno_t nvme_dev_t::flush_async(iocp_t *iocp)
 {
     return io(nullptr, 0, 0, false, nvme_op_t::flush, iocp);
@@ -1624,6 +1974,12 @@ long nvme_dev_t::info(storage_dev_info_t key)
     case STORAGE_INFO_NAME:
         return long("NVME");
 
+    case STORAGE_INFO_BLOCKCOUNT:
+        return long(block_count);
+
+    case STORAGE_INFO_HAVE_POLL:
+        return parent->poll_queue_count != 0;
+
     default:
         return 0;
     }
@@ -1637,16 +1993,28 @@ bool nvme_queue_state_t::init(
     if (unlikely(!cmp_handlers.resize(count)))
         return false;
 
-    if (unlikely(!cmp_buf.reserve(count)))
+    if (unlikely(!slot_list_page.resize(count, NO_PAGE)))
         return false;
 
-    // Allocate enough memory for 16 PRP list entries per slot
+    // Allocate the list area of each slot
     prp_lists = (uint64_t*)mmap(
-                nullptr, count * sizeof(*prp_lists) * 16,
+                nullptr, count * NVME_SLOT_LIST_BYTES,
                 PROT_READ | PROT_WRITE, MAP_POPULATE);
     if (unlikely(prp_lists == MAP_FAILED))
         return false;
 
+    list_pages = (char*)mmap(
+                nullptr, NVME_LIST_PAGES * PAGE_SIZE,
+                PROT_READ | PROT_WRITE, MAP_POPULATE);
+    if (unlikely(list_pages == MAP_FAILED))
+        return false;
+
+    for (size_t i = 0; i < NVME_LIST_PAGES; ++i)
+        list_page_next[i] = i + 1 < NVME_LIST_PAGES ? i + 1 : NO_PAGE;
+
+    list_page_free = 0;
+    list_page_free_count = NVME_LIST_PAGES;
+
     sub_queue.init(sub_queue_ptr, count, nullptr, sub_doorbell, 1);
     cmp_queue.init(cmp_queue_ptr, count, cmp_doorbell, nullptr, 1);
 
@@ -1672,8 +2040,7 @@ errno_t nvme_queue_state_t::cancel_io(iocp_t *iocp)
 // Can only fail on timeout
 bool nvme_queue_state_t::submit_cmd(
         nvme_cmd_t &&cmd, nvme_callback_t::member_t callback,
-        void *data, int64_t timeout_time,
-        mmphysrange_t *ranges, size_t range_count)
+        void *data, int64_t timeout_time, bool ring)
 {
     scoped_lock hold(lock);
 
@@ -1684,38 +2051,273 @@ bool nvme_queue_state_t::submit_cmd(
 
     NVME_CMD_SDW0_CID_SET(cmd.hdr.cdw0, index);
 
-    if (range_count > 2) {
-        // Long list has first entry for data in first page
-        cmd.hdr.dptr.prpp[0].addr = ranges[0].physaddr;
+    assert(index < cmp_handlers.size());
+    cmp_handlers[index] = nvme_callback_t(callback, data);
+
+    sub_queue.enqueue(ext::move(cmd), ring);
+
+    return true;
+}
+
+// Call fn with each physically contiguous range of size bytes, offset
+// bytes into the segments, a few at a time so any size fits on the stack
+template<typename F>
+static void nvme_for_each_range(storage_seg_t const *segs, size_t seg_count,
+                                size_t offset, size_t size,
+                                size_t max_size, F fn)
+{
+    mmphysrange_t ranges[16];
+
+    while (size) {
+        size_t count = storage_seg_physranges(
+                    ranges, countof(ranges), segs, seg_count,
+                    offset, size, max_size);
+        size_t done = mphysranges_total(ranges, count);
 
-        uint64_t volatile *prp_list = prp_lists + index * 16;
+        assert(done > 0 && done <= size);
 
-        // Fill in spill PRP slots
-        for (size_t i = 1; i < range_count; ++i)
-            prp_list[i-1] = ranges[i].physaddr;
+        for (size_t i = 0; i < count; ++i)
+            fn(ranges[i]);
 
-        // Then a pointer to the PRP list in the second entry
-        cmd.hdr.dptr.prpp[1].addr = mphysaddr(prp_list);
-    } else if (range_count > 1) {
-        cmd.hdr.dptr.prpp[0].addr = ranges[0].physaddr;
-        cmd.hdr.dptr.prpp[1].addr = ranges[1].physaddr;
-    } else if (range_count > 0) {
-        cmd.hdr.dptr.prpp[0].addr = ranges[0].physaddr;
-        cmd.hdr.dptr.prpp[1].addr = 0;
+        offset += done;
+        size -= done;
+    }
+}
+
+bool nvme_queue_state_t::submit_io(
+        nvme_cmd_t &&cmd, nvme_callback_t::member_t callback, void *data,
+        storage_seg_t const *segs, size_t seg_count,
+        size_t offset, size_t size, bool sgl, bool ring)
+{
+    // Work out how long the list is, and how many pool pages it needs.
+    // Every page but the last gives its last entry to the chain
+    size_t entry_count = 0;
+    size_t entry_size;
+
+    if (sgl) {
+        // The same walk fill_sgl_locked makes, so the counts agree
+        nvme_for_each_range(segs, seg_count, offset, size, size,
+                            [&](mmphysrange_t const&) {
+            ++entry_count;
+        });
+        entry_size = sizeof(nvme_sgl_t);
+    } else {
+        // One entry per page touched
+        nvme_for_each_range(segs, seg_count, offset, size, size,
+                            [&](mmphysrange_t const& range) {
+            entry_count += ((range.physaddr & (PAGE_SIZE - 1)) +
+                            range.size + PAGE_SIZE - 1) >> PAGE_SCALE;
+        });
+        entry_size = sizeof(uint64_t);
+    }
+
+    // PRP1 and PRP2 hold two entries without a list, sgl1 holds one
+    size_t list_count = sgl
+            ? (entry_count > 1 ? entry_count : 0)
+            : (entry_count > 2 ? entry_count - 1 : 0);
+
+    size_t pages_needed = 0;
+
+    if (list_count * entry_size > NVME_SLOT_LIST_BYTES) {
+        size_t per_page = PAGE_SIZE / entry_size;
+
+        pages_needed = 1;
+        for (size_t left = list_count; left > per_page;
+             left -= per_page - 1)
+            ++pages_needed;
+    }
+
+    assert(pages_needed <= NVME_LIST_PAGES);
+
+    scoped_lock hold(lock);
+
+    for (;;) {
+        if (!wait_sub_queue_not_full_until(hold, INT64_MAX))
+            return false;
+
+        if (likely(list_page_free_count >= pages_needed))
+            break;
+
+        // Commands held back for a batch may be holding the pages
+        sub_queue.ring();
+
+        list_page_freed.wait(hold);
+    }
+
+    uint32_t index = sub_queue.get_tail();
+
+    NVME_CMD_SDW0_CID_SET(cmd.hdr.cdw0, index);
+
+    if (sgl) {
+        cmd.hdr.cdw0 |= NVME_CMD_SDW0_PSDT_n(NVME_PSDT_SGL);
+        fill_sgl_locked(cmd, index, segs, seg_count, offset, size,
+                        entry_count);
+    } else {
+        fill_prp_locked(cmd, index, segs, seg_count, offset, size,
+                        entry_count);
     }
 
     assert(index < cmp_handlers.size());
     cmp_handlers[index] = nvme_callback_t(callback, data);
 
-    sub_queue.enqueue(ext::move(cmd));
+    sub_queue.enqueue(ext::move(cmd), ring);
 
     return true;
 }
 
+void *nvme_queue_state_t::take_list_page_locked(uint32_t index)
+{
+    uint8_t page = list_page_free;
+
+    assert(page != NO_PAGE);
+
+    list_page_free = list_page_next[page];
+    --list_page_free_count;
+
+    list_page_next[page] = slot_list_page[index];
+    slot_list_page[index] = page;
+
+    return list_pages + (size_t(page) << PAGE_SCALE);
+}
+
+void nvme_queue_state_t::fill_prp_locked(
+        nvme_cmd_t &cmd, uint32_t index,
+        storage_seg_t const *segs, size_t seg_count,
+        size_t offset, size_t size, size_t entry_count)
+{
+    cmd.hdr.dptr.prpp[1].addr = 0;
+
+    uint64_t *list = nullptr;
+    size_t avail = 0;
+    size_t n = 0;
+
+    nvme_for_each_range(segs, seg_count, offset, size, size,
+                        [&](mmphysrange_t const& range) {
+        // One entry per page touched, all but the first are page aligned
+        for (uintptr_t addr = range.physaddr,
+             end = range.physaddr + range.size; addr < end;
+             addr = (addr | (PAGE_SIZE - 1)) + 1, ++n) {
+            if (n == 0) {
+                cmd.hdr.dptr.prpp[0].addr = addr;
+                continue;
+            }
+
+            if (entry_count == 2) {
+                cmd.hdr.dptr.prpp[1].addr = addr;
+                continue;
+            }
+
+            if (!list) {
+                // The controller reads a list to the end of its page,
+                // so the slot's area can only hold a list that fits
+                if ((entry_count - 1) * sizeof(*list) <=
+                        NVME_SLOT_LIST_BYTES) {
+                    list = prp_lists + index *
+                            (NVME_SLOT_LIST_BYTES / sizeof(*list));
+                    avail = NVME_SLOT_LIST_BYTES / sizeof(*list);
+                } else {
+                    list = (uint64_t*)take_list_page_locked(index);
+                    avail = PAGE_SIZE / sizeof(*list);
+                }
+
+                cmd.hdr.dptr.prpp[1].addr = mphysaddr(list);
+            } else if (avail == 1 && n + 1 < entry_count) {
+                // Last entry of a full page points to the next page
+                uint64_t *next = (uint64_t*)take_list_page_locked(index);
+                *list = mphysaddr(next);
+                list = next;
+                avail = PAGE_SIZE / sizeof(*list);
+            }
+
+            *list++ = addr;
+            --avail;
+        }
+    });
+
+    assert(n == entry_count);
+}
+
+void nvme_queue_state_t::fill_sgl_locked(
+        nvme_cmd_t &cmd, uint32_t index,
+        storage_seg_t const *segs, size_t seg_count,
+        size_t offset, size_t size, size_t desc_count)
+{
+    nvme_sgl_t *list = nullptr;
+    size_t seg_left = 0;
+    size_t n = 0;
+
+    // Point a segment descriptor at a new segment, which holds all
+    // the remaining descriptors if they fit, otherwise one less and
+    // a pointer to the next segment
+    auto start_segment = [&](nvme_sgl_t &desc, nvme_sgl_t *seg,
+                             size_t capacity) {
+        size_t left = desc_count - n;
+        bool last = left <= capacity;
+
+        seg_left = last ? left : capacity - 1;
+
+        desc.addr = mphysaddr(seg);
+        desc.length = (last ? left : capacity) * sizeof(nvme_sgl_t);
+        desc.type = last
+                ? NVME_SGL_TYPE_LAST_SEGMENT
+                : NVME_SGL_TYPE_SEGMENT;
+
+        list = seg;
+    };
+
+    nvme_for_each_range(segs, seg_count, offset, size, size,
+                        [&](mmphysrange_t const& range) {
+        nvme_sgl_t desc{};
+        desc.addr = range.physaddr;
+        desc.length = range.size;
+        desc.type = NVME_SGL_TYPE_DATA;
+
+        if (desc_count == 1) {
+            cmd.hdr.dptr.sgl1 = desc;
+            ++n;
+            return;
+        }
+
+        if (!list) {
+            if (desc_count * sizeof(nvme_sgl_t) <= NVME_SLOT_LIST_BYTES) {
+                start_segment(cmd.hdr.dptr.sgl1, (nvme_sgl_t*)
+                              (prp_lists + index * (NVME_SLOT_LIST_BYTES /
+                                                    sizeof(*prp_lists))),
+                              NVME_SLOT_LIST_BYTES / sizeof(nvme_sgl_t));
+            } else {
+                start_segment(cmd.hdr.dptr.sgl1, (nvme_sgl_t*)
+                              take_list_page_locked(index),
+                              PAGE_SIZE / sizeof(nvme_sgl_t));
+            }
+        } else if (!seg_left) {
+            // The slot after a full segment points to the next one
+            start_segment(*list, (nvme_sgl_t*)
+                          take_list_page_locked(index),
+                          PAGE_SIZE / sizeof(nvme_sgl_t));
+        }
+
+        *list++ = desc;
+        --seg_left;
+        ++n;
+    });
+
+    assert(n == desc_count);
+}
+
+void nvme_queue_state_t::ring_doorbell()
+{
+    scoped_lock hold(lock);
+    sub_queue.ring();
+}
+
 bool nvme_queue_state_t::wait_sub_queue_not_full_until(
         scoped_lock& lock_, int64_t timeout_time)
 {
     while (sub_queue.is_full()) {
+        // Commands held back for a batch must reach the controller,
+        // or the queue would never drain
+        sub_queue.ring();
+
         if (unlikely(not_full.wait_until(lock_, timeout_time) ==
                      ext::cv_status::timeout))
             return false;
@@ -1724,7 +2326,8 @@ bool nvme_queue_state_t::wait_sub_queue_not_full_until(
     return true;
 }
 
-void nvme_queue_state_t::advance_head(uint16_t new_head, bool need_lock)
+void nvme_queue_state_t::advance_head(
+        uint16_t new_head, uint16_t cmd_id, bool need_lock)
 {
     scoped_lock hold(lock, ext::defer_lock_t());
 
@@ -1733,6 +2336,25 @@ void nvme_queue_state_t::advance_head(uint16_t new_head, bool need_lock)
 
     sub_queue.take_until(new_head);
     not_full.notify_all();
+
+    // Return the list pages the command held to the pool
+    assert(cmd_id < slot_list_page.size());
+    uint8_t page = slot_list_page[cmd_id];
+
+    if (page == NO_PAGE)
+        return;
+
+    slot_list_page[cmd_id] = NO_PAGE;
+
+    while (page != NO_PAGE) {
+        uint8_t next = list_page_next[page];
+        list_page_next[page] = list_page_free;
+        list_page_free = page;
+        ++list_page_free_count;
+        page = next;
+    }
+
+    list_page_freed.notify_all();
 }
 
 void nvme_queue_state_t::invoke_completion(
@@ -1743,53 +2365,72 @@ void nvme_queue_state_t::invoke_completion(
     cmp_handlers[cmd_id](owner, packet, cmd_id, status_type, status);
 }
 
-void nvme_queue_state_t::process_completions(
+size_t nvme_queue_state_t::process_completions(
         nvme_if_t *nvme_if, nvme_queue_state_t *queues)
 {
-    scoped_lock hold(lock);
+    // Completions are copied out under the lock and handled after it is
+    // released. The copy is on the stack, because polling threads and the
+    // IRQ handler can be in here at the same time
+    nvme_cmp_t batch[32];
+    size_t total = 0;
+    uint32_t i;
 
-    uint32_t i = 0;
-    for (;;) {
-        bool phase;
-        nvme_cmp_t const& packet = cmp_queue.at_head(i, phase);
+    do {
+        scoped_lock hold(lock);
 
-        // Done when phase does not match expected phase
-        if (NVME_CMP_DW3_P_GET(packet.cmp_dword[3]) != phase)
-            break;
+        for (i = 0; i < countof(batch); ++i) {
+            bool phase;
+            nvme_cmp_t const& packet = cmp_queue.at_head(i, phase);
 
-        ++i;
+            // Done when phase does not match expected phase
+            if (NVME_CMP_DW3_P_GET(packet.cmp_dword[3]) != phase)
+                break;
 
-        // Decode submission queue for which command has completed
-        unsigned sub_queue_id = NVME_CMP_DW2_SQID_GET(
-                    packet.cmp_dword[2]);
-        assert(sub_queue_id < nvme_if->get_queue_count());
-        nvme_queue_state_t& sub_queue_state = queues[sub_queue_id];
+            // Decode submission queue for which command has completed
+            unsigned sub_queue_id = NVME_CMP_DW2_SQID_GET(
+                        packet.cmp_dword[2]);
+            assert(sub_queue_id < nvme_if->get_queue_count());
+            nvme_queue_state_t& sub_queue_state = queues[sub_queue_id];
 
-        // Get submission queue head
-        unsigned sub_queue_head = NVME_CMP_DW2_SQHD_GET(
-                    packet.cmp_dword[2]);
-        sub_queue_state.advance_head(sub_queue_head,
-                                     &sub_queue_state != this);
+            // Get submission queue head
+            unsigned sub_queue_head = NVME_CMP_DW2_SQHD_GET(
+                        packet.cmp_dword[2]);
+            uint16_t cmd_id = NVME_CMP_DW3_CID_GET(packet.cmp_dword[3]);
+            sub_queue_state.advance_head(sub_queue_head, cmd_id,
+                                         &sub_queue_state != this);
 
-        if (unlikely(!cmp_buf.push_back(packet)))
-            panic_oom();
-    }
+            batch[i] = packet;
+        }
 
-    if (i > 0)
-        cmp_queue.take(i);
+        if (i > 0)
+            cmp_queue.take(i);
 
-    hold.unlock();
+        hold.unlock();
 
-    for (nvme_cmp_t& packet : cmp_buf) {
-        //bool dnr = NVME_CMP_DW3_DNR_GET(packet.cmp_dword[3]);
-        int status_type = NVME_CMP_DW3_SCT_GET(packet.cmp_dword[3]);
-        int status = NVME_CMP_DW3_SC_GET(packet.cmp_dword[3]);
-        uint16_t cmd_id = NVME_CMP_DW3_CID_GET(packet.cmp_dword[3]);
+        for (uint32_t k = 0; k < i; ++k) {
+            nvme_cmp_t& packet = batch[k];
 
-        invoke_completion(nvme_if, packet, cmd_id, status_type, status);
-    }
+            //bool dnr = NVME_CMP_DW3_DNR_GET(packet.cmp_dword[3]);
+            int status_type = NVME_CMP_DW3_SCT_GET(packet.cmp_dword[3]);
+            int status = NVME_CMP_DW3_SC_GET(packet.cmp_dword[3]);
+            uint16_t cmd_id = NVME_CMP_DW3_CID_GET(packet.cmp_dword[3]);
+
+            invoke_completion(nvme_if, packet, cmd_id, status_type, status);
+        }
 
-    cmp_buf.clear();
+        total += i;
+
+        // A full batch, there may be more
+    } while (i == countof(batch));
+
+    return total;
+}
+
+bool nvme_queue_state_t::completion_pending() const
+{
+    bool phase;
+    nvme_cmp_t const& packet = cmp_queue.at_head(0, phase);
+    return NVME_CMP_DW3_P_GET(atomic_ld_acq(&packet.cmp_dword[3])) == phase;
 }
 
 nvme_cmd_t *nvme_queue_state_t::sub_queue_ptr()
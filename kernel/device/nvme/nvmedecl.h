@@ -50,13 +50,32 @@ struct nvme_mmio_t {
 
 C_ASSERT(sizeof(nvme_mmio_t) == 0x1000);
 
-// Scatter gather list
+// Scatter gather list descriptor
 struct nvme_sgl_t {
-    char data[16];
+    uint64_t addr;
+    uint32_t length;
+    uint8_t reserved[3];
+
+    // Descriptor type in the upper 4 bits, subtype in the lower 4
+    uint8_t type;
 };
 
 C_ASSERT(sizeof(nvme_sgl_t) == 16);
 
+// 4.4 SGL descriptor types, with address subtype
+#define NVME_SGL_TYPE_DATA          0x00
+#define NVME_SGL_TYPE_SEGMENT       0x20
+#define NVME_SGL_TYPE_LAST_SEGMENT  0x30
+
+// Identify controller SGLS bits 1:0, nonzero if SGLs are supported,
+// 2 if they must be dword aligned
+#define NVME_SGLS_SUPPORT_MASK      0x3
+#define NVME_SGLS_SUPPORT_DWORD     0x2
+
+// PSDT field values
+#define NVME_PSDT_PRP               0
+#define NVME_PSDT_SGL               1
+
 // Physical region pointer
 struct nvme_prp_t {
     uintptr_t addr;
@@ -110,10 +129,11 @@ struct nvme_cmd_t {
             void *addr, uint32_t size,
             uint16_t sqid, uint16_t cqid, uint8_t prio);
 
-    // Create a command that creates a completion queue
+    // Create a command that creates a completion queue.
+    // Pass ien = false for a queue that is only polled
     static nvme_cmd_t create_cmp_queue(
             void *addr, uint32_t size,
-            uint16_t cqid, uint16_t intr);
+            uint16_t cqid, uint16_t intr, bool ien = true);
 
     // Create a command that reads storage
     static nvme_cmd_t create_read(
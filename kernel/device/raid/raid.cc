@@ -0,0 +1,672 @@
+// Striped and mirrored arrays of other storage devices
+//
+// The array is created when the module is loaded with parameters, or
+// from the same options prefixed with "raid." on the boot command line:
+//
+//   level=N         0 stripes, 1 mirrors, default 0
+//   chunk=SIZE      stripe chunk, power of two, k, m and g suffixes,
+//                   default 64k, level 0 only
+//   devs=LIST       member storage device indices, like 1-4 or 1,3
+//
+// The array is appended to the storage devices, so it gets the next
+// device index, and storbench can be pointed at it. The members must
+// have the same sector size, the smallest member limits the size.
+//
+// Requests are split into one request per member chunk (level 0) or per
+// member (level 1 writes, trims and flushes), which are started in
+// parallel. The caller's iocp expects one invoke per part and gets the
+// result when the last part completes. Level 1 reads go to the member
+// with the fewest requests in flight, ties rotate through the members.
+
+#include "kmodule.h"
+#include "dev_storage.h"
+#include "bootinfo.h"
+#include "printk.h"
+#include "string.h"
+#include "atomic.h"
+#include "mutex.h"
+#include "vector.h"
+#include "unique_ptr.h"
+#include "inttypes.h"
+
+#define RAID_DEBUG   1
+#if RAID_DEBUG
+#define RAID_TRACE(...) printdbg("raid: " __VA_ARGS__)
+#else
+#define RAID_TRACE(...) ((void)0)
+#endif
+
+#define RAID_MAX_MEMBERS    32
+
+// Parts held in the request itself, larger splits allocate
+#define RAID_INLINE_PARTS   4
+
+__BEGIN_ANONYMOUS
+
+struct raid_opts_t {
+    unsigned level = 0;
+    uint64_t chunk = uint64_t(64) << 10;
+    unsigned dev_count = 0;
+    dev_t devs[RAID_MAX_MEMBERS];
+};
+
+enum struct raid_op_t {
+    read,
+    write,
+    trim,
+    flush
+};
+
+struct raid_if_factory_t final
+    : public storage_if_factory_t
+{
+    raid_if_factory_t();
+
+    virtual ext::vector<storage_if_base_t *> detect(void) override;
+};
+
+struct raid_if_t final : public storage_if_base_t {
+    STORAGE_IF_IMPL
+};
+
+struct raid_member_t {
+    storage_dev_base_t *dev;
+
+    // Requests started and not completed yet
+    unsigned inflight;
+};
+
+// One request to the array, split into requests to the members
+struct raid_io_t {
+    struct part_t {
+        raid_io_t *owner;
+        iocp_t iocp;
+        raid_member_t *member;
+        char *data;
+        int64_t count;
+        uint64_t lba;
+    };
+
+    raid_io_t(iocp_t *caller_iocp, size_t part_count, size_t size)
+        : caller_iocp(caller_iocp)
+        , parts(part_count <= RAID_INLINE_PARTS
+                ? inline_parts
+                : new (ext::nothrow) part_t[part_count]())
+        , part_count(part_count)
+        , remaining(part_count)
+        , size(size)
+    {
+    }
+
+    ~raid_io_t()
+    {
+        if (parts != inline_parts)
+            delete[] parts;
+    }
+
+    static void part_done(dgos::err_sz_pair_t const& result, uintptr_t arg);
+
+    using lock_type = ext::noirq_lock<ext::spinlock>;
+    using scoped_lock = ext::unique_lock<lock_type>;
+
+    iocp_t *caller_iocp;
+    part_t *parts;
+    size_t part_count;
+    size_t remaining;
+
+    // Bytes reported to the caller on success
+    size_t size;
+    errno_t err = errno_t::OK;
+    lock_type lock;
+    part_t inline_parts[RAID_INLINE_PARTS];
+};
+
+class raid_dev_t final : public storage_dev_base_t {
+public:
+    ~raid_dev_t();
+
+    // On failure, the members opened so far are closed by the destructor
+    bool init(raid_opts_t const& opts);
+
+private:
+    STORAGE_DEV_IMPL
+
+    void close_members();
+
+    errno_t check_range(int64_t count, uint64_t lba) const;
+
+    // Split the range at chunk boundaries
+    raid_io_t *split(char *data, int64_t count, uint64_t lba,
+                     size_t size, iocp_t *iocp);
+
+    // The same request to every member
+    raid_io_t *replicate(char *data, int64_t count, uint64_t lba,
+                         size_t size, iocp_t *iocp);
+
+    // The least busy member, for level 1 reads
+    raid_member_t *pick_reader();
+
+    errno_t start(raid_io_t *state, raid_op_t op, bool fua);
+
+    ext::vector<raid_member_t> members;
+    unsigned level = 0;
+    uint8_t log2_sectorsize = 9;
+    uint8_t log2_chunk = 0;
+    bool have_trim = false;
+    uint64_t block_count = 0;
+
+    // Rotates level 1 reads among equally busy members
+    unsigned next_reader = 0;
+};
+
+static raid_opts_t raid_opts;
+static ext::vector<raid_if_t*> raid_ifs;
+static ext::vector<raid_dev_t*> raid_devs;
+
+raid_if_factory_t::raid_if_factory_t()
+    : storage_if_factory_t("raid")
+{
+}
+
+ext::vector<storage_if_base_t *> raid_if_factory_t::detect()
+{
+    ext::vector<storage_if_base_t *> list;
+
+    ext::unique_ptr<raid_if_t> if_(new (ext::nothrow) raid_if_t());
+
+    if (unlikely(!if_ || !raid_ifs.push_back(if_)))
+        return list;
+
+    if (unlikely(!list.push_back(if_)))
+        panic_oom();
+
+    if_.release();
+
+    return list;
+}
+
+void raid_if_t::cleanup_if()
+{
+}
+
+ext::vector<storage_dev_base_t *> raid_if_t::detect_devices()
+{
+    ext::vector<storage_dev_base_t *> list;
+
+    ext::unique_ptr<raid_dev_t> drive(new (ext::nothrow) raid_dev_t());
+
+    if (unlikely(!drive || !drive->init(raid_opts)))
+        return list;
+
+    if (unlikely(!raid_devs.push_back(drive)))
+        return list;
+
+    if (unlikely(!list.push_back(drive)))
+        panic_oom();
+
+    drive.release();
+
+    return list;
+}
+
+bool raid_dev_t::init(raid_opts_t const& opts)
+{
+    level = opts.level;
+
+    if (unlikely(!members.reserve(opts.dev_count)))
+        return false;
+
+    size_t dev_count = storage_dev_count();
+    uint64_t member_blocks = UINT64_MAX;
+    have_trim = true;
+
+    for (unsigned i = 0; i < opts.dev_count; ++i) {
+        dev_t index = opts.devs[i];
+
+        if (unlikely(size_t(index) >= dev_count)) {
+            printdbg("raid: no storage device %d\n", index);
+            return false;
+        }
+
+        storage_dev_base_t *dev = storage_dev_open(index);
+
+        if (unlikely(!dev)) {
+            printdbg("raid: cannot open storage device %d\n", index);
+            return false;
+        }
+
+        for (raid_member_t const& member : members) {
+            if (unlikely(member.dev == dev)) {
+                printdbg("raid: device %d listed twice\n", index);
+                storage_dev_close(dev);
+                return false;
+            }
+        }
+
+        uint8_t member_log2 = uint8_t(dev->info(STORAGE_INFO_BLOCKSIZE_LOG2));
+
+        if (i == 0) {
+            log2_sectorsize = member_log2;
+        } else if (unlikely(member_log2 != log2_sectorsize)) {
+            printdbg("raid: device %d has %u byte sectors, expected %u\n",
+                     index, 1U << member_log2, 1U << log2_sectorsize);
+            storage_dev_close(dev);
+            return false;
+        }
+
+        member_blocks = ext::min(member_blocks,
+                                 uint64_t(dev->info(STORAGE_INFO_BLOCKCOUNT)));
+
+        have_trim = have_trim && dev->info(STORAGE_INFO_HAVE_TRIM);
+
+        // Reserved above, cannot fail
+        members.push_back({ dev, 0 });
+    }
+
+    if (level == 0) {
+        if (unlikely(opts.chunk < (uint64_t(1) << log2_sectorsize))) {
+            printdbg("raid: chunk is smaller than a sector\n");
+            return false;
+        }
+
+        log2_chunk = uint8_t(bit_log2(opts.chunk) - log2_sectorsize);
+
+        // Only whole chunks are striped
+        member_blocks &= -(uint64_t(1) << log2_chunk);
+        block_count = member_blocks * members.size();
+    } else {
+        block_count = member_blocks;
+    }
+
+    RAID_TRACE("level %u, %zu members, %" PRIu64 " sectors of %u bytes\n",
+               level, members.size(), block_count, 1U << log2_sectorsize);
+
+    return block_count != 0;
+}
+
+raid_dev_t::~raid_dev_t()
+{
+    close_members();
+}
+
+void raid_dev_t::close_members()
+{
+    for (raid_member_t const& member : members)
+        storage_dev_close(member.dev);
+
+    members.clear();
+}
+
+void raid_dev_t::cleanup_dev()
+{
+    close_members();
+}
+
+errno_t raid_dev_t::check_range(int64_t count, uint64_t lba) const
+{
+    if (unlikely(count <= 0 || lba > block_count ||
+                 uint64_t(count) > block_count - lba))
+        return errno_t::EINVAL;
+
+    return errno_t::OK;
+}
+
+raid_io_t *raid_dev_t::split(char *data, int64_t count, uint64_t lba,
+                             size_t size, iocp_t *iocp)
+{
+    uint64_t first_chunk = lba >> log2_chunk;
+    uint64_t last_chunk = (lba + count - 1) >> log2_chunk;
+
+    raid_io_t *state = new (ext::nothrow) raid_io_t(
+                iocp, size_t(last_chunk - first_chunk + 1), size);
+
+    if (unlikely(!state || !state->parts)) {
+        delete state;
+        return nullptr;
+    }
+
+    uint64_t chunk_blocks = uint64_t(1) << log2_chunk;
+    size_t member_count = members.size();
+
+    for (size_t i = 0; i < state->part_count; ++i) {
+        raid_io_t::part_t &part = state->parts[i];
+
+        uint64_t chunk = lba >> log2_chunk;
+        uint64_t chunk_ofs = lba & (chunk_blocks - 1);
+        int64_t part_count = int64_t(ext::min(uint64_t(count),
+                                              chunk_blocks - chunk_ofs));
+
+        part.owner = state;
+        part.member = &members[chunk % member_count];
+        part.data = data;
+        part.count = part_count;
+        part.lba = ((chunk / member_count) << log2_chunk) + chunk_ofs;
+
+        if (data)
+            data += size_t(part_count) << log2_sectorsize;
+
+        lba += part_count;
+        count -= part_count;
+    }
+
+    return state;
+}
+
+raid_io_t *raid_dev_t::replicate(char *data, int64_t count, uint64_t lba,
+                                 size_t size, iocp_t *iocp)
+{
+    raid_io_t *state = new (ext::nothrow) raid_io_t(
+                iocp, members.size(), size);
+
+    if (unlikely(!state || !state->parts)) {
+        delete state;
+        return nullptr;
+    }
+
+    for (size_t i = 0; i < state->part_count; ++i) {
+        raid_io_t::part_t &part = state->parts[i];
+
+        part.owner = state;
+        part.member = &members[i];
+        part.data = data;
+        part.count = count;
+        part.lba = lba;
+    }
+
+    return state;
+}
+
+raid_member_t *raid_dev_t::pick_reader()
+{
+    size_t member_count = members.size();
+    size_t first = atomic_xadd(&next_reader, 1) % member_count;
+    raid_member_t *best = nullptr;
+    unsigned best_inflight = UINT_MAX;
+
+    for (size_t i = 0; i < member_count; ++i) {
+        raid_member_t *member = &members[(first + i) % member_count];
+        unsigned inflight = atomic_ld_acq(&member->inflight);
+
+        if (inflight < best_inflight) {
+            best = member;
+            best_inflight = inflight;
+
+            if (!inflight)
+                break;
+        }
+    }
+
+    return best;
+}
+
+void raid_io_t::part_done(dgos::err_sz_pair_t const& result, uintptr_t arg)
+{
+    part_t *part = (part_t*)arg;
+    raid_io_t *state = part->owner;
+    iocp_t *caller_iocp = state->caller_iocp;
+
+    atomic_dec(&part->member->inflight);
+
+    scoped_lock hold(state->lock);
+
+    if (unlikely(result.first != errno_t::OK))
+        state->err = result.first;
+
+    bool last = --state->remaining == 0;
+
+    hold.unlock();
+
+    // Every part invokes the caller's iocp, and the last part to finish
+    // sets the result before its invoke, so the result is in place by
+    // the time the expected number of invokes is reached
+    if (last) {
+        caller_iocp->set_result({
+            state->err,
+            state->err == errno_t::OK ? state->size : 0
+        });
+
+        delete state;
+    }
+
+    caller_iocp->invoke();
+}
+
+errno_t raid_dev_t::start(raid_io_t *state, raid_op_t op, bool fua)
+{
+    // The state may be gone as soon as the last part is started
+    raid_io_t::part_t *parts = state->parts;
+    size_t part_count = state->part_count;
+
+    for (size_t i = 0; i < part_count; ++i)
+        parts[i].iocp.reset(&raid_io_t::part_done, uintptr_t(&parts[i]));
+
+    state->caller_iocp->set_expect(unsigned(part_count));
+
+    for (size_t i = 0; i < part_count; ++i) {
+        raid_io_t::part_t &part = parts[i];
+        storage_dev_base_t *dev = part.member->dev;
+        errno_t err = errno_t::OK;
+
+        atomic_inc(&part.member->inflight);
+
+        switch (op) {
+        case raid_op_t::read:
+            err = dev->read_async(part.data, part.count, part.lba,
+                                  &part.iocp);
+            break;
+
+        case raid_op_t::write:
+            err = dev->write_async(part.data, part.count, part.lba,
+                                   fua, &part.iocp);
+            break;
+
+        case raid_op_t::trim:
+            err = dev->trim_async(part.count, part.lba, &part.iocp);
+            break;
+
+        case raid_op_t::flush:
+            err = dev->flush_async(&part.iocp);
+            break;
+        }
+
+        if (unlikely(err != errno_t::OK)) {
+            part.iocp.set_result({ err, 0 });
+            part.iocp.set_expect(1);
+            part.iocp.invoke();
+        }
+    }
+
+    return errno_t::OK;
+}
+
+errno_t raid_dev_t::read_async(void *data, int64_t count,
+                               uint64_t lba, iocp_t *iocp)
+{
+    errno_t err = check_range(count, lba);
+
+    if (unlikely(err != errno_t::OK))
+        return err;
+
+    size_t size = size_t(count) << log2_sectorsize;
+    raid_io_t *state;
+
+    if (level == 0) {
+        state = split((char*)data, count, lba, size, iocp);
+    } else {
+        state = new (ext::nothrow) raid_io_t(iocp, 1, size);
+
+        if (likely(state)) {
+            raid_io_t::part_t &part = state->parts[0];
+            part.owner = state;
+            part.member = pick_reader();
+            part.data = (char*)data;
+            part.count = count;
+            part.lba = lba;
+        }
+    }
+
+    if (unlikely(!state))
+        return errno_t::ENOMEM;
+
+    return start(state, raid_op_t::read, false);
+}
+
+errno_t raid_dev_t::write_async(void const *data, int64_t count,
+                                uint64_t lba, bool fua, iocp_t *iocp)
+{
+    errno_t err = check_range(count, lba);
+
+    if (unlikely(err != errno_t::OK))
+        return err;
+
+    size_t size = size_t(count) << log2_sectorsize;
+
+    raid_io_t *state = level == 0
+            ? split((char*)data, count, lba, size, iocp)
+            : replicate((char*)data, count, lba, size, iocp);
+
+    if (unlikely(!state))
+        return errno_t::ENOMEM;
+
+    return start(state, raid_op_t::write, fua);
+}
+
+errno_t raid_dev_t::flush_async(iocp_t *iocp)
+{
+    raid_io_t *state = replicate(nullptr, 0, 0, 0, iocp);
+
+    if (unlikely(!state))
+        return errno_t::ENOMEM;
+
+    return start(state, raid_op_t::flush, false);
+}
+
+errno_t raid_dev_t::trim_async(int64_t count, uint64_t lba,
+                               iocp_t *iocp)
+{
+    if (unlikely(!have_trim))
+        return errno_t::ENOSYS;
+
+    errno_t err = check_range(count, lba);
+
+    if (unlikely(err != errno_t::OK))
+        return err;
+
+    size_t size = size_t(count) << log2_sectorsize;
+
+    raid_io_t *state = level == 0
+            ? split(nullptr, count, lba, size, iocp)
+            : replicate(nullptr, count, lba, size, iocp);
+
+    if (unlikely(!state))
+        return errno_t::ENOMEM;
+
+    return start(state, raid_op_t::trim, false);
+}
+
+errno_t raid_dev_t::cancel_io(iocp_t *iocp)
+{
+    // The members only know the iocps of the parts
+    return errno_t::ENOSYS;
+}
+
+long raid_dev_t::info(storage_dev_info_t key)
+{
+    switch (key) {
+    case STORAGE_INFO_BLOCKSIZE:
+        return 1L << log2_sectorsize;
+
+    case STORAGE_INFO_BLOCKSIZE_LOG2:
+        return log2_sectorsize;
+
+    case STORAGE_INFO_HAVE_TRIM:
+        return have_trim;
+
+    case STORAGE_INFO_NAME:
+        return long(level == 0 ? "RAID0" : "RAID1");
+
+    case STORAGE_INFO_BLOCKCOUNT:
+        return long(block_count);
+
+    default:
+        return 0;
+    }
+}
+
+// Comma separated indices and ranges of indices
+static bool raid_parse_devs(raid_opts_t &opts, char const *text)
+{
+    bool ok = true;
+    char const *p = text;
+
+    opts.dev_count = 0;
+
+    while (ok) {
+        uint64_t st = bootinfo_scan_uint(&p, &ok);
+        uint64_t en = st;
+
+        if (*p == '-') {
+            ++p;
+            en = bootinfo_scan_uint(&p, &ok);
+        }
+
+        for (uint64_t index = st; ok && index <= en; ++index) {
+            if (opts.dev_count >= RAID_MAX_MEMBERS) {
+                ok = false;
+                break;
+            }
+
+            opts.devs[opts.dev_count++] = dev_t(index);
+        }
+
+        if (*p != ',')
+            break;
+
+        ++p;
+    }
+
+    return ok && !*p;
+}
+
+static bootopt_result_t raid_parse_option(
+        void *arg, char const *key, char const *value)
+{
+    raid_opts_t &opts = *(raid_opts_t*)arg;
+    bool ok = true;
+
+    if (!strcmp(key, "level")) {
+        uint64_t level = bootinfo_parse_uint(value, &ok);
+        ok = ok && level <= 1;
+        opts.level = unsigned(level);
+    } else if (!strcmp(key, "chunk")) {
+        opts.chunk = bootinfo_parse_size(value, &ok);
+        ok = ok && opts.chunk && !(opts.chunk & (opts.chunk - 1));
+    } else if (!strcmp(key, "devs")) {
+        ok = raid_parse_devs(opts, value);
+    } else {
+        return bootopt_result_t::unknown;
+    }
+
+    return ok ? bootopt_result_t::ok : bootopt_result_t::invalid;
+}
+
+static raid_if_factory_t raid_if_factory;
+
+__END_ANONYMOUS
+
+int module_main(int argc, char const * const * argv)
+{
+    // Nothing to do, or a mistake in the options, which is reported
+    if (bootinfo_parse_options("raid", argc, argv,
+                               raid_parse_option, &raid_opts) <= 0)
+        return 0;
+
+    if (raid_opts.dev_count < 2) {
+        printdbg("raid: need at least two devs\n");
+        return 0;
+    }
+
+    storage_if_register_factory(&raid_if_factory);
+
+    return 0;
+}
@@ -0,0 +1,600 @@
+// RAM backed storage device
+//
+// Disks are created when the module is loaded with parameters, or from
+// the same options prefixed with "ramdisk." on the boot command line:
+//
+//   size=SIZE       bytes per disk, k, m and g suffixes, default 64m
+//   count=N         number of disks, default 1
+//   sector=N        sector size, 512 or 4096, default 512
+//   latency_us=N    delay every completion by N microseconds, default 0
+//
+// When the module is loaded without parameters and the command line has
+// no ramdisk options, no disks are created.
+//
+// Pages are allocated on first write, sectors never written read as
+// zeros, and trim releases whole pages. Without latency, requests
+// complete before read_async/write_async return.
+
+#include "kmodule.h"
+#include "dev_storage.h"
+#include "bootinfo.h"
+#include "mm.h"
+#include "printk.h"
+#include "string.h"
+#include "atomic.h"
+#include "mutex.h"
+#include "thread.h"
+#include "time.h"
+#include "vector.h"
+#include "unique_ptr.h"
+#include "inttypes.h"
+
+#define RAMDISK_DEBUG   1
+#if RAMDISK_DEBUG
+#define RAMDISK_TRACE(...) printdbg("ramdisk: " __VA_ARGS__)
+#else
+#define RAMDISK_TRACE(...) ((void)0)
+#endif
+
+__BEGIN_ANONYMOUS
+
+struct ramdisk_opts_t {
+    uint64_t size = uint64_t(64) << 20;
+    unsigned count = 1;
+    uint8_t log2_sectorsize = 9;
+    uint64_t latency_ns = 0;
+};
+
+struct ramdisk_if_factory_t final
+    : public storage_if_factory_t
+{
+    ramdisk_if_factory_t();
+
+    virtual ext::vector<storage_if_base_t *> detect(void) override;
+};
+
+struct ramdisk_if_t final : public storage_if_base_t {
+    STORAGE_IF_IMPL
+};
+
+// A completion held back to simulate device latency
+struct ramdisk_pending_t {
+    ramdisk_pending_t *next;
+    iocp_t *iocp;
+    uint64_t due;
+    dgos::err_sz_pair_t result;
+};
+
+class ramdisk_dev_t final : public storage_dev_base_t {
+public:
+    ~ramdisk_dev_t();
+
+    bool init(uint64_t size, uint8_t log2_sectorsize, uint64_t latency_ns);
+
+private:
+    STORAGE_DEV_IMPL
+
+    using lock_type = ext::shared_mutex;
+    using scoped_lock = ext::unique_lock<lock_type>;
+    using shared_lock = ext::shared_lock<lock_type>;
+
+    using pending_lock_type = ext::noirq_lock<ext::spinlock>;
+    using pending_scoped_lock = ext::unique_lock<pending_lock_type>;
+
+    // Each leaf is a page of page pointers
+    static constexpr size_t leaf_log2 = PAGE_SCALE - 3;
+    static constexpr size_t leaf_pages = size_t(1) << leaf_log2;
+
+    errno_t check_range(int64_t count, uint64_t lba) const;
+
+    // Page at index, nullptr if it was never written
+    char *page_at(uint64_t page) const;
+
+    // Page at index, allocated if needed. Drops the lock to allocate
+    char *page_commit(uint64_t page, shared_lock &hold);
+
+    errno_t transfer(void *data, int64_t count, uint64_t lba, bool write);
+
+    void complete(iocp_t *iocp, errno_t err, size_t size);
+
+    static intptr_t completion_thread(void *arg);
+    intptr_t completion_thread();
+
+    // Shared for reads and writes, exclusive to release pages
+    lock_type lock;
+
+    char ***leaves = nullptr;
+    size_t leaf_count = 0;
+    uint64_t block_count = 0;
+    uint8_t log2_sectorsize = 9;
+
+    // Delayed completions, in due order
+    uint64_t latency_ns = 0;
+    pending_lock_type pending_lock;
+    ext::condition_variable pending_cond;
+    ramdisk_pending_t *pending_head = nullptr;
+    ramdisk_pending_t *pending_tail = nullptr;
+    iocp_t *invoking = nullptr;
+    thread_t completion_tid = -1;
+};
+
+static ramdisk_opts_t ramdisk_opts;
+static ext::vector<ramdisk_if_t*> ramdisk_ifs;
+static ext::vector<ramdisk_dev_t*> ramdisk_devs;
+
+ramdisk_if_factory_t::ramdisk_if_factory_t()
+    : storage_if_factory_t("ramdisk")
+{
+}
+
+ext::vector<storage_if_base_t *> ramdisk_if_factory_t::detect()
+{
+    ext::vector<storage_if_base_t *> list;
+
+    ext::unique_ptr<ramdisk_if_t> if_(new (ext::nothrow) ramdisk_if_t());
+
+    if (unlikely(!if_ || !ramdisk_ifs.push_back(if_)))
+        return list;
+
+    if (unlikely(!list.push_back(if_)))
+        panic_oom();
+
+    if_.release();
+
+    return list;
+}
+
+void ramdisk_if_t::cleanup_if()
+{
+}
+
+ext::vector<storage_dev_base_t *> ramdisk_if_t::detect_devices()
+{
+    ext::vector<storage_dev_base_t *> list;
+
+    for (unsigned i = 0; i < ramdisk_opts.count; ++i) {
+        ext::unique_ptr<ramdisk_dev_t> drive(
+                    new (ext::nothrow) ramdisk_dev_t());
+
+        if (unlikely(!drive || !drive->init(ramdisk_opts.size,
+                                            ramdisk_opts.log2_sectorsize,
+                                            ramdisk_opts.latency_ns))) {
+            RAMDISK_TRACE("out of memory creating disk %u\n", i);
+            break;
+        }
+
+        if (unlikely(!ramdisk_devs.push_back(drive)))
+            break;
+
+        if (unlikely(!list.push_back(drive)))
+            panic_oom();
+
+        drive.release();
+    }
+
+    return list;
+}
+
+ramdisk_dev_t::~ramdisk_dev_t()
+{
+    for (size_t i = 0; leaves && i < leaf_count; ++i) {
+        if (!leaves[i])
+            continue;
+
+        for (size_t k = 0; k < leaf_pages; ++k) {
+            if (leaves[i][k])
+                munmap(leaves[i][k], PAGE_SIZE);
+        }
+
+        munmap(leaves[i], PAGE_SIZE);
+    }
+
+    delete[] leaves;
+}
+
+bool ramdisk_dev_t::init(uint64_t size, uint8_t log2_sectorsize,
+                         uint64_t latency_ns)
+{
+    this->log2_sectorsize = log2_sectorsize;
+    this->latency_ns = latency_ns;
+
+    block_count = size >> log2_sectorsize;
+
+    uint64_t pages = (size + PAGE_SIZE - 1) >> PAGE_SCALE;
+    leaf_count = (pages + leaf_pages - 1) >> leaf_log2;
+
+    // Only the top level is allocated up front
+    leaves = new (ext::nothrow) char**[leaf_count]();
+
+    if (unlikely(!leaves))
+        return false;
+
+    if (latency_ns) {
+        completion_tid = thread_create(
+                    nullptr, &ramdisk_dev_t::completion_thread, this,
+                    "ramdisk", 0, false, false);
+
+        if (unlikely(completion_tid < 0))
+            return false;
+    }
+
+    RAMDISK_TRACE("%" PRIu64 " sectors of %u bytes, %" PRIu64 "ns latency\n",
+                  block_count, 1U << log2_sectorsize, latency_ns);
+
+    return true;
+}
+
+void ramdisk_dev_t::cleanup_dev()
+{
+}
+
+errno_t ramdisk_dev_t::check_range(int64_t count, uint64_t lba) const
+{
+    if (unlikely(count < 0 || lba > block_count ||
+                 uint64_t(count) > block_count - lba))
+        return errno_t::EINVAL;
+
+    return errno_t::OK;
+}
+
+char *ramdisk_dev_t::page_at(uint64_t page) const
+{
+    char **leaf = atomic_ld_acq(&leaves[page >> leaf_log2]);
+
+    if (!leaf)
+        return nullptr;
+
+    return atomic_ld_acq(&leaf[page & (leaf_pages - 1)]);
+}
+
+char *ramdisk_dev_t::page_commit(uint64_t page, shared_lock &hold)
+{
+    char ***leaf_ptr = &leaves[page >> leaf_log2];
+
+    for (;;) {
+        char **leaf = atomic_ld_acq(leaf_ptr);
+
+        if (leaf) {
+            char *existing = atomic_ld_acq(&leaf[page & (leaf_pages - 1)]);
+
+            if (existing)
+                return existing;
+        }
+
+        // mmap can block, and zero fills
+        hold.unlock();
+        void *mem = mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_POPULATE);
+        hold.lock();
+
+        if (unlikely(mem == MAP_FAILED))
+            return nullptr;
+
+        // Leaves are never released until the disk is destroyed,
+        // so a leaf seen above is still valid
+        bool installed;
+
+        if (!leaf) {
+            installed = atomic_cmpxchg(leaf_ptr, nullptr,
+                                       (char**)mem) == nullptr;
+        } else {
+            installed = atomic_cmpxchg(&leaf[page & (leaf_pages - 1)],
+                                       nullptr, (char*)mem) == nullptr;
+        }
+
+        if (!installed) {
+            // Lost a race with another writer
+            hold.unlock();
+            munmap(mem, PAGE_SIZE);
+            hold.lock();
+        }
+    }
+}
+
+errno_t ramdisk_dev_t::transfer(void *data, int64_t count,
+                                uint64_t lba, bool write)
+{
+    uint64_t offset = lba << log2_sectorsize;
+    size_t remain = size_t(count) << log2_sectorsize;
+    char *buf = (char*)data;
+
+    shared_lock hold(lock);
+
+    while (remain) {
+        uint64_t page = offset >> PAGE_SCALE;
+        size_t page_ofs = offset & (PAGE_SIZE - 1);
+        size_t chunk = ext::min(remain, size_t(PAGE_SIZE) - page_ofs);
+
+        if (write) {
+            char *mem = page_commit(page, hold);
+
+            if (unlikely(!mem))
+                return errno_t::ENOMEM;
+
+            memcpy(mem + page_ofs, buf, chunk);
+        } else {
+            char *mem = page_at(page);
+
+            if (mem)
+                memcpy(buf, mem + page_ofs, chunk);
+            else
+                memset(buf, 0, chunk);
+        }
+
+        buf += chunk;
+        offset += chunk;
+        remain -= chunk;
+    }
+
+    return errno_t::OK;
+}
+
+void ramdisk_dev_t::complete(iocp_t *iocp, errno_t err, size_t size)
+{
+    dgos::err_sz_pair_t result{ err, size };
+
+    ramdisk_pending_t *pending = latency_ns
+            ? new (ext::nothrow) ramdisk_pending_t()
+            : nullptr;
+
+    if (!pending) {
+        iocp->set_result(result);
+        iocp->invoke();
+        return;
+    }
+
+    pending->iocp = iocp;
+    pending->due = time_ns() + latency_ns;
+    pending->result = result;
+
+    pending_scoped_lock hold(pending_lock);
+
+    if (pending_tail)
+        pending_tail->next = pending;
+    else
+        pending_head = pending;
+
+    pending_tail = pending;
+
+    pending_cond.notify_one();
+}
+
+intptr_t ramdisk_dev_t::completion_thread(void *arg)
+{
+    return ((ramdisk_dev_t*)arg)->completion_thread();
+}
+
+intptr_t ramdisk_dev_t::completion_thread()
+{
+    pending_scoped_lock hold(pending_lock);
+
+    for (;;) {
+        if (!pending_head) {
+            pending_cond.wait(hold);
+            continue;
+        }
+
+        // Every request has the same latency, so the head is due first
+        ramdisk_pending_t *pending = pending_head;
+
+        if (time_ns() < pending->due) {
+            pending_cond.wait_until(hold, pending->due);
+            continue;
+        }
+
+        pending_head = pending->next;
+
+        if (!pending_head)
+            pending_tail = nullptr;
+
+        invoking = pending->iocp;
+        hold.unlock();
+
+        pending->iocp->set_result(pending->result);
+        pending->iocp->invoke();
+
+        delete pending;
+
+        hold.lock();
+        invoking = nullptr;
+        pending_cond.notify_all();
+    }
+
+    return 0;
+}
+
+errno_t ramdisk_dev_t::read_async(void *data, int64_t count,
+                                  uint64_t lba, iocp_t *iocp)
+{
+    errno_t err = check_range(count, lba);
+
+    if (unlikely(err != errno_t::OK))
+        return err;
+
+    iocp->set_expect(1);
+
+    err = transfer(data, count, lba, false);
+
+    complete(iocp, err, err == errno_t::OK
+             ? size_t(count) << log2_sectorsize : 0);
+
+    return errno_t::OK;
+}
+
+errno_t ramdisk_dev_t::write_async(void const *data, int64_t count,
+                                   uint64_t lba, bool, iocp_t *iocp)
+{
+    errno_t err = check_range(count, lba);
+
+    if (unlikely(err != errno_t::OK))
+        return err;
+
+    iocp->set_expect(1);
+
+    err = transfer(const_cast<void*>(data), count, lba, true);
+
+    complete(iocp, err, err == errno_t::OK
+             ? size_t(count) << log2_sectorsize : 0);
+
+    return errno_t::OK;
+}
+
+errno_t ramdisk_dev_t::flush_async(iocp_t *iocp)
+{
+    iocp->set_expect(1);
+    complete(iocp, errno_t::OK, 0);
+    return errno_t::OK;
+}
+
+errno_t ramdisk_dev_t::trim_async(int64_t count, uint64_t lba,
+                                  iocp_t *iocp)
+{
+    errno_t err = check_range(count, lba);
+
+    if (unlikely(err != errno_t::OK))
+        return err;
+
+    uint64_t st = lba << log2_sectorsize;
+    uint64_t en = uint64_t(lba + count) << log2_sectorsize;
+
+    // Partial pages at either end are zeroed, whole pages are released
+    uint64_t page_st = (st + PAGE_SIZE - 1) >> PAGE_SCALE;
+    uint64_t page_en = en >> PAGE_SCALE;
+
+    ext::vector<char*> released;
+
+    scoped_lock hold(lock);
+
+    for (uint64_t offset = st; offset < en; ) {
+        uint64_t page = offset >> PAGE_SCALE;
+        size_t page_ofs = offset & (PAGE_SIZE - 1);
+        size_t chunk = ext::min(en - offset,
+                                uint64_t(PAGE_SIZE) - page_ofs);
+
+        char *mem = page_at(page);
+
+        if (mem && page >= page_st && page < page_en) {
+            // Only detach the page once it is sure to be unmapped,
+            // zeroing it in place is correct too, just not frugal
+            if (likely(released.push_back(mem)))
+                leaves[page >> leaf_log2][page & (leaf_pages - 1)] = nullptr;
+            else
+                memset(mem, 0, PAGE_SIZE);
+        } else if (mem) {
+            memset(mem + page_ofs, 0, chunk);
+        }
+
+        offset += chunk;
+    }
+
+    hold.unlock();
+
+    for (char *mem : released)
+        munmap(mem, PAGE_SIZE);
+
+    iocp->set_expect(1);
+    complete(iocp, errno_t::OK, size_t(count) << log2_sectorsize);
+
+    return errno_t::OK;
+}
+
+errno_t ramdisk_dev_t::cancel_io(iocp_t *iocp)
+{
+    pending_scoped_lock hold(pending_lock);
+
+    ramdisk_pending_t **link = &pending_head;
+    ramdisk_pending_t *prev = nullptr;
+
+    while (*link) {
+        ramdisk_pending_t *pending = *link;
+
+        if (pending->iocp == iocp) {
+            *link = pending->next;
+
+            if (pending_tail == pending)
+                pending_tail = prev;
+
+            delete pending;
+            continue;
+        }
+
+        prev = pending;
+        link = &pending->next;
+    }
+
+    // Wait out a completion already being delivered
+    while (invoking == iocp)
+        pending_cond.wait(hold);
+
+    return errno_t::OK;
+}
+
+long ramdisk_dev_t::info(storage_dev_info_t key)
+{
+    switch (key) {
+    case STORAGE_INFO_BLOCKSIZE:
+        return 1L << log2_sectorsize;
+
+    case STORAGE_INFO_BLOCKSIZE_LOG2:
+        return log2_sectorsize;
+
+    case STORAGE_INFO_HAVE_TRIM:
+        return 1;
+
+    case STORAGE_INFO_NAME:
+        return long("RAMDISK");
+
+    case STORAGE_INFO_BLOCKCOUNT:
+        return long(block_count);
+
+    default:
+        return 0;
+    }
+}
+
+static bootopt_result_t ramdisk_parse_option(
+        void *arg, char const *key, char const *value)
+{
+    ramdisk_opts_t &opts = *(ramdisk_opts_t*)arg;
+    bool ok = true;
+
+    if (!strcmp(key, "size")) {
+        opts.size = bootinfo_parse_size(value, &ok);
+        ok = ok && opts.size >= PAGE_SIZE;
+    } else if (!strcmp(key, "count")) {
+        uint64_t count = bootinfo_parse_uint(value, &ok);
+        ok = ok && count <= UINT_MAX;
+        opts.count = unsigned(count);
+    } else if (!strcmp(key, "sector")) {
+        uint64_t sector_size = bootinfo_parse_uint(value, &ok);
+        ok = ok && (sector_size == 512 || sector_size == 4096);
+        opts.log2_sectorsize = sector_size == 4096 ? 12 : 9;
+    } else if (!strcmp(key, "latency_us")) {
+        uint64_t latency_us = bootinfo_parse_uint(value, &ok);
+        ok = ok && latency_us <= UINT64_MAX / 1000;
+        opts.latency_ns = latency_us * 1000;
+    } else {
+        return bootopt_result_t::unknown;
+    }
+
+    return ok ? bootopt_result_t::ok : bootopt_result_t::invalid;
+}
+
+static ramdisk_if_factory_t ramdisk_if_factory;
+
+__END_ANONYMOUS
+
+int module_main(int argc, char const * const * argv)
+{
+    // Nothing to do, or a mistake in the options, which is reported
+    if (bootinfo_parse_options("ramdisk", argc, argv,
+                               ramdisk_parse_option, &ramdisk_opts) <= 0)
+        return 0;
+
+    // Ensure the size is a whole number of sectors
+    ramdisk_opts.size &= -(uint64_t(1) << ramdisk_opts.log2_sectorsize);
+
+    storage_if_register_factory(&ramdisk_if_factory);
+
+    return 0;
+}
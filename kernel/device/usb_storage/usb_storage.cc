@@ -381,6 +381,10 @@ long usb_msc_dev_t::info(storage_dev_info_t key)
     case STORAGE_INFO_NAME:
         return long("USB-MSC");
 
+    case STORAGE_INFO_BLOCKCOUNT:
+        // Read capacity reports the last LBA
+        return long(max_lba + 1);
+
     default:
         return 0;
     }
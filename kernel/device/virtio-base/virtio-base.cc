@@ -99,141 +99,6 @@ bool virtio_base_t::virtio_init(pci_dev_iterator_t const& pci_iter,
                         (void*)addr, cap_rec.length,
                         PROT_READ | PROT_WRITE, MAP_PHYSICAL);
 
-            // 4.1.4.3 Reset the device
-            common_cfg->device_status = 0;
-
-            // 4.1.4.3.2 Wait until reset completes
-            uint64_t timeout;
-            timeout = time_ns() + 2000000000;
-
-            // Poll a million times between checking for timeout,
-            // so we don't spend 99% of CPU checking time
-            int timeout_divisor;
-            timeout_divisor = 1000000;
-            while (atomic_ld_acq(&common_cfg->device_status) != 0) {
-                if (unlikely(!--timeout_divisor)) {
-                    timeout_divisor = 1000000;
-                    if (time_ns() > timeout) {
-                        printk("Timeout waiting for %s device reset!\n",
-                               isr_name);
-                        return false;
-                    }
-                }
-
-                pause();
-            }
-
-            // Notify the device that a virtio driver has found it
-            mm_or(common_cfg->device_status, VIRTIO_STATUS_ACKNOWLEDGE);
-
-            // Notify the device that a virtio driver is accessing it
-            mm_or(common_cfg->device_status, VIRTIO_STATUS_DRIVER);
-
-            // Negotiate features
-            do {
-                feature_set_t features;
-
-                features.fetch_device_features(common_cfg);
-
-                // Offer the feature bitmap to the subclass
-                if (!offer_features(features)) {
-                    // Tell the device we gave up
-                    mm_or(common_cfg->device_status, VIRTIO_STATUS_FAILED);
-                    return false;
-                }
-
-                // Write the driver supported features into feature select
-                features.store_driver_features(common_cfg);
-
-                // Then read back what got set
-                features.fetch_driver_features(common_cfg);
-
-                if (!verify_features(features)) {
-                    // Tell the device we gave up
-                    mm_or(common_cfg->device_status, VIRTIO_STATUS_FAILED);
-                    return false;
-                }
-            } while (false);
-
-            atomic_fence();
-            mm_or(common_cfg->device_status, VIRTIO_STATUS_FEATURES_OK);
-
-            atomic_fence();
-            if (!(common_cfg->device_status & VIRTIO_STATUS_FEATURES_OK)) {
-                // Tell the device we gave up
-                mm_or(common_cfg->device_status, VIRTIO_STATUS_FAILED);
-                return false;
-            }
-
-            queue_count = common_cfg->num_queues;
-
-            // Allocate number of queues supported by device
-            queues.reset(new (ext::nothrow) virtio_virtqueue_t[queue_count]);
-
-            if (unlikely(!queues)) {
-                // Tell the device we gave up
-                mm_or(common_cfg->device_status, VIRTIO_STATUS_FAILED);
-                return false;
-            }
-
-            if (per_cpu_queues) {
-                // Use two interrupt vectors, first one is config IRQ,
-                // second one is shared by all queues
-                // Route first vector to CPU 0, route rest of vectors
-                // round robin across all CPUs, starting at CPU 0
-
-                ext::vector<int> target_cpus(queue_count + 1, 0);
-                ext::vector<int> vector_offsets(queue_count + 1, 1);
-
-                // Route config IRQs to CPU 0
-                vector_offsets[0] = 0;
-
-                // Distribute the rest of the IRQs across CPUs
-                int cpu_count = thread_get_cpu_count();
-                for (size_t i = 1; i <= queue_count; ++i)
-                    target_cpus[i] = (i - 1) % cpu_count;
-
-                use_msi = pci_try_msi_irq(pci_iter, &irq_range, 0, false,
-                                          queue_count + 1,
-                                          &virtio_base_t::irq_handler,
-                                          isr_name, target_cpus.data(),
-                                          vector_offsets.data());
-            } else {
-                use_msi = pci_try_msi_irq(pci_iter, &irq_range, 0, false,
-                                          queue_count + 1,
-                                          &virtio_base_t::irq_handler,
-                                          isr_name);
-            }
-
-            pci_set_irq_unmask(pci_iter, true);
-
-            // Initialize MSI-X IRQs
-            common_cfg->config_msix_vector = 0;
-
-            for (size_t i = queue_count; i > 0; --i) {
-                virtio_virtqueue_t& vq = queues[i - 1];
-
-                uint16_t queue_msix_vector = (use_msi && irq_range.msix)
-                        ? i : 0;
-
-                if (unlikely(!vq.init(i - 1, common_cfg,
-                                      notify_cap_offset,
-                                      notify_accessor,
-                                      notify_off_multiplier,
-                                      queue_msix_vector))) {
-                    // Tell the device we gave up
-                    mm_or(common_cfg->device_status, VIRTIO_STATUS_FAILED);
-                    return false;
-                }
-            }
-
-            atomic_fence();
-            mm_or(common_cfg->device_status, VIRTIO_STATUS_FEATURES_OK);
-            atomic_fence();
-            mm_or(common_cfg->device_status, VIRTIO_STATUS_DRIVER_OK);
-
-            VIRTIO_TRACE("Successfully negotiated features\n");
-
             break;
 
         case VIRTIO_PCI_CAP_NOTIFY_CFG:
@@ -285,11 +150,176 @@ bool virtio_base_t::virtio_init(pci_dev_iterator_t const& pci_iter,
         }
     }
 
+    if (unlikely(!common_cfg)) {
+        printdbg("virtio: %s has no common configuration\n", isr_name);
+        return false;
+    }
+
+    // The queues use the notify capability, which may come after
+    // the common configuration, so the device is set up last
+    if (unlikely(!virtio_setup(pci_iter, isr_name, per_cpu_queues)))
+        return false;
+
     VIRTIO_TRACE("Completed %s init successfully\n", isr_name);
 
     return true;
 }
 
+bool virtio_base_t::virtio_setup(pci_dev_iterator_t const& pci_iter,
+                                 char const *isr_name, bool per_cpu_queues)
+{
+    // 4.1.4.3 Reset the device
+    common_cfg->device_status = 0;
+
+    // 4.1.4.3.2 Wait until reset completes
+    uint64_t timeout;
+    timeout = time_ns() + 2000000000;
+
+    // Poll a million times between checking for timeout,
+    // so we don't spend 99% of CPU checking time
+    int timeout_divisor;
+    timeout_divisor = 1000000;
+    while (atomic_ld_acq(&common_cfg->device_status) != 0) {
+        if (unlikely(!--timeout_divisor)) {
+            timeout_divisor = 1000000;
+            if (time_ns() > timeout) {
+                printk("Timeout waiting for %s device reset!\n",
+                       isr_name);
+                return false;
+            }
+        }
+
+        pause();
+    }
+
+    // Notify the device that a virtio driver has found it
+    mm_or(common_cfg->device_status, VIRTIO_STATUS_ACKNOWLEDGE);
+
+    // Notify the device that a virtio driver is accessing it
+    mm_or(common_cfg->device_status, VIRTIO_STATUS_DRIVER);
+
+    // Negotiate features
+    do {
+        feature_set_t features;
+
+        features.fetch_device_features(common_cfg);
+
+        bool device_packed = features[VIRTIO_F_RING_PACKED_BIT];
+
+        // Offer the feature bitmap to the subclass
+        if (!offer_features(features)) {
+            // Tell the device we gave up
+            mm_or(common_cfg->device_status, VIRTIO_STATUS_FAILED);
+            return false;
+        }
+
+        // Every queue handles packed rings, which need a modern driver
+        features[VIRTIO_F_RING_PACKED_BIT] = device_packed &&
+                features[VIRTIO_F_VERSION_1_BIT];
+
+        // Write the driver supported features into feature select
+        features.store_driver_features(common_cfg);
+
+        // Then read back what got set
+        features.fetch_driver_features(common_cfg);
+
+        if (!verify_features(features)) {
+            // Tell the device we gave up
+            mm_or(common_cfg->device_status, VIRTIO_STATUS_FAILED);
+            return false;
+        }
+
+        // Ring features are only offered by drivers that handle them
+        event_idx_enabled = features[VIRTIO_F_RING_EVENT_IDX_BIT];
+        indirect_enabled = features[VIRTIO_F_INDIRECT_DESC_BIT];
+        packed_enabled = features[VIRTIO_F_RING_PACKED_BIT];
+    } while (false);
+
+    atomic_fence();
+    mm_or(common_cfg->device_status, VIRTIO_STATUS_FEATURES_OK);
+
+    atomic_fence();
+    if (!(common_cfg->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+        // Tell the device we gave up
+        mm_or(common_cfg->device_status, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+
+    queue_count = ext::min(size_t(common_cfg->num_queues), max_queue_count);
+
+    // Allocate number of queues supported by device
+    queues.reset(new (ext::nothrow) virtio_virtqueue_t[queue_count]);
+
+    if (unlikely(!queues)) {
+        // Tell the device we gave up
+        mm_or(common_cfg->device_status, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+
+    if (per_cpu_queues) {
+        // Use two interrupt vectors, first one is config IRQ,
+        // second one is shared by all queues
+        // Route first vector to CPU 0, route rest of vectors
+        // round robin across all CPUs, starting at CPU 0
+
+        ext::vector<int> target_cpus(queue_count + 1, 0);
+        ext::vector<int> vector_offsets(queue_count + 1, 1);
+
+        // Route config IRQs to CPU 0
+        vector_offsets[0] = 0;
+
+        // Distribute the rest of the IRQs across CPUs
+        int cpu_count = thread_get_cpu_count();
+        for (size_t i = 1; i <= queue_count; ++i)
+            target_cpus[i] = (i - 1) % cpu_count;
+
+        use_msi = pci_try_msi_irq(pci_iter, &irq_range, 0, false,
+                                  queue_count + 1,
+                                  &virtio_base_t::irq_handler,
+                                  isr_name, target_cpus.data(),
+                                  vector_offsets.data());
+    } else {
+        use_msi = pci_try_msi_irq(pci_iter, &irq_range, 0, false,
+                                  queue_count + 1,
+                                  &virtio_base_t::irq_handler,
+                                  isr_name);
+    }
+
+    pci_set_irq_unmask(pci_iter, true);
+
+    // Initialize MSI-X IRQs
+    common_cfg->config_msix_vector = 0;
+
+    for (size_t i = queue_count; i > 0; --i) {
+        virtio_virtqueue_t& vq = queues[i - 1];
+
+        uint16_t queue_msix_vector = (use_msi && irq_range.msix)
+                ? i : 0;
+
+        if (unlikely(!vq.init(i - 1, common_cfg,
+                              notify_cap_offset,
+                              notify_accessor,
+                              notify_off_multiplier,
+                              queue_msix_vector,
+                              event_idx_enabled,
+                              indirect_enabled,
+                              packed_enabled))) {
+            // Tell the device we gave up
+            mm_or(common_cfg->device_status, VIRTIO_STATUS_FAILED);
+            return false;
+        }
+    }
+
+    atomic_fence();
+    mm_or(common_cfg->device_status, VIRTIO_STATUS_FEATURES_OK);
+    atomic_fence();
+    mm_or(common_cfg->device_status, VIRTIO_STATUS_DRIVER_OK);
+
+    VIRTIO_TRACE("Successfully negotiated features\n");
+
+    return true;
+}
+
 isr_context_t *virtio_base_t::irq_handler(int irq, isr_context_t *ctx)
 {
     for (virtio_base_t *dev : virtio_devs) {
@@ -316,9 +346,13 @@ bool virtio_virtqueue_t::init(
         uint32_t cap_offset,
         pci_bar_accessor_t &notify_accessor,
         uint32_t notify_off_multiplier,
-        uint16_t msix_vector)
+        uint16_t msix_vector,
+        bool event_idx,
+        bool indirect,
+        bool packed)
 {
     this->queue_idx = queue_idx;
+    this->event_idx = event_idx;
 
     this->notify_accessor = notify_accessor;
 
@@ -343,9 +377,38 @@ bool virtio_virtqueue_t::init(
             (sizeof(used_t) << log2_queue_size) +
             sizeof(ring_ftr_t);
 
-    single_page = bytes <= PAGE_SIZE;
+    single_page = !packed && bytes <= PAGE_SIZE;
 
-    if (single_page) {
+    if (packed) {
+        // The ring is at most a page, the event structures share another
+        packed_ring = (packed_desc_t*)mmap(
+                    nullptr, sizeof(packed_desc_t) << log2_queue_size,
+                    PROT_READ | PROT_WRITE, MAP_POPULATE);
+        if (packed_ring == MAP_FAILED) {
+            packed_ring = nullptr;
+            return false;
+        }
+
+        driver_event = (packed_event_t*)mmap(
+                    nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_POPULATE);
+        if (driver_event == MAP_FAILED)
+            return false;
+
+        device_event = driver_event + 1;
+
+        // Only the driver looks at these
+        desc_tab = (desc_t*)mmap(
+                    nullptr, sizeof(desc_t) << log2_queue_size,
+                    PROT_READ | PROT_WRITE, MAP_POPULATE);
+        if (desc_tab == MAP_FAILED)
+            return false;
+
+        if (event_idx) {
+            // Interrupt when the first position is used
+            driver_event->off_wrap = 1U << VIRTQ_EVENT_WRAP_BIT;
+            driver_event->flags = VIRTQ_EVENT_F_DESC;
+        }
+    } else if (single_page) {
         char *buffer = (char*)mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
                                    MAP_POPULATE);
         if (buffer == MAP_FAILED)
@@ -389,6 +452,18 @@ bool virtio_virtqueue_t::init(
         used_ftr = (ring_ftr_t*)(used_ring + queue_count);
     }
 
+    if (indirect) {
+        // One table for each descriptor that can head a chain.
+        // Tables never straddle a page, so each is physically contiguous
+        indirect_tab = (desc_t*)mmap(
+                    nullptr, (sizeof(desc_t) * indirect_max) << log2_queue_size,
+                    PROT_READ | PROT_WRITE, MAP_POPULATE);
+        if (indirect_tab == MAP_FAILED) {
+            indirect_tab = nullptr;
+            return false;
+        }
+    }
+
     completions.reset(new (ext::nothrow) virtio_iocp_t*[queue_count]());
     if (!completions)
         return false;
@@ -409,17 +484,17 @@ bool virtio_virtqueue_t::init(
     common_cfg->queue_size = 1 << log2_queue_size;
 
     uint64_t desc_paddr;
-    desc_paddr = mphysaddr(desc_tab);
+    desc_paddr = mphysaddr(packed ? (void*)packed_ring : (void*)desc_tab);
     assert((desc_paddr & -16) == desc_paddr);
     common_cfg->queue_desc = desc_paddr;
 
     uint64_t avail_paddr;
-    avail_paddr = mphysaddr(avail_hdr);
+    avail_paddr = mphysaddr(packed ? (void*)driver_event : (void*)avail_hdr);
     assert((avail_paddr & -2) == avail_paddr);
     common_cfg->queue_avail = avail_paddr;
 
     uint64_t used_paddr;
-    used_paddr = mphysaddr(used_hdr);
+    used_paddr = mphysaddr(packed ? (void*)device_event : (void*)used_hdr);
     assert((used_paddr & -4) == used_paddr);
 
     common_cfg->queue_used = used_paddr;
@@ -454,6 +529,10 @@ bool virtio_virtqueue_t::wait_for_descriptors(
     assert(count > 0);
 
     while (desc_free_count < count) {
+        // Chains held back for a batch must reach the device,
+        // or descriptors would never be freed
+        kick_locked(lock);
+
         if (unlikely(queue_not_full.wait_until(lock, timeout_time_ns) ==
                 ext::cv_status::timeout))
             return false;
@@ -514,16 +593,133 @@ bool virtio_virtqueue_t::alloc_multiple(
 }
 
 void virtio_virtqueue_t::enqueue_avail(desc_t **desc, size_t count,
-                                       virtio_iocp_t *iocp)
+                                       virtio_iocp_t *iocp, bool notify)
+{
+    scoped_lock lock(queue_lock);
+    return enqueue_avail(desc, count, iocp, lock, notify);
+}
+
+void virtio_virtqueue_t::kick()
 {
     scoped_lock lock(queue_lock);
-    return enqueue_avail(desc, count, iocp, lock);
+    kick_locked(lock);
+}
+
+void virtio_virtqueue_t::kick_locked(scoped_lock &lock)
+{
+    if (!kick_pending)
+        return;
+
+    kick_pending = false;
+
+    // The device must see the new descriptors before we look at
+    // whether it asked to be notified
+    atomic_fence();
+
+    bool need_notify;
+
+    if (packed_ring) {
+        uint16_t off_wrap = atomic_ld_acq(&device_event->off_wrap);
+        uint16_t flags = atomic_ld_acq(&device_event->flags);
+
+        need_notify = virtio_packed_need_notify(
+                    off_wrap, flags, avail_pos, avail_wrap,
+                    added_since_kick, log2_queue_size);
+
+        added_since_kick = 0;
+
+        if (need_notify)
+            notify_accessor.wr_16(notify_reg, queue_idx);
+
+        return;
+    }
+
+    uint16_t new_idx = avail_hdr->idx;
+    uint16_t old_idx = notified_idx;
+    notified_idx = new_idx;
+
+    if (event_idx) {
+        // Notify only if the index the device asked for was passed
+        uint16_t avail_event = atomic_ld_acq(&used_ftr->event);
+        need_notify = uint16_t(new_idx - avail_event - 1) <
+                uint16_t(new_idx - old_idx);
+    } else {
+        need_notify = !(atomic_ld_acq(&used_hdr->flags) &
+                        VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    if (need_notify)
+        notify_accessor.wr_16(notify_reg, queue_idx);
+}
+
+bool virtio_virtqueue_t::enqueue_indirect(desc_t const *descs, size_t count,
+                                          virtio_iocp_t *iocp, bool notify,
+                                          int64_t timeout_time_ns)
+{
+    assert(count > 0 && count <= indirect_capacity());
+
+    scoped_lock lock(queue_lock);
+
+    if (unlikely(!wait_for_descriptors(1, timeout_time_ns, lock)))
+        return false;
+
+    desc_t *head = alloc_desc(false, lock);
+
+    desc_t *table = indirect_tab + size_t(index_of(head)) * indirect_max;
+
+    if (packed_ring) {
+        // Packed indirect tables are sequential, without next links
+        packed_desc_t *packed_table = (packed_desc_t*)table;
+
+        for (size_t i = 0; i < count; ++i) {
+            packed_table[i].addr = descs[i].addr;
+            packed_table[i].len = descs[i].len;
+            packed_table[i].id = 0;
+            packed_table[i].flags = descs[i].flags.bits.write
+                    ? VIRTQ_DESC_F_WRITE
+                    : 0;
+        }
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            table[i] = descs[i];
+            table[i].flags.bits.next = (i + 1 < count);
+            table[i].next = (i + 1 < count) ? i + 1 : 0;
+        }
+    }
+
+    head->addr = mphysaddr(table);
+    head->len = sizeof(*table) * count;
+    head->flags.bits.indirect = true;
+
+    enqueue_avail(&head, 1, iocp, lock, notify);
+
+    return true;
 }
 
 void virtio_virtqueue_t::enqueue_avail(desc_t **desc, size_t count,
                                        virtio_iocp_t *iocp,
-                                       scoped_lock& lock)
+                                       scoped_lock& lock, bool notify)
 {
+    if (packed_ring) {
+        bool skip = false;
+        for (size_t i = 0; i < count; ++i) {
+            if (!skip) {
+                iocp->set_expect(1);
+                completions[index_of(desc[i])] = iocp;
+                enqueue_packed(desc[i], lock);
+            }
+
+            skip = desc[i]->flags.bits.next;
+        }
+
+        kick_pending = true;
+
+        if (notify)
+            kick_locked(lock);
+
+        return;
+    }
+
     size_t mask = ~-(size_t(1) << log2_queue_size);
 
     bool skip = false;
@@ -548,25 +744,57 @@ void virtio_virtqueue_t::enqueue_avail(desc_t **desc, size_t count,
             avail_ring[avail_head++ & mask] = chain_start;
     }
 
-    // Update used idx (tell virtio the last used event we looked at)
-    // enforce ordering until after prior stores are globally visible
-    atomic_st_rel(&avail_ftr->used_event, avail_head - 1);
-
     // Update idx (tell virtio where we would put the next new item)
     // enforce ordering until after prior store is globally visible
     atomic_st_rel(&avail_hdr->idx, avail_head);
 
-    // If there are items between where we enqueued and what device claims
-    // to have seen, then write the notify MMIO to kick virtio and make
-    // it look at the ring
-    if (int16_t((uint16_t)avail_head - (uint16_t)avail_ftr->used_event) > 0)
-        notify_accessor.wr_16(notify_reg, queue_idx);
+    // Whether the device wants to hear about it is decided when kicking
+    kick_pending = true;
+
+    if (notify)
+        kick_locked(lock);
+}
+
+void virtio_virtqueue_t::enqueue_packed(desc_t *head, scoped_lock &lock)
+{
+    uint16_t const id = index_of(head);
+    uint16_t const head_pos = avail_pos;
+    uint16_t head_flags = 0;
+
+    // Every descriptor carries the buffer id, the head is made
+    // available last, so the device never sees a partial chain
+    for (desc_t *desc = head; ; desc = desc_tab + desc->next) {
+        uint16_t flags = (desc->flags.bits.next ? VIRTQ_DESC_F_NEXT : 0) |
+                (desc->flags.bits.write ? VIRTQ_DESC_F_WRITE : 0) |
+                (desc->flags.bits.indirect ? VIRTQ_DESC_F_INDIRECT : 0) |
+                (avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED);
+
+        packed_desc_t &item = packed_ring[avail_pos];
+        item.addr = desc->addr;
+        item.len = desc->len;
+        item.id = id;
+
+        if (desc == head)
+            head_flags = flags;
+        else
+            item.flags = flags;
+
+        virtio_packed_advance(avail_pos, avail_wrap, 1, log2_queue_size);
+
+        ++added_since_kick;
+
+        if (!desc->flags.bits.next)
+            break;
+    }
+
+    atomic_st_rel(&packed_ring[head_pos].flags, head_flags);
 }
 
 void virtio_virtqueue_t::sendrecv(void const *sent_data, size_t sent_size,
                                   void *rcvd_data, size_t rcvd_size)
 {
-    sendrecv(sent_data, sent_size, rcvd_data, rcvd_size);
+    // Cannot time out
+    (void)sendrecv(sent_data, sent_size, rcvd_data, rcvd_size, INT64_MAX);
 }
 
 bool virtio_virtqueue_t::sendrecv(void const *sent_data, size_t sent_size,
@@ -588,7 +816,9 @@ void virtio_virtqueue_t::sendrecv(void const *sent_data, size_t sent_size,
                                   void *rcvd_data, size_t rcvd_size,
                                   virtio_iocp_t *iocp)
 {
-    sendrecv(sent_data, sent_size, rcvd_data, rcvd_size, iocp);
+    // Cannot time out
+    (void)sendrecv(sent_data, sent_size, rcvd_data, rcvd_size,
+                   iocp, INT64_MAX);
 }
 
 bool virtio_virtqueue_t::sendrecv(void const *sent_data, size_t sent_size,
@@ -649,52 +879,127 @@ bool virtio_virtqueue_t::sendrecv(void const *sent_data, size_t sent_size,
     return true;
 }
 
-void virtio_virtqueue_t::recycle_used()
+unsigned virtio_virtqueue_t::free_chain(avail_t id, uint64_t used_len,
+                                        scoped_lock &lock)
 {
-    scoped_lock lock(queue_lock);
+    VIRTIO_TRACE("Recycling id=%u (head)\n", id);
 
-    VIRTIO_TRACE("Recycling used descriptors\n");
+    unsigned freed_count = 1;
 
+    avail_t end = id;
+    while (desc_tab[end].flags.bits.next) {
+        end = desc_tab[end].next;
+        ++freed_count;
+        VIRTIO_TRACE("Recycling id=%u (chained)\n", end);
+    }
+
+    desc_tab[end].next = desc_first_free;
+    desc_first_free = id;
+    desc_free_count += freed_count;
+
+    virtio_iocp_t* const completion = completions[id];
+    completions[id] = nullptr;
+    completion->set_result(used_len);
+    if (unlikely(!pending_completions.push_back(completion)))
+        panic_oom();
+
+    return freed_count;
+}
+
+bool virtio_virtqueue_t::recycle_split(scoped_lock &lock)
+{
     size_t tail = used_tail;
     size_t const mask = ~-(1 << log2_queue_size);
-    size_t const done_idx = atomic_ld_acq(&used_hdr->idx);
+    size_t done_idx = atomic_ld_acq(&used_hdr->idx);
     VIRTIO_TRACE("done_idx = %zu\n", done_idx);
-    if (unlikely(done_idx == tail)) {
-        VIRTIO_TRACE("dropped spurious virtio IRQ\n");
-        return;
-    }
+    if (unlikely(done_idx == tail))
+        return false;
 
-    do {
+    for (;;) {
         used_t const& used = used_ring[tail & mask];
-        avail_t const id = used.id;
-        uint64_t const used_len = used.len;
 
-        VIRTIO_TRACE("Recycling id=%u (head)\n", id);
+        free_chain(used.id, used.len, lock);
 
-        unsigned freed_count = 1;
+        if ((++tail & 0xFFFF) != done_idx)
+            continue;
 
-        avail_t end = id;
-        while (desc_tab[end].flags.bits.next) {
-            end = desc_tab[end].next;
-            ++freed_count;
-            VIRTIO_TRACE("Recycling id=%u (chained)\n", end);
-        }
+        // Ask for an interrupt when the next one is used
+        atomic_st_rel(&avail_ftr->event, uint16_t(tail));
 
-        desc_tab[end].next = desc_first_free;
-        desc_first_free = id;
-        desc_free_count += freed_count;
+        if (!event_idx)
+            break;
 
-        virtio_iocp_t* const completion = completions[id];
-        completions[id] = nullptr;
-        completion->set_result(used_len);
-        if (unlikely(!pending_completions.push_back(completion)))
-            panic_oom();
-    } while ((++tail & 0xFFFF) != done_idx);
+        // It may have been used before the device could see that,
+        // and it would not interrupt for it, so look again
+        atomic_fence();
+        done_idx = atomic_ld_acq(&used_hdr->idx);
+
+        if (done_idx == (tail & 0xFFFF))
+            break;
+    }
 
     used_tail = tail;
 
-    // Notify device how far used ring has been processed
-    atomic_st_rel(&used_ftr->used_event, tail);
+    return true;
+}
+
+bool virtio_virtqueue_t::recycle_packed(scoped_lock &lock)
+{
+    bool found = false;
+
+    for (;;) {
+        packed_desc_t const& item = packed_ring[used_pos];
+        uint16_t flags = atomic_ld_acq(&item.flags);
+
+        // Used when both bits match the used wrap counter
+        bool avail = flags & VIRTQ_DESC_F_AVAIL;
+        bool used = flags & VIRTQ_DESC_F_USED;
+
+        if (avail != used_wrap || used != used_wrap) {
+            if (!event_idx || !found)
+                break;
+
+            // Ask for an interrupt when this position is used,
+            // then look again, like the split ring
+            atomic_st_rel(&driver_event->off_wrap, uint16_t(
+                              used_pos |
+                              (used_wrap << VIRTQ_EVENT_WRAP_BIT)));
+            atomic_fence();
+
+            flags = atomic_ld_acq(&item.flags);
+            avail = flags & VIRTQ_DESC_F_AVAIL;
+            used = flags & VIRTQ_DESC_F_USED;
+
+            if (avail != used_wrap || used != used_wrap)
+                break;
+        }
+
+        found = true;
+
+        // The chain occupied as many ring positions as it has descriptors
+        unsigned freed_count = free_chain(item.id, item.len, lock);
+
+        virtio_packed_advance(used_pos, used_wrap, freed_count,
+                              log2_queue_size);
+    }
+
+    return found;
+}
+
+void virtio_virtqueue_t::recycle_used()
+{
+    scoped_lock lock(queue_lock);
+
+    VIRTIO_TRACE("Recycling used descriptors\n");
+
+    bool found = packed_ring
+            ? recycle_packed(lock)
+            : recycle_split(lock);
+
+    if (unlikely(!found)) {
+        VIRTIO_TRACE("dropped spurious virtio IRQ\n");
+        return;
+    }
 
     pending_completions.swap(finished_completions);
 
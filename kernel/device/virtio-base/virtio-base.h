@@ -70,8 +70,12 @@ public:
         uint16_t idx;
     };
 
+    // With VIRTIO_F_RING_EVENT_IDX, the available ring ends with the
+    // used index the driver wants an interrupt at (used_event), and the
+    // used ring ends with the available index the device wants to be
+    // notified at (avail_event)
     struct ring_ftr_t {
-        uint16_t used_event;
+        uint16_t event;
         uint16_t padding;
     };
 
@@ -82,6 +86,23 @@ public:
         uint32_t len;
     };
 
+    // Packed ring descriptor, made available and used in place
+    struct packed_desc_t {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t id;
+        uint16_t flags;
+    };
+
+    static_assert(sizeof(packed_desc_t) == 16, "Unexpected size");
+
+    // Packed ring event suppression
+    struct packed_event_t {
+        // Ring position, with the wrap counter in bit 15
+        uint16_t off_wrap;
+        uint16_t flags;
+    };
+
     virtio_virtqueue_t()
     {
     }
@@ -89,6 +110,22 @@ public:
     ~virtio_virtqueue_t()
     {
         scoped_lock hold(queue_lock);
+        if (indirect_tab) {
+            munmap(indirect_tab,
+                   (sizeof(*indirect_tab) * indirect_max) << log2_queue_size);
+            indirect_tab = nullptr;
+        }
+
+        if (packed_ring) {
+            munmap(packed_ring, sizeof(*packed_ring) << log2_queue_size);
+            munmap(driver_event, PAGE_SIZE);
+            munmap(desc_tab, sizeof(*desc_tab) << log2_queue_size);
+            packed_ring = nullptr;
+            driver_event = nullptr;
+            device_event = nullptr;
+            desc_tab = nullptr;
+        }
+
         if (single_page && desc_tab) {
             munmap(desc_tab, (sizeof(*desc_tab) << log2_queue_size) +
                    (sizeof(uint16_t) << log2_queue_size) +
@@ -107,7 +144,10 @@ public:
               uint32_t cap_offset,
               pci_bar_accessor_t &notify_accessor,
               uint32_t notify_off_multiplier,
-              uint16_t msix_vector);
+              uint16_t msix_vector,
+              bool event_idx = false,
+              bool indirect = false,
+              bool packed = false);
 
     uint16_t index_of(desc_t *desc) const
     {
@@ -142,7 +182,26 @@ public:
     bool alloc_multiple(desc_t **descs, size_t count,
                         int64_t timeout_time_ns = INT64_MAX);
 
-    void enqueue_avail(desc_t **desc, size_t count, virtio_iocp_t *iocp);
+    // Pass notify = false to defer the notification to a later kick()
+    void enqueue_avail(desc_t **desc, size_t count, virtio_iocp_t *iocp,
+                       bool notify = true);
+
+    // Notify the device of chains enqueued without notifying
+    void kick();
+
+    // Largest chain that fits in an indirect table, 0 when not negotiated
+    size_t indirect_capacity() const
+    {
+        return indirect_tab ? indirect_max : 0;
+    }
+
+    // Make a chain of count descriptors available through an indirect
+    // table, using a single ring descriptor. The chain's next fields
+    // are filled in here
+    _use_result
+    bool enqueue_indirect(desc_t const *descs, size_t count,
+                          virtio_iocp_t *iocp, bool notify = true,
+                          int64_t timeout_time_ns = INT64_MAX);
 
 private:
     using lock_type = ext::noirq_lock<ext::spinlock>;
@@ -150,7 +209,18 @@ private:
 
     desc_t *alloc_desc(bool dev_writable, scoped_lock &lock);
 
-    void enqueue_avail(desc_t **desc, size_t count, virtio_iocp_t *iocp, scoped_lock &lock);
+    void enqueue_avail(desc_t **desc, size_t count, virtio_iocp_t *iocp,
+                       scoped_lock &lock, bool notify = true);
+
+    void kick_locked(scoped_lock &lock);
+
+    void enqueue_packed(desc_t *head, scoped_lock &lock);
+
+    // Return a used chain to the free list and queue its completion
+    unsigned free_chain(avail_t id, uint64_t used_len, scoped_lock &lock);
+
+    bool recycle_split(scoped_lock &lock);
+    bool recycle_packed(scoped_lock &lock);
 
     bool wait_for_descriptors(size_t count, int64_t timeout_time_ns,
                               scoped_lock &lock);
@@ -184,6 +254,41 @@ private:
 
     uint8_t log2_queue_size = 0;
     bool single_page = false;
+
+    // Descriptors in each indirect table
+    static constexpr size_t indirect_max = 32;
+
+    // indirect_max entry table for each ring descriptor
+    desc_t *indirect_tab = nullptr;
+
+    // Available index when the device was last notified
+    uint16_t notified_idx = 0;
+
+    // Chains were made available without notifying the device
+    bool kick_pending = false;
+
+    // VIRTIO_F_RING_EVENT_IDX was negotiated
+    bool event_idx = false;
+
+    // With VIRTIO_F_RING_PACKED, the device sees only packed_ring and
+    // the two event structures. Callers still build split descriptor
+    // chains in desc_tab, which are copied into the ring when made
+    // available and stay allocated until used, so desc_tab's free
+    // count is always the ring's free space
+    packed_desc_t *packed_ring = nullptr;
+    packed_event_t *driver_event = nullptr;
+    packed_event_t *device_event = nullptr;
+
+    // Next ring position to make available and to look for a used one
+    uint16_t avail_pos = 0;
+    uint16_t used_pos = 0;
+
+    // Descriptors made available since the device was last notified,
+    // each descriptor of a chain takes a ring position
+    uint32_t added_since_kick = 0;
+
+    bool avail_wrap = true;
+    bool used_wrap = true;
 };
 
 struct virtio_pci_cap_hdr_t {
@@ -230,10 +335,72 @@ C_ASSERT(sizeof(virtio_pci_cap_hdr_t) == 16);
 
 // Reserved feature bits
 
+#define VIRTIO_F_RING_PACKED_BIT    34
 #define VIRTIO_F_VERSION_1_BIT      32
 #define VIRTIO_F_RING_EVENT_IDX_BIT 29
 #define VIRTIO_F_INDIRECT_DESC_BIT  28
 
+// Used ring flags, device asks not to be notified
+#define VIRTQ_USED_F_NO_NOTIFY      1
+
+// Packed ring descriptor flags
+#define VIRTQ_DESC_F_NEXT           1
+#define VIRTQ_DESC_F_WRITE          2
+#define VIRTQ_DESC_F_INDIRECT       4
+#define VIRTQ_DESC_F_AVAIL          (1 << 7)
+#define VIRTQ_DESC_F_USED           (1 << 15)
+
+// Packed ring event suppression flags
+#define VIRTQ_EVENT_F_ENABLE        0
+#define VIRTQ_EVENT_F_DISABLE       1
+#define VIRTQ_EVENT_F_DESC          2
+#define VIRTQ_EVENT_WRAP_BIT        15
+
+// Advance a packed ring position by count descriptors
+static inline void virtio_packed_advance(uint16_t &pos, bool &wrap,
+                                         unsigned count,
+                                         uint8_t log2_queue_size)
+{
+    uint32_t next = uint32_t(pos) + count;
+
+    while (next >= (1U << log2_queue_size)) {
+        next -= 1U << log2_queue_size;
+        wrap = !wrap;
+    }
+
+    pos = uint16_t(next);
+}
+
+// Whether the device, with the given event suppression, wants to hear
+// about added descriptors made available up to new_pos on the
+// new_wrap lap of a packed ring
+static inline bool virtio_packed_need_notify(uint16_t off_wrap,
+                                             uint16_t flags,
+                                             uint16_t new_pos,
+                                             bool new_wrap,
+                                             uint32_t added,
+                                             uint8_t log2_queue_size)
+{
+    if (flags != VIRTQ_EVENT_F_DESC)
+        return flags != VIRTQ_EVENT_F_DISABLE;
+
+    uint16_t const size = uint16_t(1U << log2_queue_size);
+
+    // A whole lap or more passed every position the device could ask for
+    if (added >= size)
+        return true;
+
+    // Positions on the previous lap are made negative, so they
+    // compare as if the ring never wrapped
+    uint16_t event = off_wrap & ~(1U << VIRTQ_EVENT_WRAP_BIT);
+    if (bool(off_wrap >> VIRTQ_EVENT_WRAP_BIT) != new_wrap)
+        event -= size;
+
+    uint16_t old_idx = new_pos - uint16_t(added);
+
+    return uint16_t(new_pos - event - 1) < uint16_t(new_pos - old_idx);
+}
+
 // virtqueue
 
 struct virtio_pci_common_cfg_t {
@@ -408,6 +575,9 @@ protected:
     bool virtio_init(pci_dev_iterator_t const &pci_iter, char const *isr_name,
                      bool per_cpu_queues = false);
 
+    bool virtio_setup(pci_dev_iterator_t const &pci_iter, char const *isr_name,
+                      bool per_cpu_queues);
+
     virtual bool init(pci_dev_iterator_t const &pci_iter) = 0;
 
     // Tell the driver what is supported and expect it to clear features
@@ -439,6 +609,18 @@ protected:
     ext::unique_ptr<virtio_virtqueue_t[]> queues;
     size_t queue_count = 0;
 
+    // Subclass may lower this in verify_features to use fewer queues
+    // than the device has
+    size_t max_queue_count = SIZE_MAX;
+
+    // Negotiated ring features, a subclass offers them to opt in
+    bool event_idx_enabled = false;
+    bool indirect_enabled = false;
+
+    // Packed rings are used whenever the device offers them
+    // and the subclass accepted VIRTIO_F_VERSION_1
+    bool packed_enabled = false;
+
     lock_type cfg_lock;
 
     // MMIO
@@ -40,6 +40,9 @@ PCI_DRIVER(
 // Device exports information on optimal I/O alignment.
 #define VIRTIO_BLK_F_TOPOLOGY_BIT (10)
 
+// Device supports multiqueue, count is in num_queues.
+#define VIRTIO_BLK_F_MQ_BIT (12)
+
 #define VIRTIO_BLK_T_IN     0
 #define VIRTIO_BLK_T_OUT    1
 #define VIRTIO_BLK_T_FLUSH  4
@@ -95,7 +98,11 @@ public:
         } header;
 
         per_queue_t *owner;
-        void *data;
+
+        // The buffer, only used while the chain is built
+        storage_seg_t const *segs;
+        size_t seg_count;
+
         int64_t count;
         virtio_iocp_t io_iocp;
         iocp_t *caller_iocp;
@@ -125,6 +132,21 @@ private:
     errno_t io(void *data, int64_t count, uint64_t lba, bool fua,
                virtio_blk_op_t op, iocp_t *iocp);
 
+    errno_t segs_io(storage_seg_t const *segs, size_t seg_count,
+                    uint64_t lba, bool fua, virtio_blk_op_t op,
+                    iocp_t *iocp);
+
+    errno_t submit_plan(disk_io_plan_t *plan) override final;
+
+    errno_t readv_async(storage_seg_t const *segs, size_t seg_count,
+                        uint64_t lba, iocp_t *iocp) override final;
+
+    errno_t writev_async(storage_seg_t const *segs, size_t seg_count,
+                         uint64_t lba, bool fua,
+                         iocp_t *iocp) override final;
+
+    unsigned io_queue_index();
+
 private:
     using lock_type = ext::spinlock;
     using scoped_lock = ext::unique_lock<lock_type>;
@@ -156,17 +178,25 @@ private:
             uint32_t opt_io_size;
         } topology;
 
-        uint8_t reserved;
+        uint8_t writeback;
+        uint8_t unused0;
+
+        // Number of request queues, with VIRTIO_BLK_F_MQ
+        uint16_t num_queues;
     };
 
     struct per_queue_t {
         bool init(virtio_blk_if_t *owner, virtio_virtqueue_t *queue);
 
-        int io(request_t *request);
+        // With notify = false, the device is notified by a later kick
+        int io(request_t *request, bool notify = true);
 
         virtio_blk_if_t *owner;
         lock_type per_queue_lock;
         ext::vector<virtio_virtqueue_t::desc_t*> desc_chain;
+
+        // Chains built here are copied into an indirect table
+        ext::vector<virtio_virtqueue_t::desc_t> indirect_chain;
         ext::vector<mmphysrange_t> phys_ranges;
         virtio_virtqueue_t *req_queue;
     };
@@ -216,13 +246,16 @@ void virtio_blk_factory_t::found_device(virtio_base_t *device)
         panic_oom();
 }
 
-int virtio_blk_if_t::io(request_t *request)
+unsigned virtio_blk_if_t::io_queue_index()
 {
-    unsigned queue_nr = queue_count > 1
+    return queue_count > 1
             ? thread_cpu_number() % queue_count
             : 0;
+}
 
-    return per_queue[queue_nr].io(request);
+int virtio_blk_if_t::io(request_t *request)
+{
+    return per_queue[io_queue_index()].io(request);
 }
 
 bool virtio_blk_if_t::per_queue_t::init(
@@ -234,11 +267,13 @@ bool virtio_blk_if_t::per_queue_t::init(
         return false;
     if (!phys_ranges.resize(16))
         return false;
+    if (!indirect_chain.resize(queue->indirect_capacity()))
+        return false;
 
     return true;
 }
 
-int virtio_blk_if_t::per_queue_t::io(request_t *request)
+int virtio_blk_if_t::per_queue_t::io(request_t *request, bool notify)
 {
     request->owner = this;
 
@@ -260,14 +295,15 @@ int virtio_blk_if_t::per_queue_t::io(request_t *request)
     }
 
     size_t range_count;
-    char *data = (char*)request->data;
     size_t remain = request->count << owner->log2_sectorsize;
 
     scoped_lock lock(per_queue_lock);
 
     for (;;) {
-        range_count = mphysranges(phys_ranges.data(), phys_ranges.size(),
-                                  data, remain, owner->blk_config->size_max);
+        range_count = storage_seg_physranges(
+                    phys_ranges.data(), phys_ranges.size(),
+                    request->segs, request->seg_count, 0, remain,
+                    owner->blk_config->size_max);
 
         if (likely(range_count < phys_ranges.size()))
             break;
@@ -276,6 +312,37 @@ int virtio_blk_if_t::per_queue_t::io(request_t *request)
         phys_ranges.resize(phys_ranges.size() * 2);
     }
 
+    request->io_iocp.reset(&virtio_blk_if_t::io_completion,
+                           uintptr_t(request));
+
+    if (range_count + 2 <= indirect_chain.size()) {
+        // Header, data, status, taking one ring descriptor
+        virtio_virtqueue_t::desc_t *chain = indirect_chain.data();
+
+        chain[0] = {};
+        chain[0].addr = mphysaddr(&request->header);
+        chain[0].len = sizeof(request->header);
+
+        for (size_t i = 0; i < range_count; ++i) {
+            chain[i + 1] = {};
+            chain[i + 1].addr = phys_ranges[i].physaddr;
+            chain[i + 1].len = phys_ranges[i].size;
+            chain[i + 1].flags.bits.write =   // writes RAM
+                    (request->op == virtio_blk_op_t::read);
+        }
+
+        chain[range_count + 1] = {};
+        chain[range_count + 1].addr = mphysaddr(&request->status);
+        chain[range_count + 1].len = sizeof(request->status);
+        chain[range_count + 1].flags.bits.write = true;
+
+        if (unlikely(!req_queue->enqueue_indirect(
+                         chain, range_count + 2, &request->io_iocp, notify)))
+            return -1;
+
+        return 1;
+    }
+
     if (unlikely(desc_chain.size() < range_count + 2)) {
         if (unlikely(!desc_chain.resize(range_count + 2)))
             panic_oom();
@@ -306,11 +373,8 @@ int virtio_blk_if_t::per_queue_t::io(request_t *request)
     desc_chain[i + 1]->flags.bits.next = false;
     desc_chain[i + 1]->flags.bits.write = true;
 
-    request->io_iocp.reset(&virtio_blk_if_t::io_completion,
-                           uintptr_t(request));
-
     req_queue->enqueue_avail(desc_chain.data(), range_count + 2,
-                             &request->io_iocp);
+                             &request->io_iocp, notify);
 
     return 1;
 }
@@ -349,7 +413,11 @@ bool virtio_blk_if_t::offer_features(virtio_base_t::feature_set_t &features)
         VIRTIO_BLK_F_GEOMETRY_BIT,
         VIRTIO_BLK_F_RO_BIT,
         VIRTIO_BLK_F_BLK_SIZE_BIT,
-        VIRTIO_BLK_F_TOPOLOGY_BIT
+        VIRTIO_BLK_F_TOPOLOGY_BIT,
+        VIRTIO_BLK_F_MQ_BIT,
+        VIRTIO_F_RING_EVENT_IDX_BIT,
+        VIRTIO_F_INDIRECT_DESC_BIT,
+        VIRTIO_F_VERSION_1_BIT
     };
 
     features &= support;
@@ -371,6 +439,28 @@ bool virtio_blk_if_t::verify_features(virtio_base_t::feature_set_t &features)
         printk("virtio-blk: supports %s\n", "BLK_SIZE");
     if (features[VIRTIO_BLK_F_TOPOLOGY_BIT])
         printk("virtio-blk: supports %s\n", "TOPOLOGY");
+    if (features[VIRTIO_F_RING_EVENT_IDX_BIT])
+        printk("virtio-blk: supports %s\n", "EVENT_IDX");
+    if (features[VIRTIO_F_INDIRECT_DESC_BIT])
+        printk("virtio-blk: supports %s\n", "INDIRECT_DESC");
+    if (features[VIRTIO_F_RING_PACKED_BIT])
+        printk("virtio-blk: supports %s\n", "RING_PACKED");
+
+    // Queue 0 is the only request queue without multiqueue.
+    // With it, use up to one queue per CPU
+    max_queue_count = 1;
+
+    if (features[VIRTIO_BLK_F_MQ_BIT] && device_cfg) {
+        blk_config_t const volatile *config =
+                (blk_config_t const volatile *)device_cfg;
+
+        max_queue_count = ext::max(ext::min(
+                    size_t(config->num_queues),
+                    size_t(thread_get_cpu_count())), size_t(1));
+
+        printk("virtio-blk: supports %s, using %zu queues\n",
+               "MQ", max_queue_count);
+    }
 
     return true;
 }
@@ -386,7 +476,15 @@ void virtio_blk_if_t::irq_handler(int offset)
     if (offset == 0 || irq_range.count == 1)
         config_irq();
 
-    if (offset == 1 || irq_range.count == 1) {
+    if (!use_msi || !irq_range.msix) {
+        // One interrupt for everything, it could be any queue
+        for (size_t i = 0; i < queue_count; ++i)
+            per_queue[i].req_queue->recycle_used();
+        return;
+    }
+
+    if (offset == 1) {
+        // Each queue's vector is routed to the CPU that submits to it
         uint32_t cpu_nr = thread_cpu_number();
         uint32_t queue_nr = cpu_nr % queue_count;
 
@@ -401,11 +499,33 @@ errno_t virtio_blk_if_t::io(
         void *data, int64_t count, uint64_t lba,
         bool fua, virtio_blk_op_t op, iocp_t *iocp)
 {
+   storage_seg_t seg{ data, 0, size_t(count) << log2_sectorsize };
+
+   return segs_io(&seg, data ? 1 : 0, lba, fua, op, iocp);
+}
+
+// Each segment becomes descriptors of the chain directly
+errno_t virtio_blk_if_t::segs_io(
+        storage_seg_t const *segs, size_t seg_count,
+        uint64_t lba, bool fua, virtio_blk_op_t op, iocp_t *iocp)
+{
+   size_t size = 0;
+
+   for (size_t i = 0; i < seg_count; ++i)
+       size += segs[i].size;
+
+   if (unlikely(size & ((size_t(1) << log2_sectorsize) - 1)))
+       return errno_t::EINVAL;
+
    virtio_blk_if_t::request_t *request =
            new (ext::nothrow) virtio_blk_if_t::request_t;
 
-   request->data = data;
-   request->count = count;
+   if (unlikely(!request))
+       return errno_t::ENOMEM;
+
+   request->segs = segs;
+   request->seg_count = seg_count;
+   request->count = size >> log2_sectorsize;
    request->header.lba = lba;
    request->op = op;
    request->fua = fua;
@@ -417,6 +537,46 @@ errno_t virtio_blk_if_t::io(
    return errno_t::OK;
 }
 
+errno_t virtio_blk_if_t::submit_plan(disk_io_plan_t *plan)
+{
+    // Make every chain available, then notify the device once
+    per_queue_t &queue = per_queue[io_queue_index()];
+
+    for (uint32_t i = 0; i < plan->count; ++i) {
+        disk_vec_t const &item = plan->vec[i];
+
+        request_t *request = new (ext::nothrow) request_t;
+
+        if (unlikely(!request)) {
+            item.iocp->set_result({ errno_t::ENOMEM, 0 });
+            item.iocp->set_expect(1);
+            item.iocp->invoke();
+            continue;
+        }
+
+        storage_seg_t seg{
+            item.data, 0, size_t(item.count) << log2_sectorsize
+        };
+
+        request->segs = &seg;
+        request->seg_count = 1;
+        request->count = item.count;
+        request->header.lba = item.lba;
+        request->op = item.write
+                ? virtio_blk_op_t::write
+                : virtio_blk_op_t::read;
+        request->fua = item.fua;
+        request->caller_iocp = item.iocp;
+
+        int expect = queue.io(request, false);
+        item.iocp->set_expect(expect);
+    }
+
+    queue.req_queue->kick();
+
+    return errno_t::OK;
+}
+
 void virtio_blk_if_t::cleanup_if()
 {
 }
@@ -443,6 +603,20 @@ errno_t virtio_blk_if_t::write_async(void const *data, int64_t count,
               virtio_blk_op_t::write, iocp);
 }
 
+errno_t virtio_blk_if_t::readv_async(
+        storage_seg_t const *segs, size_t seg_count,
+        uint64_t lba, iocp_t *iocp)
+{
+    return segs_io(segs, seg_count, lba, false, virtio_blk_op_t::read, iocp);
+}
+
+errno_t virtio_blk_if_t::writev_async(
+        storage_seg_t const *segs, size_t seg_count,
+        uint64_t lba, bool fua, iocp_t *iocp)
+{
+    return segs_io(segs, seg_count, lba, fua, virtio_blk_op_t::write, iocp);
+}
+
 errno_t virtio_blk_if_t::flush_async(iocp_t *iocp)
 {
     return io(nullptr, 0, 0, false, virtio_blk_op_t::flush, iocp);
@@ -468,6 +642,10 @@ long virtio_blk_if_t::info(storage_dev_info_t key)
     case STORAGE_INFO_NAME:
         return long("virtio-blk");
 
+    case STORAGE_INFO_BLOCKCOUNT:
+        // Capacity is always in 512 byte units
+        return long(blk_config->capacity >> (log2_sectorsize - 9));
+
     default:
         return 0;
     }
@@ -1,11 +1,27 @@
 #include "dev_storage.h"
+#include "bcache.h"
+#include "blk_queue.h"
 
 #include "bitop.h"
+#include "bitsearch.h"
 #include "mm.h"
 #include "printk.h"
 #include "vector.h"
+#include "basic_set.h"
+#include "algorithm.h"
+#include "mutex.h"
+#include "pool.h"
+#include "string.h"
+#include "user_mem.h"
 #include "inttypes.h"
 
+#define DEBUG_EXT4 0
+#if DEBUG_EXT4
+#define EXT4_TRACE(...) printdbg("ext4: " __VA_ARGS__)
+#else
+#define EXT4_TRACE(...) ((void)0)
+#endif
+
 class ext4_fs_t final : public fs_base_t {
     FS_BASE_RW_IMPL
 
@@ -86,6 +102,7 @@ class ext4_fs_t final : public fs_base_t {
             HALF_MD4,
             TEA,
             LEGACY_UNSIGNED,
+            HALF_MD4_UNSIGNED,
             TEA_UNSIGNED
         };
 
@@ -185,112 +202,1466 @@ class ext4_fs_t final : public fs_base_t {
         le16 s_reserved_pad;
         le64 s_kbytes_written;
 
-        //
-        // Snapshot information
+        //
+        // Snapshot information
+
+        le32 s_snapshot_inum;
+        le32 s_snapshot_id;
+        le64 s_snapshot_r_blocks_count;
+        le32 s_snapshot_list;
+
+        //
+        // Error information
+
+        le32 s_error_count;
+
+        le32 s_first_error_time;
+        le32 s_first_error_ino;
+        le64 s_first_error_block;
+        u8 s_first_error_func[32];
+        le32 s_first_error_line;
+
+        le32 s_last_error_time;
+        le32 s_last_error_ino;
+        le32 s_last_error_line;
+        le64 s_last_error_block;
+        u8 s_last_error_func[32];
+
+        u8 s_mount_opts[64];
+        le32 s_usr_quota_inum;
+        le32 s_grp_quota_inum;
+        le32 s_overhead_blocks;
+        le32 s_reserved[108];
+        le32 s_checksum;
+    } _packed;
+
+    C_ASSERT(offsetof(superblock_t, s_default_mount_opts) == 0x100);
+    C_ASSERT(offsetof(superblock_t, s_snapshot_inum) == 0x180);
+    C_ASSERT(offsetof(superblock_t, s_snapshot_list) == 0x190);
+    C_ASSERT(offsetof(superblock_t, s_first_error_func) == 0x1A8);
+    C_ASSERT(offsetof(superblock_t, s_mount_opts) == 0x200);
+    C_ASSERT(sizeof(superblock_t) == 0x400);
+
+    friend constexpr bool enable_bitwise(superblock_t::state_t);
+    friend constexpr bool enable_bitwise(superblock_t::feature_compat_t);
+    friend constexpr bool enable_bitwise(superblock_t::feature_incompat_t);
+    friend constexpr bool enable_bitwise(superblock_t::feature_ro_compat_t);
+    friend constexpr bool enable_bitwise(superblock_t::mount_opts_t);
+    friend constexpr bool enable_bitwise(superblock_t::misc_flags_t);
+
+    struct group_desc_t {
+        le32 bg_block_bitmap_lo;
+        le32 bg_inode_bitmap_lo;
+        le32 bg_inode_table_lo;
+        le16 bg_free_blocks_count_lo;
+        le16 bg_free_inodes_count_lo;
+        le16 bg_used_dirs_count_lo;
+        le16 bg_flags;
+        le32 bg_exclude_bitmap_lo;
+        le16 bg_block_bitmap_csum_lo;
+        le16 bg_inode_bitmap_csum_lo;
+        le16 bg_itable_unused_lo;
+        le16 bg_checksum;
+
+        //
+        // Only present when the descriptor size is at least 64
+
+        le32 bg_block_bitmap_hi;
+        le32 bg_inode_bitmap_hi;
+        le32 bg_inode_table_hi;
+        le16 bg_free_blocks_count_hi;
+        le16 bg_free_inodes_count_hi;
+        le16 bg_used_dirs_count_hi;
+        le16 bg_itable_unused_hi;
+        le32 bg_exclude_bitmap_hi;
+        le16 bg_block_bitmap_csum_hi;
+        le16 bg_inode_bitmap_csum_hi;
+        le32 bg_reserved;
+    } _packed;
+
+    C_ASSERT(offsetof(group_desc_t, bg_block_bitmap_hi) == 0x20);
+    C_ASSERT(sizeof(group_desc_t) == 0x40);
+
+    enum inode_flags_t : le32 {
+        INDEX_FL        = 0x1000,
+        HUGE_FILE_FL    = 0x40000,
+        EXTENTS_FL      = 0x80000,
+        INLINE_DATA_FL  = 0x10000000
+    };
+
+    struct disk_inode_t {
+        le16 i_mode;
+        le16 i_uid;
+        le32 i_size_lo;
+        le32 i_atime;
+        le32 i_ctime;
+        le32 i_mtime;
+        le32 i_dtime;
+        le16 i_gid;
+        le16 i_links_count;
+        le32 i_blocks_lo;
+        le32 i_flags;
+        le32 l_i_version;
+        le32 i_block[15];
+        le32 i_generation;
+        le32 i_file_acl_lo;
+        le32 i_size_high;
+        le32 i_obso_faddr;
+        le16 l_i_blocks_high;
+        le16 l_i_file_acl_high;
+        le16 l_i_uid_high;
+        le16 l_i_gid_high;
+        le16 l_i_checksum_lo;
+        le16 l_i_reserved;
+    } _packed;
+
+    C_ASSERT(offsetof(disk_inode_t, i_block) == 0x28);
+    C_ASSERT(sizeof(disk_inode_t) == 0x80);
+
+    static constexpr uint16_t mode_type_mask = 0xF000;
+    static constexpr uint16_t mode_dir = 0x4000;
+    static constexpr uint16_t mode_link = 0xA000;
+
+    static constexpr uint32_t root_ino = 2;
+
+    struct extent_header_t {
+        le16 eh_magic;
+        le16 eh_entries;
+        le16 eh_max;
+        le16 eh_depth;
+        le32 eh_generation;
+    } _packed;
+
+    struct extent_idx_t {
+        le32 ei_block;
+        le32 ei_leaf_lo;
+        le16 ei_leaf_hi;
+        le16 ei_unused;
+    } _packed;
+
+    struct extent_leaf_t {
+        le32 ee_block;
+        le16 ee_len;
+        le16 ee_start_hi;
+        le32 ee_start_lo;
+    } _packed;
+
+    static constexpr le16 extent_magic = 0xF30A;
+
+    // Longer extents are unwritten, and are this much too long
+    static constexpr uint16_t extent_init_max = 32768;
+
+    static constexpr unsigned extent_max_depth = 5;
+
+    // The name, name_len bytes, not null terminated, follows the entry
+    struct dir_entry_t {
+        le32 inode;
+        le16 rec_len;
+        u8 name_len;
+        u8 file_type;
+    } _packed;
+
+    // Follows the . and .. entries in block 0 of an indexed directory
+    struct dx_root_info_t {
+        le32 reserved_zero;
+        u8 hash_version;
+        u8 info_length;
+        u8 indirect_levels;
+        u8 unused_flags;
+    } _packed;
+
+    // The count and limit overlay the hash of the first entry,
+    // which takes every hash below the second entry
+    struct dx_entry_t {
+        le32 hash;
+        le32 block;
+    } _packed;
+
+    struct dx_countlimit_t {
+        le16 limit;
+        le16 count;
+    } _packed;
+
+    static constexpr size_t dx_root_info_ofs = 0x18;
+
+    // Offset of the entries in an interior node, after a fake empty dirent
+    static constexpr size_t dx_node_entries_ofs = 8;
+
+    // Run of logical blocks that map to consecutive physical blocks,
+    // a zero block is a hole or an unwritten extent, which reads as zeros
+    struct extent_t {
+        uint32_t index;
+        uint32_t count;
+        uint64_t block;
+    };
+
+    // In memory copy of the parts of an inode needed to read it
+    struct inode_t {
+        uint32_t ino;
+        unsigned refcount;
+
+        // Inode cache clock when last acquired, oldest is evicted first
+        uint64_t last_use;
+
+        uint16_t mode;
+        uint16_t links;
+        uint32_t uid;
+        uint32_t gid;
+        uint32_t flags;
+        uint64_t size;
+
+        // 512 byte units
+        uint64_t blocks;
+
+        uint32_t atime;
+        uint32_t mtime;
+        uint32_t ctime;
+
+        le32 i_block[15];
+
+        // Sorted runs of the ranges of the file already looked up,
+        // each extent tree leaf is cached whole, holes included
+        ext::vector<extent_t> extents;
+    };
+
+    struct file_handle_t : public fs_file_info_t {
+        file_handle_t(ext4_fs_t *fs, inode_t *inode)
+            : fs(fs)
+            , inode(inode)
+        {
+        }
+
+        ino_t get_inode() const override
+        {
+            return inode->ino;
+        }
+
+        ext4_fs_t *fs;
+        inode_t *inode;
+    };
+
+    static pool_t<file_handle_t> handles;
+
+    bool mount(fs_init_info_t *conn);
+
+    //
+    // Internals
+
+    static int mm_fault_handler(void *dev, void *addr,
+                                uint64_t offset, uint64_t length,
+                                bool read, bool flush);
+    int mm_fault_handler(void *addr, uint64_t offset, uint64_t length,
+                         bool read, bool flush);
+
+    char *block_ptr(uint64_t block) const;
+
+    // Metadata is read through the block cache, returns a pointer to the
+    // block inside buf, which the caller releases
+    char const *meta_block(uint64_t block, bcache_buf_t *&buf, errno_t& err);
+
+    // First block of the inode table of group, zero on error
+    uint64_t group_inode_table(uint32_t group, errno_t& err);
+
+    // Get a referenced inode, from the cache if possible
+    inode_t *acquire_inode(uint32_t ino, errno_t& err);
+    void release_inode(inode_t *inode);
+
+    // Evict the least recently used unreferenced inodes over the limit,
+    // called with inode_lock held
+    void trim_inodes();
+
+    // Get the run holding logical block index, walking the extent tree
+    // (or the indirect block map) if it isn't cached
+    bool map_block(inode_t *inode, uint32_t index,
+                   extent_t& run, errno_t& err);
+
+    static bool lookup_cached_run(inode_t *inode, uint32_t index,
+                                  extent_t& run);
+
+    // Replace the cached runs overlapping the range of runs with runs
+    static void cache_runs(inode_t *inode,
+                           extent_t const *runs, size_t count);
+
+    // Called with inode_lock held
+    bool walk_extents(inode_t *inode, uint32_t index, errno_t& err);
+    bool walk_block_map(inode_t *inode, uint32_t index, errno_t& err);
+
+    // Block of a directory, nullptr with err OK for a hole
+    char *dir_block(inode_t *dir, uint32_t index, errno_t& err);
+
+    uint32_t entry_rec_len(dir_entry_t const *de) const;
+
+    // Position in a directory, remembers the block it was last in
+    struct dir_cursor_t {
+        uint64_t pos;
+        uint32_t index = ~0U;
+        char const *block = nullptr;
+    };
+
+    // Fill buf with the next entry in use and advance past it.
+    // Returns false with err OK at the end of the directory
+    bool next_dirent(inode_t *dir, dir_cursor_t& cur,
+                     dirent_t *buf, errno_t& err);
+
+    ssize_t getdents(fs_file_info_t *fi, void *buf,
+                     size_t size, off_t &offset) override final;
+
+    // Find name in one directory block, zero if it isn't there
+    uint32_t scan_dir_block(char const *block,
+                            char const *name, size_t len) const;
+
+    // Inode number of name in dir, zero with err OK if it doesn't exist
+    uint32_t dir_lookup(inode_t *dir, char const *name, size_t len,
+                        errno_t& err);
+
+    // Search an indexed directory, returns false if it can't be,
+    // then the caller scans it
+    bool dx_lookup(inode_t *dir, char const *name, size_t len,
+                   uint32_t& ino, errno_t& err);
+
+    template<typename C>
+    static uint32_t dx_hack_hash(char const *name, size_t len);
+
+    template<typename C>
+    static void str2hashbuf(char const *msg, size_t len,
+                            uint32_t *buf, int num);
+
+    static uint32_t half_md4_transform(uint32_t *buf, uint32_t const *in);
+    static void tea_transform(uint32_t *buf, uint32_t const *in);
+
+    uint32_t dx_hash(char const *name, size_t len, uint8_t version) const;
+
+    inode_t *lookup_path(fs_file_info_t *dirfi, char const *path,
+                         errno_t& err);
+
+    bool is_inline(inode_t const *inode) const;
+
+    ssize_t read_inode(inode_t *inode, char *buf,
+                       size_t size, off_t offset);
+
+    void fill_stat(inode_t const *inode, fs_stat_t *st) const;
+
+    storage_dev_base_t *drive;
+    uint64_t part_st;
+    uint64_t part_len;
+
+    uint8_t sector_shift = 9;
+    uint8_t log2_block_size = 10;
+    uint32_t block_size = 1024;
+
+    uint64_t blocks_count = 0;
+    uint64_t free_blocks = 0;
+    uint32_t inodes_count = 0;
+    uint32_t free_inodes = 0;
+    uint32_t inodes_per_group = 0;
+    uint32_t group_count = 0;
+    uint16_t inode_size = 128;
+    uint16_t desc_size = 32;
+    uint64_t gdt_block = 0;
+
+    // Size of the block cache reads, at least one sector
+    uint32_t meta_size = 1024;
+
+    uint32_t feature_compat = 0;
+    uint32_t feature_incompat = 0;
+
+    uint32_t hash_seed[4] = {};
+
+    // Added to the signed hash versions when the unsigned flag is set
+    uint8_t hash_unsigned = 0;
+
+    uint64_t fsid = 0;
+
+    char *mm_dev = nullptr;
+
+    using inode_lock_type = ext::mutex;
+    using inode_scoped_lock = ext::unique_lock<inode_lock_type>;
+
+    // Protects the inode cache, reference counts, and the extent caches
+    inode_lock_type inode_lock;
+    ext::map<uint32_t, inode_t*> inodes;
+    uint64_t inode_clock = 0;
+
+    static constexpr size_t inode_cache_max = 256;
+
+    // Inode table reads look this many blocks ahead
+    static constexpr uint32_t inode_readahead = 8;
+};
+
+class ext4_factory_t
+        : public fs_factory_t {
+public:
+    ext4_factory_t();
+    fs_base_t *mount(fs_init_info_t *conn) override;
+};
+
+static ext::vector<ext4_fs_t*> ext4_mounts;
+
+// ---------------------------------------------------------------------------
+// Internal implementation
+// ---------------------------------------------------------------------------
+
+int ext4_fs_t::mm_fault_handler(
+        void *dev, void *addr, uint64_t offset, uint64_t length,
+        bool read, bool flush)
+{
+    FS_DEV_PTR(ext4_fs_t, dev);
+    return self->mm_fault_handler(addr, offset, length, read, flush);
+}
+
+int ext4_fs_t::mm_fault_handler(
+        void *addr, uint64_t offset, uint64_t length, bool read, bool flush)
+{
+    uint64_t sector_offset = (offset >> sector_shift);
+    uint64_t lba = part_st + sector_offset;
+
+    if (likely(read)) {
+        EXT4_TRACE("demand paging LBA %" PRId64 " at addr %p\n", lba, addr);
+
+        return blk_read_blocks(drive, addr, length >> sector_shift, lba);
+    }
+
+    EXT4_TRACE("writing back LBA %" PRId64 " at addr %p\n", lba, addr);
+    int result = drive->write_blocks(addr, length >> sector_shift, lba, flush);
+
+    return result;
+}
+
+pool_t<ext4_fs_t::file_handle_t> ext4_fs_t::handles;
+
+char *ext4_fs_t::block_ptr(uint64_t block) const
+{
+    return mm_dev + (block << log2_block_size);
+}
+
+char const *ext4_fs_t::meta_block(uint64_t block, bcache_buf_t *&buf,
+                                  errno_t& err)
+{
+    uint64_t byte = block << log2_block_size;
+
+    // Blocks smaller than a sector share it
+    buf = bcache_read(drive, part_st + ((byte & -uint64_t(meta_size)) >>
+                                        sector_shift), meta_size, &err);
+
+    if (unlikely(!buf))
+        return nullptr;
+
+    return buf->data + (byte & (meta_size - 1));
+}
+
+uint64_t ext4_fs_t::group_inode_table(uint32_t group, errno_t& err)
+{
+    // Descriptor sizes are powers of two, one never crosses a block
+    uint64_t byte = uint64_t(group) * desc_size;
+
+    bcache_buf_t *buf;
+    group_desc_t const *desc = (group_desc_t const *)meta_block(
+                gdt_block + (byte >> log2_block_size), buf, err);
+
+    if (unlikely(!desc))
+        return 0;
+
+    desc = (group_desc_t const *)((char const *)desc +
+                                  (byte & (block_size - 1)));
+
+    uint64_t table = desc->bg_inode_table_lo;
+
+    if (desc_size >= sizeof(group_desc_t))
+        table |= uint64_t(desc->bg_inode_table_hi) << 32;
+
+    bcache_release(buf);
+
+    if (unlikely(table == 0))
+        err = errno_t::EIO;
+
+    return table;
+}
+
+ext4_fs_t::inode_t *ext4_fs_t::acquire_inode(uint32_t ino, errno_t& err)
+{
+    inode_scoped_lock lock(inode_lock);
+
+    auto it = inodes.find(ino);
+
+    if (it != inodes.end()) {
+        inode_t *inode = it->second;
+        ++inode->refcount;
+        inode->last_use = ++inode_clock;
+        return inode;
+    }
+
+    // A directory entry pointing outside the inode table is corrupt
+    if (unlikely(ino == 0 || ino > inodes_count)) {
+        err = errno_t::EIO;
+        return nullptr;
+    }
+
+    uint32_t group = (ino - 1) / inodes_per_group;
+    uint32_t slot = (ino - 1) % inodes_per_group;
+
+    uint64_t table = group_inode_table(group, err);
+
+    uint64_t table_blocks = ((uint64_t(inodes_per_group) * inode_size) +
+                             block_size - 1) >> log2_block_size;
+
+    if (unlikely(table == 0 || table + table_blocks > blocks_count)) {
+        printdbg("ext4: group %u inode table out of range\n", group);
+        err = errno_t::EIO;
+        return nullptr;
+    }
+
+    // Inode sizes are powers of two, one never crosses a block
+    uint64_t byte = uint64_t(slot) * inode_size;
+
+    bcache_buf_t *buf;
+    disk_inode_t const *di = (disk_inode_t const *)meta_block(
+                table + (byte >> log2_block_size), buf, err);
+
+    if (unlikely(!di))
+        return nullptr;
+
+    di = (disk_inode_t const *)((char const *)di +
+                                (byte & (block_size - 1)));
+
+    // Neighbouring inodes are usually wanted next, a directory listing
+    // stats them in order. Start reading the rest of the table after it
+    uint64_t read_st = ((table << log2_block_size) + byte) &
+            -uint64_t(meta_size);
+    uint64_t ahead = (((table + table_blocks) << log2_block_size) -
+                      read_st) / meta_size;
+
+    if (ahead > 1)
+        bcache_readahead(drive, part_st + ((read_st + meta_size) >>
+                                           sector_shift), meta_size,
+                         uint32_t(ext::min(ahead - 1,
+                                           uint64_t(inode_readahead))));
+
+    inode_t *inode = new (ext::nothrow) inode_t();
+
+    if (unlikely(!inode))
+        panic_oom();
+
+    inode->ino = ino;
+    inode->refcount = 1;
+    inode->last_use = ++inode_clock;
+    inode->mode = di->i_mode;
+    inode->links = di->i_links_count;
+    inode->uid = di->i_uid | (uint32_t(di->l_i_uid_high) << 16);
+    inode->gid = di->i_gid | (uint32_t(di->l_i_gid_high) << 16);
+    inode->flags = di->i_flags;
+    inode->size = di->i_size_lo | (uint64_t(di->i_size_high) << 32);
+    inode->blocks = di->i_blocks_lo | (uint64_t(di->l_i_blocks_high) << 32);
+    inode->atime = di->i_atime;
+    inode->mtime = di->i_mtime;
+    inode->ctime = di->i_ctime;
+    memcpy(inode->i_block, di->i_block, sizeof(inode->i_block));
+
+    // Huge files count in filesystem blocks
+    if (inode->flags & HUGE_FILE_FL)
+        inode->blocks <<= log2_block_size - 9;
+
+    bcache_release(buf);
+
+    if (unlikely(inodes.insert({ ino, inode }).first == inodes.end()))
+        panic_oom();
+
+    trim_inodes();
+
+    return inode;
+}
+
+void ext4_fs_t::release_inode(inode_t *inode)
+{
+    inode_scoped_lock lock(inode_lock);
+
+    assert(inode->refcount > 0);
+
+    if (--inode->refcount == 0 && inodes.size() > inode_cache_max)
+        trim_inodes();
+}
+
+void ext4_fs_t::trim_inodes()
+{
+    while (inodes.size() > inode_cache_max) {
+        inode_t *oldest = nullptr;
+
+        for (auto const& item : inodes) {
+            inode_t *inode = item.second;
+
+            if (inode->refcount == 0 &&
+                    (!oldest || inode->last_use < oldest->last_use))
+                oldest = inode;
+        }
+
+        // Everything is in use, let the cache grow
+        if (!oldest)
+            break;
+
+        inodes.erase(oldest->ino);
+        delete oldest;
+    }
+}
+
+bool ext4_fs_t::map_block(inode_t *inode, uint32_t index,
+                          extent_t& run, errno_t& err)
+{
+    // The data is in the inode, there are no blocks
+    if (unlikely(is_inline(inode))) {
+        err = errno_t::EOPNOTSUPP;
+        return false;
+    }
+
+    inode_scoped_lock lock(inode_lock);
+
+    if (lookup_cached_run(inode, index, run))
+        return true;
+
+    bool ok = (inode->flags & EXTENTS_FL)
+            ? walk_extents(inode, index, err)
+            : walk_block_map(inode, index, err);
+
+    if (unlikely(!ok))
+        return false;
+
+    if (unlikely(!lookup_cached_run(inode, index, run))) {
+        err = errno_t::EIO;
+        return false;
+    }
+
+    return true;
+}
+
+bool ext4_fs_t::lookup_cached_run(inode_t *inode, uint32_t index,
+                                  extent_t& run)
+{
+    // Binary search for the first run ending after index
+    extent_t const *st = inode->extents.data();
+    extent_t const *en = st + inode->extents.size();
+    extent_t const *it = ext::lower_bound(
+                st, en, index,
+                [](extent_t const& lhs, uint32_t rhs) {
+        return uint64_t(lhs.index) + lhs.count <= rhs;
+    });
+
+    if (it == en || it->index > index)
+        return false;
+
+    run = *it;
+
+    return true;
+}
+
+void ext4_fs_t::cache_runs(inode_t *inode,
+                           extent_t const *runs, size_t count)
+{
+    uint64_t st = runs[0].index;
+    uint64_t en = uint64_t(runs[count - 1].index) + runs[count - 1].count;
+
+    ext::vector<extent_t>& cached = inode->extents;
+    ext::vector<extent_t> merged;
+
+    if (unlikely(!merged.reserve(cached.size() + count)))
+        panic_oom();
+
+    size_t i = 0;
+
+    for (; i < cached.size() &&
+         uint64_t(cached[i].index) + cached[i].count <= st; ++i) {
+        if (unlikely(!merged.push_back(cached[i])))
+            panic_oom();
+    }
+
+    // Only a corrupt tree has leaves that overlap, the new leaf wins
+    while (i < cached.size() && cached[i].index < en)
+        ++i;
+
+    for (size_t r = 0; r < count; ++r) {
+        if (unlikely(!merged.push_back(runs[r])))
+            panic_oom();
+    }
+
+    for (; i < cached.size(); ++i) {
+        if (unlikely(!merged.push_back(cached[i])))
+            panic_oom();
+    }
+
+    cached.swap(merged);
+}
+
+bool ext4_fs_t::walk_extents(inode_t *inode, uint32_t index, errno_t& err)
+{
+    extent_header_t const *hdr = (extent_header_t const *)inode->i_block;
+    size_t node_size = sizeof(inode->i_block);
+
+    // Logical range covered by the node being visited
+    uint64_t lo = 0;
+    uint64_t hi = ~uint32_t(0);
+
+    // Holds the node below the inode
+    bcache_buf_t *node_buf = nullptr;
+
+    for (unsigned level = 0; ; ++level) {
+        if (unlikely(hdr->eh_magic != extent_magic ||
+                     level > extent_max_depth ||
+                     sizeof(*hdr) + size_t(hdr->eh_entries) *
+                     sizeof(extent_idx_t) > node_size)) {
+            printdbg("ext4: inode %u bad extent node\n", inode->ino);
+            bcache_release(node_buf);
+            err = errno_t::EIO;
+            return false;
+        }
+
+        if (hdr->eh_depth == 0)
+            break;
+
+        extent_idx_t const *idx = (extent_idx_t const *)(hdr + 1);
+        size_t count = hdr->eh_entries;
+
+        if (count == 0)
+            break;
+
+        // Last index starting at or before index,
+        // the first one also takes everything before it
+        size_t i = ext::lower_bound(
+                    idx + 1, idx + count, index,
+                    [](extent_idx_t const& lhs, uint32_t rhs) {
+            return lhs.ei_block <= rhs;
+        }) - idx - 1;
+
+        if (i > 0)
+            lo = idx[i].ei_block;
+
+        if (i + 1 < count)
+            hi = idx[i + 1].ei_block;
+
+        uint64_t block = idx[i].ei_leaf_lo |
+                (uint64_t(idx[i].ei_leaf_hi) << 32);
+
+        if (unlikely(block == 0 || block >= blocks_count || lo >= hi)) {
+            printdbg("ext4: inode %u bad extent index\n", inode->ino);
+            bcache_release(node_buf);
+            err = errno_t::EIO;
+            return false;
+        }
+
+        bcache_release(node_buf);
+
+        hdr = (extent_header_t const *)meta_block(block, node_buf, err);
+
+        if (unlikely(!hdr))
+            return false;
+
+        node_size = block_size;
+    }
+
+    // Turn the leaf into runs covering lo to hi, holes included
+    extent_leaf_t const *leaf = (extent_leaf_t const *)(hdr + 1);
+    size_t count = hdr->eh_depth == 0 ? hdr->eh_entries : 0;
+
+    ext::vector<extent_t> runs;
+
+    if (unlikely(!runs.reserve(count * 2 + 1)))
+        panic_oom();
+
+    uint64_t cursor = lo;
+
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t st = leaf[i].ee_block;
+        uint32_t len = leaf[i].ee_len;
+        uint64_t block = leaf[i].ee_start_lo |
+                (uint64_t(leaf[i].ee_start_hi) << 32);
+
+        if (len > extent_init_max) {
+            len -= extent_init_max;
+            block = 0;
+        }
+
+        if (unlikely(len == 0 || st < cursor || st + len > hi ||
+                     (block && (block + len > blocks_count)))) {
+            printdbg("ext4: inode %u bad extent\n", inode->ino);
+            bcache_release(node_buf);
+            err = errno_t::EIO;
+            return false;
+        }
+
+        if (st > cursor) {
+            if (unlikely(!runs.push_back({ uint32_t(cursor),
+                                           uint32_t(st - cursor), 0 })))
+                panic_oom();
+        }
+
+        if (unlikely(!runs.push_back({ uint32_t(st), len, block })))
+            panic_oom();
+
+        cursor = st + len;
+    }
+
+    bcache_release(node_buf);
+
+    if (cursor < hi) {
+        if (unlikely(!runs.push_back({ uint32_t(cursor),
+                                       uint32_t(hi - cursor), 0 })))
+            panic_oom();
+    }
+
+    if (!runs.empty())
+        cache_runs(inode, runs.data(), runs.size());
+
+    return true;
+}
+
+bool ext4_fs_t::walk_block_map(inode_t *inode, uint32_t index, errno_t& err)
+{
+    uint32_t per_block = block_size >> 2;
+
+    le32 const *table = inode->i_block;
+    size_t table_len = 12;
+    uint64_t rel = index;
+
+    // Holds the indirect block table points into
+    bcache_buf_t *table_buf = nullptr;
+
+    if (rel >= 12) {
+        rel -= 12;
+
+        // Find the single, double or triple indirect tree holding it
+        uint64_t span = per_block;
+        unsigned depth = 1;
+
+        while (rel >= span) {
+            rel -= span;
+            span *= per_block;
+
+            if (unlikely(++depth > 3)) {
+                err = errno_t::EIO;
+                return false;
+            }
+        }
+
+        uint64_t block = inode->i_block[11 + depth];
+
+        // span is how many blocks the current subtree maps,
+        // rel is the offset of index into it
+        for (; depth > 0; --depth) {
+            if (block == 0) {
+                // The whole rest of the subtree is a hole
+                bcache_release(table_buf);
+                uint64_t len = ext::min(span - rel,
+                                        uint64_t(~uint32_t(0) - index));
+                extent_t hole{ index, uint32_t(len), 0 };
+                cache_runs(inode, &hole, 1);
+                return true;
+            }
+
+            if (unlikely(block >= blocks_count)) {
+                printdbg("ext4: inode %u bad indirect block\n", inode->ino);
+                bcache_release(table_buf);
+                err = errno_t::EIO;
+                return false;
+            }
+
+            bcache_release(table_buf);
+
+            table = (le32 const *)meta_block(block, table_buf, err);
+
+            if (unlikely(!table))
+                return false;
+
+            table_len = per_block;
+            span /= per_block;
+
+            if (depth > 1) {
+                block = table[rel / span];
+                rel %= span;
+            }
+        }
+    }
+
+    // Extend the run along the table while the blocks are consecutive
+    uint64_t first = table[rel];
+    uint32_t count = 1;
+
+    while (rel + count < table_len &&
+           table[rel + count] == (first ? first + count : 0))
+        ++count;
+
+    bcache_release(table_buf);
+
+    if (unlikely(first && first + count > blocks_count)) {
+        printdbg("ext4: inode %u bad block\n", inode->ino);
+        err = errno_t::EIO;
+        return false;
+    }
+
+    extent_t run{ index, count, first };
+    cache_runs(inode, &run, 1);
+
+    return true;
+}
+
+char *ext4_fs_t::dir_block(inode_t *dir, uint32_t index, errno_t& err)
+{
+    extent_t run;
+
+    if (unlikely(!map_block(dir, index, run, err)))
+        return nullptr;
+
+    if (run.block == 0)
+        return nullptr;
+
+    return block_ptr(run.block + (index - run.index));
+}
+
+uint32_t ext4_fs_t::entry_rec_len(dir_entry_t const *de) const
+{
+    uint32_t len = de->rec_len;
+
+    // 64KB blocks can't encode a whole block in 16 bits
+    if (block_size >= 65536 && (len == 65535 || len == 0))
+        return block_size;
+
+    return len;
+}
+
+uint32_t ext4_fs_t::scan_dir_block(char const *block,
+                                   char const *name, size_t len) const
+{
+    for (uint32_t ofs = 0; ofs + sizeof(dir_entry_t) <= block_size; ) {
+        dir_entry_t const *de = (dir_entry_t const *)(block + ofs);
+
+        uint32_t rec_len = entry_rec_len(de);
+
+        // Stop at a corrupt entry, nothing after it can be trusted
+        if (unlikely(rec_len < sizeof(dir_entry_t) || (rec_len & 3) ||
+                     ofs + rec_len > block_size ||
+                     sizeof(dir_entry_t) + de->name_len > rec_len))
+            break;
+
+        if (de->inode && de->name_len == len &&
+                !memcmp((char const *)(de + 1), name, len))
+            return de->inode;
+
+        ofs += rec_len;
+    }
+
+    return 0;
+}
+
+uint32_t ext4_fs_t::dir_lookup(inode_t *dir, char const *name, size_t len,
+                               errno_t& err)
+{
+    uint32_t ino = 0;
+
+    if (dx_lookup(dir, name, len, ino, err))
+        return ino;
+
+    if (err != errno_t::OK)
+        return 0;
+
+    uint64_t block_count = (dir->size + block_size - 1) >> log2_block_size;
+
+    for (uint64_t index = 0; index < block_count; ++index) {
+        char const *block = dir_block(dir, uint32_t(index), err);
+
+        if (!block) {
+            if (err != errno_t::OK)
+                return 0;
+            continue;
+        }
+
+        ino = scan_dir_block(block, name, len);
+
+        if (ino)
+            return ino;
+    }
+
+    return 0;
+}
+
+bool ext4_fs_t::dx_lookup(inode_t *dir, char const *name, size_t len,
+                          uint32_t& ino, errno_t& err)
+{
+    if (!(dir->flags & INDEX_FL) ||
+            !(feature_compat &
+              uint32_t(superblock_t::feature_compat_t::DIR_INDEX)))
+        return false;
+
+    char *root = dir_block(dir, 0, err);
+
+    if (!root)
+        return false;
+
+    dx_root_info_t const *info = (dx_root_info_t const *)
+            (root + dx_root_info_ofs);
+
+    unsigned max_levels = (feature_incompat &
+            uint32_t(superblock_t::feature_incompat_t::LARGEDIR)) ? 3 : 2;
+
+    uint8_t version = info->hash_version;
+
+    if (version <= uint8_t(superblock_t::hash_version_t::TEA))
+        version += hash_unsigned;
+
+    // Anything unexpected, and the directory is scanned instead
+    if (info->reserved_zero != 0 ||
+            info->info_length != sizeof(dx_root_info_t) ||
+            info->indirect_levels >= max_levels ||
+            version > uint8_t(superblock_t::hash_version_t::TEA_UNSIGNED))
+        return false;
+
+    uint32_t hash = dx_hash(name, len, version);
+    unsigned levels = info->indirect_levels;
+
+    // The path down the tree, to continue into the next leaf
+    // when a run of colliding hashes crosses a leaf boundary
+    dx_entry_t const *path_entries[3];
+    unsigned path_count[3];
+    unsigned path_at[3];
+
+    dx_entry_t const *entries = (dx_entry_t const *)
+            (root + dx_root_info_ofs + info->info_length);
+    char const *node_end = root + block_size;
+
+    for (unsigned level = 0; ; ++level) {
+        dx_countlimit_t const *cl = (dx_countlimit_t const *)entries;
+
+        unsigned count = cl->count;
+
+        if (count == 0 || count > cl->limit ||
+                (char const *)(entries + cl->limit) > node_end)
+            return false;
+
+        // Last entry with a hash at or below, the first has no hash
+        unsigned at = ext::lower_bound(
+                    entries + 1, entries + count, hash,
+                    [](dx_entry_t const& lhs, uint32_t rhs) {
+            return lhs.hash <= rhs;
+        }) - entries - 1;
+
+        path_entries[level] = entries;
+        path_count[level] = count;
+        path_at[level] = at;
+
+        if (level == levels)
+            break;
+
+        char *node = dir_block(dir, entries[at].block & 0x0FFFFFFF, err);
+
+        if (!node)
+            return false;
+
+        entries = (dx_entry_t const *)(node + dx_node_entries_ofs);
+        node_end = node + block_size;
+    }
+
+    for (;;) {
+        dx_entry_t const& leaf_entry = path_entries[levels][path_at[levels]];
+
+        char const *leaf = dir_block(
+                    dir, leaf_entry.block & 0x0FFFFFFF, err);
+
+        if (!leaf)
+            return false;
+
+        ino = scan_dir_block(leaf, name, len);
+
+        if (ino)
+            return true;
+
+        // Find the deepest level with another entry to the right
+        int level = levels;
+
+        while (level >= 0 && path_at[level] + 1 >= path_count[level])
+            --level;
+
+        if (level < 0)
+            return true;
+
+        ++path_at[level];
+
+        // The next leaf continues the collision run only if it starts
+        // with the same hash, the low bit marks a continuation
+        if ((path_entries[level][path_at[level]].hash & ~1U) != hash)
+            return true;
+
+        // Go down the left edge to the next leaf
+        for (unsigned down = level + 1; down <= levels; ++down) {
+            dx_entry_t const& parent =
+                    path_entries[down - 1][path_at[down - 1]];
+
+            char *node = dir_block(dir, parent.block & 0x0FFFFFFF, err);
+
+            if (!node)
+                return false;
+
+            entries = (dx_entry_t const *)(node + dx_node_entries_ofs);
+
+            dx_countlimit_t const *cl = (dx_countlimit_t const *)entries;
+
+            if (cl->count == 0 || cl->count > cl->limit ||
+                    (char const *)(entries + cl->limit) > node + block_size)
+                return false;
+
+            path_entries[down] = entries;
+            path_count[down] = cl->count;
+            path_at[down] = 0;
+        }
+    }
+}
+
+template<typename C>
+uint32_t ext4_fs_t::dx_hack_hash(char const *name, size_t len)
+{
+    uint32_t hash;
+    uint32_t hash0 = 0x12a3fe2d;
+    uint32_t hash1 = 0x37abe8f9;
+
+    C const *p = (C const *)name;
+
+    while (len--) {
+        hash = hash1 + (hash0 ^ uint32_t(int(*p++) * 7152373));
+
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+template<typename C>
+void ext4_fs_t::str2hashbuf(char const *msg, size_t len,
+                            uint32_t *buf, int num)
+{
+    C const *p = (C const *)msg;
+
+    uint32_t pad = uint32_t(len) | (uint32_t(len) << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+
+    if (len > size_t(num) * 4)
+        len = num * 4;
+
+    for (size_t i = 0; i < len; ++i) {
+        val = int(p[i]) + (val << 8);
+
+        if ((i & 3) == 3) {
+            *buf++ = val;
+            val = pad;
+            --num;
+        }
+    }
+
+    if (--num >= 0)
+        *buf++ = val;
+
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+uint32_t ext4_fs_t::half_md4_transform(uint32_t *buf, uint32_t const *in)
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    auto F = [](uint32_t x, uint32_t y, uint32_t z) {
+        return z ^ (x & (y ^ z));
+    };
+
+    auto G = [](uint32_t x, uint32_t y, uint32_t z) {
+        return (x & y) + ((x ^ y) & z);
+    };
+
+    auto H = [](uint32_t x, uint32_t y, uint32_t z) {
+        return x ^ y ^ z;
+    };
+
+    auto rol = [](uint32_t x, int s) {
+        return (x << s) | (x >> (32 - s));
+    };
+
+    constexpr uint32_t K2 = 013240474631U;
+    constexpr uint32_t K3 = 015666365641U;
+
+    a = rol(a + F(b, c, d) + in[0], 3);
+    d = rol(d + F(a, b, c) + in[1], 7);
+    c = rol(c + F(d, a, b) + in[2], 11);
+    b = rol(b + F(c, d, a) + in[3], 19);
+    a = rol(a + F(b, c, d) + in[4], 3);
+    d = rol(d + F(a, b, c) + in[5], 7);
+    c = rol(c + F(d, a, b) + in[6], 11);
+    b = rol(b + F(c, d, a) + in[7], 19);
+
+    a = rol(a + G(b, c, d) + in[1] + K2, 3);
+    d = rol(d + G(a, b, c) + in[3] + K2, 5);
+    c = rol(c + G(d, a, b) + in[5] + K2, 9);
+    b = rol(b + G(c, d, a) + in[7] + K2, 13);
+    a = rol(a + G(b, c, d) + in[0] + K2, 3);
+    d = rol(d + G(a, b, c) + in[2] + K2, 5);
+    c = rol(c + G(d, a, b) + in[4] + K2, 9);
+    b = rol(b + G(c, d, a) + in[6] + K2, 13);
+
+    a = rol(a + H(b, c, d) + in[3] + K3, 3);
+    d = rol(d + H(a, b, c) + in[7] + K3, 9);
+    c = rol(c + H(d, a, b) + in[2] + K3, 11);
+    b = rol(b + H(c, d, a) + in[6] + K3, 15);
+    a = rol(a + H(b, c, d) + in[1] + K3, 3);
+    d = rol(d + H(a, b, c) + in[5] + K3, 9);
+    c = rol(c + H(d, a, b) + in[0] + K3, 11);
+    b = rol(b + H(c, d, a) + in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+
+    return buf[1];
+}
+
+void ext4_fs_t::tea_transform(uint32_t *buf, uint32_t const *in)
+{
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+    for (int n = 0; n < 16; ++n) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+uint32_t ext4_fs_t::dx_hash(char const *name, size_t len,
+                            uint8_t version) const
+{
+    uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint32_t in[8];
+    uint32_t hash = 0;
+
+    // An all zero seed means the default one
+    if (hash_seed[0] | hash_seed[1] | hash_seed[2] | hash_seed[3])
+        memcpy(buf, hash_seed, sizeof(buf));
+
+    using hash_version_t = superblock_t::hash_version_t;
+
+    switch (hash_version_t(version)) {
+    case hash_version_t::LEGACY:
+        hash = dx_hack_hash<signed char>(name, len);
+        break;
+
+    case hash_version_t::LEGACY_UNSIGNED:
+        hash = dx_hack_hash<unsigned char>(name, len);
+        break;
+
+    case hash_version_t::HALF_MD4:
+    case hash_version_t::HALF_MD4_UNSIGNED:
+        for (size_t ofs = 0; ofs < len; ofs += 32) {
+            if (hash_version_t(version) == hash_version_t::HALF_MD4)
+                str2hashbuf<signed char>(name + ofs, len - ofs, in, 8);
+            else
+                str2hashbuf<unsigned char>(name + ofs, len - ofs, in, 8);
+
+            half_md4_transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+
+    case hash_version_t::TEA:
+    case hash_version_t::TEA_UNSIGNED:
+        for (size_t ofs = 0; ofs < len; ofs += 16) {
+            if (hash_version_t(version) == hash_version_t::TEA)
+                str2hashbuf<signed char>(name + ofs, len - ofs, in, 4);
+            else
+                str2hashbuf<unsigned char>(name + ofs, len - ofs, in, 4);
+
+            tea_transform(buf, in);
+        }
+        hash = buf[0];
+        break;
+
+    }
+
+    hash &= ~1U;
+
+    // The end of directory marker can't be a hash
+    if (hash == (0x7FFFFFFFU << 1))
+        hash = (0x7FFFFFFFU - 1) << 1;
+
+    return hash;
+}
+
+ext4_fs_t::inode_t *ext4_fs_t::lookup_path(
+        fs_file_info_t *dirfi, char const *path, errno_t& err)
+{
+    uint32_t ino = root_ino;
+
+    if (path[0] != '/' && dirfi)
+        ino = static_cast<file_handle_t*>(dirfi)->inode->ino;
+
+    inode_t *inode = acquire_inode(ino, err);
+
+    if (unlikely(!inode))
+        return nullptr;
+
+    char const *it = path;
+
+    for (;;) {
+        while (*it == '/')
+            ++it;
+
+        if (!*it)
+            return inode;
+
+        char const *end = it;
+
+        while (*end && *end != '/')
+            ++end;
+
+        size_t len = end - it;
+
+        if (unlikely((inode->mode & mode_type_mask) != mode_dir)) {
+            err = errno_t::ENOTDIR;
+            release_inode(inode);
+            return nullptr;
+        }
+
+        if (unlikely(len > NAME_MAX)) {
+            err = errno_t::ENAMETOOLONG;
+            release_inode(inode);
+            return nullptr;
+        }
+
+        err = errno_t::OK;
+        uint32_t next = dir_lookup(inode, it, len, err);
+
+        release_inode(inode);
+
+        if (!next) {
+            if (err == errno_t::OK)
+                err = errno_t::ENOENT;
+            return nullptr;
+        }
 
-        le32 s_snapshot_inum;
-        le32 s_snapshot_id;
-        le64 s_snapshot_r_blocks_count;
-        le32 s_snapshot_list;
+        inode = acquire_inode(next, err);
 
-        //
-        // Error information
+        if (unlikely(!inode))
+            return nullptr;
 
-        le32 s_error_count;
+        it = end;
+    }
+}
 
-        le32 s_first_error_time;
-        le32 s_first_error_ino;
-        le64 s_first_error_block;
-        u8 s_first_error_func[32];
-        le32 s_first_error_line;
+bool ext4_fs_t::is_inline(inode_t const *inode) const
+{
+    if (inode->flags & INLINE_DATA_FL)
+        return true;
 
-        le32 s_last_error_time;
-        le32 s_last_error_ino;
-        le32 s_last_error_line;
-        le64 s_last_error_block;
-        u8 s_last_error_func[32];
+    // Short symlink targets are kept in the block map
+    return (inode->mode & mode_type_mask) == mode_link &&
+            !(inode->flags & EXTENTS_FL) &&
+            inode->size < sizeof(inode->i_block);
+}
 
-        u8 s_mount_opts[64];
-        le32 s_usr_quota_inum;
-        le32 s_grp_quota_inum;
-        le32 s_overhead_blocks;
-        le32 s_reserved[108];
-        le32 s_checksum;
-    } _packed;
+ssize_t ext4_fs_t::read_inode(inode_t *inode, char *buf,
+                              size_t size, off_t offset)
+{
+    if (unlikely(offset < 0))
+        return -int(errno_t::EINVAL);
 
-    C_ASSERT(offsetof(superblock_t, s_default_mount_opts) == 0x100);
-    C_ASSERT(offsetof(superblock_t, s_snapshot_inum) == 0x180);
-    C_ASSERT(offsetof(superblock_t, s_snapshot_list) == 0x190);
-    C_ASSERT(offsetof(superblock_t, s_first_error_func) == 0x1A8);
-    C_ASSERT(offsetof(superblock_t, s_mount_opts) == 0x200);
-    C_ASSERT(sizeof(superblock_t) == 0x400);
+    if (uint64_t(offset) >= inode->size)
+        return 0;
 
-    friend constexpr bool enable_bitwise(superblock_t::state_t);
-    friend constexpr bool enable_bitwise(superblock_t::feature_compat_t);
-    friend constexpr bool enable_bitwise(superblock_t::feature_incompat_t);
-    friend constexpr bool enable_bitwise(superblock_t::feature_ro_compat_t);
-    friend constexpr bool enable_bitwise(superblock_t::mount_opts_t);
-    friend constexpr bool enable_bitwise(superblock_t::misc_flags_t);
+    if (size > inode->size - offset)
+        size = inode->size - offset;
 
-    bool mount(fs_init_info_t *conn);
+    if (is_inline(inode)) {
+        // The rest of longer inline data is in an extended attribute
+        if (unlikely(offset + size > sizeof(inode->i_block)))
+            return -int(errno_t::EOPNOTSUPP);
 
-    //
-    // Internals
+        char const *data = (char const *)inode->i_block + offset;
 
-    static int mm_fault_handler(void *dev, void *addr,
-                                uint64_t offset, uint64_t length,
-                                bool read, bool flush);
-    int mm_fault_handler(void *addr, uint64_t offset, uint64_t length,
-                         bool read, bool flush);
+        if (mm_is_user_range(buf, size)) {
+            if (unlikely(!mm_copy_user(buf, data, size)))
+                return -int(errno_t::EFAULT);
+        } else {
+            memcpy(buf, data, size);
+        }
 
-    storage_dev_base_t *drive;
-    uint64_t part_st;
-    uint64_t part_len;
+        return size;
+    }
 
-    static constexpr uint8_t sector_shift = 9;
-    static constexpr uint8_t block_shift = 3;
-    static constexpr uint32_t sector_size = 1U << (sector_shift);
-    static constexpr uint32_t block_size = sector_size << block_shift;
+    size_t done = 0;
 
-    char *mm_dev;
-};
+    // Each pass moves as much as the run holding the offset allows,
+    // the device mapping of the run is contiguous too
+    while (done < size) {
+        uint64_t pos = offset + done;
 
-class ext4_factory_t
-        : public fs_factory_t {
-    ext4_factory_t();
-    fs_base_t *mount(fs_init_info_t *conn) override;
-};
+        extent_t run;
+        errno_t err = errno_t::OK;
 
-static ext::vector<ext4_fs_t*> ext4_mounts;
+        if (unlikely(!map_block(inode, uint32_t(pos >> log2_block_size),
+                                run, err))) {
+            if (done)
+                break;
+            return -int(err);
+        }
 
-// ---------------------------------------------------------------------------
-// Internal implementation
-// ---------------------------------------------------------------------------
+        uint64_t run_st = uint64_t(run.index) << log2_block_size;
+        uint64_t run_en = run_st + (uint64_t(run.count) << log2_block_size);
 
-int ext4_fs_t::mm_fault_handler(
-        void *dev, void *addr, uint64_t offset, uint64_t length,
-        bool read, bool flush)
-{
-    FS_DEV_PTR(ext4_fs_t, dev);
-    return self->mm_fault_handler(addr, offset, length, read, flush);
-}
+        size_t avail = size - done;
 
-int ext4_fs_t::mm_fault_handler(
-        void *addr, uint64_t offset, uint64_t length, bool read, bool flush)
-{
-    uint64_t sector_offset = (offset >> sector_shift);
-    uint64_t lba = part_st + sector_offset;
+        if (avail > run_en - pos)
+            avail = run_en - pos;
 
-    if (likely(read)) {
-        printdbg("Demand paging LBA %" PRId64 " at addr %p\n", lba, addr);
+        char *io = buf + done;
+
+        // Holes and unwritten extents read as zeros
+        char const *disk_data = run.block
+                ? block_ptr(run.block) + (pos - run_st)
+                : nullptr;
 
-        return drive->read_blocks(addr, length >> sector_shift, lba);
+        // Issue one large read for the range instead of a fault per page
+        if (disk_data && avail > block_size)
+            madvise((void*)disk_data, avail, MADV_WILLNEED);
+
+        if (mm_is_user_range(io, avail)) {
+            if (unlikely(!mm_copy_user(io, disk_data, avail)))
+                return done ? ssize_t(done) : -int(errno_t::EFAULT);
+        } else if (disk_data) {
+            memcpy(io, disk_data, avail);
+        } else {
+            memset(io, 0, avail);
+        }
+
+        done += avail;
     }
 
-    printdbg("Writing back LBA %" PRId64 " at addr %p\n", lba, addr);
-    int result = drive->write_blocks(addr, length >> sector_shift, lba, flush);
+    return done;
+}
 
-    return result;
+void ext4_fs_t::fill_stat(inode_t const *inode, fs_stat_t *st) const
+{
+    memset(st, 0, sizeof(*st));
+
+    st->st_ino = inode->ino;
+    st->st_mode = inode->mode;
+    st->st_nlink = inode->links;
+    st->st_uid = inode->uid;
+    st->st_gid = inode->gid;
+    st->st_size = inode->size;
+    st->st_blksize = block_size;
+    st->st_blocks = inode->blocks;
+    st->st_atime = inode->atime;
+    st->st_mtime = inode->mtime;
+    st->st_ctime = inode->ctime;
 }
 
 // ---------------------------------------------------------------------------
@@ -308,7 +1679,16 @@ ext4_factory_t::ext4_factory_t()
 
 fs_base_t *ext4_factory_t::mount(fs_init_info_t *conn)
 {
+    if (ext4_mounts.empty()) {
+        if (unlikely(!ext4_fs_t::handles.create(512)))
+            return nullptr;
+    }
+
     ext::unique_ptr<ext4_fs_t> self(new (ext::nothrow) ext4_fs_t);
+
+    if (unlikely(!self))
+        panic_oom();
+
     if (self->mount(conn)) {
         if (unlikely(!ext4_mounts.push_back(self))) {
             panic_oom();
@@ -322,18 +1702,137 @@ fs_base_t *ext4_factory_t::mount(fs_init_info_t *conn)
 
 bool ext4_fs_t::mount(fs_init_info_t *conn)
 {
+    using feature_incompat_t = superblock_t::feature_incompat_t;
+    using misc_flags_t = superblock_t::misc_flags_t;
+
     drive = conn->drive;
     part_st = conn->part_st;
     part_len = conn->part_len;
 
+    // The superblock is 1KB into the partition
+    uint32_t drive_sector_size = drive->info(STORAGE_INFO_BLOCKSIZE);
+    uint32_t sb_size = ext::max(drive_sector_size, 1024U);
+
+    sector_shift = bit_log2(drive_sector_size);
+
+    bcache_buf_t *sb_buf = bcache_read(
+                drive, part_st + 1024 / drive_sector_size, sb_size);
+
+    if (!sb_buf)
+        return false;
+
+    superblock_t const *sb = (superblock_t const *)
+            (sb_buf->data + (1024 & (sb_size - 1)));
+
+    bool valid = sb->s_magic == magic && sb->s_log_block_size <= 6 &&
+            sb->s_inodes_per_group != 0 && sb->s_blocks_per_group != 0;
+
+    if (valid) {
+        feature_compat = uint32_t(sb->s_feature_compat);
+        feature_incompat = uint32_t(sb->s_feature_incompat);
+
+        bool is64 = feature_incompat & uint32_t(feature_incompat_t::IS64BIT);
+
+        log2_block_size = 10 + sb->s_log_block_size;
+        block_size = 1U << log2_block_size;
+        meta_size = ext::max(block_size, drive_sector_size);
+
+        blocks_count = sb->s_blocks_count_lo |
+                (is64 ? uint64_t(sb->s_blocks_count_hi) << 32 : 0);
+        free_blocks = sb->s_free_blocks_count_lo |
+                (is64 ? uint64_t(sb->s_free_blocks_count_hi) << 32 : 0);
+        inodes_count = sb->s_inodes_count;
+        free_inodes = sb->s_free_inodes_count;
+        inodes_per_group = sb->s_inodes_per_group;
+
+        group_count = (blocks_count - sb->s_first_data_block +
+                       sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
+
+        inode_size = sb->s_rev_level == superblock_t::rev_level_t::ORIGINAL
+                ? 128
+                : sb->s_inode_size;
+
+        desc_size = is64 ? sb->s_desc_size : 32;
+
+        // The descriptor table follows the superblock's block
+        gdt_block = sb->s_first_data_block + 1;
+
+        memcpy(hash_seed, sb->s_hash_seed, sizeof(hash_seed));
+
+        if (uint32_t(sb->s_flags) & uint32_t(misc_flags_t::UNSIGNED_DIR_HASH))
+            hash_unsigned = uint8_t(superblock_t::hash_version_t::
+                                    LEGACY_UNSIGNED);
+
+        memcpy(&fsid, sb->s_uuid, sizeof(fsid));
+    }
+
+    bcache_release(sb_buf);
+
+    if (!valid) {
+        printdbg("ext4: bad superblock\n");
+        return false;
+    }
+
+    // Features that change how data is found, and aren't handled
+    uint32_t unsupported = feature_incompat & (
+                uint32_t(feature_incompat_t::COMPRESSION) |
+                uint32_t(feature_incompat_t::JOURNAL_DEV) |
+                uint32_t(feature_incompat_t::META_BG) |
+                uint32_t(feature_incompat_t::DIRDATA));
+
+    if (unsupported) {
+        printdbg("ext4: unsupported incompatible features 0x%x\n",
+                 unsupported);
+        return false;
+    }
+
+    if (feature_incompat & uint32_t(feature_incompat_t::RECOVER))
+        printdbg("ext4: journal needs recovery, reading anyway\n");
+
+    if (inode_size < sizeof(disk_inode_t) || inode_size > block_size ||
+            (inode_size & (inode_size - 1)) ||
+            desc_size < 32 || desc_size > block_size ||
+            (desc_size & (desc_size - 1)) ||
+            uint64_t(group_count) * inodes_per_group < inodes_count ||
+            gdt_block + ((uint64_t(group_count) * desc_size + block_size - 1)
+                         >> log2_block_size) > blocks_count) {
+        printdbg("ext4: inconsistent superblock\n");
+        return false;
+    }
+
+    // Data is reached through the mapping and metadata through the block
+    // cache, don't let a block number outside the partition reach
+    // into some other partition
+    if (blocks_count << log2_block_size > part_len << sector_shift) {
+        printdbg("ext4: filesystem is larger than the partition\n");
+        return false;
+    }
+
     mm_dev = (char*)mmap_register_device(
-                this, block_size, conn->part_len,
-                PROT_READ | PROT_WRITE, &ext4_fs_t::mm_fault_handler);
+                this, drive_sector_size, part_len,
+                PROT_READ, &ext4_fs_t::mm_fault_handler);
 
     if (!mm_dev)
         return false;
 
-    return false;
+    errno_t err = errno_t::OK;
+    inode_t *root = acquire_inode(root_ino, err);
+
+    bool root_ok = root && (root->mode & mode_type_mask) == mode_dir;
+
+    if (root)
+        release_inode(root);
+
+    if (!root_ok) {
+        printdbg("ext4: root directory is not valid\n");
+        unmount();
+        return false;
+    }
+
+    printdbg("ext4: mounted, %u byte blocks, %" PRIu64 " blocks,"
+             " %u groups\n", block_size, blocks_count, group_count);
+
+    return true;
 }
 
 char const *ext4_fs_t::name() const noexcept
@@ -343,6 +1842,21 @@ char const *ext4_fs_t::name() const noexcept
 
 void ext4_fs_t::unmount()
 {
+    inode_scoped_lock lock(inode_lock);
+
+    for (auto& item : inodes)
+        delete item.second;
+    inodes.clear();
+
+    lock.unlock();
+
+    if (mm_dev) {
+        munmap(mm_dev, part_len << sector_shift);
+        mm_dev = nullptr;
+    }
+
+    // Read only, nothing is dirty, this only drops the cached metadata
+    bcache_invalidate(drive);
 }
 
 bool ext4_fs_t::is_boot() const
@@ -362,28 +1876,53 @@ int ext4_fs_t::resolve(fs_file_info_t *dirfi, fs_cpath_t path,
 int ext4_fs_t::getattrat(fs_file_info_t *dirfi, fs_cpath_t path,
                          fs_stat_t* stbuf)
 {
-    (void)dirfi;
-    (void)path;
-    (void)stbuf;
-    return -int(errno_t::ENOSYS);
+    errno_t err = errno_t::OK;
+    inode_t *inode = lookup_path(dirfi, path, err);
+
+    if (unlikely(!inode))
+        return -int(err);
+
+    fill_stat(inode, stbuf);
+
+    release_inode(inode);
+
+    return 0;
 }
 
 int ext4_fs_t::accessat(fs_file_info_t *dirfi, fs_cpath_t path,
                         int mask)
 {
-    (void)dirfi;
-    (void)path;
-    (void)mask;
-    return -int(errno_t::ENOSYS);
+    errno_t err = errno_t::OK;
+    inode_t *inode = lookup_path(dirfi, path, err);
+
+    if (unlikely(!inode))
+        return -int(err);
+
+    release_inode(inode);
+
+    if (mask & W_OK)
+        return -int(errno_t::EROFS);
+
+    return 0;
 }
 
 int ext4_fs_t::readlinkat(fs_file_info_t *dirfi, fs_cpath_t path,
                           char* buf, size_t size)
 {
-    (void)path;
-    (void)buf;
-    (void)size;
-    return -int(errno_t::ENOSYS);
+    errno_t err = errno_t::OK;
+    inode_t *inode = lookup_path(dirfi, path, err);
+
+    if (unlikely(!inode))
+        return -int(err);
+
+    ssize_t result = -int(errno_t::EINVAL);
+
+    if ((inode->mode & mode_type_mask) == mode_link)
+        result = read_inode(inode, buf, size, 0);
+
+    release_inode(inode);
+
+    return int(result);
 }
 
 //
@@ -392,25 +1931,163 @@ int ext4_fs_t::readlinkat(fs_file_info_t *dirfi, fs_cpath_t path,
 int ext4_fs_t::opendirat(fs_file_info_t **fi,
                          fs_file_info_t *dirfi, fs_cpath_t path)
 {
-    (void)dirfi;
-    (void)path;
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    errno_t err = errno_t::OK;
+    inode_t *inode = lookup_path(dirfi, path, err);
+
+    if (unlikely(!inode))
+        return -int(err);
+
+    if (unlikely((inode->mode & mode_type_mask) != mode_dir)) {
+        release_inode(inode);
+        return -int(errno_t::ENOTDIR);
+    }
+
+    file_handle_t *dir = handles.alloc(this, inode);
+
+    if (unlikely(!dir)) {
+        release_inode(inode);
+        return -int(errno_t::EMFILE);
+    }
+
+    *fi = dir;
+
+    return 0;
+}
+
+bool ext4_fs_t::next_dirent(inode_t *dir, dir_cursor_t& cur,
+                            dirent_t *buf, errno_t& err)
+{
+    // ext4 file types, to dirent d_type
+    static constexpr uint8_t const dirent_types[] = {
+        0, 8, 4, 2, 6, 1, 12, 10
+    };
+
+    bool has_type = feature_incompat &
+            uint32_t(superblock_t::feature_incompat_t::FILETYPE);
+
+    // Skip deleted entries, the position advances past them too
+    while (cur.pos < dir->size) {
+        uint32_t index = uint32_t(cur.pos >> log2_block_size);
+        uint32_t ofs = cur.pos & (block_size - 1);
+
+        if (index != cur.index) {
+            cur.block = dir_block(dir, index, err);
+            cur.index = index;
+
+            if (unlikely(err != errno_t::OK))
+                return false;
+        }
+
+        if (!cur.block) {
+            cur.pos = uint64_t(index + 1) << log2_block_size;
+            continue;
+        }
+
+        dir_entry_t const *de = (dir_entry_t const *)(cur.block + ofs);
+
+        if (unlikely(ofs + sizeof(dir_entry_t) > block_size)) {
+            err = errno_t::EIO;
+            return false;
+        }
+
+        uint32_t rec_len = entry_rec_len(de);
+
+        if (unlikely(rec_len < sizeof(dir_entry_t) || (rec_len & 3) ||
+                     ofs + rec_len > block_size ||
+                     sizeof(dir_entry_t) + de->name_len > rec_len)) {
+            err = errno_t::EIO;
+            return false;
+        }
+
+        cur.pos += rec_len;
+
+        if (!de->inode)
+            continue;
+
+        buf->d_ino = de->inode;
+        buf->d_off = cur.pos;
+        buf->d_reclen = sizeof(*buf);
+        buf->d_type = has_type && de->file_type < countof(dirent_types)
+                ? dirent_types[de->file_type]
+                : 0;
+        memcpy(buf->d_name, (char const *)(de + 1), de->name_len);
+        buf->d_name[de->name_len] = 0;
+
+        return true;
+    }
+
+    return false;
 }
 
 ssize_t ext4_fs_t::readdir(fs_file_info_t *fi,
                            dirent_t *buf, off_t offset)
 {
-    (void)buf;
-    (void)offset;
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    file_handle_t *dir = (file_handle_t*)fi;
+
+    if (unlikely(offset < 0))
+        return -int(errno_t::EINVAL);
+
+    dir_cursor_t cur{ uint64_t(offset) };
+    errno_t err = errno_t::OK;
+
+    if (!next_dirent(dir->inode, cur, buf, err))
+        return -int(err);
+
+    return cur.pos - offset;
+}
+
+// Walk the directory once, each block is looked up once
+ssize_t ext4_fs_t::getdents(fs_file_info_t *fi, void *buf,
+                            size_t size, off_t &offset)
+{
+    file_handle_t *dir = (file_handle_t*)fi;
+
+    if (unlikely(offset < 0))
+        return -int(errno_t::EINVAL);
+
+    char *out = (char*)buf;
+    size_t used = 0;
+    dirent_t ent;
+
+    dir_cursor_t cur{ uint64_t(offset) };
+    errno_t err = errno_t::OK;
+
+    while (next_dirent(dir->inode, cur, &ent, err)) {
+        ssize_t stored = fs_dirent_pack(out + used, size - used,
+                                        &ent, cur.pos);
+
+        if (unlikely(stored < 0))
+            return stored;
+
+        if (!stored) {
+            if (unlikely(!used))
+                return -int(errno_t::EINVAL);
+
+            return used;
+        }
+
+        used += stored;
+        offset = cur.pos;
+    }
+
+    if (unlikely(err != errno_t::OK && !used))
+        return -int(err);
+
+    // Skip trailing deleted entries only at the end
+    if (err == errno_t::OK)
+        offset = cur.pos;
+
+    return used;
 }
 
 int ext4_fs_t::releasedir(fs_file_info_t *fi)
 {
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    file_handle_t *dir = (file_handle_t*)fi;
+
+    release_inode(dir->inode);
+    handles.free(dir);
+
+    return 0;
 }
 
 
@@ -510,19 +2187,38 @@ int ext4_fs_t::utimensat(fs_file_info_t *dirfi, fs_cpath_t path,
 
 int ext4_fs_t::openat(fs_file_info_t **fi,
                       fs_file_info_t *dirfi, fs_cpath_t path,
-                      int flags, mode_t mode)
+                      int flags, mode_t)
 {
-    (void)fi;
-    (void)path;
-    (void)flags;
-    (void)mode;
-    return -int(errno_t::ENOSYS);
+    // Read only
+    if (unlikely(flags & (O_CREAT | O_TRUNC | O_WRONLY)))
+        return -int(errno_t::EROFS);
+
+    errno_t err = errno_t::OK;
+    inode_t *inode = lookup_path(dirfi, path, err);
+
+    if (unlikely(!inode))
+        return -int(err);
+
+    file_handle_t *file = handles.alloc(this, inode);
+
+    if (unlikely(!file)) {
+        release_inode(inode);
+        return -int(errno_t::EMFILE);
+    }
+
+    *fi = file;
+
+    return 0;
 }
 
 int ext4_fs_t::release(fs_file_info_t *fi)
 {
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    file_handle_t *file = (file_handle_t*)fi;
+
+    release_inode(file->inode);
+    handles.free(file);
+
+    return 0;
 }
 
 
@@ -532,11 +2228,12 @@ int ext4_fs_t::release(fs_file_info_t *fi)
 ssize_t ext4_fs_t::read(fs_file_info_t *fi, char *buf,
                                 size_t size, off_t offset)
 {
-    (void)buf;
-    (void)size;
-    (void)offset;
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    file_handle_t *file = (file_handle_t*)fi;
+
+    if (unlikely((file->inode->mode & mode_type_mask) == mode_dir))
+        return -int(errno_t::EISDIR);
+
+    return read_inode(file->inode, buf, size, offset);
 }
 
 ssize_t ext4_fs_t::write(fs_file_info_t *fi, char const *buf,
@@ -562,9 +2259,11 @@ int ext4_fs_t::ftruncate(fs_file_info_t *fi, off_t offset)
 
 int ext4_fs_t::fstat(fs_file_info_t *fi, fs_stat_t *st)
 {
-    (void)fi;
-    (void)st;
-    return -int(errno_t::ENOSYS);
+    file_handle_t *file = (file_handle_t*)fi;
+
+    fill_stat(file->inode, st);
+
+    return 0;
 }
 
 //
@@ -595,8 +2294,22 @@ int ext4_fs_t::flush(fs_file_info_t *fi)
 
 int ext4_fs_t::statfs(fs_statvfs_t* stbuf)
 {
-    (void)stbuf;
-    return -int(errno_t::ENOSYS);
+    stbuf->f_bsize = block_size;
+    stbuf->f_frsize = block_size;
+    stbuf->f_blocks = blocks_count;
+    stbuf->f_bfree = free_blocks;
+    stbuf->f_bavail = free_blocks;
+    stbuf->f_files = inodes_count;
+    stbuf->f_ffree = free_inodes;
+    stbuf->f_favail = free_inodes;
+    stbuf->f_fsid = fsid;
+
+    // Read only
+    stbuf->f_flag = 1;
+
+    stbuf->f_namemax = NAME_MAX;
+
+    return 0;
 }
 
 //
@@ -722,3 +2435,5 @@ constexpr bool enable_bitwise(ext4_fs_t::superblock_t::misc_flags_t)
 {
     return true;
 }
+
+static ext4_factory_t ext4_factory;
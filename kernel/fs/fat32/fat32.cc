@@ -1,5 +1,7 @@
 #include "kmodule.h"
 #include "dev_storage.h"
+#include "bcache.h"
+#include "blk_queue.h"
 #include "stdlib.h"
 #include "printk.h"
 #include "string.h"
@@ -9,6 +11,8 @@
 #include "fat32_decl.h"
 #include "bootinfo.h"
 #include "user_mem.h"
+#include "name_index.h"
+#include "filemap.h"
 
 #define DEBUG_FAT32 1
 #if DEBUG_FAT32
@@ -33,13 +37,43 @@ struct fat32_fs_t final : public fs_base_t {
             "_^$~!#%&-{}@`'()";
 
     struct full_lfn_t {
-        fat32_dir_union_t fragments[(256 + 12) / 13 + 1] = {};
+        // Long name fragments of 13 characters, then the short entry
+        static constexpr size_t max_fragments = (256 + 12) / 13 + 1;
+
+        // Longest name_from_lfns result, up to 3 UTF-8 bytes per character
+        static constexpr size_t max_name_utf8 = max_fragments * 13 * 3;
+
+        fat32_dir_union_t fragments[max_fragments] = {};
         uint8_t lfn_entry_count = 0;
 
         // Debugging magic, reconstructs the filename
         ext::string str() const;
     };
 
+    // Run of physically contiguous clusters in a cluster chain
+    struct extent_t {
+        // Index of the first cluster of the run within the file
+        uint32_t index;
+        uint32_t count;
+        cluster_t cluster;
+    };
+
+    // Extent map of a file, built lazily from the FAT and shared
+    // by every handle open on the same directory entry
+    struct file_extents_t {
+        fat32_dir_entry_t const *dirent = nullptr;
+
+        ext::vector<extent_t> runs;
+
+        // Number of clusters covered by runs
+        uint32_t mapped = 0;
+
+        // The whole chain is in runs
+        bool complete = false;
+
+        unsigned refcount = 0;
+    };
+
     struct file_handle_t : public fs_file_info_t {
         file_handle_t() = default;
 
@@ -55,9 +89,11 @@ struct fat32_fs_t final : public fs_base_t {
         fat32_dir_entry_t *dirent = nullptr;
         ext::string filename;
 
-        off_t cached_offset = 0;
-        cluster_t cached_cluster = 0;
+        file_extents_t *extents = nullptr;
         bool dirty = false;
+
+        // Opened with O_DIRECT
+        bool direct = false;
     };
 
     static pool_t<file_handle_t> handles;
@@ -69,13 +105,49 @@ struct fat32_fs_t final : public fs_base_t {
     int mm_fault_handler(void *addr,
             uint64_t offset, uint64_t length, bool read, bool flush);
 
-    _pure
-    void *lookup_sector(uint64_t lba);
-
     uint64_t offsetof_cluster(uint64_t cluster);
 
     void *lookup_cluster(uint64_t cluster);
 
+    // The FAT block holding the entry of cluster, in the first or the
+    // second copy of the FAT. Returns a referenced buffer, nullptr on error
+    bcache_buf_t *fat_block(cluster_t cluster, bool second,
+                            errno_t *err = nullptr);
+
+    // An entry that can't be read reads as the end of the chain
+    cluster_t fat_get(cluster_t cluster);
+
+    // Set the entry in both copies, sync_fat_range writes them
+    int fat_set(cluster_t cluster, cluster_t value);
+
+    // The directory cluster, held in the block cache until it is freed
+    // or the volume is unmounted, so directory entry pointers stay valid.
+    // Returns nullptr on error
+    fat32_dir_union_t *dir_cluster(cluster_t cluster);
+
+    // Hold buf as the directory cluster, takes over the reference
+    fat32_dir_union_t *dir_cluster_insert(cluster_t cluster,
+                                          bcache_buf_t *buf);
+
+    // Start a new directory cluster, a copy of copy, or zeroed,
+    // and write it
+    int dir_cluster_new(cluster_t cluster, void const *copy = nullptr);
+
+    // A directory cluster went back to the free map
+    void dir_cluster_free(cluster_t cluster);
+
+    // The device mapping must not write over a cached directory cluster
+    bool dir_cluster_cached(cluster_t cluster);
+
+    // Write the directory cluster holding de now
+    int sync_dir(void const *de);
+
+    // Drop the held directory clusters, boot sector and FSInfo
+    void release_metadata();
+
+    // Write the FSInfo hints and every dirty metadata block
+    int sync_metadata();
+
     _pure
     static cluster_t dirent_start_cluster(fat32_dir_entry_t const *de);
     static void dirent_start_cluster(fat32_dir_entry_t *de, cluster_t cluster);
@@ -108,11 +180,50 @@ struct fat32_fs_t final : public fs_base_t {
     _pure
     static bool is_dirent_free(fat32_dir_union_t const *de);
 
+    // Allocate up to count new directory clusters after cluster,
+    // zeroed and written, not linked into any chain
     int32_t extend_fat_chain(cluster_t *clusters,
                              int32_t count, cluster_t cluster);
+
+    // Reserve one cluster after cluster, not zeroed
     cluster_t allocate_near(cluster_t cluster);
     int commit_fat_extend(cluster_t *clusters, int32_t count);
 
+    // Reserve a run of up to count contiguous free clusters, searching
+    // forward from the cluster after the hint. Returns the first cluster
+    // and stores the run length in run_len, returns 0 if the disk is full.
+    // The clusters are marked reserved (1) in the FAT but not zeroed
+    cluster_t allocate_run(cluster_t hint, int32_t count, int32_t& run_len);
+
+    // Find the first run of at least count free clusters at or after
+    // start, wrapping around, or the longest run if there is none
+    cluster_t find_free_run(cluster_t start, int32_t count,
+                            int32_t& run_len) const;
+
+    int zero_clusters(cluster_t cluster, int32_t count);
+
+    // Set a FAT entry to zero and return the cluster to the free map
+    void free_cluster(cluster_t cluster);
+
+    // Allocation hint for clusters not appended to an existing chain
+    cluster_t alloc_hint() const;
+
+    // Extend the cluster chain of a file to cover a write of [offset,end),
+    // allocating contiguous runs. Clusters the write completely covers are
+    // not zeroed. Returns the offset covered by the chain, and stores the
+    // offset where the newly allocated clusters start in fresh
+    off_t reserve_clusters(file_handle_t *file, off_t offset, off_t end,
+                           off_t& fresh);
+
+    // Zero what is left of the clusters reserve_clusters allocated
+    // when a write fails part way through
+    void abandon_write(file_handle_t *file, off_t offset,
+                       off_t fresh, off_t end);
+
+    bool build_free_map();
+    void mark_free_map(cluster_t cluster, int32_t count, bool free);
+    int sync_fsinfo();
+
     // Iterate the directory, and if extend_cluster is not null, then
     // store the appended cluster number there if we fall off the end
     // of the fat chain of the directory
@@ -125,7 +236,29 @@ struct fat32_fs_t final : public fs_base_t {
     fat32_dir_union_t *search_dir(cluster_t cluster,
             char const *filename, size_t name_len);
 
-    off_t walk_cluster_chain(file_handle_t *file, off_t offset, bool append);
+    // Index of the long names in the directory starting at cluster,
+    // built on first use, null if it could not be built.
+    // Called with dir_index_lock held
+    name_index_t *dir_index(cluster_t cluster);
+    bool build_dir_index(name_index_t *index, cluster_t cluster);
+
+    // Find the run holding cluster index of the file, mapping more of
+    // the chain from the FAT as needed. Returns false past the end of
+    // the chain
+    bool lookup_extent(file_handle_t *file, uint32_t index, extent_t& run);
+
+    // Map the chain from the FAT until it covers cluster index,
+    // called with extent_lock held
+    void map_extents(file_extents_t *extents, uint32_t index);
+
+    static void append_extent(file_extents_t *extents,
+                              cluster_t cluster, uint32_t count);
+
+    file_extents_t *acquire_extents(fat32_dir_entry_t const *de);
+    void release_extents(file_extents_t *extents);
+
+    // The cluster chain of the entry grew behind the extent map's back
+    void extents_extended(fat32_dir_entry_t const *de);
 
     fat32_dir_union_t *lookup_dirent(fs_file_info_t *dirfi, char const *pathname,
                                      fat32_dir_union_t **dde);
@@ -139,6 +272,7 @@ struct fat32_fs_t final : public fs_base_t {
     int change_dirent_start(fat32_dir_union_t *dde, cluster_t start);
 
     int sync_fat_entry(cluster_t cluster);
+    int sync_fat_range(cluster_t cluster, int32_t count);
 
     cluster_t transact_cluster(cluster_t prev_cluster,
                                fat32_dir_union_t *dde, cluster_t cluster);
@@ -150,12 +284,29 @@ struct fat32_fs_t final : public fs_base_t {
                             unsigned date_field, unsigned time_field,
                             unsigned centiseconds);
 
+    // Sets *created when O_CREAT made a new directory entry
     file_handle_t *create_handle(fs_file_info_t *dirfi, char const *path,
-                                 int flags, mode_t mode, errno_t &err);
+                                 int flags, mode_t mode, errno_t &err,
+                                 bool *created = nullptr);
 
     ssize_t internal_rw(file_handle_t *file,
             void *buf, size_t size, off_t offset, bool read);
 
+    // Transfer whole sectors straight between buf and the device,
+    // falls back to internal_rw for anything unaligned
+    ssize_t direct_rw(file_handle_t *file,
+            void *buf, size_t size, off_t offset, bool read);
+
+    // Update the size and modification time after writing up to end
+    void note_write(file_handle_t *file, off_t end);
+
+    // Caller holds rwlock
+    ssize_t readdir_locked(file_handle_t *file, dirent_t *buf,
+                           off_t offset);
+
+    ssize_t getdents(fs_file_info_t *fi, void *buf,
+                     size_t size, off_t &offset) override final;
+
     void generate_unique_shortname(full_lfn_t& lfn, uint64_t dir_index);
 
     static char *name_from_lfns(char *pathname, full_lfn_t const *full);
@@ -166,6 +317,29 @@ struct fat32_fs_t final : public fs_base_t {
 
     lock_type rwlock;
 
+    // Protects extent_maps and the maps in it, lookups happen
+    // with rwlock only held shared
+    using extent_lock_type = ext::mutex;
+    using extent_scoped_lock = ext::unique_lock<extent_lock_type>;
+
+    extent_lock_type extent_lock;
+    ext::map<fat32_dir_entry_t const *, file_extents_t *> extent_maps;
+
+    // Long name index of each directory that has been searched, by start
+    // cluster. Built under a shared rwlock, so it has its own lock
+    using dir_index_lock_type = ext::mutex;
+    using dir_index_scoped_lock = ext::unique_lock<dir_index_lock_type>;
+
+    dir_index_lock_type dir_index_lock;
+    ext::map<cluster_t, name_index_t *> dir_indexes;
+
+    // Clusters mapped past the one asked for, so sequential access
+    // does not go back to the FAT for every cluster
+    static constexpr uint32_t extent_map_ahead = 256;
+
+    // FAT blocks read ahead of the scan at mount, a power of two
+    static constexpr cluster_t fat_readahead = 8;
+
     storage_dev_base_t *drive;
 
     // Device memory mapping
@@ -177,8 +351,10 @@ struct fat32_fs_t final : public fs_base_t {
 
     uint64_t serial;
 
-    cluster_t *fat;
-    cluster_t *fat2;
+    // First sector of the first FAT, partition relative,
+    // the second copy follows it
+    uint64_t fat_lba;
+    uint32_t fat_sectors;
     int32_t fat_size;
 
     cluster_t root_cluster;
@@ -192,6 +368,36 @@ struct fat32_fs_t final : public fs_base_t {
     uint8_t block_shift;
     uint8_t fat_block_shift;
 
+    // One bit per cluster, set when the cluster is free
+    ext::vector<uint64_t> free_map;
+
+    // Number of free clusters in each group of free_group_size clusters,
+    // so searches can step over full regions without looking at the map
+    static constexpr uint8_t free_group_shift = 12;
+    static constexpr int32_t free_group_size = 1 << free_group_shift;
+    ext::vector<uint16_t> free_summary;
+
+    cluster_t free_count;
+    cluster_t next_free;
+
+    // The boot sector, held for the whole mount. The root directory
+    // start cluster is written through it
+    bcache_buf_t *boot_buf;
+
+    // FSInfo sector in its held buffer, null if the volume has none.
+    // Only a hint, it is written when the filesystem is synced
+    fat32_fsinfo_t *fsinfo;
+    bcache_buf_t *fsinfo_buf;
+
+    // Cached directory clusters by cluster number, and by address so
+    // a directory entry pointer finds its buffer
+    using dir_buf_lock_type = ext::mutex;
+    using dir_buf_scoped_lock = ext::unique_lock<dir_buf_lock_type>;
+
+    dir_buf_lock_type dir_buf_lock;
+    ext::map<cluster_t, bcache_buf_t *> dir_bufs;
+    ext::map<uintptr_t, bcache_buf_t *> dir_buf_addrs;
+
     // Synthetic root directory entry
     // to allow code to refer to root as a
     // directory entry
@@ -228,13 +434,49 @@ int fat32_fs_t::mm_fault_handler(
     uint64_t sector_offset = (offset >> sector_shift);
     uint64_t lba = lba_st + sector_offset;
 
-    int result;
+    int result = 0;
     if (likely(!read)) {
-        printdbg("Writing back LBA %" PRId64 " at addr %p\n", lba, addr);
-        result = drive->write_blocks(addr, length >> sector_shift, lba, flush);
+        // The boot sector, FSInfo, the FATs and the cached directory
+        // clusters are written through the block cache, the copy here
+        // may be older. Only the runs of sectors between them are written
+        uint64_t data_st = cluster_ofs + (uint64_t(2) << block_shift);
+        uint64_t st = sector_offset;
+        uint64_t en = st + (length >> sector_shift);
+
+        while (st < en && result >= 0) {
+            uint64_t run_en;
+            bool skip = st < data_st;
+
+            if (skip) {
+                run_en = en < data_st ? en : data_st;
+            } else {
+                // A cluster at a time, while they are all cached or not
+                cluster_t cluster = (st - cluster_ofs) >> block_shift;
+                skip = dir_cluster_cached(cluster);
+
+                do {
+                    ++cluster;
+                    run_en = cluster_ofs + (uint64_t(cluster) << block_shift);
+                } while (run_en < en && dir_cluster_cached(cluster) == skip);
+
+                run_en = run_en < en ? run_en : en;
+            }
+
+            if (!skip) {
+                char *run_addr = (char*)addr +
+                        ((st - sector_offset) << sector_shift);
+
+                printdbg("Writing back LBA %" PRId64 " at addr %p\n",
+                         lba_st + st, run_addr);
+                result = drive->write_blocks(run_addr, run_en - st,
+                                             lba_st + st, flush);
+            }
+
+            st = run_en;
+        }
     } else {
         printdbg("Demand paging LBA %" PRId64 " at addr %p\n", lba, addr);
-        result = drive->read_blocks(addr, length >> sector_shift, lba);
+        result = blk_read_blocks(drive, addr, length >> sector_shift, lba);
     }
 
     if (result < 0)
@@ -243,9 +485,232 @@ int fat32_fs_t::mm_fault_handler(
     return result;
 }
 
-void *fat32_fs_t::lookup_sector(uint64_t lba)
+bcache_buf_t *fat32_fs_t::fat_block(cluster_t cluster, bool second,
+                                     errno_t *err)
 {
-    return mm_dev + (lba << sector_shift);
+    // Blocks are cluster sized, the last one stops at the end of the FAT
+    // so it never overlaps the other copy
+    uint64_t block_st = uint64_t(cluster >> fat_block_shift) << block_shift;
+    uint64_t sectors = fat_sectors - block_st;
+
+    if (sectors > (uint64_t(1) << block_shift))
+        sectors = uint64_t(1) << block_shift;
+
+    return bcache_read(drive, lba_st + fat_lba +
+                       (second ? fat_sectors : 0) + block_st,
+                       sectors << sector_shift, err);
+}
+
+cluster_t fat32_fs_t::fat_get(cluster_t cluster)
+{
+    bcache_buf_t *buf = fat_block(cluster, false);
+
+    if (unlikely(!buf))
+        return 0x0FFFFFFF;
+
+    cluster_t value = ((cluster_t const *)buf->data)[
+            cluster & ((cluster_t(1) << fat_block_shift) - 1)];
+
+    bcache_release(buf);
+
+    return value;
+}
+
+int fat32_fs_t::fat_set(cluster_t cluster, cluster_t value)
+{
+    size_t index = cluster & ((cluster_t(1) << fat_block_shift) - 1);
+
+    for (int copy = 0; copy < 2; ++copy) {
+        errno_t err = errno_t::EIO;
+        bcache_buf_t *buf = fat_block(cluster, copy != 0, &err);
+
+        if (unlikely(!buf))
+            return -int(err);
+
+        ((cluster_t *)buf->data)[index] = value;
+
+        bcache_mark_dirty(buf);
+        bcache_release(buf);
+    }
+
+    return 0;
+}
+
+fat32_dir_union_t *fat32_fs_t::dir_cluster(cluster_t cluster)
+{
+    dir_buf_scoped_lock lock(dir_buf_lock);
+
+    auto it = dir_bufs.find(cluster);
+
+    if (it != dir_bufs.end())
+        return (fat32_dir_union_t *)it->second->data;
+
+    lock.unlock();
+
+    bcache_buf_t *buf = bcache_read(
+                drive, lba_st + (offsetof_cluster(cluster) >> sector_shift),
+                block_size);
+
+    if (unlikely(!buf))
+        return nullptr;
+
+    // Directories are usually read start to end,
+    // start reading the next cluster of the chain
+    cluster_t next = fat_get(cluster);
+
+    if (!is_eof(next) && next < end_cluster)
+        bcache_readahead(drive, lba_st + (offsetof_cluster(next) >>
+                                          sector_shift), block_size, 1);
+
+    return dir_cluster_insert(cluster, buf);
+}
+
+fat32_dir_union_t *fat32_fs_t::dir_cluster_insert(cluster_t cluster,
+                                                  bcache_buf_t *buf)
+{
+    dir_buf_scoped_lock lock(dir_buf_lock);
+
+    auto ins = dir_bufs.insert({ cluster, buf });
+
+    if (unlikely(ins.first == dir_bufs.end())) {
+        lock.unlock();
+        bcache_release(buf);
+        return nullptr;
+    }
+
+    if (!ins.second) {
+        // Another reader got there first, with the same buffer
+        bcache_buf_t *held = ins.first->second;
+        lock.unlock();
+        bcache_release(buf);
+        return (fat32_dir_union_t *)held->data;
+    }
+
+    if (unlikely(dir_buf_addrs.insert({ uintptr_t(buf->data), buf }).first ==
+                 dir_buf_addrs.end())) {
+        dir_bufs.erase(cluster);
+        lock.unlock();
+        bcache_release(buf);
+        return nullptr;
+    }
+
+    return (fat32_dir_union_t *)buf->data;
+}
+
+int fat32_fs_t::dir_cluster_new(cluster_t cluster, void const *copy)
+{
+    errno_t err = errno_t::EIO;
+
+    bcache_buf_t *buf = bcache_get(
+                drive, lba_st + (offsetof_cluster(cluster) >> sector_shift),
+                block_size, &err);
+
+    if (unlikely(!buf))
+        return -int(err);
+
+    // A block still cached from an earlier use is not zero filled
+    if (copy)
+        memcpy(buf->data, copy, block_size);
+    else
+        memset(buf->data, 0, block_size);
+
+    bcache_mark_dirty(buf);
+
+    err = bcache_writeback(buf);
+
+    if (unlikely(err != errno_t::OK)) {
+        bcache_release(buf);
+        return -int(err);
+    }
+
+    return dir_cluster_insert(cluster, buf)
+            ? 0
+            : -int(errno_t::ENOMEM);
+}
+
+void fat32_fs_t::dir_cluster_free(cluster_t cluster)
+{
+    dir_buf_scoped_lock lock(dir_buf_lock);
+
+    auto it = dir_bufs.find(cluster);
+
+    if (it == dir_bufs.end())
+        return;
+
+    bcache_buf_t *buf = it->second;
+
+    dir_buf_addrs.erase(uintptr_t(buf->data));
+    dir_bufs.erase(it);
+
+    lock.unlock();
+
+    bcache_release(buf);
+}
+
+bool fat32_fs_t::dir_cluster_cached(cluster_t cluster)
+{
+    dir_buf_scoped_lock lock(dir_buf_lock);
+
+    return dir_bufs.find(cluster) != dir_bufs.end();
+}
+
+int fat32_fs_t::sync_dir(void const *de)
+{
+    dir_buf_scoped_lock lock(dir_buf_lock);
+
+    // The buffer holding de is the last one starting at or before it
+    auto it = dir_buf_addrs.lower_bound(uintptr_t(de) - block_size + 1);
+
+    // The synthetic root directory entry is not on the disk
+    if (it == dir_buf_addrs.end() || it->first > uintptr_t(de))
+        return 0;
+
+    bcache_buf_t *buf = it->second;
+
+    lock.unlock();
+
+    bcache_mark_dirty(buf);
+
+    errno_t err = bcache_writeback(buf);
+
+    return likely(err == errno_t::OK) ? 0 : -int(err);
+}
+
+void fat32_fs_t::release_metadata()
+{
+    dir_buf_scoped_lock lock(dir_buf_lock);
+
+    ext::vector<bcache_buf_t *> held;
+
+    if (unlikely(!held.reserve(dir_bufs.size() + 2)))
+        panic_oom();
+
+    for (auto const& item : dir_bufs)
+        held.push_back(item.second);
+
+    dir_bufs.clear();
+    dir_buf_addrs.clear();
+
+    lock.unlock();
+
+    held.push_back(boot_buf);
+    held.push_back(fsinfo_buf);
+
+    boot_buf = nullptr;
+    fsinfo_buf = nullptr;
+    fsinfo = nullptr;
+
+    for (bcache_buf_t *buf : held)
+        bcache_release(buf);
+}
+
+int fat32_fs_t::sync_metadata()
+{
+    sync_fsinfo();
+
+    errno_t err = bcache_sync(drive);
+
+    return likely(err == errno_t::OK) ? 0 : -int(err);
 }
 
 uint64_t fat32_fs_t::offsetof_cluster(uint64_t cluster)
@@ -562,11 +1027,31 @@ bool fat32_fs_t::is_dirent_free(fat32_dir_union_t const *de)
 int32_t fat32_fs_t::extend_fat_chain(cluster_t *clusters,
                                      int32_t count, cluster_t cluster)
 {
-    int32_t allocated;
+    int32_t allocated = 0;
+
+    while (allocated < count) {
+        int32_t run_len;
+        cluster_t run = allocate_run(cluster, count - allocated, run_len);
+
+        if (unlikely(!run))
+            break;
+
+        int32_t started = 0;
+
+        while (started < run_len && dir_cluster_new(run + started) >= 0)
+            ++started;
 
-    for (allocated = 0; allocated < count; ++allocated) {
-        cluster = allocate_near(cluster);
-        clusters[allocated] = cluster;
+        // Give back what could not be written
+        for (int32_t i = started; i < run_len; ++i)
+            free_cluster(run + i);
+
+        for (int32_t i = 0; i < started; ++i)
+            clusters[allocated++] = run + i;
+
+        if (unlikely(started < run_len))
+            break;
+
+        cluster = run + run_len - 1;
     }
 
     if (unlikely(allocated < count))
@@ -577,21 +1062,268 @@ int32_t fat32_fs_t::extend_fat_chain(cluster_t *clusters,
 
 cluster_t fat32_fs_t::allocate_near(cluster_t cluster)
 {
-    cluster_t candidate = cluster + 1;
+    int32_t run_len;
+
+    // Zero if disk full
+    return allocate_run(cluster, 1, run_len);
+}
+
+cluster_t fat32_fs_t::allocate_run(cluster_t hint,
+                                   int32_t count, int32_t& run_len)
+{
+    run_len = 0;
+
+    if (unlikely(free_count == 0 || count <= 0))
+        return 0;
+
+    cluster_t start = hint + 1;
+
+    if (unlikely(start >= end_cluster || start < 2))
+        start = 2;
+
+    cluster_t run = find_free_run(start, count, run_len);
+
+    if (unlikely(!run))
+        return 0;
+
+    for (int32_t i = 0; i < run_len; ++i) {
+        assert(is_free(fat_get(run + i)));
+        fat_set(run + i, 1);
+    }
+
+    mark_free_map(run, run_len, false);
+
+    next_free = run + run_len;
+
+    if (unlikely(next_free >= end_cluster))
+        next_free = 2;
+
+    return run;
+}
+
+cluster_t fat32_fs_t::find_free_run(cluster_t start, int32_t count,
+                                    int32_t& run_len) const
+{
+    // Words of the free map per summary group
+    constexpr uint8_t group_word_shift = free_group_shift - 6;
+
+    size_t word_count = free_map.size();
+    size_t first_word = size_t(start) >> 6;
+
+    cluster_t best = 0;
+    int32_t best_len = 0;
+
+    // Scan from the start to the end of the map, then wrap around
+    for (int pass = 0; pass < 2; ++pass) {
+        size_t w = pass ? 0 : first_word;
+        size_t e = pass ? first_word + 1 : word_count;
+
+        if (e > word_count)
+            e = word_count;
+
+        cluster_t run = 0;
+        int32_t len = 0;
+
+        while (w < e) {
+            size_t group = w >> group_word_shift;
+
+            // Step over whole groups with nothing free
+            if (!free_summary[group]) {
+                if (len > best_len) {
+                    best = run;
+                    best_len = len;
+                }
+                len = 0;
+                w = (group + 1) << group_word_shift;
+                continue;
+            }
+
+            uint64_t bits = free_map[w];
+
+            if (pass == 0 && w == first_word)
+                bits &= ~uint64_t(0) << (start & 63);
+
+            // Step through the runs of set and clear bits in the word
+            for (unsigned b = 0; b < 64; ) {
+                uint64_t rest = bits >> b;
+
+                if (rest & 1) {
+                    uint64_t clear = ~rest;
+                    unsigned ones = clear
+                            ? bit_lsb_set_64(int64_t(clear))
+                            : 64;
 
-    for (int32_t checked = 0; checked < end_cluster; ++checked, ++candidate) {
-        if (unlikely(candidate >= end_cluster || candidate < 2))
-            candidate = 2;
+                    if (!len)
+                        run = cluster_t((w << 6) + b);
 
-        if (unlikely(is_free(fat[candidate]))) {
-            void *block = lookup_cluster(candidate);
-            memset(block, 0, block_size);
-            fat[candidate] = 1;
-            return candidate;
+                    len += ones;
+                    b += ones;
+
+                    if (len >= count) {
+                        run_len = count;
+                        return run;
+                    }
+                } else {
+                    if (len > best_len) {
+                        best = run;
+                        best_len = len;
+                    }
+
+                    len = 0;
+                    b += rest ? bit_lsb_set_64(int64_t(rest)) : 64 - b;
+                }
+            }
+
+            ++w;
+        }
+
+        if (len > best_len) {
+            best = run;
+            best_len = len;
         }
     }
 
-    // Disk full
+    run_len = best_len;
+    return best;
+}
+
+int fat32_fs_t::zero_clusters(cluster_t cluster, int32_t count)
+{
+    void *block = lookup_cluster(cluster);
+    size_t len = size_t(count) << (sector_shift + block_shift);
+
+    // Page in the whole run with one request instead of a fault per page
+    madvise(block, len, MADV_WILLNEED);
+    memset(block, 0, len);
+
+    // O_DIRECT reads go straight to the disk, which must not still hold
+    // whatever the clusters had before they were allocated
+    return msync(block, len, MS_SYNC);
+}
+
+void fat32_fs_t::free_cluster(cluster_t cluster)
+{
+    fat_set(cluster, 0);
+    dir_cluster_free(cluster);
+
+    mark_free_map(cluster, 1, true);
+}
+
+cluster_t fat32_fs_t::alloc_hint() const
+{
+    // Try to reserve first MB to metadata, otherwise carry on
+    // from where the last allocation ended
+    return next_free > 2048 ? next_free - 1 : 2047;
+}
+
+void fat32_fs_t::mark_free_map(cluster_t cluster, int32_t count, bool free)
+{
+    while (count > 0) {
+        size_t word = size_t(cluster) >> 6;
+        unsigned bit = cluster & 63;
+        int32_t chunk = 64 - bit;
+
+        if (chunk > count)
+            chunk = count;
+
+        uint64_t mask = chunk < 64
+                ? ((uint64_t(1) << chunk) - 1) << bit
+                : ~uint64_t(0);
+
+        // A word never straddles a summary group
+        uint16_t& group_free = free_summary[cluster >> free_group_shift];
+
+        if (free) {
+            int32_t changed = bit_popcnt_64(int64_t(mask & ~free_map[word]));
+            free_map[word] |= mask;
+            group_free += changed;
+            free_count += changed;
+        } else {
+            int32_t changed = bit_popcnt_64(int64_t(mask & free_map[word]));
+            free_map[word] &= ~mask;
+            group_free -= changed;
+            free_count -= changed;
+        }
+
+        cluster += chunk;
+        count -= chunk;
+    }
+}
+
+bool fat32_fs_t::build_free_map()
+{
+    size_t word_count = (size_t(end_cluster) + 63) >> 6;
+    size_t group_count = (size_t(end_cluster) + free_group_size - 1) >>
+            free_group_shift;
+
+    if (unlikely(!free_map.resize(word_count)))
+        return false;
+
+    if (unlikely(!free_summary.resize(group_count)))
+        return false;
+
+    free_count = 0;
+
+    cluster_t per_block = cluster_t(1) << fat_block_shift;
+    cluster_t block_count = (end_cluster + per_block - 1) >> fat_block_shift;
+
+    // Only whole blocks are read ahead, the last one may be shorter
+    cluster_t full_blocks = fat_sectors >> block_shift;
+
+    for (cluster_t block = 0; block < block_count; ++block) {
+        // Keep a window of reads going ahead of the scan
+        if ((block & (fat_readahead - 1)) == 0 && block < full_blocks) {
+            cluster_t count = full_blocks - block < fat_readahead
+                    ? full_blocks - block
+                    : fat_readahead;
+
+            bcache_readahead(drive, lba_st + fat_lba +
+                             (uint64_t(block) << block_shift),
+                             block_size, count);
+        }
+
+        bcache_buf_t *buf = fat_block(block << fat_block_shift, false);
+
+        if (unlikely(!buf))
+            return false;
+
+        cluster_t const *entries = (cluster_t const *)buf->data;
+
+        cluster_t st = block << fat_block_shift;
+        cluster_t en = st + per_block;
+
+        st = st > 2 ? st : 2;
+        en = en < end_cluster ? en : end_cluster;
+
+        for (cluster_t cluster = st; cluster < en; ++cluster) {
+            if (is_free(entries[cluster & (per_block - 1)])) {
+                free_map[cluster >> 6] |= uint64_t(1) << (cluster & 63);
+                ++free_summary[cluster >> free_group_shift];
+                ++free_count;
+            }
+        }
+
+        bcache_release(buf);
+    }
+
+    return true;
+}
+
+int fat32_fs_t::sync_fsinfo()
+{
+    if (!fsinfo)
+        return 0;
+
+    if (fsinfo->free_count == uint32_t(free_count) &&
+            fsinfo->next_free == uint32_t(next_free))
+        return 0;
+
+    fsinfo->free_count = free_count;
+    fsinfo->next_free = next_free;
+
+    // Only a hint, written with the rest when the volume is synced
+    bcache_mark_dirty(fsinfo_buf);
+
     return 0;
 }
 
@@ -605,20 +1337,20 @@ int fat32_fs_t::commit_fat_extend(cluster_t *clusters, int32_t count)
         for (i = 0; i < count - 1; ++i) {
             cluster = clusters[i];
 
-            assert(fat[cluster] == 1);
-            fat[cluster] = clusters[i+1];
-            fat2[cluster] = clusters[i+1];
+            assert(fat_get(cluster) == 1);
+            result = fat_set(cluster, clusters[i+1]);
 
-            result = sync_fat_entry(cluster);
+            if (likely(result >= 0))
+                result = sync_fat_entry(cluster);
 
             if (unlikely(result < 0))
                 return result;
         }
         cluster = clusters[i];
-        fat[cluster] = 0x0FFFFFFF;
-        fat2[cluster] = 0x0FFFFFFF;
+        result = fat_set(cluster, 0x0FFFFFFF);
 
-        result = sync_fat_entry(cluster);
+        if (likely(result >= 0))
+            result = sync_fat_entry(cluster);
     }
 
     return result;
@@ -637,8 +1369,8 @@ int fat32_fs_t::iterate_dir(cluster_t cluster, F callback,
         *extend_cluster = 0;
 
     while (!is_eof(cluster)) {
-        fat32_dir_union_t *de = (fat32_dir_union_t *)lookup_cluster(cluster);
-        if (unlikely(madvise(de, block_size, MADV_WILLNEED) < 0))
+        fat32_dir_union_t *de = dir_cluster(cluster);
+        if (unlikely(!de))
             return -1;
 
         // Iterate through all of the directory entries in this cluster
@@ -647,11 +1379,13 @@ int fat32_fs_t::iterate_dir(cluster_t cluster, F callback,
                 return 0;
         }
 
-        if (extend_cluster && is_eof(fat[cluster])) {
+        cluster_t next = fat_get(cluster);
+
+        if (extend_cluster && is_eof(next)) {
             extend_fat_chain(extend_cluster, 1, cluster);// fixme disk full?
             cluster = *extend_cluster;
         } else {
-            cluster = fat[cluster];
+            cluster = next;
         }
     }
 
@@ -665,6 +1399,23 @@ fat32_dir_union_t *fat32_fs_t::search_dir(
     full_lfn_t lfn;
     dirents_from_name(&lfn, filename, name_len);
 
+    // Long names are looked up in the index, which matches the same
+    // entries as the scan below
+    if (likely(lfn.lfn_entry_count)) {
+        dir_index_scoped_lock lock(dir_index_lock);
+
+        name_index_t *index = dir_index(cluster);
+
+        if (likely(index)) {
+            uintptr_t found;
+
+            if (index->lookup(filename, name_len, found))
+                return (fat32_dir_union_t *)found;
+
+            return nullptr;
+        }
+    }
+
     size_t match_index = 0;
 
     uint8_t last_checksum = 0;
@@ -700,112 +1451,377 @@ fat32_dir_union_t *fat32_fs_t::search_dir(
                 return false;
             }
 
-            // Start matching from the start of the searched entry
-            match_index = 0;
-            return true;
+            // Start matching from the start of the searched entry
+            match_index = 0;
+            return true;
+        }
+
+        if (match_index < lfn.lfn_entry_count) {
+            fat32_long_dir_entry_t const *le;
+            le = &lfn.fragments[match_index].long_entry;
+
+            if (le->ordinal == de->long_entry.ordinal &&
+                    !memcmp((void*)le->name,
+                            (void*)de->long_entry.name,
+                            sizeof(le->name)) &&
+                    !memcmp((void*)le->name2,
+                            (void*)de->long_entry.name2,
+                            sizeof(le->name2)) &&
+                    !memcmp((void*)le->name3,
+                            (void*)de->long_entry.name3,
+                            sizeof(le->name3))) {
+                last_checksum = de->long_entry.checksum;
+                ++match_index;
+            } else {
+                match_index = 0;
+            }
+        } else {
+            match_index = 0;
+        }
+
+        return true;
+    };
+
+    int iterate_result = iterate_dir(cluster, iterate_callback);
+
+    if (unlikely(iterate_result < 0))
+        return nullptr;
+
+    return result;
+}
+
+name_index_t *fat32_fs_t::dir_index(cluster_t cluster)
+{
+    auto it = dir_indexes.find(cluster);
+
+    if (it != dir_indexes.end())
+        return it->second;
+
+    ext::unique_ptr<name_index_t> index(new (ext::nothrow) name_index_t());
+
+    if (unlikely(!index || !build_dir_index(index, cluster)))
+        return nullptr;
+
+    if (unlikely(dir_indexes.insert({ cluster, index.get() }).first ==
+                 dir_indexes.end()))
+        return nullptr;
+
+    FAT32_TRACE("indexed %zu names in directory at cluster %d\n",
+                index->size(), cluster);
+
+    return index.release();
+}
+
+bool fat32_fs_t::build_dir_index(name_index_t *index, cluster_t cluster)
+{
+    full_lfn_t lfn;
+    size_t fragment_count = 0;
+    size_t expected = 0;
+    uint8_t checksum = 0;
+    bool ok = true;
+
+    char name[full_lfn_t::max_name_utf8 + 1];
+
+    // Same rules as search_dir: a long name is a run of fragments with
+    // descending ordinals and one checksum, followed by its short entry
+    int iterate_result = iterate_dir(cluster, [&](
+            fat32_dir_union_t *de, cluster_t, bool) -> bool {
+        if (de->long_entry.attr == FAT_LONGNAME &&
+                uint8_t(de->short_entry.name[0]) !=
+                uint8_t(FAT_DELETED_FLAG)) {
+            uint8_t ordinal = de->long_entry.ordinal;
+            size_t lfn_index = ordinal & FAT_ORDINAL_MASK;
+
+            if (ordinal & FAT_LAST_LFN_ORDINAL) {
+                if (lfn_index == 0 || lfn_index >= countof(lfn.fragments)) {
+                    expected = 0;
+                    return true;
+                }
+
+                expected = lfn_index;
+                fragment_count = 0;
+                checksum = de->long_entry.checksum;
+            } else if (!expected || fragment_count >= expected ||
+                       lfn_index != expected - fragment_count ||
+                       de->long_entry.checksum != checksum) {
+                expected = 0;
+                return true;
+            }
+
+            lfn.fragments[fragment_count++] = *de;
+            return true;
+        }
+
+        if (expected && fragment_count == expected &&
+                de->long_entry.attr != 0 &&
+                lfn_checksum(de->short_entry.name) == checksum) {
+            lfn.lfn_entry_count = expected;
+
+            size_t len = name_from_lfns(name, &lfn) - name;
+
+            if (unlikely(!index->insert(name, len, uintptr_t(de)))) {
+                ok = false;
+                return false;
+            }
+        }
+
+        expected = 0;
+        return true;
+    });
+
+    if (unlikely(iterate_result < 0 || !ok))
+        return false;
+
+    index->set_complete();
+
+    return true;
+}
+
+off_t fat32_fs_t::reserve_clusters(file_handle_t *file,
+                                   off_t offset, off_t end, off_t& fresh)
+{
+    uint8_t cluster_shift = sector_shift + block_shift;
+
+    file_extents_t *extents = file->extents;
+
+    extent_scoped_lock lock(extent_lock);
+
+    // Find the end of the chain
+    if (!extents->complete)
+        map_extents(extents, ~uint32_t(0));
+
+    cluster_t last = 0;
+    off_t covered = off_t(extents->mapped) << cluster_shift;
+
+    if (!extents->runs.empty()) {
+        extent_t const& tail = extents->runs.back();
+        last = tail.cluster + tail.count - 1;
+    }
+
+    fresh = covered;
+
+    if (covered >= end)
+        return covered;
+
+    int32_t need = int32_t((end - covered + block_size - 1) >> cluster_shift);
+    cluster_t hint = last ? last : alloc_hint();
+    int status;
+
+    while (need > 0) {
+        int32_t run_len;
+        cluster_t run = allocate_run(hint, need, run_len);
+
+        if (unlikely(!run))
+            break;
+
+        // Zero the clusters the write does not completely overwrite,
+        // the rest would only be read in to be overwritten
+        off_t skip_st = offset > covered
+                ? (offset - covered + block_size - 1) >> cluster_shift
+                : 0;
+        off_t skip_en = (end - covered) >> cluster_shift;
+
+        skip_st = skip_st < run_len ? skip_st : run_len;
+        skip_en = skip_en < run_len ? skip_en : run_len;
+        skip_en = skip_en > skip_st ? skip_en : skip_st;
+
+        status = skip_st > 0
+                ? zero_clusters(run, skip_st)
+                : 0;
+
+        if (likely(status >= 0 && skip_en < run_len))
+            status = zero_clusters(run + skip_en, run_len - skip_en);
+
+        if (unlikely(status < 0)) {
+            // Not linked to the file yet, give them back
+            for (int32_t i = 0; i < run_len; ++i)
+                free_cluster(run + i);
+
+            return status;
         }
 
-        if (match_index < lfn.lfn_entry_count) {
-            fat32_long_dir_entry_t const *le;
-            le = &lfn.fragments[match_index].long_entry;
+        // Chain the run together, then link it onto the end of the file
+        for (int32_t i = 0; i < run_len && status >= 0; ++i)
+            status = fat_set(run + i, i < run_len - 1
+                             ? run + i + 1
+                             : 0x0FFFFFFF);
 
-            if (le->ordinal == de->long_entry.ordinal &&
-                    !memcmp((void*)le->name,
-                            (void*)de->long_entry.name,
-                            sizeof(le->name)) &&
-                    !memcmp((void*)le->name2,
-                            (void*)de->long_entry.name2,
-                            sizeof(le->name2)) &&
-                    !memcmp((void*)le->name3,
-                            (void*)de->long_entry.name3,
-                            sizeof(le->name3))) {
-                last_checksum = de->long_entry.checksum;
-                ++match_index;
-            } else {
-                match_index = 0;
-            }
+        if (likely(status >= 0))
+            status = sync_fat_range(run, run_len);
+
+        if (unlikely(status < 0))
+            return status;
+
+        if (last) {
+            status = fat_set(last, run);
+
+            if (likely(status >= 0))
+                status = sync_fat_entry(last);
         } else {
-            match_index = 0;
+            dirent_start_cluster(file->dirent, run);
+            status = sync_dir(file->dirent);
         }
 
-        return true;
-    };
+        if (unlikely(status < 0))
+            return status;
 
-    int iterate_result = iterate_dir(cluster, iterate_callback);
+        append_extent(extents, run, run_len);
 
-    if (unlikely(iterate_result < 0))
-        return nullptr;
+        last = run + run_len - 1;
+        hint = last;
+        need -= run_len;
+        covered += off_t(run_len) << cluster_shift;
+    }
 
-    return result;
+    sync_fsinfo();
+
+    return covered;
 }
 
-off_t fat32_fs_t::walk_cluster_chain(
-        file_handle_t *file, off_t offset, bool append)
+void fat32_fs_t::abandon_write(file_handle_t *file, off_t offset,
+                               off_t fresh, off_t end)
 {
-    off_t walked = 0;
+    uint8_t cluster_shift = sector_shift + block_shift;
 
-    cluster_t& c_clus = file->cached_cluster;
-    off_t& c_ofs = file->cached_offset;
+    // Only the newly allocated clusters may hold stale data
+    off_t st = offset > fresh ? offset : fresh;
 
-    ext::vector<cluster_t> sync_pending;
+    extent_t run;
+    while (st < end && lookup_extent(file, st >> cluster_shift, run)) {
+        off_t run_st = off_t(run.index) << cluster_shift;
+        off_t run_en = run_st + (off_t(run.count) << cluster_shift);
+        off_t en = end < run_en ? end : run_en;
 
-    while (walked + block_size <= offset) {
-        if (is_eof(fat[c_clus])) {
-            if (!append)
-                break;
+        memset((char*)lookup_cluster(run.cluster) + (st - run_st),
+               0, en - st);
+
+        st = en;
+    }
+}
 
-            cluster_t alloc = allocate_near(c_clus);
-            if (unlikely(alloc == 0))
-                break;
+bool fat32_fs_t::lookup_extent(file_handle_t *file,
+                               uint32_t index, extent_t& run)
+{
+    file_extents_t *extents = file->extents;
 
-            if (dirent_start_cluster(file->dirent) == 0)
-                dirent_start_cluster(file->dirent, alloc);
+    extent_scoped_lock lock(extent_lock);
 
-            cluster_t fat_block = c_clus >> fat_block_shift;
-            if (sync_pending.empty() || sync_pending.back() != fat_block) {
-                if (unlikely(!sync_pending.push_back(fat_block)))
-                    panic_oom();
-            }
+    if (index >= extents->mapped && !extents->complete)
+        map_extents(extents, index);
 
-            fat[c_clus] = alloc;
-            fat2[c_clus] = alloc;
+    if (index >= extents->mapped)
+        return false;
 
-            c_clus = alloc;
-        }
+    // Binary search for the first run ending after index
+    extent_t const *it = ext::lower_bound(
+                extents->runs.data(),
+                extents->runs.data() + extents->runs.size(), index,
+                [](extent_t const& lhs, uint32_t rhs) {
+        return lhs.index + lhs.count <= rhs;
+    });
 
-        c_ofs += block_size;
+    run = *it;
 
-        c_clus = fat[c_clus];
-        walked += block_size;
-    }
+    return true;
+}
 
-    if (append && c_clus == 0) {
-        // Initial block in empty file (try to reserve first MB to metadata)
-        c_clus = allocate_near(2047);
-        c_ofs = 0;
+void fat32_fs_t::map_extents(file_extents_t *extents, uint32_t index)
+{
+    uint32_t target = index < ~uint32_t(0) - extent_map_ahead
+            ? index + extent_map_ahead
+            : ~uint32_t(0);
+
+    cluster_t cluster;
 
-        cluster_t fat_block = c_clus >> fat_block_shift;
-        if (sync_pending.empty() || sync_pending.back() != fat_block)
-            if (unlikely(!sync_pending.push_back(fat_block)))
-                panic_oom();
+    if (extents->runs.empty()) {
+        cluster = dirent_start_cluster(extents->dirent);
+    } else {
+        extent_t const& tail = extents->runs.back();
+        cluster = fat_get(tail.cluster + tail.count - 1);
     }
 
-    for (cluster_t block_index : sync_pending) {
-        int status = msync(fat + (block_index << fat_block_shift),
-                           block_size, MS_SYNC);
+    while (extents->mapped <= target) {
+        // Stop at the end, and don't go around forever in a corrupt chain
+        if (is_eof(cluster) || cluster >= end_cluster ||
+                extents->mapped >= uint32_t(end_cluster)) {
+            extents->complete = true;
+            break;
+        }
 
-        if (status < 0)
-            return status;
+        append_extent(extents, cluster, 1);
+        cluster = fat_get(cluster);
+    }
+}
 
-        if (c_ofs == 0) {
-            dirent_start_cluster(file->dirent, c_clus);
-            status = msync(file->dirent, sizeof(*file->dirent), MS_SYNC);
-            if (status < 0)
-                return status;
+void fat32_fs_t::append_extent(file_extents_t *extents,
+                               cluster_t cluster, uint32_t count)
+{
+    if (!extents->runs.empty()) {
+        extent_t& tail = extents->runs.back();
+
+        if (tail.cluster + cluster_t(tail.count) == cluster) {
+            tail.count += count;
+            extents->mapped += count;
+            return;
         }
     }
 
-    return walked;
+    if (unlikely(!extents->runs.push_back({ extents->mapped, count, cluster })))
+        panic_oom();
+
+    extents->mapped += count;
+}
+
+fat32_fs_t::file_extents_t *fat32_fs_t::acquire_extents(
+        fat32_dir_entry_t const *de)
+{
+    extent_scoped_lock lock(extent_lock);
+
+    auto it = extent_maps.find(de);
+
+    if (it != extent_maps.end()) {
+        ++it->second->refcount;
+        return it->second;
+    }
+
+    file_extents_t *extents = new (ext::nothrow) file_extents_t();
+
+    if (unlikely(!extents))
+        panic_oom();
+
+    extents->dirent = de;
+    extents->refcount = 1;
+
+    if (unlikely(extent_maps.insert({ de, extents }).first ==
+                 extent_maps.end()))
+        panic_oom();
+
+    return extents;
+}
+
+void fat32_fs_t::release_extents(file_extents_t *extents)
+{
+    extent_scoped_lock lock(extent_lock);
+
+    if (--extents->refcount)
+        return;
+
+    extent_maps.erase(extents->dirent);
+
+    lock.unlock();
+
+    delete extents;
+}
+
+void fat32_fs_t::extents_extended(fat32_dir_entry_t const *de)
+{
+    extent_scoped_lock lock(extent_lock);
+
+    auto it = extent_maps.find(de);
+
+    // The existing runs are still right, continue from the old end
+    if (it != extent_maps.end())
+        it->second->complete = false;
 }
 
 fat32_dir_union_t *fat32_fs_t::lookup_dirent(
@@ -988,32 +2004,31 @@ fat32_dir_union_t *fat32_fs_t::dirent_create(
         for (int i = 0; i < count; ++i)
             ins_point[i] = lfn.fragments[i];
 
+        if (sync_dir(ins_point) < 0)
+            return nullptr;
+
         // Write EOF
-        assert(fat[extend_cluster] == 1);
-        //assert(fat2[extend_cluster] == 1);
-        fat[extend_cluster] = 0x0FFFFFF8;
-        fat2[extend_cluster] = 0x0FFFFFF8;
-        if (sync_fat_entry(extend_cluster) < 0)
+        assert(fat_get(extend_cluster) == 1);
+        if (fat_set(extend_cluster, 0x0FFFFFF8) < 0 ||
+                sync_fat_entry(extend_cluster) < 0)
             return nullptr;
     } else {
         // Perform transacted update
         backup = transact_cluster(prev_cluster, dde, result_cluster);
 
-        // Copy directory entries into page cache
+        // Copy directory entries into the cached cluster
         for (int i = 0; i < count; ++i)
             ins_point[i] = lfn.fragments[i];
 
         // Write new directory entries to disk
-        if (msync(ins_point, sizeof(*ins_point) * count, MS_SYNC) < 0)
+        if (sync_dir(ins_point) < 0)
             return nullptr;
     }
 
     // Commit transaction
     if (prev_cluster) {
-        fat[prev_cluster] = result_cluster;
-        fat2[prev_cluster] = result_cluster;
-
-        if (sync_fat_entry(prev_cluster) < 0)
+        if (fat_set(prev_cluster, result_cluster) < 0 ||
+                sync_fat_entry(prev_cluster) < 0)
             return nullptr;
     } else {
         if (change_dirent_start(dde, result_cluster) < 0)
@@ -1022,10 +2037,32 @@ fat32_dir_union_t *fat32_fs_t::dirent_create(
 
     if (!extend_cluster) {
         assert(backup != 0);
-        fat[backup] = 0;
-        fat2[backup] = 0;
+        free_cluster(backup);
+    } else {
+        extents_extended(&dde->short_entry);
+    }
+
+    dir_index_scoped_lock index_lock(dir_index_lock);
+
+    auto index_it = dir_indexes.find(dir_start);
+
+    if (index_it != dir_indexes.end()) {
+        char name[full_lfn_t::max_name_utf8 + 1];
+        size_t len = name_from_lfns(name, &lfn) - name;
+
+        // Forget the index rather than let it miss the new name
+        if (unlikely(!index_it->second->insert(
+                         name, len, uintptr_t(ins_point +
+                                              lfn.lfn_entry_count)))) {
+            delete index_it->second;
+            dir_indexes.erase(index_it);
+        }
     }
 
+    index_lock.unlock();
+
+    sync_fsinfo();
+
     return ins_point + lfn.lfn_entry_count;
 }
 
@@ -1035,7 +2072,7 @@ int fat32_fs_t::change_dirent_start(fat32_dir_union_t *dde, cluster_t start)
         dde->short_entry.start_lo = (start >> (0*16)) & 0xFFFF;
         dde->short_entry.start_hi = (start >> (1*16)) & 0xFFFF;
 
-        return msync(dde, sizeof(*dde), MS_SYNC);
+        return sync_dir(dde);
     }
 
     // Update synthetic root directory directory entry
@@ -1043,22 +2080,47 @@ int fat32_fs_t::change_dirent_start(fat32_dir_union_t *dde, cluster_t start)
     dde->short_entry.start_hi = (start >> (1*16)) & 0xFFFF;
 
     // Update boot parameter block root directory location
-    cluster_t *root_start = (cluster_t*)(mm_dev + 0x2C);
+    cluster_t *root_start = (cluster_t*)(boot_buf->data + 0x2C);
     *root_start = start;
 
     root_cluster = start;
 
-    return msync(root_start, sizeof(cluster_t), MS_SYNC);
+    bcache_mark_dirty(boot_buf);
+
+    errno_t err = bcache_writeback(boot_buf);
+
+    return likely(err == errno_t::OK) ? 0 : -int(err);
 }
 
 int fat32_fs_t::sync_fat_entry(cluster_t cluster)
 {
-    int result = msync(fat + cluster, sizeof(cluster_t), MS_SYNC);
+    return sync_fat_range(cluster, 1);
+}
+
+int fat32_fs_t::sync_fat_range(cluster_t cluster, int32_t count)
+{
+    cluster_t en = cluster + count;
 
-    if (likely(result >= 0))
-        return msync(fat2 + cluster, sizeof(cluster_t), MS_SYNC);
+    // All of the first copy, then the second, one block at a time
+    for (int copy = 0; copy < 2; ++copy) {
+        for (cluster_t block = cluster; block < en;
+             block = ((block >> fat_block_shift) + 1) << fat_block_shift) {
+            errno_t err = errno_t::EIO;
+            bcache_buf_t *buf = fat_block(block, copy != 0, &err);
 
-    return result;
+            if (unlikely(!buf))
+                return -int(err);
+
+            err = bcache_writeback(buf);
+
+            bcache_release(buf);
+
+            if (unlikely(err != errno_t::OK))
+                return -int(err);
+        }
+    }
+
+    return 0;
 }
 
 void fat32_fs_t::date_decode(time_of_day_t *tod,
@@ -1121,15 +2183,16 @@ int32_t fat32_fs_t::transact_cluster(
     if (unlikely(!backup))
         return 0;
 
-    void *destination = lookup_cluster(backup);
-    void *source = lookup_cluster(cluster);
-    memcpy(destination, source, block_size);
-    result = msync(destination, block_size, MS_SYNC);
-    if (unlikely(result < 0))
+    void const *source = dir_cluster(cluster);
+
+    result = source ? dir_cluster_new(backup, source) : -int(errno_t::EIO);
+
+    if (unlikely(result < 0)) {
+        free_cluster(backup);
         return result;
+    }
 
-    fat[backup] = fat[cluster];
-    fat2[backup] = fat[cluster];
+    fat_set(backup, fat_get(cluster));
     result = sync_fat_entry(backup);
     if (unlikely(result < 0))
         return result;
@@ -1139,8 +2202,7 @@ int32_t fat32_fs_t::transact_cluster(
         result = change_dirent_start(dde, backup);
     } else {
         // Not the first cluster, adjust FAT entry
-        fat[prev_cluster] = backup;
-        fat2[prev_cluster] = backup;
+        fat_set(prev_cluster, backup);
         result = sync_fat_entry(prev_cluster);
     }
 
@@ -1149,7 +2211,7 @@ int32_t fat32_fs_t::transact_cluster(
 
 fat32_fs_t::file_handle_t *fat32_fs_t::create_handle(
         fs_file_info_t *dirfi, char const *path,
-        int flags, mode_t mode, errno_t& err)
+        int flags, mode_t mode, errno_t& err, bool *created)
 {
     fat32_dir_union_t *dde;
     fat32_dir_union_t *fde = lookup_dirent(dirfi, path, &dde);
@@ -1181,6 +2243,9 @@ fat32_fs_t::file_handle_t *fat32_fs_t::create_handle(
                 err = errno_t::EIO;
                 return nullptr;
             }
+
+            if (created)
+                *created = true;
         }
     }
 
@@ -1198,8 +2263,9 @@ fat32_fs_t::file_handle_t *fat32_fs_t::create_handle(
     file->fs = this;
     file->dirent = &fde->short_entry;
 
-    file->cached_cluster = dirent_start_cluster(&fde->short_entry);
-    file->cached_offset = 0;
+    file->extents = acquire_extents(file->dirent);
+
+    file->direct = flags & O_DIRECT;
 
     return file;
 }
@@ -1210,80 +2276,58 @@ ssize_t fat32_fs_t::internal_rw(file_handle_t *file,
     char *io = (char*)buf;
     ssize_t result = 0;
 
-    // The fat chain is a singly linked list, so we
-    // keep track of our current offset as we step through
-    // the chain. If a read outside the "cached" range occurs
-    // we reiterate through the fat chain and reset the cache
+    uint8_t cluster_shift = sector_shift + block_shift;
 
-    off_t cached_end = file->cached_cluster
-            ? file->cached_offset + block_size
-            : 0;
+    // Where clusters allocated by this write start, and where it ends
+    off_t fresh = 0;
+    off_t write_end = offset + size;
 
-    while (size > 0) {
+    if (read) {
         if (unlikely(!file->dirent->is_within_size(offset)))
-            break;
-
-        // Calculate the amount of data remaining at this offset
-        off_t remain = file->dirent->size - offset;
-
-        remain = (remain > 0) ? remain : 0;
+            return 0;
 
         // Clamp read size to entire remainder of file
-        size = (size > uint64_t(remain)) ? remain : size;
-
-        if (file->cached_cluster &&
-                file->dirent->is_within_size(offset) &&
-                (offset >= cached_end) &&
-                (offset < cached_end + block_size)) {
-            // We are caching a position in the chain, and,
-            // the offset is within the file size, and,
-            // the offset is in the next block in the chain, then,
-            // move to next cluster
-            file->cached_offset += block_size;
-            cached_end = file->cached_offset + block_size;
-            file->cached_cluster = fat[file->cached_cluster];
-        } else if (!file->cached_cluster ||
-                   (offset < file->cached_offset) ||
-                   (offset >= cached_end)) {
-            // We are not caching a position, or,
-            // we are rewinding to before the cached position, or,
-            // we are seeking past the end of the cached cluster, then,
-            // offset cache miss
-            file->cached_cluster = dirent_start_cluster(file->dirent);
-            file->cached_offset = 0;
-            cached_end = 0;
-
-            // Walk from the start of the chain to the new position
-            // if it is a write, possibly append clusters to the chain
-            walk_cluster_chain(file, offset, !read);
-
-            if (file->cached_cluster &&
-                    (file->dirent->is_directory() ||
-                     file->dirent->size > 0 || !read)) {
-                // We successfully walked the cluster chain, and
-                // (it is a directory or
-                //  the file is not empty
-                //  or it is a write), then
-                cached_end = file->cached_offset + block_size;
-            }
+        if (!file->dirent->is_directory()) {
+            off_t remain = file->dirent->size - offset;
+
+            size = (size > uint64_t(remain)) ? remain : size;
         }
+    } else if (size > 0) {
+        // Allocate the clusters for the whole write up front, so a large
+        // write gets a few contiguous runs instead of a cluster at a time
+        off_t covered = reserve_clusters(file, offset, write_end, fresh);
+
+        if (unlikely(covered < 0))
+            return covered;
 
-        size_t avail;
+        if (unlikely(covered <= offset))
+            return -int(errno_t::ENOSPC);
 
-        if (offset < cached_end)
-            avail = cached_end - offset;
-        else
-            avail = 0;
+        // Disk full, write what fits
+        if (write_end > covered) {
+            write_end = covered;
+            size = covered - offset;
+        }
+    }
 
-        assert(avail <= block_size);
+    // Each pass moves as much as the run of contiguous clusters
+    // holding the offset allows, the device mapping is contiguous too
+    extent_t run;
+    while (size > 0 && lookup_extent(file, offset >> cluster_shift, run)) {
+        off_t run_st = off_t(run.index) << cluster_shift;
+        off_t run_en = run_st + (off_t(run.count) << cluster_shift);
+
+        size_t avail = run_en - offset;
 
         if (avail > size)
             avail = size;
 
-        size_t cluster_data_ofs = offsetof_cluster(file->cached_cluster);
+        void *disk_data = (char*)lookup_cluster(run.cluster) +
+                (offset - run_st);
 
-        void *disk_data = mm_dev + cluster_data_ofs +
-                (offset - file->cached_offset);
+        // Issue one large read for the range instead of a fault per page
+        if (read && avail > block_size)
+            madvise(disk_data, avail, MADV_WILLNEED);
 
         if (read) {
             if (mm_is_user_range(io, avail)) {
@@ -1294,38 +2338,153 @@ ssize_t fat32_fs_t::internal_rw(file_handle_t *file,
             }
         } else {
             if (mm_is_user_range(io, avail)) {
-                if (unlikely(!mm_copy_user(disk_data, io, avail)))
+                if (unlikely(!mm_copy_user(disk_data, io, avail))) {
+                    abandon_write(file, offset, fresh, write_end);
                     return -int(errno_t::EFAULT);
+                }
             } else {
                 memcpy(disk_data, io, avail);
             }
             int status = msync(disk_data, avail, MS_ASYNC);
-            if (status < 0)
+            if (status < 0) {
+                abandon_write(file, offset, fresh, write_end);
                 return status;
+            }
+
+            note_write(file, offset + avail);
+        }
+
+        offset += avail;
+        size -= avail;
+        io += avail;
+        result += avail;
+    }
+
+    return result;
+}
+
+void fat32_fs_t::note_write(file_handle_t *file, off_t end)
+{
+    // Update size
+    if (file->dirent->size < end)
+        file->dirent->size = end;
+
+    // Update last-modified
+    time_of_day_t now = time_ofday();
+    date_encode(&file->dirent->modified_date,
+                &file->dirent->modified_time, nullptr, now);
+
+    // Set archive bit
+    file->dirent->attr |= FAT_ATTR_ARCH;
+
+    // Mark for writeback
+    file->dirty = true;
+}
+
+ssize_t fat32_fs_t::direct_rw(file_handle_t *file,
+        void *buf, size_t size, off_t offset, bool read)
+{
+    char *io = (char*)buf;
+    ssize_t result = 0;
+
+    uint8_t cluster_shift = sector_shift + block_shift;
+    size_t sector_mask = sector_size - 1;
+
+    if (unlikely((size | offset | uintptr_t(buf)) & sector_mask) ||
+            file->dirent->is_directory())
+        return internal_rw(file, buf, size, offset, read);
+
+    off_t fresh = 0;
+    off_t write_end = offset + size;
+
+    // What is left after the last whole sector, at the end of the file
+    size_t tail = 0;
+
+    if (read) {
+        if (unlikely(!file->dirent->is_within_size(offset)))
+            return 0;
+
+        off_t remain = file->dirent->size - offset;
 
-            // Update size
-            if (file->dirent->size < offset + avail)
-                file->dirent->size = offset + avail;
+        if (size > uint64_t(remain)) {
+            size = remain;
+            tail = size & sector_mask;
+            size -= tail;
+        }
+    } else if (size > 0) {
+        off_t covered = reserve_clusters(file, offset, write_end, fresh);
+
+        if (unlikely(covered < 0))
+            return covered;
+
+        if (unlikely(covered <= offset))
+            return -int(errno_t::ENOSPC);
+
+        // Disk full, write the whole sectors that fit
+        if (write_end > covered) {
+            write_end = covered;
+            size = covered - offset;
+        }
+    }
+
+    // Each pass transfers the run of contiguous clusters holding the
+    // offset with one request, straight into or out of the buffer pages
+    extent_t run;
+    while (size > 0 && lookup_extent(file, offset >> cluster_shift, run)) {
+        off_t run_st = off_t(run.index) << cluster_shift;
+        off_t run_en = run_st + (off_t(run.count) << cluster_shift);
+
+        size_t avail = run_en - offset;
 
-            // Update last-modified
-            time_of_day_t now = time_ofday();
-            date_encode(&file->dirent->modified_date,
-                        &file->dirent->modified_time, nullptr, now);
+        if (avail > size)
+            avail = size;
+
+        char *disk_data = (char*)lookup_cluster(run.cluster) +
+                (offset - run_st);
+
+        uint64_t lba = lba_st + ((disk_data - mm_dev) >> sector_shift);
+
+        int status;
+
+        // The device mapping must not keep older copies of what is
+        // written. Reads need nothing here: buffered writes and zeroed
+        // clusters are written through before they return, and shared
+        // file mappings were written back before the lock was taken
+        if (!read) {
+            status = mm_device_invalidate(disk_data, avail);
+
+            if (unlikely(status < 0)) {
+                abandon_write(file, offset, fresh, write_end);
+                return status;
+            }
+        }
 
-            // Set archive bit
-            file->dirent->attr |= FAT_ATTR_ARCH;
+        status = storage_direct_io(drive, io, avail >> sector_shift,
+                                   lba, !read);
 
-            // Mark for writeback
-            file->dirty = true;
+        if (unlikely(status < 0)) {
+            if (!read)
+                abandon_write(file, offset, fresh, write_end);
+            return status;
         }
 
+        if (!read)
+            note_write(file, offset + avail);
+
         offset += avail;
         size -= avail;
         io += avail;
         result += avail;
+    }
 
-        if (unlikely(avail == 0))
-            break;
+    // The partial sector at the end of the file goes through the cache
+    if (tail && size == 0) {
+        ssize_t tail_result = internal_rw(file, io, tail, offset, true);
+
+        if (unlikely(tail_result < 0))
+            return tail_result;
+
+        result += tail_result;
     }
 
     return result;
@@ -1340,8 +2499,8 @@ fat32_fs_t::fat32_fs_t()
     , lba_st(0)
     , lba_en(0)
     , serial(0)
-    , fat(nullptr)
-    , fat2(nullptr)
+    , fat_lba(0)
+    , fat_sectors(0)
     , fat_size(0)
     , root_cluster(0)
     , cluster_ofs(0)
@@ -1351,6 +2510,11 @@ fat32_fs_t::fat32_fs_t()
     , sector_shift(0)
     , block_shift(0)
     , fat_block_shift(0)
+    , free_count(0)
+    , next_free(2)
+    , boot_buf(nullptr)
+    , fsinfo(nullptr)
+    , fsinfo_buf(nullptr)
     , root_dirent{}
 {
 }
@@ -1361,22 +2525,19 @@ bool fat32_fs_t::mount(fs_init_info_t *conn)
 
     sector_size = drive->info(STORAGE_INFO_BLOCKSIZE);
 
-    ext::unique_ptr<char[]> sector_buffer =
-            new (ext::nothrow) char[sector_size];
-
-    if (!sector_buffer)
-        return false;
-
     fat32_bpb_data_t bpb;
 
     lba_st = conn->part_st;
     lba_en = conn->part_st + conn->part_len;
 
-    if (drive->read_blocks(sector_buffer, 1, lba_st) < 0)
+    // Held until unmount, renaming the root directory rewrites it
+    boot_buf = bcache_read(drive, lba_st, sector_size);
+
+    if (!boot_buf)
         return false;
 
     // Pass 0 partition cluster to get partition relative values
-    fat32_parse_bpb(&bpb, 0, sector_buffer);
+    fat32_parse_bpb(&bpb, 0, boot_buf->data);
 
     serial = bpb.serial;
 
@@ -1403,14 +2564,56 @@ bool fat32_fs_t::mount(fs_init_info_t *conn)
                 this, block_size, conn->part_len,
                 PROT_READ | PROT_WRITE, &fat32_fs_t::mm_fault_handler);
 
-    if (unlikely(!mm_dev))
+    if (unlikely(!mm_dev)) {
+        release_metadata();
         return false;
+    }
 
     fat_size = bpb.sec_per_fat << sector_shift;
-    fat = (cluster_t*)lookup_sector(bpb.first_fat_lba);
-    fat2 = (cluster_t*)lookup_sector(bpb.first_fat_lba + bpb.sec_per_fat);
+    fat_lba = bpb.first_fat_lba;
+    fat_sectors = bpb.sec_per_fat;
     end_cluster = (lba_en - cluster_ofs) >> bit_log2(bpb.sec_per_cluster);
 
+    // Don't trust clusters past the end of the FAT
+    if (end_cluster > cluster_t(fat_size >> bit_log2(sizeof(cluster_t))))
+        end_cluster = fat_size >> bit_log2(sizeof(cluster_t));
+
+    if (bpb.fsinfo_sector != 0 && bpb.fsinfo_sector != 0xFFFF) {
+        bcache_buf_t *buf = bcache_read(
+                    drive, lba_st + bpb.fsinfo_sector, sector_size);
+
+        fat32_fsinfo_t *info = buf ? (fat32_fsinfo_t*)buf->data : nullptr;
+
+        if (info && info->lead_sig == FAT32_FSINFO_LEAD_SIG &&
+                info->struct_sig == FAT32_FSINFO_STRUCT_SIG &&
+                info->trail_sig == FAT32_FSINFO_TRAIL_SIG) {
+            fsinfo_buf = buf;
+            fsinfo = info;
+        } else {
+            bcache_release(buf);
+        }
+    }
+
+    if (unlikely(!build_free_map())) {
+        munmap(mm_dev, conn->part_len << sector_shift);
+        mm_dev = nullptr;
+        release_metadata();
+        return false;
+    }
+
+    if (fsinfo) {
+        // The free count is only a hint, the map is authoritative
+        if (fsinfo->free_count != FAT32_FSINFO_UNKNOWN &&
+                fsinfo->free_count != uint32_t(free_count)) {
+            FAT32_TRACE("FSInfo free count %u corrected to %d\n",
+                        fsinfo->free_count, free_count);
+        }
+
+        if (fsinfo->next_free >= 2 &&
+                fsinfo->next_free < uint32_t(end_cluster))
+            next_free = fsinfo->next_free;
+    }
+
     //int fat_mismatches = 0;
     //for (int i = 0, e = fat_size >> bit_log2(sizeof(cluster_t)); i < e; ++i)
     //    fat_mismatches += fat[i] != fat2[i];
@@ -1458,7 +2661,21 @@ void fat32_fs_t::unmount()
 {
     write_lock lock(rwlock);
 
+    for (auto& item : dir_indexes)
+        delete item.second;
+    dir_indexes.clear();
+
+    // File data first, it is written through the mapping
     munmap(mm_dev, (lba_en - lba_st) << sector_shift);
+
+    int status = sync_metadata();
+
+    if (unlikely(status < 0))
+        FAT32_TRACE("metadata writeback failed, errno=%d\n", -status);
+
+    release_metadata();
+
+    bcache_invalidate(drive);
 }
 
 bool fat32_fs_t::is_boot() const
@@ -1501,6 +2718,30 @@ ssize_t fat32_fs_t::readdir(fs_file_info_t *fi,
     if (unlikely(!file->dirent->is_directory()))
         return -int(errno_t::ENOTDIR);
 
+    read_lock lock(rwlock);
+
+    return readdir_locked(file, buf, offset);
+}
+
+// Pack entries under one hold of the lock, instead of one per entry
+ssize_t fat32_fs_t::getdents(fs_file_info_t *fi, void *buf,
+                             size_t size, off_t &offset)
+{
+    file_handle_t *file = (file_handle_t*)fi;
+    if (unlikely(!file->dirent->is_directory()))
+        return -int(errno_t::ENOTDIR);
+
+    read_lock lock(rwlock);
+
+    return getdents_pack(buf, size, offset,
+                         [&](dirent_t *ent, off_t ofs) {
+        return readdir_locked(file, ent, ofs);
+    });
+}
+
+ssize_t fat32_fs_t::readdir_locked(file_handle_t *file, dirent_t *buf,
+                                   off_t offset)
+{
     full_lfn_t lfn;
     size_t index;
     size_t distance;
@@ -1509,8 +2750,6 @@ ssize_t fat32_fs_t::readdir(fs_file_info_t *fi,
 
     char expected_fragments = 0;
 
-    read_lock lock(rwlock);
-
     for (index = 0, distance = 0;
          sizeof(lfn.fragments[index]) == internal_rw(
              file, lfn.fragments + index,
@@ -1583,7 +2822,9 @@ ssize_t fat32_fs_t::readdir(fs_file_info_t *fi,
 
 int fat32_fs_t::releasedir(fs_file_info_t *fi)
 {
-    handles.free(static_cast<file_handle_t*>(fi));
+    file_handle_t *file = static_cast<file_handle_t*>(fi);
+    release_extents(file->extents);
+    handles.free(file);
     return 0;
 }
 
@@ -1749,13 +2990,14 @@ int fat32_fs_t::openat(fs_file_info_t **fi,
     file_handle_t *file;
 
     errno_t err = errno_t::OK;
+    bool created = false;
 
     if (!(flags & O_CREAT)) {
         read_lock lock(rwlock);
         file = create_handle(dirfi, path, flags, mode, err);
     } else {
         write_lock lock(rwlock);
-        file = create_handle(dirfi, path, flags, mode, err);
+        file = create_handle(dirfi, path, flags, mode, err, &created);
     }
 
     if (unlikely(!file))
@@ -1763,7 +3005,7 @@ int fat32_fs_t::openat(fs_file_info_t **fi,
 
     *fi = file;
 
-    return 0;
+    return created ? FS_OPEN_CREATED : 0;
 }
 
 int fat32_fs_t::release(fs_file_info_t *fi)
@@ -1774,8 +3016,9 @@ int fat32_fs_t::release(fs_file_info_t *fi)
     int status = 0;
 
     if (file->dirty)
-        status = msync(file->dirent, sizeof(*file->dirent), MS_SYNC);
+        status = sync_dir(file->dirent);
 
+    release_extents(file->extents);
     handles.free(file);
 
     return status;
@@ -1789,9 +3032,23 @@ ssize_t fat32_fs_t::read(fs_file_info_t *fi,
                           size_t size,
                           off_t offset)
 {
+    file_handle_t *file = (file_handle_t*)fi;
+
+    // Writes made through shared mappings of the file must reach the
+    // disk first. Before locking, they are written back through here
+    if (file->direct) {
+        errno_t err = filemap_sync(this, file->get_inode());
+
+        if (unlikely(err != errno_t::OK))
+            return -int(err);
+    }
+
     read_lock lock(rwlock);
 
-    return internal_rw((file_handle_t*)fi, buf, size, offset, true);
+    if (file->direct)
+        return direct_rw(file, buf, size, offset, true);
+
+    return internal_rw(file, buf, size, offset, true);
 }
 
 ssize_t fat32_fs_t::write(fs_file_info_t *fi,
@@ -1799,9 +3056,22 @@ ssize_t fat32_fs_t::write(fs_file_info_t *fi,
                            size_t size,
                            off_t offset)
 {
+    file_handle_t *file = (file_handle_t*)fi;
+
+    // Older writes through shared mappings go to the disk before this one
+    if (file->direct) {
+        errno_t err = filemap_sync(this, file->get_inode());
+
+        if (unlikely(err != errno_t::OK))
+            return -int(err);
+    }
+
     write_lock lock(rwlock);
 
-    return internal_rw((file_handle_t*)fi, (char*)buf, size, offset, false);
+    if (file->direct)
+        return direct_rw(file, (char*)buf, size, offset, false);
+
+    return internal_rw(file, (char*)buf, size, offset, false);
 }
 
 int fat32_fs_t::ftruncate(fs_file_info_t *fi,
@@ -1857,8 +3127,19 @@ int fat32_fs_t::fsync(fs_file_info_t *fi,
     write_lock lock(rwlock);
 
     (void)isdatasync;
-    (void)fi;
-    return 0;
+
+    file_handle_t *file = (file_handle_t*)fi;
+
+    if (file->dirty) {
+        int status = sync_dir(file->dirent);
+
+        if (unlikely(status < 0))
+            return status;
+
+        file->dirty = false;
+    }
+
+    return sync_metadata();
 }
 
 int fat32_fs_t::fsyncdir(fs_file_info_t *fi,
@@ -1868,7 +3149,7 @@ int fat32_fs_t::fsyncdir(fs_file_info_t *fi,
 
     (void)isdatasync;
     (void)fi;
-    return 0;
+    return sync_metadata();
 }
 
 int fat32_fs_t::flush(fs_file_info_t *fi)
@@ -1876,7 +3157,7 @@ int fat32_fs_t::flush(fs_file_info_t *fi)
     write_lock lock(rwlock);
 
     (void)fi;
-    return 0;
+    return sync_metadata();
 }
 
 //
@@ -1915,8 +3196,16 @@ int fat32_fs_t::statfs(fs_statvfs_t* stbuf)
 {
     read_lock lock(rwlock);
 
-    (void)stbuf;
-    return -int(errno_t::ENOSYS);
+    *stbuf = {};
+    stbuf->f_bsize = block_size;
+    stbuf->f_frsize = block_size;
+    stbuf->f_blocks = end_cluster - 2;
+    stbuf->f_bfree = free_count;
+    stbuf->f_bavail = free_count;
+    stbuf->f_fsid = serial;
+    stbuf->f_namemax = 255;
+
+    return 0;
 }
 
 //
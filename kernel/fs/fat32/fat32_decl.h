@@ -18,6 +18,7 @@ struct fat32_bpb_data_t {
     uint8_t number_of_fats;		// 0x10 Always 2
     uint32_t sec_per_fat;		// 0x24 1 per 128 clusters
     uint32_t root_dir_start;	// 0x2C LBA
+    uint16_t fsinfo_sector;     // 0x30 FSInfo sector, 0 or 0xFFFF if none
     uint32_t serial;            // 0x43 serial number
     uint16_t signature;			// 0x1FE Always 0xAA55
 
@@ -217,6 +218,36 @@ union fat32_dir_union_t {
     fat32_long_dir_entry_t long_entry;
 };
 
+// FSInfo sector, holds hints maintained by the filesystem driver.
+// Either hint is 0xFFFFFFFF when unknown, and both may be stale
+#define FAT32_FSINFO_LEAD_SIG   0x41615252U
+#define FAT32_FSINFO_STRUCT_SIG 0x61417272U
+#define FAT32_FSINFO_TRAIL_SIG  0xAA550000U
+#define FAT32_FSINFO_UNKNOWN    0xFFFFFFFFU
+
+struct fat32_fsinfo_t {
+    // offset = 0x000 "RRaA"
+    uint32_t lead_sig;
+
+    uint8_t reserved1[480];
+
+    // offset = 0x1E4 "rrAa"
+    uint32_t struct_sig;
+
+    // offset = 0x1E8 Last known free cluster count
+    uint32_t free_count;
+
+    // offset = 0x1EC Cluster where the search for a free cluster should start
+    uint32_t next_free;
+
+    uint8_t reserved2[12];
+
+    // offset = 0x1FC
+    uint32_t trail_sig;
+};
+
+C_ASSERT(sizeof(fat32_fsinfo_t) == 512);
+
 struct fat32_lfn_fragment_t {
     uint8_t ordinal;
     uint16_t fragment[13];
@@ -238,6 +269,7 @@ static _always_inline void fat32_parse_bpb(fat32_bpb_data_t *bpb,
     bpb->number_of_fats = *(uint8_t*)(sector_buffer + 0x10);
     bpb->sec_per_fat = *(uint32_t*)(sector_buffer + 0x24);
     bpb->root_dir_start = *(uint32_t*)(sector_buffer + 0x2C);
+    bpb->fsinfo_sector = *(uint16_t*)(sector_buffer + 0x30);
     bpb->serial = *(uint32_t*)(sector_buffer + 0x43);
     bpb->signature = *(uint16_t*)(sector_buffer + 0x1FE);
 
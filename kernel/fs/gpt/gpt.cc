@@ -1,4 +1,5 @@
 #include "dev_storage.h"
+#include "bcache.h"
 #include "string.h"
 #include "unique_ptr.h"
 #include "printk.h"
@@ -89,50 +90,45 @@ ext::vector<part_dev_t *> gpt_part_factory_t::detect(storage_dev_base_t *drive)
 
     size_t sector_size = 1UL << log2_sector_size;
 
-    // Create sector-sized buffer to look at partition header
-    ext::unique_ptr<uint8_t[]> buffer(new (ext::nothrow) uint8_t[sector_size]);
-
-    if (unlikely(!buffer))
-        panic_oom();
-
     GPT_TRACE("Reading 1 %lu byte block at LBA 1 from %s\n",
               sector_size, drive_name);
 
     // Read primary GPT header
-    if (unlikely(drive->read_blocks(buffer, 1, 1) < 0))
+    bcache_buf_t *buf = bcache_read(drive, 1, sector_size);
+
+    if (unlikely(!buf))
         return list;
 
     gpt_hdr_t hdr;
-    memcpy(&hdr, buffer, sizeof(hdr));
+    memcpy(&hdr, buf->data, sizeof(hdr));
+
+    bcache_release(buf);
 
     if (unlikely(hdr.sig != hdr.sig_expected))
         return list;
 
     size_t part_tbl_size = hdr.part_ent_sz * hdr.part_ent_count;
 
-    size_t part_tbl_sector_count = part_tbl_size >> log2_sector_size;
+    size_t part_tbl_sector_count = (part_tbl_size + sector_size - 1) >>
+            log2_sector_size;
 
     gpt_part_tbl_ent_t ptent;
 
-    buffer.reset();
-    buffer.reset(new (ext::nothrow) uint8_t[part_tbl_size]);
-
-    if (unlikely(!buffer))
-        panic_oom();
-
     GPT_TRACE("Reading %zu %zd byte blocks at LBA %" PRIu64 " from %s\n",
               part_tbl_sector_count, sector_size,
               hdr.part_ent_lba, drive_name);
 
-    if (unlikely(drive->read_blocks(buffer, part_tbl_sector_count,
-                                    hdr.part_ent_lba)) < 0)
+    buf = bcache_read(drive, hdr.part_ent_lba,
+                      part_tbl_sector_count << log2_sector_size);
+
+    if (unlikely(!buf))
         return list;
 
     for (uint32_t i = 0; i < hdr.part_ent_count; ++i) {
         ext::unique_ptr<part_dev_t> part;
 
         // Copy into aligned object
-        memcpy(&ptent, &buffer.get()[i * hdr.part_ent_sz], sizeof(ptent));
+        memcpy(&ptent, buf->data + i * hdr.part_ent_sz, sizeof(ptent));
 
         if (ptent.type_guid == efi_part) {
             part.reset(new (ext::nothrow) part_dev_t{});
@@ -157,6 +153,8 @@ ext::vector<part_dev_t *> gpt_part_factory_t::detect(storage_dev_base_t *drive)
         }
     }
 
+    bcache_release(buf);
+
     GPT_TRACE("Found %zu partitions on %s\n", list.size(), drive_name);
     return list;
 }
@@ -1,4 +1,6 @@
 #include "dev_storage.h"
+#include "bcache.h"
+#include "blk_queue.h"
 #include "iso9660_decl.h"
 #include "threadsync.h"
 #include "bitsearch.h"
@@ -13,6 +15,8 @@
 #include "cxxstring.h"
 #include "user_mem.h"
 #include "string.h"
+#include "name_index.h"
+#include "mutex.h"
 
 __BEGIN_ANONYMOUS
 
@@ -82,6 +86,25 @@ struct iso9660_fs_t final : public fs_base_ro_t {
     static char *name_copy_utf16be(
             char *out, void *in, size_t len);
 
+    // Directory index keys, two names compare equal with name_compare
+    // exactly when their keys are the same bytes. Returns the key
+    // length, or -1 if the name can't be keyed
+    static ssize_t name_key_ascii(
+            char *key, void const *name, size_t name_len);
+
+    static ssize_t name_key_utf16be(
+            char *key, void const *name, size_t name_len);
+
+    static ssize_t find_key_ascii(
+            char *key, char const *find, size_t find_len);
+
+    static ssize_t find_key_utf16be(
+            char *key, char const *find, size_t find_len);
+
+    // Longest key, and longest name that find_key accepts
+    static constexpr size_t name_key_max = 768;
+    static constexpr size_t find_key_max = 512;
+
     static uint32_t round_up(
             uint32_t n,
             uint8_t log2_size);
@@ -121,12 +144,18 @@ struct iso9660_fs_t final : public fs_base_ro_t {
 
     iso9660_dir_ent_t *lookup_dirent(char const *pathname);
 
+    // Index of the names in the directory at lba, built on first use,
+    // null if it could not be built. Called with dir_index_lock held
+    name_index_t *dir_index(uint64_t lba, iso9660_dir_ent_t *dir);
+
     static int mm_fault_handler(void *dev, void *addr,
                                 uint64_t offset, uint64_t length,
                                 bool read, bool flush);
     int mm_fault_handler(void *addr, uint64_t offset, uint64_t length,
                          bool read, bool flush);
 
+    bool read_pvd(iso9660_pvd_t *pvd, uint32_t block);
+
     bool mount(fs_init_info_t *conn);
 
     storage_dev_base_t *drive = nullptr;
@@ -152,6 +181,15 @@ struct iso9660_fs_t final : public fs_base_ro_t {
     int (*name_compare)(void const *name, size_t name_len,
                         char const *find, size_t find_len);
     char *(*name_copy)(char *out, void *in, size_t len);
+    ssize_t (*name_key)(char *key, void const *name, size_t name_len);
+    ssize_t (*find_key)(char *key, char const *find, size_t find_len);
+
+    // Name index of each directory that has been searched, by lba
+    using dir_index_lock_type = ext::mutex;
+    using dir_index_scoped_lock = ext::unique_lock<dir_index_lock_type>;
+
+    dir_index_lock_type dir_index_lock;
+    ext::map<uint64_t, name_index_t *> dir_indexes;
 
     // Path table and path table lookup table
     iso9660_pt_rec_t *pt;
@@ -298,6 +336,102 @@ char *iso9660_fs_t::name_copy_utf16be(
     return out;
 }
 
+// Each side of the last dot is compared space padded, so the key is
+// both sides with trailing spaces dropped. The version suffix is not
+// part of the comparison
+ssize_t iso9660_fs_t::name_key_ascii(
+        char *key, void const *name, size_t name_len)
+{
+    char const *chk = (char const *)name;
+    char const *chk_limit = (char const *)memrchr(chk, '.', name_len);
+    char const *chk_end = (char const *)memrchr(chk, ';', name_len);
+
+    char const *base_en = chk_limit ? chk_limit : chk;
+    char const *ext_st = base_en;
+    char const *ext_en = chk_end && chk_end > ext_st ? chk_end : ext_st;
+
+    while (base_en > chk && base_en[-1] == ' ')
+        --base_en;
+
+    while (ext_en > ext_st && ext_en[-1] == ' ')
+        --ext_en;
+
+    char *out = key;
+
+    for (char const *in = chk; in < base_en; ++in) {
+        // Never equal to a decoded codepoint
+        if (unlikely(*in & 0x80))
+            return -1;
+        *out++ = *in;
+    }
+
+    *out++ = '/';
+
+    for (char const *in = ext_st; in < ext_en; ++in) {
+        if (unlikely(*in & 0x80))
+            return -1;
+        *out++ = *in;
+    }
+
+    return out - key;
+}
+
+ssize_t iso9660_fs_t::find_key_ascii(
+        char *key, char const *find, size_t find_len)
+{
+    if (unlikely(find_len > find_key_max))
+        return -1;
+
+    char const *find_limit = (char const *)memrchr(find, '.', find_len);
+    char const *find_end = find + find_len;
+
+    char *out = key;
+
+    for (int pass = 0; pass < 2; ++pass) {
+        char const *en = pass ? find_end : find_limit ? find_limit : find;
+        char *part_st = out;
+
+        while (find < en) {
+            char32_t codepoint = utf8_to_ucs4_upd(find);
+
+            if (unlikely(codepoint >= 0x80))
+                return -1;
+
+            *out++ = char(codepoint);
+        }
+
+        while (out > part_st && out[-1] == ' ')
+            --out;
+
+        if (!pass)
+            *out++ = '/';
+    }
+
+    return out - key;
+}
+
+ssize_t iso9660_fs_t::name_key_utf16be(
+        char *key, void const *name, size_t name_len)
+{
+    return name_copy_utf16be(key, (void*)name, name_len) - key;
+}
+
+ssize_t iso9660_fs_t::find_key_utf16be(
+        char *key, char const *find, size_t find_len)
+{
+    if (unlikely(find_len > find_key_max))
+        return -1;
+
+    char const *find_end = find + find_len;
+    char *out = key;
+
+    // Reencode, so the key is the same bytes for the same codepoints
+    while (find < find_end)
+        out += ucs4_to_utf8(out, utf8_to_ucs4_upd(find));
+
+    return out - key;
+}
+
 uint32_t iso9660_fs_t::round_up(
         uint32_t n,
         uint8_t log2_size)
@@ -556,6 +690,24 @@ iso9660_dir_ent_t *iso9660_fs_t::lookup_dirent(char const *pathname)
     if (unlikely(!dir))
         return nullptr;
 
+    char key[name_key_max];
+    ssize_t key_len = find_key(key, name, name_len);
+
+    if (likely(key_len >= 0)) {
+        dir_index_scoped_lock lock(dir_index_lock);
+
+        name_index_t *index = dir_index(pt_rec_lba(pt_rec), dir);
+
+        if (likely(index)) {
+            uintptr_t found;
+
+            if (index->lookup(key, key_len, found))
+                return (iso9660_dir_ent_t *)found;
+
+            return nullptr;
+        }
+    }
+
     size_t dir_len = dirent_size(dir);
 
     iso9660_dir_ent_t *result = nullptr;
@@ -572,6 +724,47 @@ iso9660_dir_ent_t *iso9660_fs_t::lookup_dirent(char const *pathname)
     return result;
 }
 
+name_index_t *iso9660_fs_t::dir_index(uint64_t lba, iso9660_dir_ent_t *dir)
+{
+    auto it = dir_indexes.find(lba);
+
+    if (it != dir_indexes.end())
+        return it->second;
+
+    ext::unique_ptr<name_index_t> index(new (ext::nothrow) name_index_t());
+
+    if (unlikely(!index))
+        return nullptr;
+
+    size_t dir_len = dirent_size(dir);
+
+    char key[name_key_max];
+
+    for (size_t ofs = 0; ofs < dir_len; ofs = next_dirent(dir, ofs)) {
+        iso9660_dir_ent_t *de = (iso9660_dir_ent_t*)((char*)dir + ofs);
+
+        // Padding at the end of a sector
+        if (de->len == 0)
+            continue;
+
+        ssize_t key_len = name_key(key, de->name, de->filename_len);
+
+        if (key_len < 0)
+            continue;
+
+        if (unlikely(!index->insert(key, key_len, uintptr_t(de))))
+            return nullptr;
+    }
+
+    index->set_complete();
+
+    if (unlikely(dir_indexes.insert({ lba, index.get() }).first ==
+                 dir_indexes.end()))
+        return nullptr;
+
+    return index.release();
+}
+
 int iso9660_fs_t::mm_fault_handler(
         void *dev, void *addr, uint64_t offset, uint64_t length,
         bool read, bool)
@@ -591,12 +784,28 @@ int iso9660_fs_t::mm_fault_handler(void *addr, uint64_t offset, uint64_t length,
 
     printdbg("Demand paging LBA %" PRId64 " at addr %p\n", lba, addr);
 
-    return drive->read_blocks(addr, length >> sector_shift, lba);
+    return blk_read_blocks(drive, addr, length >> sector_shift, lba);
 }
 
 //
 // Startup and shutdown
 
+// Copy out the volume descriptor at the given logical block,
+// which partition detection has likely left in the cache
+bool iso9660_fs_t::read_pvd(iso9660_pvd_t *pvd, uint32_t block)
+{
+    bcache_buf_t *buf = bcache_read(drive, uint64_t(block) << block_shift,
+                                    block_size);
+
+    if (!buf)
+        return false;
+
+    memcpy(pvd, buf->data, sizeof(*pvd));
+    bcache_release(buf);
+
+    return true;
+}
+
 iso9660_factory_t::iso9660_factory_t()
     : fs_factory_t("iso9660")
 {
@@ -636,14 +845,12 @@ bool iso9660_fs_t::mount(fs_init_info_t *conn)
     lookup_path_cmp = lookup_path_cmp_ascii;
     name_compare = name_compare_ascii;
     name_copy = name_copy_ascii;
+    name_key = name_key_ascii;
+    find_key = find_key_ascii;
 
     for (uint32_t ofs = 0; ofs < 4; ++ofs) {
         // Read logical block 16
-        int err = drive->read_blocks(
-                    &pvd, 1 << block_shift,
-                    (16 + ofs) << block_shift);
-
-        if (err < 0)
+        if (!read_pvd(&pvd, 16 + ofs))
             continue;
 
         if (pvd.type_code == 2) {
@@ -653,6 +860,8 @@ bool iso9660_fs_t::mount(fs_init_info_t *conn)
             lookup_path_cmp = lookup_path_cmp_utf16be;
             name_compare = name_compare_utf16be;
             name_copy = name_copy_utf16be;
+            name_key = name_key_utf16be;
+            find_key = find_key_utf16be;
             best_ofs = ofs;
             break;
         }
@@ -660,10 +869,7 @@ bool iso9660_fs_t::mount(fs_init_info_t *conn)
 
     if (best_ofs == 0) {
         // We didn't find Joliet PVD, reread first one
-        int err = drive->read_blocks(&pvd, 1 << block_shift,
-                                     16 << block_shift);
-
-        if (err < 0)
+        if (!read_pvd(&pvd, 16))
             return false;
     }
 
@@ -692,10 +898,14 @@ bool iso9660_fs_t::mount(fs_init_info_t *conn)
     if (pt == MAP_FAILED)
         return false;
 
-    int err = drive->read_blocks(pt, pt_alloc_size >> sector_shift, pt_lba);
-    if (err < 0)
+    bcache_buf_t *pt_buf = bcache_read(drive, uint64_t(pt_lba) << block_shift,
+                                       pt_alloc_size);
+    if (!pt_buf)
         return false;
 
+    memcpy(pt, pt_buf->data, pt_alloc_size);
+    bcache_release(pt_buf);
+
     // Count the path table entries
     pt_count = walk_pt(nullptr, nullptr);
 
@@ -728,6 +938,10 @@ char const *iso9660_fs_t::name() const noexcept
 
 void iso9660_fs_t::unmount()
 {
+    for (auto& item : dir_indexes)
+        delete item.second;
+    dir_indexes.clear();
+
     munmap(pt, pt_bytes);
     pt = nullptr;
 
@@ -1,4 +1,5 @@
 #include "dev_storage.h"
+#include "bcache.h"
 #include "string.h"
 #include "unique_ptr.h"
 
@@ -34,16 +35,16 @@ iso9660_part_factory_t::detect(storage_dev_base_t *drive)
     if (sector_mul < 1)
         sector_mul = 1;
 
-    ext::unique_ptr<char[]> sector =
-            new (ext::nothrow) char[sector_size * sector_mul];
-    iso9660_pvd_t *pvd = (iso9660_pvd_t*)sector.get();
+    // The volume descriptor is read through the cache, for the mount
+    bcache_buf_t *buf = bcache_read(drive, 16 * sector_mul,
+                                    sector_size * sector_mul);
 
-    int err = drive->read_blocks(sector, 1 * sector_mul, 16 * sector_mul);
+    if (buf)
+        memcpy(sig, buf->data + 1, sizeof(sig));
 
-    if (err >= 0)
-        memcpy(sig, sector + 1, sizeof(sig));
+    if (buf && !memcmp(sig, "CD001", 5)) {
+        iso9660_pvd_t *pvd = (iso9660_pvd_t*)buf->data;
 
-    if (err >= sector_mul && !memcmp(sig, "CD001", 5)) {
         ext::unique_ptr<part_dev_t> part(new (ext::nothrow) part_dev_t{});
 
         part->drive = drive;
@@ -58,6 +59,8 @@ iso9660_part_factory_t::detect(storage_dev_base_t *drive)
             part.release();
     }
 
+    bcache_release(buf);
+
     return list;
 }
 
@@ -1,4 +1,5 @@
 #include "dev_storage.h"
+#include "bcache.h"
 #include "string.h"
 #include "unique_ptr.h"
 #include "printk.h"
@@ -50,11 +51,11 @@ ext::vector<part_dev_t *> mbr_part_factory_t::detect(storage_dev_base_t *drive)
     long sector_size = drive->info(STORAGE_INFO_BLOCKSIZE);
 
     if (sector_size >= 512) {
-        ext::unique_ptr<uint8_t[]> sector(new (ext::nothrow)
-                                          uint8_t[sector_size]);
-        memset(sector, 0, sector_size);
+        bcache_buf_t *buf = bcache_read(drive, 0, sector_size);
+
+        if (buf) {
+            uint8_t const *sector = (uint8_t const *)buf->data;
 
-        if (drive->read_blocks(sector, 1, 0) >= 0) {
             if (sector[510] == 0x55 && sector[511] == 0xAA) {
                 partition_tbl_ent_t ptbl[4];
                 memcpy(ptbl, sector + 446, sizeof(ptbl));
@@ -81,17 +82,22 @@ ext::vector<part_dev_t *> mbr_part_factory_t::detect(storage_dev_base_t *drive)
                         break;
 
                     case 0x83:
-                        // Linux filesystem
-                        ext::unique_ptr<uint8_t> ext_superblock =
-                                new (ext::nothrow) uint8_t[sector_size];
-
-                        if (drive->read_blocks(ext_superblock, 1,
-                                                ptbl[i].start_lba) < 0) {
+                        // Linux filesystem, the superblock is 1KB in.
+                        // Read it the way the filesystem will, so it
+                        // finds it in the cache
+                        bcache_buf_t *ext_superblock = bcache_read(
+                                    drive,
+                                    ptbl[i].start_lba + 1024 / sector_size,
+                                    ext::max(sector_size, 1024L));
+
+                        if (!ext_superblock) {
                             MBR_TRACE("Unable to read linux partition"
                                       " (at LBA %u)!\n", ptbl[i].start_lba);
                             break;
                         }
 
+                        bcache_release(ext_superblock);
+
                         part.reset(new (ext::nothrow) part_dev_t{});
                         part->drive = drive;
                         part->lba_st = ptbl[i].start_lba;
@@ -108,6 +114,8 @@ ext::vector<part_dev_t *> mbr_part_factory_t::detect(storage_dev_base_t *drive)
                     }
                 }
             }
+
+            bcache_release(buf);
         }
     }
 
@@ -3,15 +3,20 @@
 
 #include "likely.h"
 #include "mm.h"
-#include "rbtree.h"
+#include "mmu.h"
+#include "mutex.h"
 #include "unique_ptr.h"
-#include "algorithm.h"
 #include "memory.h"
-#include "cxxstring.h"
+#include "algorithm.h"
 #include "vector.h"
-#include "hash.h"
+#include "string.h"
+#include "time.h"
+#include "printk.h"
 #include "user_mem.h"
 #include "bootinfo.h"
+#include "name_index.h"
+#include "zlib_helper.h"
+#include "inttypes.h"
 
 #define DEBUG_TMPFS 1
 #if DEBUG_TMPFS
@@ -20,31 +25,325 @@
 #define TMPFS_TRACE(...) ((void)0)
 #endif
 
+// Pages mapped by one call when no freed page is available
+#define TMPFS_PAGE_BATCH        16
+
+// Freed pages kept for reuse, the rest are unmapped
+#define TMPFS_MAX_FREE_PAGES    256
+
 __BEGIN_ANONYMOUS
 
-static void *initrd_st;
-static size_t initrd_sz;
+// Data pages and radix nodes of every tmpfs file. The kernel has no
+// direct map of physical memory, so each page needs a kernel mapping.
+// Pages are mapped a batch at a time, and freed pages are chained
+// through their first word and handed out again, so a growing file
+// rarely maps and a truncated one rarely unmaps
+class tmpfs_page_pool_t {
+public:
+    static void *alloc()
+    {
+        scoped_lock lock(free_lock);
+
+        void **page = free_first;
+
+        if (page) {
+            free_first = (void**)*page;
+            --free_count;
+            lock.unlock();
+
+            memset(page, 0, PAGE_SIZE);
+
+            return page;
+        }
+
+        lock.unlock();
+
+        // Populated pages are zeroed
+        char *batch = (char*)mmap(nullptr, PAGE_SIZE * TMPFS_PAGE_BATCH,
+                                  PROT_READ | PROT_WRITE, MAP_POPULATE);
+
+        if (unlikely(batch == MAP_FAILED)) {
+            // Memory is short, try for just the one page
+            void *one = mmap(nullptr, PAGE_SIZE,
+                             PROT_READ | PROT_WRITE, MAP_POPULATE);
+
+            return one != MAP_FAILED ? one : nullptr;
+        }
+
+        lock.lock();
+
+        for (size_t i = 1; i < TMPFS_PAGE_BATCH; ++i) {
+            void **extra = (void**)(batch + (i << PAGE_SIZE_BIT));
+            *extra = free_first;
+            free_first = extra;
+            ++free_count;
+        }
+
+        return batch;
+    }
+
+    static void free(void *page)
+    {
+        scoped_lock lock(free_lock);
+
+        if (free_count < TMPFS_MAX_FREE_PAGES) {
+            *(void**)page = free_first;
+            free_first = (void**)page;
+            ++free_count;
+            return;
+        }
+
+        lock.unlock();
+
+        munmap(page, PAGE_SIZE);
+    }
+
+private:
+    using lock_type = ext::noirq_lock<ext::spinlock>;
+    using scoped_lock = ext::unique_lock<lock_type>;
+
+    static lock_type free_lock;
+    static void **free_first;
+    static size_t free_count;
+};
+
+tmpfs_page_pool_t::lock_type tmpfs_page_pool_t::free_lock;
+void **tmpfs_page_pool_t::free_first;
+size_t tmpfs_page_pool_t::free_count;
+
+// Sparse file contents, one page for each page of the file that was
+// written, found through a radix tree of page sized nodes that grows a
+// level at a time as the file does. Pages that were never written have
+// no page and read as zero. The data pages are ordinary kernel pages, so
+// they can later be mapped into a process instead of copied
+class tmpfs_pages_t {
+public:
+    tmpfs_pages_t() = default;
+    tmpfs_pages_t(tmpfs_pages_t const&) = delete;
+    tmpfs_pages_t& operator=(tmpfs_pages_t const&) = delete;
+
+    ~tmpfs_pages_t()
+    {
+        truncate(0);
+    }
+
+    // The page holding page index, or nullptr if it was never written
+    void *lookup(uint64_t index) const
+    {
+        if (unlikely(!levels || !in_range(index, levels)))
+            return nullptr;
+
+        void **node = root;
+
+        for (unsigned level = levels - 1; level > 0 && node; --level)
+            node = (void**)node[slot_of(index, level)];
+
+        return node ? node[slot_of(index, 0)] : nullptr;
+    }
+
+    // The page holding page index, allocating a zeroed page and any
+    // missing nodes if necessary. Returns nullptr when out of memory
+    void *create(uint64_t index)
+    {
+        while (!levels || !in_range(index, levels)) {
+            void **node = (void**)alloc_page();
+
+            if (unlikely(!node))
+                return nullptr;
+
+            // The old tree becomes the first child of the new root
+            node[0] = root;
+            root = node;
+            ++levels;
+        }
+
+        void **node = root;
+
+        for (unsigned level = levels - 1; level > 0; --level) {
+            void *&child = node[slot_of(index, level)];
+
+            if (!child && unlikely(!(child = alloc_page())))
+                return nullptr;
+
+            node = (void**)child;
+        }
+
+        void *&page = node[slot_of(index, 0)];
+
+        if (!page) {
+            if (unlikely(!(page = alloc_page())))
+                return nullptr;
+
+            ++pages;
+        }
+
+        return page;
+    }
+
+    // Free every page at or after page index first
+    void truncate(uint64_t first)
+    {
+        if (levels && trim(root, levels - 1, 0, first)) {
+            free_page(root);
+            root = nullptr;
+            levels = 0;
+        }
+    }
+
+    size_t page_count() const
+    {
+        return pages;
+    }
+
+private:
+    static constexpr unsigned fanout_shift = PAGE_SIZE_BIT - 3;
+    static constexpr size_t fanout = size_t(1) << fanout_shift;
+
+    static bool in_range(uint64_t index, unsigned levels)
+    {
+        return levels * fanout_shift >= 64 ||
+                !(index >> (levels * fanout_shift));
+    }
+
+    static size_t slot_of(uint64_t index, unsigned level)
+    {
+        return (index >> (level * fanout_shift)) & (fanout - 1);
+    }
+
+    // Zeroed
+    static void *alloc_page()
+    {
+        return tmpfs_page_pool_t::alloc();
+    }
+
+    static void free_page(void *page)
+    {
+        tmpfs_page_pool_t::free(page);
+    }
+
+    // Free the pages at or after first under node, which covers the
+    // pages from base. Returns true when nothing is left under node
+    bool trim(void **node, unsigned level, uint64_t base, uint64_t first)
+    {
+        uint64_t span = uint64_t(1) << (level * fanout_shift);
+        bool empty = true;
+
+        for (size_t i = 0; i < fanout; ++i) {
+            void *child = node[i];
+
+            if (!child)
+                continue;
+
+            uint64_t child_base = base + i * span;
+
+            if (child_base + span <= first) {
+                empty = false;
+            } else if (level == 0) {
+                free_page(child);
+                node[i] = nullptr;
+                --pages;
+            } else if (trim((void**)child, level - 1, child_base, first)) {
+                free_page(child);
+                node[i] = nullptr;
+            } else {
+                empty = false;
+            }
+        }
+
+        return empty;
+    }
+
+    void **root = nullptr;
+    unsigned levels = 0;
+    size_t pages = 0;
+};
 
 class tmpfs_fs_t final : public fs_base_t {
 public:
     void* mount(fs_init_info_t *conn);
     FS_BASE_RW_IMPL
 
+    ssize_t getdents(fs_file_info_t *fi, void *buf,
+                     size_t size, off_t &offset) override final;
+
 private:
-    friend class tmpfs_factory_t;
-
-    ext::vector<char> names;
-
-    struct file_t {
-        size_t name_ofs = 0;
-        size_t name_sz = 0;
-        size_t file_ofs = 0;
-        uint32_t name_hash = 0;
-        uint32_t file_sz = 0;
-        uint32_t mtime = 0;
-        uint16_t ino = 0;
+    static constexpr uint16_t mode_type_mask = 0xF000;
+    static constexpr uint16_t mode_dir = 0x4000;
+    static constexpr uint16_t mode_reg = 0x8000;
+    static constexpr uint16_t mode_link = 0xA000;
+    static constexpr uint16_t mode_perm_mask = 07777;
+
+    using lock_type = ext::shared_mutex;
+    using read_lock = ext::shared_lock<lock_type>;
+    using write_lock = ext::unique_lock<lock_type>;
+
+    struct inode_t;
+
+    struct dir_entry_t {
+        // nullptr when the slot is free
+        inode_t *inode;
+        char *name;
+        size_t name_len;
+    };
+
+    // The index maps names to slots, readdir walks the slots in order,
+    // the slots of removed names are reused
+    struct dir_t {
+        name_index_t index;
+        ext::vector<dir_entry_t> slots;
+        ext::vector<uint32_t> free_slots;
+    };
+
+    struct inode_t {
+        ino_t ino = 0;
         uint16_t mode = 0;
-        uint16_t nlink = 0;
+
+        // Directory entries referring to it
+        uint32_t nlink = 0;
+
+        // Open handles
+        uint32_t refcount = 0;
+
+        fs_uid_t uid = 0;
+        fs_gid_t gid = 0;
+
+        // Protects size, pages and mtime, ctime is also set under rwlock.
+        // Reads and writes take only this, so copying from or to user
+        // memory never holds the filesystem's rwlock. When both are
+        // held, rwlock is taken first
+        lock_type data_lock;
+
+        uint64_t size = 0;
+        time_t mtime = 0;
+        time_t ctime = 0;
+
+        // Directories only, nullptr once removed
+        inode_t *parent = nullptr;
+        ext::unique_ptr<dir_t> dir;
+
+        // Regular files and symlink targets
+        tmpfs_pages_t pages;
+
+        bool is_dir() const
+        {
+            return (mode & mode_type_mask) == mode_dir;
+        }
+    };
+
+    struct file_handle_t final : public fs_file_info_t {
+        file_handle_t(inode_t *inode, int flags)
+            : inode(inode)
+            , flags(flags)
+        {
+        }
+
+        ino_t get_inode() const override
+        {
+            return inode->ino;
+        }
+
+        inode_t *inode;
+        int flags;
     };
 
     struct cpio_hdr_t {
@@ -77,81 +376,712 @@ private:
         {
             return (mtime_parts[0] << 16) | mtime_parts[1];
         }
+    } _packed;
 
-        char const *name() const
-        {
-            return (char const *)(this + 1);
+    static time_t now();
+
+    static bool is_dots(char const *name, size_t len);
+
+    // Caller holds rwlock exclusive
+    inode_t *new_inode(uint16_t mode, errno_t& err);
+    void put_inode(inode_t *inode);
+    void free_tree(inode_t *dir);
+
+    // Caller holds rwlock
+    inode_t *dir_find(inode_t *dir, char const *name, size_t len) const;
+
+    // Caller holds rwlock exclusive
+    bool dir_add(inode_t *dir, char const *name, size_t len,
+                 inode_t *inode, errno_t& err);
+    void dir_remove(inode_t *dir, uint32_t slot);
+    inode_t *create(inode_t *dir, char const *name, size_t len,
+                    uint16_t mode, errno_t& err);
+
+    // Resolve all but the last component of path, the last component is
+    // returned in name and len, len is zero when path names the starting
+    // directory. Missing directories are created when make_dirs is true.
+    // Caller holds rwlock, exclusive if make_dirs is true
+    inode_t *walk_parent(fs_file_info_t *dirfi, char const *path,
+                         bool make_dirs, char const *&name, size_t& len,
+                         errno_t& err);
+
+    inode_t *walk(fs_file_info_t *dirfi, char const *path, errno_t& err);
+
+    // Caller holds the inode's data_lock, exclusive to change it
+    ssize_t read_inode(inode_t *inode, char *buf, size_t size, off_t offset);
+    ssize_t write_inode(inode_t *inode, char const *buf,
+                        size_t size, off_t offset);
+    int truncate_inode(inode_t *inode, off_t size);
+    void fill_stat(inode_t const *inode, fs_stat_t *st) const;
+
+    // Returns how far the offset advances, 0 at the end
+    ssize_t readdir_locked(inode_t *dir, dirent_t *buf, off_t offset);
+
+    // Parses the archive as it arrives, in pieces of any size, so a
+    // compressed archive can be imported as it is decompressed
+    struct cpio_reader_t {
+        enum struct state_t {
+            header,
+            name,
+            data,
+            done
+        };
+
+        state_t state = state_t::header;
+        cpio_hdr_t hdr;
+        ext::vector<char> name;
+
+        // Size of the current part, including padding, and how much of it
+        // has arrived
+        size_t want = sizeof(cpio_hdr_t);
+        size_t have = 0;
+
+        // Receives the data of the current member
+        inode_t *inode = nullptr;
+
+        // Archive bytes consumed
+        uint64_t offset = 0;
+    };
+
+    // Caller holds rwlock exclusive
+    inode_t *import_member(cpio_hdr_t const& hdr, char const *path,
+                           errno_t& err);
+    void import_finish(cpio_reader_t& rd);
+
+    // Returns false at the end of the archive, or when it is corrupt
+    bool import_feed(cpio_reader_t& rd, char const *data, size_t size);
+    void import_gzip(cpio_reader_t& rd);
+
+    lock_type rwlock;
+
+    inode_t *root = nullptr;
+    ino_t last_ino = 0;
+    uint64_t inode_count = 0;
+    // Changed with atomics, writes don't hold rwlock
+    uint64_t page_count = 0;
+
+    char const *st = nullptr;
+    char const *en = nullptr;
+};
+
+//
+// Inodes and directories
+
+time_t tmpfs_fs_t::now()
+{
+    return time_unix(time_ofday());
+}
+
+bool tmpfs_fs_t::is_dots(char const *name, size_t len)
+{
+    return (len == 1 && name[0] == '.') ||
+            (len == 2 && name[0] == '.' && name[1] == '.');
+}
+
+tmpfs_fs_t::inode_t *tmpfs_fs_t::new_inode(uint16_t mode, errno_t& err)
+{
+    ext::unique_ptr<inode_t> inode(new (ext::nothrow) inode_t{});
+
+    if (unlikely(!inode)) {
+        err = errno_t::ENOMEM;
+        return nullptr;
+    }
+
+    if ((mode & mode_type_mask) == mode_dir) {
+        inode->dir.reset(new (ext::nothrow) dir_t{});
+
+        if (unlikely(!inode->dir)) {
+            err = errno_t::ENOMEM;
+            return nullptr;
         }
+    }
 
-        void const *data() const
-        {
-            return (char const *)(this + 1) + namesize + (namesize & 1);
+    inode->ino = ++last_ino;
+    inode->mode = mode;
+    inode->mtime = now();
+    inode->ctime = inode->mtime;
+
+    ++inode_count;
+
+    return inode.release();
+}
+
+// Free the inode when it has no names and is not open
+void tmpfs_fs_t::put_inode(inode_t *inode)
+{
+    if (inode->nlink || inode->refcount)
+        return;
+
+    atomic_add(&page_count, -uint64_t(inode->pages.page_count()));
+    --inode_count;
+
+    delete inode;
+}
+
+// Drop every name under dir, for unmount
+void tmpfs_fs_t::free_tree(inode_t *dir)
+{
+    for (dir_entry_t& ent : dir->dir->slots) {
+        if (!ent.inode)
+            continue;
+
+        if (ent.inode->is_dir())
+            free_tree(ent.inode);
+
+        --ent.inode->nlink;
+        put_inode(ent.inode);
+
+        delete[] ent.name;
+    }
+
+    dir->dir->slots.clear();
+    dir->dir->free_slots.clear();
+    dir->dir->index.clear();
+}
+
+tmpfs_fs_t::inode_t *tmpfs_fs_t::dir_find(
+        inode_t *dir, char const *name, size_t len) const
+{
+    if (len == 1 && name[0] == '.')
+        return dir;
+
+    if (len == 2 && name[0] == '.' && name[1] == '.')
+        return dir == root ? dir : dir->parent;
+
+    uintptr_t slot;
+
+    if (!dir->dir->index.lookup(name, len, slot))
+        return nullptr;
+
+    return dir->dir->slots[slot].inode;
+}
+
+bool tmpfs_fs_t::dir_add(inode_t *dir, char const *name, size_t len,
+                         inode_t *inode, errno_t& err)
+{
+    // Can't add names to a removed directory
+    if (unlikely(dir != root && !dir->nlink)) {
+        err = errno_t::ENOENT;
+        return false;
+    }
+
+    if (unlikely(len > NAME_MAX)) {
+        err = errno_t::ENAMETOOLONG;
+        return false;
+    }
+
+    dir_t *d = dir->dir.get();
+
+    ext::unique_ptr<char[]> copy(new (ext::nothrow) char[len]);
+
+    if (unlikely(!copy)) {
+        err = errno_t::ENOMEM;
+        return false;
+    }
+
+    memcpy(copy.get(), name, len);
+
+    uint32_t slot;
+    bool reused = !d->free_slots.empty();
+
+    if (reused) {
+        slot = d->free_slots.back();
+    } else {
+        slot = d->slots.size();
+
+        if (unlikely(!d->slots.push_back(dir_entry_t{}))) {
+            err = errno_t::ENOMEM;
+            return false;
         }
+    }
 
-        cpio_hdr_t const *next(char const *en) const
-        {
-            if (unlikely(namesize == 11 &&
-                         !memcmp(name(), "TRAILER!!!", 10) &&
-                         filesize() == 0))
-                return nullptr;
+    if (unlikely(!d->index.insert(name, len, slot))) {
+        if (!reused)
+            d->slots.pop_back();
 
-            cpio_hdr_t const *next_hdr = (cpio_hdr_t const *)
-                    ((char const *)data() + (filesize() + (filesize() & 1)));
+        err = errno_t::ENOMEM;
+        return false;
+    }
 
-            // Catch overrun
-            if (unlikely((char const *)(next_hdr + 1) > en))
-                return nullptr;
+    if (reused)
+        d->free_slots.pop_back();
+
+    dir_entry_t& ent = d->slots[slot];
+    ent.inode = inode;
+    ent.name = copy.release();
+    ent.name_len = len;
+
+    ++inode->nlink;
+
+    if (inode->is_dir())
+        inode->parent = dir;
+
+    dir->mtime = now();
+    dir->ctime = dir->mtime;
+
+    return true;
+}
+
+void tmpfs_fs_t::dir_remove(inode_t *dir, uint32_t slot)
+{
+    dir_t *d = dir->dir.get();
+    dir_entry_t& ent = d->slots[slot];
+    inode_t *inode = ent.inode;
+
+    d->index.erase(ent.name, ent.name_len);
+
+    delete[] ent.name;
+    ent = {};
+
+    // Trailing slots are dropped, others are reused. Without memory for
+    // the free list, the slot is never reused
+    if (slot + 1 == d->slots.size())
+        d->slots.pop_back();
+    else if (unlikely(!d->free_slots.push_back(slot)))
+        TMPFS_TRACE("leaked directory slot %u\n", slot);
+
+    dir->mtime = now();
+    dir->ctime = dir->mtime;
+
+    if (inode->is_dir() && inode->parent == dir)
+        inode->parent = nullptr;
 
-            return next_hdr;
+    --inode->nlink;
+    inode->ctime = dir->mtime;
+
+    put_inode(inode);
+}
+
+tmpfs_fs_t::inode_t *tmpfs_fs_t::create(
+        inode_t *dir, char const *name, size_t len,
+        uint16_t mode, errno_t& err)
+{
+    inode_t *inode = new_inode(mode, err);
+
+    if (unlikely(!inode))
+        return nullptr;
+
+    if (unlikely(!dir_add(dir, name, len, inode, err))) {
+        put_inode(inode);
+        return nullptr;
+    }
+
+    return inode;
+}
+
+tmpfs_fs_t::inode_t *tmpfs_fs_t::walk_parent(
+        fs_file_info_t *dirfi, char const *path, bool make_dirs,
+        char const *&name, size_t& len, errno_t& err)
+{
+    inode_t *dir = root;
+
+    if (path[0] != '/' && dirfi)
+        dir = static_cast<file_handle_t*>(dirfi)->inode;
+
+    if (unlikely(!dir->is_dir())) {
+        err = errno_t::ENOTDIR;
+        return nullptr;
+    }
+
+    char const *it = path;
+
+    for (;;) {
+        while (*it == '/')
+            ++it;
+
+        char const *end = it;
+
+        while (*end && *end != '/')
+            ++end;
+
+        char const *next = end;
+
+        while (*next == '/')
+            ++next;
+
+        if (!*next) {
+            name = it;
+            len = end - it;
+            return dir;
         }
-    } _packed;
 
-    cpio_hdr_t const *add(cpio_hdr_t const *hdr)
-    {
-        if (unlikely(hdr->magic != 0x71c7))
+        size_t comp_len = end - it;
+
+        if (unlikely(comp_len > NAME_MAX)) {
+            err = errno_t::ENAMETOOLONG;
             return nullptr;
+        }
 
-        file_t file{};
-        file.file_ofs = (char*)hdr->data() - st;
-        file.name_ofs = names.size();
-        file.name_sz = hdr->namesize;
-        file.file_sz = hdr->filesize();
-        file.name_hash = likely(hdr->namesize)
-                ? hash_32(hdr->name(), hdr->namesize - 1)
-                : 0;
-        file.ino = hdr->ino;
-        file.mode = hdr->mode;
-        file.mtime = hdr->mtime();
-        file.nlink = hdr->nlink;
-
-        char const *name = hdr->name();
-        if (hdr->namesize == 11 &&
-                name[0] == 'T' &&
-                name[8] == '!' &&
-                !memcmp(name, "TRAILER!!!", hdr->namesize))
+        inode_t *child = dir_find(dir, it, comp_len);
+
+        if (!child && make_dirs)
+            child = create(dir, it, comp_len, mode_dir | 0755, err);
+        else if (!child)
+            err = errno_t::ENOENT;
+
+        if (unlikely(!child))
             return nullptr;
 
-        for (size_t i = 0, e = hdr->namesize; i < e; ++i) {
-            if (unlikely(!names.push_back(name[i])))
-                return nullptr;
+        if (unlikely(!child->is_dir())) {
+            err = errno_t::ENOTDIR;
+            return nullptr;
+        }
+
+        dir = child;
+        it = next;
+    }
+}
+
+tmpfs_fs_t::inode_t *tmpfs_fs_t::walk(
+        fs_file_info_t *dirfi, char const *path, errno_t& err)
+{
+    char const *name;
+    size_t len;
+    inode_t *dir = walk_parent(dirfi, path, false, name, len, err);
+
+    if (unlikely(!dir) || !len)
+        return dir;
+
+    if (unlikely(len > NAME_MAX)) {
+        err = errno_t::ENAMETOOLONG;
+        return nullptr;
+    }
+
+    inode_t *inode = dir_find(dir, name, len);
+
+    if (unlikely(!inode))
+        err = errno_t::ENOENT;
+
+    return inode;
+}
+
+//
+// File contents
+
+ssize_t tmpfs_fs_t::read_inode(inode_t *inode, char *buf,
+                               size_t size, off_t offset)
+{
+    // Holes are copied from here
+    static char const zero_page[PAGE_SIZE] = {};
+
+    if (unlikely(offset < 0 || off_t(size) < 0))
+        return -int(errno_t::EINVAL);
+
+    if (uint64_t(offset) >= inode->size)
+        return 0;
+
+    if (size > inode->size - offset)
+        size = inode->size - offset;
+
+    bool user = mm_is_user_range(buf, size);
+
+    for (size_t done = 0; done < size; ) {
+        uint64_t pos = offset + done;
+        size_t page_ofs = pos & PAGE_MASK;
+        size_t chunk = ext::min(size - done, size_t(PAGE_SIZE - page_ofs));
+
+        char const *page = (char const *)
+                inode->pages.lookup(pos >> PAGE_SIZE_BIT);
+        char const *src = page ? page + page_ofs : zero_page;
+
+        if (user) {
+            if (unlikely(!mm_copy_user(buf + done, src, chunk)))
+                return -int(errno_t::EFAULT);
+        } else {
+            memcpy(buf + done, src, chunk);
         }
 
+        done += chunk;
+    }
+
+    return size;
+}
+
+ssize_t tmpfs_fs_t::write_inode(inode_t *inode, char const *buf,
+                                size_t size, off_t offset)
+{
+    if (unlikely(offset < 0 || off_t(size) < 0 ||
+                 off_t(offset + size) < offset))
+        return -int(errno_t::EINVAL);
+
+    bool user = mm_is_user_range(buf, size);
+    size_t pages_before = inode->pages.page_count();
+    ssize_t result = 0;
+    size_t done;
+
+    for (done = 0; done < size; ) {
+        uint64_t pos = offset + done;
+        size_t page_ofs = pos & PAGE_MASK;
+        size_t chunk = ext::min(size - done, size_t(PAGE_SIZE - page_ofs));
+
+        char *page = (char *)inode->pages.create(pos >> PAGE_SIZE_BIT);
+
+        if (unlikely(!page)) {
+            result = -int(errno_t::ENOSPC);
+            break;
+        }
+
+        if (user) {
+            if (unlikely(!mm_copy_user(page + page_ofs, buf + done, chunk))) {
+                result = -int(errno_t::EFAULT);
+                break;
+            }
+        } else {
+            memcpy(page + page_ofs, buf + done, chunk);
+        }
+
+        done += chunk;
+    }
+
+    atomic_add(&page_count, inode->pages.page_count() - pages_before);
+
+    if (done) {
+        if (inode->size < offset + done)
+            inode->size = offset + done;
+
+        inode->mtime = now();
+        inode->ctime = inode->mtime;
+    }
+
+    // A short write succeeds with what was written
+    return done ? ssize_t(done) : result;
+}
+
+int tmpfs_fs_t::truncate_inode(inode_t *inode, off_t size)
+{
+    if (unlikely(size < 0))
+        return -int(errno_t::EINVAL);
+
+    if (unlikely(inode->is_dir()))
+        return -int(errno_t::EISDIR);
+
+    if (uint64_t(size) < inode->size) {
+        size_t pages_before = inode->pages.page_count();
+
+        inode->pages.truncate((size + PAGE_MASK) >> PAGE_SIZE_BIT);
+
+        atomic_add(&page_count,
+                   -uint64_t(pages_before - inode->pages.page_count()));
+
+        // Past the end reads as zero if the file grows again
+        char *page = (char *)inode->pages.lookup(size >> PAGE_SIZE_BIT);
+
+        if (page && (size & PAGE_MASK))
+            memset(page + (size & PAGE_MASK), 0,
+                   PAGE_SIZE - (size & PAGE_MASK));
+    }
+
+    inode->size = size;
+    inode->mtime = now();
+    inode->ctime = inode->mtime;
+
+    return 0;
+}
+
+void tmpfs_fs_t::fill_stat(inode_t const *inode, fs_stat_t *st) const
+{
+    *st = {};
+    st->st_ino = inode->ino;
+    st->st_mode = inode->mode;
+
+    // Directories are also named by their own "." entry
+    st->st_nlink = inode->nlink + inode->is_dir();
+
+    st->st_uid = inode->uid;
+    st->st_gid = inode->gid;
+    st->st_size = inode->size;
+    st->st_blksize = PAGE_SIZE;
+    st->st_blocks = inode->pages.page_count() << (PAGE_SIZE_BIT - 9);
+    st->st_atime = inode->mtime;
+    st->st_mtime = inode->mtime;
+    st->st_ctime = inode->ctime;
+}
+
+//
+// Startup and shutdown
+
+// Create one archive member in the tree, creating missing directories.
+// Returns the inode that receives the member's data, if any
+tmpfs_fs_t::inode_t *tmpfs_fs_t::import_member(
+        cpio_hdr_t const& hdr, char const *path, errno_t& err)
+{
+    if (unlikely(!hdr.namesize || path[hdr.namesize - 1])) {
+        err = errno_t::EINVAL;
+        return nullptr;
+    }
+
+    char const *name;
+    size_t len;
+    inode_t *dir = walk_parent(nullptr, path, true, name, len, err);
+
+    if (unlikely(!dir))
+        return nullptr;
+
+    // The archive root, "." or "./"
+    if (!len || (len == 1 && name[0] == '.'))
+        return nullptr;
+
+    if (unlikely(is_dots(name, len))) {
+        err = errno_t::EINVAL;
+        return nullptr;
+    }
+
+    uint16_t mode = hdr.mode;
+    inode_t *inode = dir_find(dir, name, len);
+
+    if (inode && inode->is_dir() && (mode & mode_type_mask) == mode_dir) {
+        // The directory was created for an earlier member
+        inode->mode = mode;
+    } else if (unlikely(inode)) {
+        err = errno_t::EEXIST;
+        return nullptr;
+    } else {
+        inode = create(dir, name, len, mode, err);
+
+        if (unlikely(!inode))
+            return nullptr;
+    }
+
+    inode->uid = hdr.uid;
+    inode->gid = hdr.gid;
+    inode->mtime = hdr.mtime();
+    inode->ctime = inode->mtime;
+
+    TMPFS_TRACE("added %s\n", path);
+
+    return inode;
+}
+
+void tmpfs_fs_t::import_finish(cpio_reader_t& rd)
+{
+    // Writing the data moved the times
+    if (rd.inode) {
+        rd.inode->mtime = rd.hdr.mtime();
+        rd.inode->ctime = rd.inode->mtime;
+        rd.inode = nullptr;
+    }
+
+    rd.state = cpio_reader_t::state_t::header;
+    rd.want = sizeof(rd.hdr);
+}
+
+bool tmpfs_fs_t::import_feed(cpio_reader_t& rd,
+                             char const *data, size_t size)
+{
+    using state_t = cpio_reader_t::state_t;
+
+    while (size && rd.state != state_t::done) {
+        size_t n = ext::min(size, rd.want - rd.have);
+
+        if (rd.state == state_t::header) {
+            memcpy((char*)&rd.hdr + rd.have, data, n);
+        } else if (rd.state == state_t::name) {
+            memcpy(rd.name.data() + rd.have, data, n);
+        } else if (rd.inode && rd.have < rd.hdr.filesize()) {
+            // The data, without the padding byte
+            size_t part = ext::min(n, size_t(rd.hdr.filesize() - rd.have));
+
+            write_lock data_hold(rd.inode->data_lock);
+
+            if (unlikely(write_inode(rd.inode, data, part, rd.have) !=
+                         ssize_t(part)))
+                panic_oom();
+        }
+
+        data += n;
+        size -= n;
+        rd.have += n;
+        rd.offset += n;
+
+        if (rd.have < rd.want)
+            continue;
+
+        rd.have = 0;
+
+        if (rd.state == state_t::header) {
+            if (unlikely(rd.hdr.magic != 0x71c7)) {
+                printdbg("tmpfs: corrupt initrd at offset %" PRIu64 "\n",
+                         rd.offset - sizeof(rd.hdr));
+                rd.state = state_t::done;
+                break;
+            }
+
+            rd.want = rd.hdr.namesize + (rd.hdr.namesize & 1);
+
+            if (unlikely(!rd.name.resize(rd.want)))
+                panic_oom();
+
+            rd.state = state_t::name;
+        } else if (rd.state == state_t::name) {
+            if (rd.hdr.namesize == 11 &&
+                    !memcmp(rd.name.data(), "TRAILER!!!", 11)) {
+                rd.state = state_t::done;
+                break;
+            }
+
+            errno_t err = errno_t::OK;
+            inode_t *inode = import_member(rd.hdr, rd.name.data(), err);
+
+            if (unlikely(err == errno_t::ENOMEM))
+                panic_oom();
+
+            if (unlikely(err != errno_t::OK))
+                printdbg("tmpfs: skipped %.*s, err=%d\n",
+                         int(rd.hdr.namesize), rd.name.data(), int(err));
+
+            // Directories have no data
+            rd.inode = inode && !inode->is_dir() ? inode : nullptr;
+            rd.want = rd.hdr.filesize() + (rd.hdr.filesize() & 1);
+            rd.state = state_t::data;
+
+            if (!rd.want)
+                import_finish(rd);
+        } else {
+            import_finish(rd);
+        }
+    }
+
+    return rd.state != state_t::done;
+}
+
+// Decompress a piece at a time straight into the files, the whole
+// uncompressed archive is never held in memory
+void tmpfs_fs_t::import_gzip(cpio_reader_t& rd)
+{
+    static constexpr size_t chunk_size = 64 << 10;
+
+    ext::unique_ptr<char[]> out(new (ext::nothrow) char[chunk_size]);
+
+    if (unlikely(!out))
+        panic_oom();
+
+    z_stream strm;
+    zlib_init(&strm);
+
+    // Expect the gzip wrapper
+    if (unlikely(inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK))
+        panic_oom();
+
+    strm.next_in = (Bytef *)const_cast<char *>(st);
+    strm.avail_in = uInt(en - st);
 
-        if (unlikely(!files.push_back(file)))
-            return nullptr;
+    int status;
 
-        TMPFS_TRACE("added %s\n", hdr->name());
+    do {
+        strm.next_out = (Bytef *)out.get();
+        strm.avail_out = chunk_size;
 
-        return hdr->next(en);
-    }
+        status = inflate(&strm, Z_NO_FLUSH);
 
-    ext::vector<file_t> files;
-    char const *st;
-    char const *en;
-};
+        if (unlikely(status != Z_OK && status != Z_STREAM_END)) {
+            printdbg("tmpfs: initrd inflate failed, status=%d\n", status);
+            break;
+        }
+    } while (import_feed(rd, out.get(), chunk_size - strm.avail_out) &&
+             status != Z_STREAM_END);
 
-//
-// Startup and shutdown
+    inflateEnd(&strm);
+}
 
 void* tmpfs_fs_t::mount(fs_init_info_t *conn)
 {
@@ -161,22 +1091,44 @@ void* tmpfs_fs_t::mount(fs_init_info_t *conn)
     st = (char const *)conn->part_st;
     en = (st + conn->part_len);
 
-    if (unlikely(!names.resize(1)))
+    write_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    root = new_inode(mode_dir | 0755, err);
+
+    if (unlikely(!root))
         panic_oom();
 
-    // Index the files
-    cpio_hdr_t const *next_hdr = nullptr;
-    for (cpio_hdr_t const *hdr = (cpio_hdr_t const *)st;
-         hdr && ((char const *)(hdr + 1) < en);
-         hdr = next_hdr) {
-        if (unlikely(!add(hdr)))
-            break;
+    uint64_t start_ns = time_ns();
 
-        next_hdr = hdr->next(en);
-    }
+    bool compressed = en - st >= 2 &&
+            uint8_t(st[0]) == 0x1f && uint8_t(st[1]) == 0x8b;
+
+    // Copy the archive into the tree
+    cpio_reader_t rd;
+
+    if (compressed)
+        import_gzip(rd);
+    else
+        import_feed(rd, st, en - st);
+
+    if (unlikely(en > st && rd.state != cpio_reader_t::state_t::done))
+        printdbg("tmpfs: initrd ended early\n");
 
-    names.shrink_to_fit();
-    files.shrink_to_fit();
+    printdbg("tmpfs: imported %" PRIu64 " byte archive"
+             " from %zu byte %s initrd in %" PRIu64 "us\n",
+             rd.offset, size_t(en - st),
+             compressed ? "gzip" : "uncompressed",
+             (time_ns() - start_ns) / 1000);
+
+    // Everything was copied, the initrd is no longer needed
+    if (en > st)
+        munmap(const_cast<char*>(st), en - st);
+
+    en = nullptr;
+    st = nullptr;
+
+    bootinfo_drop_initrd();
 
     return this;
 }
@@ -188,19 +1140,17 @@ char const *tmpfs_fs_t::name() const noexcept
 
 void tmpfs_fs_t::unmount()
 {
-    decltype(names) replacement_names;
-    decltype(files) replacement_files;
+    write_lock lock(rwlock);
 
-    names.swap(replacement_names);
-    files.swap(replacement_files);
+    if (!root)
+        return;
 
-    if (en > st)
-        munmap(const_cast<char*>(st), en - st);
-
-    en = nullptr;
-    st = nullptr;
+    free_tree(root);
 
-    bootinfo_drop_initrd();
+    atomic_add(&page_count, -uint64_t(root->pages.page_count()));
+    --inode_count;
+    delete root;
+    root = nullptr;
 }
 
 bool tmpfs_fs_t::is_boot() const
@@ -208,20 +1158,6 @@ bool tmpfs_fs_t::is_boot() const
     return true;
 }
 
-struct tmpfs_file_t : public fs_file_info_t {
-    size_t file_index = 0;
-
-    // Used by opendir
-    size_t end_index = SIZE_MAX;
-
-    // fs_file_info_t interface
-public:
-    ino_t get_inode() const override
-    {
-        return file_index + 1;
-    }
-};
-
 int tmpfs_fs_t::resolve(fs_file_info_t *dirfi, fs_cpath_t path,
                         size_t &consumed)
 {
@@ -235,26 +1171,54 @@ int tmpfs_fs_t::resolve(fs_file_info_t *dirfi, fs_cpath_t path,
 int tmpfs_fs_t::getattrat(fs_file_info_t *dirfi, fs_cpath_t path,
                           fs_stat_t* stbuf)
 {
-    (void)path;
-    (void)stbuf;
-    return -int(errno_t::ENOSYS);
+    read_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    inode_t *inode = walk(dirfi, path, err);
+
+    if (unlikely(!inode))
+        return -int(err);
+
+    read_lock data_hold(inode->data_lock);
+
+    fill_stat(inode, stbuf);
+
+    return 0;
 }
 
 int tmpfs_fs_t::accessat(fs_file_info_t *dirfi, fs_cpath_t path,
                          int mask)
 {
-    (void)path;
     (void)mask;
-    return -int(errno_t::ENOSYS);
+
+    read_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    inode_t *inode = walk(dirfi, path, err);
+
+    if (unlikely(!inode))
+        return -int(err);
+
+    return 0;
 }
 
 int tmpfs_fs_t::readlinkat(fs_file_info_t *dirfi, fs_cpath_t path,
                            char* buf, size_t size)
 {
-    (void)path;
-    (void)buf;
-    (void)size;
-    return -int(errno_t::ENOSYS);
+    read_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    inode_t *inode = walk(dirfi, path, err);
+
+    if (unlikely(!inode))
+        return -int(err);
+
+    if (unlikely((inode->mode & mode_type_mask) != mode_link))
+        return -int(errno_t::EINVAL);
+
+    read_lock data_hold(inode->data_lock);
+
+    return int(read_inode(inode, buf, size, 0));
 }
 
 //
@@ -263,36 +1227,99 @@ int tmpfs_fs_t::readlinkat(fs_file_info_t *dirfi, fs_cpath_t path,
 int tmpfs_fs_t::opendirat(fs_file_info_t **fi,
                           fs_file_info_t *dirfi, fs_cpath_t path)
 {
-    *fi = new (ext::nothrow) tmpfs_file_t();
+    write_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    inode_t *inode = walk(dirfi, path, err);
+
+    if (unlikely(!inode))
+        return -int(err);
+
+    if (unlikely(!inode->is_dir()))
+        return -int(errno_t::ENOTDIR);
+
+    file_handle_t *dir = new (ext::nothrow) file_handle_t(inode, 0);
+
+    if (unlikely(!dir))
+        return -int(errno_t::ENOMEM);
+
+    ++inode->refcount;
+
+    *fi = dir;
 
     return 0;
 }
 
-ssize_t tmpfs_fs_t::readdir(fs_file_info_t *fi, dirent_t *buf, off_t offset)
+// Offsets 0 and 1 are "." and "..", then one offset per slot
+ssize_t tmpfs_fs_t::readdir_locked(inode_t *dir, dirent_t *buf, off_t offset)
 {
-    auto file = static_cast<tmpfs_file_t*>(fi);
+    if (unlikely(offset < 0))
+        return -int(errno_t::EINVAL);
 
-    if (unlikely(offset >= off_t(files.size())))
-        return 0;
+    char const *name;
+    size_t len;
+    inode_t *inode;
+    off_t next;
 
-    size_t index = file->file_index + offset;
-    auto const& file_info = files[index];
+    if (offset < 2) {
+        name = "..";
+        len = offset + 1;
+        inode = offset ? (dir->parent ? dir->parent : dir) : dir;
+        next = offset + 1;
+    } else {
+        auto const& slots = dir->dir->slots;
+        size_t i = offset - 2;
+
+        while (i < slots.size() && !slots[i].inode)
+            ++i;
+
+        if (i >= slots.size())
+            return 0;
 
-    buf->d_ino = index + 1;
+        name = slots[i].name;
+        len = slots[i].name_len;
+        inode = slots[i].inode;
+        next = i + 3;
+    }
+
+    uint16_t type = inode->mode & mode_type_mask;
+
+    buf->d_ino = inode->ino;
+    buf->d_off = next;
     buf->d_reclen = sizeof(*buf);
-    buf->d_off = offset;
-    buf->d_type = 0;
-    char const *name = names.data() + file_info.name_ofs;
-    strncpy(buf->d_name, name, sizeof(buf->d_name));
+    buf->d_type = type == mode_dir ? 4 : type == mode_link ? 10 : 8;
+    memcpy(buf->d_name, name, len);
+    buf->d_name[len] = 0;
+
+    return next - offset;
+}
+
+ssize_t tmpfs_fs_t::readdir(fs_file_info_t *fi, dirent_t *buf, off_t offset)
+{
+    file_handle_t *dir = static_cast<file_handle_t*>(fi);
+
+    read_lock lock(rwlock);
+
+    return readdir_locked(dir->inode, buf, offset);
+}
+
+// Hold the lock once for the whole batch
+ssize_t tmpfs_fs_t::getdents(fs_file_info_t *fi, void *buf,
+                             size_t size, off_t &offset)
+{
+    file_handle_t *dir = static_cast<file_handle_t*>(fi);
+
+    read_lock lock(rwlock);
 
-    return 1;
+    return getdents_pack(buf, size, offset,
+                         [&](dirent_t *ent, off_t ofs) {
+        return readdir_locked(dir->inode, ent, ofs);
+    });
 }
 
 int tmpfs_fs_t::releasedir(fs_file_info_t *fi)
 {
-    auto file = static_cast<tmpfs_file_t*>(fi);
-    delete file;
-    return  0;
+    return release(fi);
 }
 
 
@@ -302,54 +1329,281 @@ int tmpfs_fs_t::releasedir(fs_file_info_t *fi)
 int tmpfs_fs_t::mknodat(fs_file_info_t *dirfi, fs_cpath_t path,
                         fs_mode_t mode, fs_dev_t rdev)
 {
-    (void)path;
-    (void)mode;
     (void)rdev;
-    return -int(errno_t::ENOSYS);
+
+    // Only regular files can be stored
+    if ((mode & mode_type_mask) && (mode & mode_type_mask) != mode_reg)
+        return -int(errno_t::ENOSYS);
+
+    write_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    char const *name;
+    size_t len;
+    inode_t *dir = walk_parent(dirfi, path, false, name, len, err);
+
+    if (unlikely(!dir))
+        return -int(err);
+
+    if (unlikely(!len || is_dots(name, len) || dir_find(dir, name, len)))
+        return -int(errno_t::EEXIST);
+
+    if (unlikely(!create(dir, name, len,
+                         mode_reg | (mode & mode_perm_mask), err)))
+        return -int(err);
+
+    return 0;
 }
 
 int tmpfs_fs_t::mkdirat(fs_file_info_t *dirfi, fs_cpath_t path,
                         fs_mode_t mode)
 {
-    (void)path;
-    (void)mode;
-    return -int(errno_t::ENOSYS);
+    write_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    char const *name;
+    size_t len;
+    inode_t *dir = walk_parent(dirfi, path, false, name, len, err);
+
+    if (unlikely(!dir))
+        return -int(err);
+
+    if (unlikely(!len || is_dots(name, len) || dir_find(dir, name, len)))
+        return -int(errno_t::EEXIST);
+
+    if (unlikely(!create(dir, name, len,
+                         mode_dir | (mode & mode_perm_mask), err)))
+        return -int(err);
+
+    return 0;
 }
 
 int tmpfs_fs_t::rmdirat(fs_file_info_t *dirfi, fs_cpath_t path)
 {
-    (void)path;
-    return -int(errno_t::ENOSYS);
+    write_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    char const *name;
+    size_t len;
+    inode_t *dir = walk_parent(dirfi, path, false, name, len, err);
+
+    if (unlikely(!dir))
+        return -int(err);
+
+    if (unlikely(!len))
+        return -int(errno_t::EBUSY);
+
+    if (unlikely(is_dots(name, len)))
+        return -int(errno_t::EINVAL);
+
+    uintptr_t slot;
+
+    if (unlikely(!dir->dir->index.lookup(name, len, slot)))
+        return -int(errno_t::ENOENT);
+
+    inode_t *inode = dir->dir->slots[slot].inode;
+
+    if (unlikely(!inode->is_dir()))
+        return -int(errno_t::ENOTDIR);
+
+    if (unlikely(inode->dir->index.size()))
+        return -int(errno_t::ENOTEMPTY);
+
+    dir_remove(dir, slot);
+
+    return 0;
 }
 
 int tmpfs_fs_t::symlinkat(fs_file_info_t *dirtofi, fs_cpath_t to,
                           fs_file_info_t *dirfromfi, fs_cpath_t from)
 {
-    (void)to;
-    (void)from;
-    return -int(errno_t::ENOSYS);
+    // The link is created at to, and holds from
+    (void)dirfromfi;
+
+    write_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    char const *name;
+    size_t len;
+    inode_t *dir = walk_parent(dirtofi, to, false, name, len, err);
+
+    if (unlikely(!dir))
+        return -int(err);
+
+    if (unlikely(!len || is_dots(name, len) || dir_find(dir, name, len)))
+        return -int(errno_t::EEXIST);
+
+    inode_t *inode = create(dir, name, len, mode_link | 0777, err);
+
+    if (unlikely(!inode))
+        return -int(err);
+
+    size_t target_len = strlen(from);
+    write_lock data_hold(inode->data_lock);
+    ssize_t wrote = write_inode(inode, from, target_len, 0);
+    data_hold.unlock();
+
+    if (unlikely(wrote != ssize_t(target_len))) {
+        uintptr_t slot;
+        if (dir->dir->index.lookup(name, len, slot))
+            dir_remove(dir, slot);
+        return wrote < 0 ? int(wrote) : -int(errno_t::ENOSPC);
+    }
+
+    return 0;
 }
 
 int tmpfs_fs_t::renameat(fs_file_info_t *dirfromfi, fs_cpath_t from,
                          fs_file_info_t *dirtofi, fs_cpath_t to)
 {
-    (void)from;
-    (void)to;
-    return -int(errno_t::ENOSYS);
+    write_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    char const *from_name;
+    size_t from_len;
+    inode_t *from_dir = walk_parent(dirfromfi, from, false,
+                                    from_name, from_len, err);
+
+    if (unlikely(!from_dir))
+        return -int(err);
+
+    char const *to_name;
+    size_t to_len;
+    inode_t *to_dir = walk_parent(dirtofi, to, false,
+                                  to_name, to_len, err);
+
+    if (unlikely(!to_dir))
+        return -int(err);
+
+    if (unlikely(!from_len || !to_len))
+        return -int(errno_t::EBUSY);
+
+    if (unlikely(is_dots(from_name, from_len) || is_dots(to_name, to_len)))
+        return -int(errno_t::EINVAL);
+
+    uintptr_t from_slot;
+
+    if (unlikely(!from_dir->dir->index.lookup(
+                     from_name, from_len, from_slot)))
+        return -int(errno_t::ENOENT);
+
+    inode_t *inode = from_dir->dir->slots[from_slot].inode;
+
+    // A directory can't be moved into itself
+    if (inode->is_dir()) {
+        for (inode_t *up = to_dir; up && up != root; up = up->parent) {
+            if (unlikely(up == inode))
+                return -int(errno_t::EINVAL);
+        }
+    }
+
+    uintptr_t to_slot;
+
+    if (to_dir->dir->index.lookup(to_name, to_len, to_slot)) {
+        dir_entry_t& target = to_dir->dir->slots[to_slot];
+        inode_t *replaced = target.inode;
+
+        // Both names already refer to the same file
+        if (replaced == inode)
+            return 0;
+
+        if (replaced->is_dir() && !inode->is_dir())
+            return -int(errno_t::EISDIR);
+
+        if (!replaced->is_dir() && inode->is_dir())
+            return -int(errno_t::ENOTDIR);
+
+        if (replaced->is_dir() && replaced->dir->index.size())
+            return -int(errno_t::ENOTEMPTY);
+
+        // Point the existing name at the file, nothing to allocate
+        target.inode = inode;
+        ++inode->nlink;
+
+        if (inode->is_dir())
+            inode->parent = to_dir;
+
+        if (replaced->is_dir())
+            replaced->parent = nullptr;
+
+        --replaced->nlink;
+        put_inode(replaced);
+
+        to_dir->mtime = now();
+        to_dir->ctime = to_dir->mtime;
+    } else if (unlikely(!dir_add(to_dir, to_name, to_len, inode, err))) {
+        return -int(err);
+    }
+
+    // The new name holds a link, so this does not free it
+    dir_remove(from_dir, from_slot);
+
+    // dir_remove orphaned it if it was moved within the same directory
+    if (inode->is_dir())
+        inode->parent = to_dir;
+
+    return 0;
 }
 
 int tmpfs_fs_t::linkat(fs_file_info_t *dirfromfi, fs_cpath_t from,
                        fs_file_info_t *dirtofi, fs_cpath_t to)
 {
-    (void)from;
-    (void)to;
-    return -int(errno_t::ENOSYS);
+    write_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    inode_t *inode = walk(dirfromfi, from, err);
+
+    if (unlikely(!inode))
+        return -int(err);
+
+    if (unlikely(inode->is_dir()))
+        return -int(errno_t::EPERM);
+
+    char const *name;
+    size_t len;
+    inode_t *dir = walk_parent(dirtofi, to, false, name, len, err);
+
+    if (unlikely(!dir))
+        return -int(err);
+
+    if (unlikely(!len || is_dots(name, len) || dir_find(dir, name, len)))
+        return -int(errno_t::EEXIST);
+
+    if (unlikely(!dir_add(dir, name, len, inode, err)))
+        return -int(err);
+
+    inode->ctime = now();
+
+    return 0;
 }
 
 int tmpfs_fs_t::unlinkat(fs_file_info_t *dirfi, fs_cpath_t path)
 {
-    (void)path;
-    return -int(errno_t::ENOSYS);
+    write_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    char const *name;
+    size_t len;
+    inode_t *dir = walk_parent(dirfi, path, false, name, len, err);
+
+    if (unlikely(!dir))
+        return -int(err);
+
+    if (unlikely(!len || is_dots(name, len)))
+        return -int(errno_t::EISDIR);
+
+    uintptr_t slot;
+
+    if (unlikely(!dir->dir->index.lookup(name, len, slot)))
+        return -int(errno_t::ENOENT);
+
+    if (unlikely(dir->dir->slots[slot].inode->is_dir()))
+        return -int(errno_t::EISDIR);
+
+    // Open handles keep the contents until they are closed
+    dir_remove(dir, slot);
+
+    return 0;
 }
 
 //
@@ -357,25 +1611,44 @@ int tmpfs_fs_t::unlinkat(fs_file_info_t *dirfi, fs_cpath_t path)
 
 int tmpfs_fs_t::fchmod(fs_file_info_t *fi, fs_mode_t mode)
 {
-    (void)fi;
-    (void)mode;
-    return -int(errno_t::ENOSYS);
+    file_handle_t *file = static_cast<file_handle_t*>(fi);
+
+    write_lock lock(rwlock);
+
+    file->inode->mode = (file->inode->mode & mode_type_mask) |
+            (mode & mode_perm_mask);
+    file->inode->ctime = now();
+
+    return 0;
 }
 
 int tmpfs_fs_t::fchown(fs_file_info_t *fi, fs_uid_t uid, fs_gid_t gid)
 {
-    (void)fi;
-    (void)uid;
-    (void)gid;
-    return -int(errno_t::ENOSYS);
+    file_handle_t *file = static_cast<file_handle_t*>(fi);
+
+    write_lock lock(rwlock);
+
+    file->inode->uid = uid;
+    file->inode->gid = gid;
+    file->inode->ctime = now();
+
+    return 0;
 }
 
 int tmpfs_fs_t::truncateat(fs_file_info_t *dirfi, fs_cpath_t path,
                            off_t size)
 {
-    (void)path;
-    (void)size;
-    return -int(errno_t::ENOSYS);
+    write_lock lock(rwlock);
+
+    errno_t err = errno_t::OK;
+    inode_t *inode = walk(dirfi, path, err);
+
+    if (unlikely(!inode))
+        return -int(err);
+
+    write_lock data_hold(inode->data_lock);
+
+    return truncate_inode(inode, size);
 }
 
 int tmpfs_fs_t::utimensat(fs_file_info_t *dirfi, fs_cpath_t path,
@@ -388,43 +1661,78 @@ int tmpfs_fs_t::utimensat(fs_file_info_t *dirfi, fs_cpath_t path,
 
 //
 // Open/close files
+
 int tmpfs_fs_t::openat(fs_file_info_t **fi,
                        fs_file_info_t *dirfi, fs_cpath_t path,
                        int flags, mode_t mode)
 {
-    if (unlikely(flags & (O_CREAT | O_TRUNC)))
-        return -int(errno_t::EROFS);
+    write_lock lock(rwlock);
 
-    size_t path_len = strlen(path);
+    errno_t err = errno_t::OK;
+    char const *name;
+    size_t len;
+    inode_t *dir = walk_parent(dirfi, path, false, name, len, err);
 
-    auto name_hash = hash_32(path, path_len);
+    if (unlikely(!dir))
+        return -int(err);
 
-    size_t index = 0;
-    for (file_t const& file : files) {
-        char const *name = names.data() + file.name_ofs;
-        if (file.name_hash == name_hash &&
-                file.name_sz == path_len + 1 &&
-                !memcmp(name, path, path_len)) {
-            ext::unique_ptr<tmpfs_file_t> file(new (ext::nothrow)
-                                               tmpfs_file_t{});
-            file->file_index = index;
-            *fi = file.release();
-            return 0;
-        }
-        ++index;
+    if (unlikely(len > NAME_MAX))
+        return -int(errno_t::ENAMETOOLONG);
+
+    inode_t *inode = len ? dir_find(dir, name, len) : dir;
+    bool created = false;
+
+    if (inode) {
+        if (unlikely((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)))
+            return -int(errno_t::EEXIST);
+    } else if (flags & O_CREAT) {
+        inode = create(dir, name, len, mode_reg | (mode & mode_perm_mask),
+                       err);
+
+        if (unlikely(!inode))
+            return -int(err);
+
+        created = true;
+    } else {
+        return -int(errno_t::ENOENT);
     }
 
-    // Fixme
-    (void)flags;
-    (void)mode;
+    if (unlikely(inode->is_dir() && (flags & (O_WRONLY | O_TRUNC))))
+        return -int(errno_t::EISDIR);
+
+    if (unlikely(!inode->is_dir() && (flags & O_DIRECTORY)))
+        return -int(errno_t::ENOTDIR);
+
+    file_handle_t *file = new (ext::nothrow) file_handle_t(inode, flags);
+
+    if (unlikely(!file))
+        return -int(errno_t::ENOMEM);
+
+    if (flags & O_TRUNC) {
+        write_lock data_hold(inode->data_lock);
+
+        if (inode->size)
+            truncate_inode(inode, 0);
+    }
+
+    ++inode->refcount;
 
-    return -int(errno_t::ENOENT);
+    *fi = file;
+
+    return created ? FS_OPEN_CREATED : 0;
 }
 
 int tmpfs_fs_t::release(fs_file_info_t *fi)
 {
-    auto file = static_cast<tmpfs_file_t*>(fi);
+    file_handle_t *file = static_cast<file_handle_t*>(fi);
+
+    write_lock lock(rwlock);
+
+    --file->inode->refcount;
+    put_inode(file->inode);
+
     delete file;
+
     return 0;
 }
 
@@ -434,52 +1742,40 @@ int tmpfs_fs_t::release(fs_file_info_t *fi)
 ssize_t tmpfs_fs_t::read(fs_file_info_t *fi, char *buf,
                                 size_t size, off_t offset)
 {
-    auto file = static_cast<tmpfs_file_t*>(fi);
-    auto const& file_info = files[file->file_index];
-
-    if (offset >= file_info.file_sz)
-        return 0;
-
-    off_t avail = off_t(file_info.file_sz) - offset;
+    file_handle_t *file = static_cast<file_handle_t*>(fi);
 
-    if (off_t(size) > avail)
-        size = avail;
+    // The open handle keeps the inode, and its type never changes
+    if (unlikely(file->inode->is_dir()))
+        return -int(errno_t::EISDIR);
 
-    if (unlikely(off_t(size) < 0))
-        return -int(errno_t::EINVAL);
-
-    if (unlikely(offset < 0))
-        return -int(errno_t::EINVAL);
+    read_lock lock(file->inode->data_lock);
 
-    void const *src = st + file_info.file_ofs + offset;
-    if (mm_is_user_range(buf, size)) {
-        if (unlikely(madvise(buf, size, MADV_WILLNEED) < 0))
-            return -int(errno_t::ENOMEM);
-        if (unlikely(!mm_copy_user(buf, src, size)))
-            return -int(errno_t::EFAULT);
-    } else {
-        memcpy(buf, src, size);
-    }
-
-    return size;
+    return read_inode(file->inode, buf, size, offset);
 }
 
 ssize_t tmpfs_fs_t::write(fs_file_info_t *fi, char const *buf,
                                  size_t size, off_t offset)
 {
-    (void)buf;
-    (void)size;
-    (void)offset;
-    (void)fi;
-    return -int(errno_t::EROFS);
+    file_handle_t *file = static_cast<file_handle_t*>(fi);
+
+    if (unlikely(file->inode->is_dir()))
+        return -int(errno_t::EISDIR);
+
+    write_lock lock(file->inode->data_lock);
+
+    if (file->flags & O_APPEND)
+        offset = file->inode->size;
+
+    return write_inode(file->inode, buf, size, offset);
 }
 
 int tmpfs_fs_t::ftruncate(fs_file_info_t *fi, off_t offset)
 {
-    (void)offset;
-    (void)fi;
-    // Fail, read only
-    return -int(errno_t::EROFS);
+    file_handle_t *file = static_cast<file_handle_t*>(fi);
+
+    write_lock lock(file->inode->data_lock);
+
+    return truncate_inode(file->inode, offset);
 }
 
 //
@@ -487,21 +1783,12 @@ int tmpfs_fs_t::ftruncate(fs_file_info_t *fi, off_t offset)
 
 int tmpfs_fs_t::fstat(fs_file_info_t *fi, fs_stat_t *st)
 {
-    auto file = static_cast<tmpfs_file_t*>(fi);
-    auto const& file_info = files[file->file_index];
-    *st = {};
-    st->st_ino = file_info.ino;
-    st->st_mode = file_info.mode;
-    st->st_nlink = file_info.nlink;
-    st->st_uid = 0;
-    st->st_gid = 0;
-    st->st_rdev = 0;
-    st->st_size = file_info.file_sz;
-    st->st_blksize = 512;
-    st->st_blocks = file_info.file_sz >> 9;
-    st->st_atime = file_info.mtime;
-    st->st_mtime = file_info.mtime;
-    st->st_ctime = file_info.mtime;
+    file_handle_t *file = static_cast<file_handle_t*>(fi);
+
+    read_lock lock(file->inode->data_lock);
+
+    fill_stat(file->inode, st);
+
     return 0;
 }
 
@@ -530,12 +1817,14 @@ int tmpfs_fs_t::flush(fs_file_info_t *fi)
 
 int tmpfs_fs_t::statfs(fs_statvfs_t* stbuf)
 {
-    (void)stbuf;
+    read_lock lock(rwlock);
+
     *stbuf = {};
-    stbuf->f_bsize = 1;
-    stbuf->f_namemax = 256;
-    stbuf->f_bsize = en - st;
-    stbuf->f_files = files.size();
+    stbuf->f_bsize = PAGE_SIZE;
+    stbuf->f_frsize = PAGE_SIZE;
+    stbuf->f_blocks = atomic_ld_acq(&page_count);
+    stbuf->f_files = inode_count;
+    stbuf->f_namemax = NAME_MAX;
     return 0;
 }
 
@@ -637,9 +1926,6 @@ __END_ANONYMOUS
 
 bool tmpfs_startup(void *st, size_t sz)
 {
-    initrd_st = st;
-    initrd_sz = sz;
-
     ext::unique_ptr<tmpfs_fs_t> fs(new (ext::nothrow) tmpfs_fs_t);
     fs_init_info_t info{};
     info.part_st = (uint64_t)st;
@@ -654,4 +1940,3 @@ bool tmpfs_startup(void *st, size_t sz)
 
     return true;
 }
-
@@ -0,0 +1,551 @@
+#include "bcache.h"
+#include "blk_queue.h"
+#include "dev_storage.h"
+#include "hash_table.h"
+#include "vector.h"
+#include "algorithm.h"
+#include "mutex.h"
+#include "string.h"
+#include "printk.h"
+#include "inttypes.h"
+
+#define DEBUG_BCACHE 0
+#if DEBUG_BCACHE
+#define BCACHE_TRACE(...) printdbg("bcache: " __VA_ARGS__)
+#else
+#define BCACHE_TRACE(...) ((void)0)
+#endif
+
+// Default byte limit
+#define BCACHE_DEFAULT_LIMIT    (UINT64_C(4) << 20)
+
+__BEGIN_ANONYMOUS
+
+struct bcache_key_t {
+    storage_dev_base_t *dev;
+    uint64_t lba;
+};
+
+C_ASSERT(sizeof(bcache_key_t) == 16);
+
+enum bcache_flags_t : uint8_t {
+    // data holds the block
+    BCACHE_UPTODATE = 0x01,
+
+    // A read into data is outstanding on io
+    BCACHE_READING = 0x02,
+
+    // data was modified since it was last written
+    BCACHE_DIRTY = 0x04,
+
+    // The last read failed
+    BCACHE_ERROR = 0x08
+};
+
+struct bcache_ent_t : public bcache_buf_t {
+    bcache_key_t key;
+
+    uint32_t refcount;
+    uint8_t flags;
+
+    // Most recently used first
+    bcache_ent_t *lru_prev;
+    bcache_ent_t *lru_next;
+
+    // Completes reads, waited on by every reader of a block being read
+    blocking_iocp_t io;
+};
+
+using bcache_lock_type = ext::mutex;
+using bcache_scoped_lock = ext::unique_lock<bcache_lock_type>;
+
+using bcache_table_t = hashtbl_t<bcache_ent_t, bcache_key_t,
+    &bcache_ent_t::key>;
+
+__END_ANONYMOUS
+
+// Protects everything below, and the bookkeeping in every buffer
+static bcache_lock_type bcache_lock;
+static bcache_table_t bcache_table;
+static bcache_ent_t *bcache_lru_first;
+static bcache_ent_t *bcache_lru_last;
+static bcache_stats_t bcache_stats = {
+    0, 0, 0, BCACHE_DEFAULT_LIMIT, 0, 0, 0, 0, 0
+};
+
+static bcache_ent_t *bcache_ent(bcache_buf_t *buf)
+{
+    return static_cast<bcache_ent_t*>(buf);
+}
+
+static void bcache_lru_unlink_locked(bcache_ent_t *ent)
+{
+    if (ent->lru_prev)
+        ent->lru_prev->lru_next = ent->lru_next;
+    else
+        bcache_lru_first = ent->lru_next;
+
+    if (ent->lru_next)
+        ent->lru_next->lru_prev = ent->lru_prev;
+    else
+        bcache_lru_last = ent->lru_prev;
+
+    ent->lru_prev = nullptr;
+    ent->lru_next = nullptr;
+}
+
+static void bcache_lru_push_locked(bcache_ent_t *ent)
+{
+    ent->lru_prev = nullptr;
+    ent->lru_next = bcache_lru_first;
+
+    if (bcache_lru_first)
+        bcache_lru_first->lru_prev = ent;
+    else
+        bcache_lru_last = ent;
+
+    bcache_lru_first = ent;
+}
+
+// A readahead may complete without anyone waiting for it,
+// so an outstanding read is checked on the iocp itself
+static bool bcache_idle_locked(bcache_ent_t *ent)
+{
+    if (ent->refcount || (ent->flags & BCACHE_DIRTY))
+        return false;
+
+    if ((ent->flags & BCACHE_READING) && !ent->io.wait_until(0))
+        return false;
+
+    return true;
+}
+
+static void bcache_remove_locked(bcache_ent_t *ent)
+{
+    bcache_table.del(&ent->key);
+    bcache_lru_unlink_locked(ent);
+
+    --bcache_stats.buffer_count;
+    bcache_stats.byte_count -= ent->size;
+
+    delete[] ent->data;
+    delete ent;
+}
+
+// Drop idle buffers, least recently used first, until
+// incoming more bytes would fit under the limit
+static void bcache_evict_locked(uint64_t incoming = 0)
+{
+    bcache_ent_t *ent = bcache_lru_last;
+
+    while (ent && bcache_stats.byte_count + incoming >
+           bcache_stats.byte_limit) {
+        bcache_ent_t *prev = ent->lru_prev;
+
+        if (bcache_idle_locked(ent)) {
+            BCACHE_TRACE("evicting lba %" PRIu64 "\n", ent->key.lba);
+            bcache_remove_locked(ent);
+            ++bcache_stats.evict_count;
+        }
+
+        ent = prev;
+    }
+}
+
+static bcache_ent_t *bcache_create_locked(
+        storage_dev_base_t *dev, uint64_t lba, uint32_t size)
+{
+    bcache_evict_locked(size);
+
+    bcache_ent_t *ent = new (ext::nothrow) bcache_ent_t();
+
+    if (unlikely(!ent))
+        return nullptr;
+
+    ent->data = new (ext::nothrow) char[size];
+
+    if (unlikely(!ent->data)) {
+        delete ent;
+        return nullptr;
+    }
+
+    ent->dev = dev;
+    ent->lba = lba;
+    ent->size = size;
+    ent->key = { dev, lba };
+
+    if (unlikely(!bcache_table.insert(ent))) {
+        delete[] ent->data;
+        delete ent;
+        return nullptr;
+    }
+
+    bcache_lru_push_locked(ent);
+
+    ++bcache_stats.buffer_count;
+    bcache_stats.byte_count += size;
+
+    return ent;
+}
+
+// Queue a read of the whole buffer, the caller holds a reference
+static errno_t bcache_start_read_locked(bcache_ent_t *ent)
+{
+    int log2_sector_size = ent->dev->info(STORAGE_INFO_BLOCKSIZE_LOG2);
+
+    ent->flags = (ent->flags & ~(BCACHE_UPTODATE | BCACHE_ERROR)) |
+            BCACHE_READING;
+    ent->io.reset();
+
+    errno_t err = blk_read_async(ent->dev, ent->data,
+                                 ent->size >> log2_sector_size,
+                                 ent->lba, &ent->io);
+
+    if (unlikely(err != errno_t::OK))
+        ent->flags = (ent->flags & ~BCACHE_READING) | BCACHE_ERROR;
+
+    return err;
+}
+
+// Wait for the outstanding read, if any, then tell whether the block
+// is present. Called with the lock held, and returns with it held
+static errno_t bcache_wait_read(bcache_scoped_lock &lock, bcache_ent_t *ent)
+{
+    if (ent->flags & BCACHE_READING) {
+        lock.unlock();
+
+        blk_flush_plug();
+
+        auto result = ent->io.wait();
+
+        lock.lock();
+
+        // The first one back records the outcome
+        if (ent->flags & BCACHE_READING) {
+            ent->flags &= ~BCACHE_READING;
+            ent->flags |= result.first == errno_t::OK
+                    ? BCACHE_UPTODATE
+                    : BCACHE_ERROR;
+        }
+    }
+
+    return (ent->flags & BCACHE_UPTODATE)
+            ? errno_t::OK
+            : errno_t::EIO;
+}
+
+static bcache_buf_t *bcache_lookup(storage_dev_base_t *dev, uint64_t lba,
+                                   uint32_t size, bool read, errno_t *err)
+{
+    errno_t status = errno_t::OK;
+
+    int log2_sector_size = dev->info(STORAGE_INFO_BLOCKSIZE_LOG2);
+
+    if (unlikely(!size || (size & ((1U << log2_sector_size) - 1))))
+        status = errno_t::EINVAL;
+
+    bcache_scoped_lock lock(bcache_lock);
+
+    bcache_key_t key{ dev, lba };
+
+    bcache_ent_t *ent = status == errno_t::OK
+            ? bcache_table.lookup(&key)
+            : nullptr;
+
+    if (ent && ent->size != size) {
+        // Same place with another block size, only replace it if idle
+        if (bcache_idle_locked(ent)) {
+            bcache_remove_locked(ent);
+            ent = nullptr;
+        } else {
+            status = errno_t::EBUSY;
+            ent = nullptr;
+        }
+    }
+
+    if (status == errno_t::OK && ent) {
+        ++bcache_stats.hit_count;
+        ++ent->refcount;
+
+        bcache_lru_unlink_locked(ent);
+        bcache_lru_push_locked(ent);
+
+        // A failed read (maybe a readahead) is retried by the next reader
+        if ((ent->flags & (BCACHE_ERROR | BCACHE_READING)) == BCACHE_ERROR) {
+            if (read) {
+                status = bcache_start_read_locked(ent);
+            } else {
+                memset(ent->data, 0, ent->size);
+                ent->flags = (ent->flags & ~BCACHE_ERROR) | BCACHE_UPTODATE;
+            }
+        }
+    } else if (status == errno_t::OK) {
+        ++bcache_stats.miss_count;
+
+        ent = bcache_create_locked(dev, lba, size);
+
+        if (unlikely(!ent)) {
+            status = errno_t::ENOMEM;
+        } else {
+            ent->refcount = 1;
+
+            if (read) {
+                status = bcache_start_read_locked(ent);
+            } else {
+                memset(ent->data, 0, ent->size);
+                ent->flags = BCACHE_UPTODATE;
+            }
+        }
+    }
+
+    if (status == errno_t::OK)
+        status = bcache_wait_read(lock, ent);
+
+    if (unlikely(status != errno_t::OK)) {
+        if (ent)
+            --ent->refcount;
+
+        if (err)
+            *err = status;
+
+        return nullptr;
+    }
+
+    return ent;
+}
+
+bcache_buf_t *bcache_read(storage_dev_base_t *dev, uint64_t lba,
+                          uint32_t size, errno_t *err)
+{
+    return bcache_lookup(dev, lba, size, true, err);
+}
+
+bcache_buf_t *bcache_get(storage_dev_base_t *dev, uint64_t lba,
+                         uint32_t size, errno_t *err)
+{
+    return bcache_lookup(dev, lba, size, false, err);
+}
+
+void bcache_release(bcache_buf_t *buf)
+{
+    if (!buf)
+        return;
+
+    bcache_ent_t *ent = bcache_ent(buf);
+
+    bcache_scoped_lock lock(bcache_lock);
+
+    assert(ent->refcount > 0);
+
+    if (--ent->refcount == 0)
+        bcache_evict_locked();
+}
+
+void bcache_mark_dirty(bcache_buf_t *buf)
+{
+    bcache_ent_t *ent = bcache_ent(buf);
+
+    bcache_scoped_lock lock(bcache_lock);
+
+    assert(ent->refcount > 0);
+
+    if (!(ent->flags & BCACHE_DIRTY)) {
+        ent->flags |= BCACHE_DIRTY;
+        ++bcache_stats.dirty_count;
+    }
+}
+
+// Write the given referenced buffers, which are in LBA order,
+// then drop the references. Buffers that fail to write stay dirty
+static errno_t bcache_write_list(bcache_ent_t **ents, size_t count)
+{
+    if (!count)
+        return errno_t::OK;
+
+    errno_t status = errno_t::OK;
+
+    blocking_iocp_t *iocps = new (ext::nothrow) blocking_iocp_t[count];
+
+    // Errors submitting are recorded in place of the write's result
+    errno_t *results = new (ext::nothrow) errno_t[count];
+
+    if (likely(iocps && results)) {
+        blk_plug_t plug;
+
+        for (size_t i = 0; i < count; ++i) {
+            bcache_ent_t *ent = ents[i];
+
+            int log2_sector_size = ent->dev->info(
+                        STORAGE_INFO_BLOCKSIZE_LOG2);
+
+            iocps[i].reset();
+
+            results[i] = blk_write_async(ent->dev, ent->data,
+                                         ent->size >> log2_sector_size,
+                                         ent->lba, false, &iocps[i]);
+        }
+
+        plug.flush();
+
+        for (size_t i = 0; i < count; ++i) {
+            if (results[i] == errno_t::OK)
+                results[i] = iocps[i].wait().first;
+        }
+    }
+
+    bcache_scoped_lock lock(bcache_lock);
+
+    for (size_t i = 0; i < count; ++i) {
+        bcache_ent_t *ent = ents[i];
+
+        errno_t result = likely(iocps && results)
+                ? results[i]
+                : errno_t::ENOMEM;
+
+        if (result == errno_t::OK) {
+            ++bcache_stats.writeback_count;
+        } else {
+            printdbg("bcache: writeback of lba %" PRIu64 " failed\n",
+                     ent->lba);
+
+            if (status == errno_t::OK)
+                status = result;
+
+            if (!(ent->flags & BCACHE_DIRTY)) {
+                ent->flags |= BCACHE_DIRTY;
+                ++bcache_stats.dirty_count;
+            }
+        }
+
+        --ent->refcount;
+    }
+
+    bcache_evict_locked();
+
+    lock.unlock();
+
+    delete[] results;
+    delete[] iocps;
+
+    return status;
+}
+
+// Take a reference to each dirty buffer and mark it clean, so changes
+// made while the write is in flight dirty it again
+static void bcache_take_dirty_locked(bcache_ent_t *ent,
+                                     ext::vector<bcache_ent_t*> &list)
+{
+    if (!(ent->flags & BCACHE_DIRTY))
+        return;
+
+    if (unlikely(!list.push_back(ent)))
+        return;
+
+    ++ent->refcount;
+    ent->flags &= ~BCACHE_DIRTY;
+    --bcache_stats.dirty_count;
+}
+
+errno_t bcache_writeback(bcache_buf_t *buf)
+{
+    bcache_ent_t *ent = bcache_ent(buf);
+
+    ext::vector<bcache_ent_t*> list;
+
+    bcache_scoped_lock lock(bcache_lock);
+    bcache_take_dirty_locked(ent, list);
+    lock.unlock();
+
+    return bcache_write_list(list.data(), list.size());
+}
+
+errno_t bcache_sync(storage_dev_base_t *dev)
+{
+    ext::vector<bcache_ent_t*> list;
+
+    bcache_scoped_lock lock(bcache_lock);
+
+    for (bcache_ent_t *ent = bcache_lru_first; ent; ent = ent->lru_next) {
+        if (!dev || ent->dev == dev)
+            bcache_take_dirty_locked(ent, list);
+    }
+
+    lock.unlock();
+
+    ext::sort(list.begin(), list.end(),
+              [](bcache_ent_t const *lhs, bcache_ent_t const *rhs) {
+        return lhs->dev != rhs->dev
+                ? uintptr_t(lhs->dev) < uintptr_t(rhs->dev)
+                : lhs->lba < rhs->lba;
+    });
+
+    BCACHE_TRACE("sync writing %zu buffers\n", list.size());
+
+    return bcache_write_list(list.data(), list.size());
+}
+
+void bcache_readahead(storage_dev_base_t *dev, uint64_t lba,
+                      uint32_t size, uint32_t count)
+{
+    int log2_sector_size = dev->info(STORAGE_INFO_BLOCKSIZE_LOG2);
+
+    if (unlikely(!size || (size & ((1U << log2_sector_size) - 1))))
+        return;
+
+    uint32_t sectors = size >> log2_sector_size;
+
+    blk_plug_t plug;
+
+    bcache_scoped_lock lock(bcache_lock);
+
+    for (uint32_t i = 0; i < count; ++i, lba += sectors) {
+        bcache_key_t key{ dev, lba };
+
+        if (bcache_table.lookup(&key))
+            continue;
+
+        bcache_ent_t *ent = bcache_create_locked(dev, lba, size);
+
+        if (unlikely(!ent))
+            break;
+
+        // Nobody holds it, eviction checks the iocp before dropping it
+        if (unlikely(bcache_start_read_locked(ent) != errno_t::OK))
+            break;
+
+        ++bcache_stats.readahead_count;
+    }
+}
+
+errno_t bcache_invalidate(storage_dev_base_t *dev)
+{
+    errno_t status = bcache_sync(dev);
+
+    bcache_scoped_lock lock(bcache_lock);
+
+    bcache_ent_t *ent = bcache_lru_first;
+
+    while (ent) {
+        bcache_ent_t *next = ent->lru_next;
+
+        if (ent->dev == dev && bcache_idle_locked(ent))
+            bcache_remove_locked(ent);
+
+        ent = next;
+    }
+
+    return status;
+}
+
+void bcache_set_limit(uint64_t bytes)
+{
+    bcache_scoped_lock lock(bcache_lock);
+    bcache_stats.byte_limit = bytes;
+    bcache_evict_locked();
+}
+
+void bcache_get_stats(bcache_stats_t *stats)
+{
+    bcache_scoped_lock lock(bcache_lock);
+    *stats = bcache_stats;
+}
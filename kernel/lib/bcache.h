@@ -0,0 +1,77 @@
+#pragma once
+#include "types.h"
+#include "errno.h"
+
+struct storage_dev_base_t;
+struct bcache_buf_t;
+
+// Block buffer cache
+//
+// One cache, shared by every filesystem on every device, holds recently
+// used metadata blocks keyed by device and LBA. Buffers are reference
+// counted, a buffer is only evicted (least recently used first) once it
+// is clean and nobody holds it. The cache is bounded by a byte limit,
+// which is soft: when every buffer is held or dirty, it grows past it.
+// Dirty buffers are written back in device and LBA order, as one plugged
+// batch per device, by bcache_sync.
+
+struct bcache_buf_t {
+    storage_dev_base_t *dev;
+    uint64_t lba;
+
+    // Block contents, size bytes, a whole number of sectors
+    char *data;
+    uint32_t size;
+};
+
+struct bcache_stats_t {
+    uint64_t buffer_count;
+    uint64_t byte_count;
+    uint64_t dirty_count;
+    uint64_t byte_limit;
+
+    // Lifetime counters
+    uint64_t hit_count;
+    uint64_t miss_count;
+    uint64_t evict_count;
+    uint64_t writeback_count;
+    uint64_t readahead_count;
+};
+
+// Get a referenced buffer holding the size byte block at lba,
+// reading it if it is not cached. Returns nullptr and sets *err on failure
+_use_result
+KERNEL_API bcache_buf_t *bcache_read(storage_dev_base_t *dev, uint64_t lba,
+                                     uint32_t size, errno_t *err = nullptr);
+
+// Like bcache_read, but a block that is not cached is zero filled
+// instead of read, for callers about to overwrite the whole block
+_use_result
+KERNEL_API bcache_buf_t *bcache_get(storage_dev_base_t *dev, uint64_t lba,
+                                    uint32_t size, errno_t *err = nullptr);
+
+// Drop a reference from bcache_read or bcache_get
+KERNEL_API void bcache_release(bcache_buf_t *buf);
+
+// The caller modified the buffer, it will be written by the next sync
+KERNEL_API void bcache_mark_dirty(bcache_buf_t *buf);
+
+// Write one dirty buffer now, for callers that must order their writes
+_use_result
+KERNEL_API errno_t bcache_writeback(bcache_buf_t *buf);
+
+// Start reading count consecutive blocks at lba that are not cached,
+// without waiting for them
+KERNEL_API void bcache_readahead(storage_dev_base_t *dev, uint64_t lba,
+                                 uint32_t size, uint32_t count);
+
+// Write back every dirty buffer of dev, or of every device if nullptr
+_use_result
+KERNEL_API errno_t bcache_sync(storage_dev_base_t *dev);
+
+// Write back and forget every buffer of dev nobody holds
+KERNEL_API errno_t bcache_invalidate(storage_dev_base_t *dev);
+
+KERNEL_API void bcache_set_limit(uint64_t bytes);
+
+KERNEL_API void bcache_get_stats(bcache_stats_t *stats);
@@ -0,0 +1,589 @@
+#include "blk_queue.h"
+#include "dev_storage.h"
+#include "thread.h"
+#include "mutex.h"
+#include "atomic.h"
+#include "printk.h"
+#include "inttypes.h"
+
+#define DEBUG_BLK_QUEUE 0
+#if DEBUG_BLK_QUEUE
+#define BLK_TRACE(...) printdbg("blk: " __VA_ARGS__)
+#else
+#define BLK_TRACE(...) ((void)0)
+#endif
+
+// Largest command produced by merging
+#define BLK_MAX_MERGE_BYTES     (UINT32_C(1) << 20)
+
+// Dispatch a plugged software queue early when it holds this many commands
+#define BLK_MAX_PENDING         32
+
+// Completed requests kept for reuse by each software queue
+#define BLK_MAX_FREE_REQS       64
+
+__BEGIN_ANONYMOUS
+
+// One submitted request. The first request of a command leads it and
+// carries the range of the whole command, the others are chained after it
+struct blk_req_t {
+    // Range of this request alone
+    uint64_t lba;
+    char *data;
+    uint32_t count;
+    bool write;
+    bool fua;
+    bool hipri;
+
+    // Completed through caller_iocp, or deferred_plug for a read
+    // made by blk_read_blocks
+    iocp_t *caller_iocp;
+    blk_plug_t *deferred_plug;
+
+    // Software queue whose free list it returns to
+    size_t swq_nr;
+
+    // Next request of the same command, in LBA order,
+    // or the next free request
+    blk_req_t *next;
+
+    // The rest is only used in the leader
+
+    blk_queue_t *owner;
+
+    // Range of the whole command
+    uint64_t cmd_lba;
+    char *cmd_data;
+    uint32_t cmd_count;
+
+    blk_req_t *tail;
+
+    // Next command in the software queue, in LBA order
+    blk_req_t *next_cmd;
+
+    // Completed by the driver
+    iocp_t iocp;
+};
+
+struct blk_swq_t {
+    using lock_type = ext::noirq_lock<ext::spinlock>;
+    using scoped_lock = ext::unique_lock<lock_type>;
+
+    lock_type lock;
+    blk_req_t *head = nullptr;
+    size_t count = 0;
+
+    // Requests kept for reuse, so submit rarely reaches the heap
+    blk_req_t *free_reqs = nullptr;
+    size_t free_count = 0;
+};
+
+__END_ANONYMOUS
+
+class blk_queue_t {
+public:
+    static blk_queue_t *get(storage_dev_base_t *dev);
+
+    errno_t submit(void *data, int64_t count, uint64_t lba,
+                   bool write, bool fua, bool hipri, iocp_t *iocp,
+                   blk_plug_t *deferred_plug = nullptr);
+
+    void dispatch(size_t cpu_nr);
+
+    void get_stats(blk_queue_stats_t *result);
+
+private:
+    blk_queue_t(storage_dev_base_t *dev, size_t swq_count);
+
+    blk_req_t *alloc_req_locked(blk_swq_t &q);
+    void free_req(blk_req_t *req);
+
+    bool merge_locked(blk_swq_t &q, blk_req_t *req);
+    void insert_locked(blk_swq_t &q, blk_req_t *req);
+
+    void complete_req(blk_req_t *req, errno_t err);
+
+    static void cmd_done(dgos::err_sz_pair_t const& result, uintptr_t arg);
+
+    storage_dev_base_t *dev;
+    blk_swq_t *swq;
+    size_t swq_count;
+    uint32_t max_merge_count;
+    uint8_t log2_sector_size;
+
+    blk_queue_stats_t stats = {};
+};
+
+blk_queue_t::blk_queue_t(storage_dev_base_t *dev, size_t swq_count)
+    : dev(dev)
+    , swq(nullptr)
+    , swq_count(swq_count)
+    , log2_sector_size(dev->info(STORAGE_INFO_BLOCKSIZE_LOG2))
+{
+    max_merge_count = BLK_MAX_MERGE_BYTES >> log2_sector_size;
+}
+
+blk_queue_t *blk_queue_t::get(storage_dev_base_t *dev)
+{
+    blk_queue_t *queue = atomic_ld_acq(&dev->blk_queue);
+
+    if (likely(queue))
+        return queue;
+
+    size_t cpu_count = thread_get_cpu_count();
+
+    queue = new (ext::nothrow) blk_queue_t(
+                dev, cpu_count ? cpu_count : 1);
+
+    if (unlikely(!queue))
+        return nullptr;
+
+    queue->swq = new (ext::nothrow) blk_swq_t[queue->swq_count];
+
+    if (unlikely(!queue->swq)) {
+        delete queue;
+        return nullptr;
+    }
+
+    blk_queue_t *existing = atomic_cmpxchg(
+                &dev->blk_queue, (blk_queue_t*)nullptr, queue);
+
+    if (unlikely(existing)) {
+        // Another thread created it first
+        delete[] queue->swq;
+        delete queue;
+        return existing;
+    }
+
+    BLK_TRACE("created queue with %zu software queues"
+              ", sector size %u\n",
+              queue->swq_count, 1U << queue->log2_sector_size);
+
+    return queue;
+}
+
+blk_req_t *blk_queue_t::alloc_req_locked(blk_swq_t &q)
+{
+    blk_req_t *req = q.free_reqs;
+
+    if (req) {
+        q.free_reqs = req->next;
+        --q.free_count;
+    }
+
+    return req;
+}
+
+void blk_queue_t::free_req(blk_req_t *req)
+{
+    blk_swq_t &q = swq[req->swq_nr];
+
+    blk_swq_t::scoped_lock lock(q.lock);
+
+    if (q.free_count < BLK_MAX_FREE_REQS) {
+        req->next = q.free_reqs;
+        q.free_reqs = req;
+        ++q.free_count;
+        return;
+    }
+
+    lock.unlock();
+
+    delete req;
+}
+
+errno_t blk_queue_t::submit(void *data, int64_t count, uint64_t lba,
+                            bool write, bool fua, bool hipri, iocp_t *iocp,
+                            blk_plug_t *deferred_plug)
+{
+    if (unlikely(count <= 0 || uint64_t(count) > UINT32_MAX))
+        return errno_t::EINVAL;
+
+    blk_plug_t *plug = (blk_plug_t*)thread_get_blk_plug();
+
+    if (plug)
+        plug = plug->root;
+
+    size_t cpu_nr = (plug ? plug->cpu_nr : thread_cpu_number()) % swq_count;
+
+    blk_swq_t &q = swq[cpu_nr];
+
+    blk_swq_t::scoped_lock lock(q.lock);
+
+    blk_req_t *req = alloc_req_locked(q);
+
+    if (unlikely(!req)) {
+        // Nothing to reuse, don't hold the queue across the heap
+        lock.unlock();
+
+        req = new (ext::nothrow) blk_req_t();
+
+        if (unlikely(!req))
+            return errno_t::ENOMEM;
+
+        lock.lock();
+    }
+
+    req->lba = lba;
+    req->data = (char*)data;
+    req->count = uint32_t(count);
+    req->write = write;
+    req->fua = fua;
+    req->hipri = hipri;
+    req->caller_iocp = iocp;
+    req->deferred_plug = deferred_plug;
+    req->swq_nr = cpu_nr;
+    req->next = nullptr;
+
+    if (iocp)
+        iocp->set_expect(1);
+
+    atomic_inc(&stats.request_count);
+
+    if (merge_locked(q, req)) {
+        atomic_inc(&stats.merge_count);
+    } else {
+        insert_locked(q, req);
+    }
+
+    size_t pending = q.count;
+
+    lock.unlock();
+
+    if (!plug || pending >= BLK_MAX_PENDING) {
+        dispatch(cpu_nr);
+        return errno_t::OK;
+    }
+
+    // Remember to dispatch this queue when the plug is released
+    for (size_t i = 0; i < plug->queue_count; ++i) {
+        if (plug->queues[i] == this)
+            return errno_t::OK;
+    }
+
+    if (plug->queue_count < blk_plug_t::max_queues)
+        plug->queues[plug->queue_count++] = this;
+    else
+        dispatch(cpu_nr);
+
+    return errno_t::OK;
+}
+
+bool blk_queue_t::merge_locked(blk_swq_t &q, blk_req_t *req)
+{
+    size_t bytes = size_t(req->count) << log2_sector_size;
+
+    for (blk_req_t **link = &q.head; *link; link = &(*link)->next_cmd) {
+        blk_req_t *cmd = *link;
+
+        if (cmd->write != req->write || cmd->fua != req->fua ||
+                cmd->hipri != req->hipri ||
+                cmd->cmd_count + req->count > max_merge_count)
+            continue;
+
+        size_t cmd_bytes = size_t(cmd->cmd_count) << log2_sector_size;
+
+        if (cmd->cmd_lba + cmd->cmd_count == req->lba &&
+                cmd->cmd_data + cmd_bytes == req->data) {
+            // Back merge, append to the chain
+            cmd->tail->next = req;
+            cmd->tail = req;
+            cmd->cmd_count += req->count;
+
+            // Absorb the next command if this closed the gap to it
+            blk_req_t *after = cmd->next_cmd;
+
+            if (after && after->write == cmd->write &&
+                    after->fua == cmd->fua &&
+                    after->hipri == cmd->hipri &&
+                    cmd->cmd_lba + cmd->cmd_count == after->cmd_lba &&
+                    cmd->cmd_data + (size_t(cmd->cmd_count) <<
+                                     log2_sector_size) == after->cmd_data &&
+                    cmd->cmd_count + after->cmd_count <= max_merge_count) {
+                cmd->tail->next = after;
+                cmd->tail = after->tail;
+                cmd->cmd_count += after->cmd_count;
+                cmd->next_cmd = after->next_cmd;
+                --q.count;
+                atomic_inc(&stats.merge_count);
+            }
+
+            return true;
+        }
+
+        if (req->lba + req->count == cmd->cmd_lba &&
+                req->data + bytes == cmd->cmd_data) {
+            // Front merge, the new request leads the command
+            req->next = cmd;
+            req->tail = cmd->tail;
+            req->cmd_lba = req->lba;
+            req->cmd_data = req->data;
+            req->cmd_count = req->count + cmd->cmd_count;
+            req->next_cmd = cmd->next_cmd;
+            req->owner = this;
+            req->iocp.reset(&blk_queue_t::cmd_done, uintptr_t(req));
+            *link = req;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void blk_queue_t::insert_locked(blk_swq_t &q, blk_req_t *req)
+{
+    req->owner = this;
+    req->cmd_lba = req->lba;
+    req->cmd_data = req->data;
+    req->cmd_count = req->count;
+    req->tail = req;
+    req->iocp.reset(&blk_queue_t::cmd_done, uintptr_t(req));
+
+    // Keep the queue sorted by LBA, so it dispatches in elevator order
+    blk_req_t **link = &q.head;
+
+    while (*link && (*link)->cmd_lba < req->lba)
+        link = &(*link)->next_cmd;
+
+    req->next_cmd = *link;
+    *link = req;
+
+    ++q.count;
+}
+
+void blk_queue_t::dispatch(size_t cpu_nr)
+{
+    blk_swq_t &q = swq[cpu_nr % swq_count];
+
+    blk_swq_t::scoped_lock lock(q.lock);
+
+    blk_req_t *head = q.head;
+    size_t count = q.count;
+
+    q.head = nullptr;
+    q.count = 0;
+
+    lock.unlock();
+
+    if (!head)
+        return;
+
+    disk_io_plan_t plan(log2_sector_size);
+
+    for (blk_req_t *cmd = head, *next; cmd; cmd = next) {
+        next = cmd->next_cmd;
+
+        if (likely(plan.add(cmd->cmd_data, cmd->cmd_lba, cmd->cmd_count,
+                            cmd->write, cmd->fua, &cmd->iocp,
+                            cmd->hipri)))
+            continue;
+
+        // Out of memory for the plan, fail the command
+        --count;
+        atomic_inc(&stats.depth);
+        cmd->iocp.set_result({ errno_t::ENOMEM, 0 });
+        cmd->iocp.set_expect(1);
+        cmd->iocp.invoke();
+    }
+
+    if (unlikely(!count))
+        return;
+
+    uint64_t depth = atomic_add(&stats.depth, count);
+    atomic_max(&stats.max_depth, depth);
+    atomic_add(&stats.dispatch_count, count);
+    atomic_inc(&stats.batch_count);
+
+    BLK_TRACE("dispatching %zu commands from cpu %zu, depth=%" PRIu64 "\n",
+              count, cpu_nr, depth);
+
+    // The commands may complete and be freed before this returns
+    dev->submit_plan(&plan);
+}
+
+void blk_queue_t::complete_req(blk_req_t *req, errno_t err)
+{
+    if (req->deferred_plug) {
+        req->deferred_plug->deferred_done(err);
+    } else {
+        req->caller_iocp->set_result({
+            err, err == errno_t::OK
+                ? size_t(req->count) << log2_sector_size
+                : 0
+        });
+        req->caller_iocp->invoke();
+    }
+
+    free_req(req);
+}
+
+void blk_queue_t::cmd_done(dgos::err_sz_pair_t const& result, uintptr_t arg)
+{
+    blk_req_t *cmd = (blk_req_t*)arg;
+    blk_queue_t *queue = cmd->owner;
+
+    // The result lives in the leader, which is freed below
+    errno_t err = result.first;
+
+    atomic_dec(&queue->stats.depth);
+
+    for (blk_req_t *req = cmd->next; req; ) {
+        blk_req_t *next = req->next;
+
+        queue->complete_req(req, err);
+
+        req = next;
+    }
+
+    queue->complete_req(cmd, err);
+}
+
+void blk_queue_t::get_stats(blk_queue_stats_t *result)
+{
+    result->request_count = atomic_ld_acq(&stats.request_count);
+    result->merge_count = atomic_ld_acq(&stats.merge_count);
+    result->dispatch_count = atomic_ld_acq(&stats.dispatch_count);
+    result->batch_count = atomic_ld_acq(&stats.batch_count);
+    result->depth = atomic_ld_acq(&stats.depth);
+    result->max_depth = atomic_ld_acq(&stats.max_depth);
+}
+
+blk_plug_t::blk_plug_t(bool defer_reads)
+    : outer((blk_plug_t*)thread_get_blk_plug())
+    , root(outer ? outer->root : this)
+    , cpu_nr(thread_cpu_number())
+    , queues{}
+    , queue_count(0)
+    , defer_reads(defer_reads)
+    , deferred_pending(0)
+    , deferred_err(errno_t::OK)
+{
+    // The thread points at the innermost plug, so blk_read_blocks
+    // sees whether it may defer
+    thread_set_blk_plug(this);
+}
+
+blk_plug_t::~blk_plug_t()
+{
+    // Deferred reads complete into the plug, which is going away
+    if (defer_reads)
+        wait();
+
+    thread_set_blk_plug(outer);
+
+    if (outer)
+        return;
+
+    for (size_t i = 0; i < queue_count; ++i)
+        queues[i]->dispatch(cpu_nr);
+}
+
+void blk_plug_t::flush()
+{
+    size_t count = root->queue_count;
+    root->queue_count = 0;
+
+    for (size_t i = 0; i < count; ++i)
+        root->queues[i]->dispatch(root->cpu_nr);
+}
+
+errno_t blk_plug_t::wait()
+{
+    flush();
+
+    scoped_lock hold(deferred_lock);
+
+    while (deferred_pending)
+        deferred_cond.wait(hold);
+
+    errno_t err = deferred_err;
+    deferred_err = errno_t::OK;
+
+    return err;
+}
+
+void blk_plug_t::deferred_done(errno_t err)
+{
+    scoped_lock hold(deferred_lock);
+
+    if (unlikely(err != errno_t::OK) && deferred_err == errno_t::OK)
+        deferred_err = err;
+
+    // Hold the lock until after notify, the plug is gone once wait sees
+    // nothing pending
+    if (!--deferred_pending)
+        deferred_cond.notify_all();
+}
+
+errno_t blk_read_async(storage_dev_base_t *dev, void *data,
+                       int64_t count, uint64_t lba, iocp_t *iocp,
+                       unsigned flags)
+{
+    blk_queue_t *queue = blk_queue_t::get(dev);
+
+    if (unlikely(!queue))
+        return errno_t::ENOMEM;
+
+    return queue->submit(data, count, lba, false, false,
+                         flags & BLK_REQ_HIPRI, iocp);
+}
+
+errno_t blk_write_async(storage_dev_base_t *dev, void const *data,
+                        int64_t count, uint64_t lba, bool fua,
+                        iocp_t *iocp, unsigned flags)
+{
+    blk_queue_t *queue = blk_queue_t::get(dev);
+
+    if (unlikely(!queue))
+        return errno_t::ENOMEM;
+
+    return queue->submit(const_cast<void*>(data), count, lba,
+                         true, fua, flags & BLK_REQ_HIPRI, iocp);
+}
+
+int blk_read_blocks(storage_dev_base_t *dev, void *data,
+                    int64_t count, uint64_t lba)
+{
+    blk_plug_t *plug = (blk_plug_t*)thread_get_blk_plug();
+
+    if (!plug || !plug->defer_reads)
+        return dev->read_blocks(data, count, lba);
+
+    blk_queue_t *queue = blk_queue_t::get(dev);
+
+    if (unlikely(!queue))
+        return -int(errno_t::ENOMEM);
+
+    blk_plug_t::scoped_lock hold(plug->deferred_lock);
+    ++plug->deferred_pending;
+    hold.unlock();
+
+    errno_t err = queue->submit(data, count, lba, false, false, false,
+                                nullptr, plug);
+
+    if (unlikely(err != errno_t::OK)) {
+        hold.lock();
+        --plug->deferred_pending;
+        return -int(err);
+    }
+
+    return int(count << dev->info(STORAGE_INFO_BLOCKSIZE_LOG2));
+}
+
+void blk_flush_plug()
+{
+    blk_plug_t *plug = (blk_plug_t*)thread_get_blk_plug();
+
+    if (plug)
+        plug->flush();
+}
+
+void blk_get_stats(storage_dev_base_t *dev, blk_queue_stats_t *stats)
+{
+    blk_queue_t *queue = atomic_ld_acq(&dev->blk_queue);
+
+    if (queue)
+        queue->get_stats(stats);
+    else
+        *stats = {};
+}
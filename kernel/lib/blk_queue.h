@@ -0,0 +1,121 @@
+#pragma once
+#include "types.h"
+#include "errno.h"
+#include "device/iocp.h"
+
+struct storage_dev_base_t;
+class blk_queue_t;
+
+// Block request queue
+//
+// Sits between filesystems and storage drivers. Every device gets one
+// queue, with a software queue per CPU. A request that continues a queued
+// request of the same direction, on the disk and in memory, is merged into
+// it and reaches the driver as a single command. Unless the submitting
+// thread holds a plug, the software queue is dispatched immediately.
+// While a plug is held, requests accumulate until the plug is released,
+// then the whole batch is passed to the driver in one disk_io_plan_t,
+// so the driver can notify the device once for all of it.
+
+struct blk_queue_stats_t {
+    // Requests submitted to the queue
+    uint64_t request_count;
+
+    // Requests that were merged into another queued request
+    uint64_t merge_count;
+
+    // Commands passed to the driver
+    uint64_t dispatch_count;
+
+    // Calls to submit_plan
+    uint64_t batch_count;
+
+    // Commands currently at the driver, and the highest it has been
+    uint64_t depth;
+    uint64_t max_depth;
+};
+
+// Hold requests made by this thread until it goes out of scope.
+// Plugs nest, only the outermost one dispatches. When the innermost plug
+// was made with defer_reads, blk_read_blocks returns without waiting for
+// the data, and wait collects the reads, so a burst of synchronous looking
+// reads reaches the driver as one batch
+class KERNEL_API blk_plug_t {
+public:
+    explicit blk_plug_t(bool defer_reads = false);
+    ~blk_plug_t();
+
+    blk_plug_t(blk_plug_t const&) = delete;
+    blk_plug_t &operator=(blk_plug_t const&) = delete;
+
+    // Dispatch everything held so far, remaining plugged
+    void flush();
+
+    // Dispatch, then wait for the reads deferred by this plug.
+    // Returns the first error
+    errno_t wait();
+
+private:
+    friend class blk_queue_t;
+    friend int blk_read_blocks(storage_dev_base_t *dev, void *data,
+                               int64_t count, uint64_t lba);
+
+    using lock_type = ext::irq_spinlock;
+    using scoped_lock = ext::unique_lock<lock_type>;
+
+    static constexpr size_t max_queues = 4;
+
+    void deferred_done(errno_t err);
+
+    blk_plug_t *outer;
+
+    // The outermost plug, which holds the queues
+    blk_plug_t *root;
+
+    // Software queue used for every request made under the plug
+    size_t cpu_nr;
+
+    blk_queue_t *queues[max_queues];
+    size_t queue_count;
+
+    bool defer_reads;
+
+    // Reads started by blk_read_blocks and not yet completed,
+    // they complete straight into the plug, without an iocp each
+    size_t deferred_pending;
+    errno_t deferred_err;
+    lock_type deferred_lock;
+    ext::condition_variable deferred_cond;
+};
+
+// Request flags
+
+// Latency sensitive, the caller will poll for completion. Sent to the
+// device's polled queues, if it has any, and only merged with other
+// polled requests
+#define BLK_REQ_HIPRI   0x1U
+
+// Queue a transfer of count blocks. The iocp is completed exactly
+// as it would be by the device's read_async/write_async
+_use_result
+KERNEL_API errno_t blk_read_async(storage_dev_base_t *dev, void *data,
+                                  int64_t count, uint64_t lba, iocp_t *iocp,
+                                  unsigned flags = 0);
+
+_use_result
+KERNEL_API errno_t blk_write_async(storage_dev_base_t *dev, void const *data,
+                                   int64_t count, uint64_t lba, bool fua,
+                                   iocp_t *iocp, unsigned flags = 0);
+
+// Read count blocks, like dev->read_blocks. Under a plug made with
+// defer_reads, only starts the read and returns the size, the plug's
+// wait reports errors
+KERNEL_API int blk_read_blocks(storage_dev_base_t *dev, void *data,
+                               int64_t count, uint64_t lba);
+
+// Dispatch the requests held by the current thread's plug, if any.
+// Must be done before waiting for a request made under a plug
+KERNEL_API void blk_flush_plug();
+
+KERNEL_API void blk_get_stats(storage_dev_base_t *dev,
+                              blk_queue_stats_t *stats);
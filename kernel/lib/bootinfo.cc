@@ -5,9 +5,14 @@
 #include "export.h"
 #include "mm.h"
 #include "printk.h"
+#include "string.h"
+#include "cxxstring.h"
 
 HIDDEN void *zero_page;
 
+// Copy of the boot menu command line
+static char bootinfo_cmdline[2048];
+
 #ifdef _ASAN_ENABLED
 _constructor(ctor_asan_init) static void bootinfo_init()
 {
@@ -33,6 +38,22 @@ static void bootinfo_remap(void*)
 
     kernel_params->vbe_selected_mode = (vbe_selected_mode_t*)
             mmap((void*)mode, sizeof(*mode), PROT_READ, MAP_PHYSICAL);
+
+    uintptr_t cmdline_addr = kernel_params->command_line;
+
+    if (cmdline_addr) {
+        char const *cmdline = (char const *)mmap(
+                    (void*)cmdline_addr, sizeof(bootinfo_cmdline),
+                    PROT_READ, MAP_PHYSICAL);
+
+        if (likely(cmdline != MAP_FAILED)) {
+            for (size_t i = 0; i < sizeof(bootinfo_cmdline) - 1 &&
+                 cmdline[i]; ++i)
+                bootinfo_cmdline[i] = cmdline[i];
+
+            munmap((void*)cmdline, sizeof(bootinfo_cmdline));
+        }
+    }
 }
 REGISTER_CALLOUT(bootinfo_remap, nullptr,
                  callout_type_t::vmm_ready, "000");
@@ -110,6 +131,9 @@ uintptr_t bootinfo_parameter(bootparam_t param)
     case bootparam_t::phys_mapping_sz:
         return data->phys_mapping_sz;
 
+    case bootparam_t::command_line:
+        return uintptr_t(bootinfo_cmdline);
+
     }
 
     return 0;
@@ -125,3 +149,133 @@ void bootinfo_drop_initrd()
     data->initrd_st = 0;
     data->initrd_sz = 0;
 }
+
+// Split one option at the '=' and hand it to parse
+static bool bootinfo_parse_option(char const *module, ext::string &option,
+                                  bootopt_parser_t parse, void *arg)
+{
+    char *key = option.data();
+    char *eq = !option.empty() ? strchr(key, '=') : nullptr;
+
+    if (!eq) {
+        printdbg("%s: expected key=value, got %s\n", module, option.c_str());
+        return false;
+    }
+
+    *eq = 0;
+
+    char const *value = eq + 1;
+
+    switch (parse(arg, key, value)) {
+    case bootopt_result_t::ok:
+        return true;
+
+    case bootopt_result_t::invalid:
+        printdbg("%s: invalid value in %s=%s\n", module, key, value);
+        return false;
+
+    case bootopt_result_t::unknown:
+        printdbg("%s: unknown option %s\n", module, key);
+        return false;
+
+    }
+
+    return false;
+}
+
+int bootinfo_parse_options(char const *module,
+                           int argc, char const * const *argv,
+                           bootopt_parser_t parse, void *arg)
+{
+    size_t module_len = strlen(module);
+    int count = 0;
+
+    for (char const *p = bootinfo_cmdline; *p; ) {
+        while (*p == ' ')
+            ++p;
+
+        char const *end = strchr(p, ' ');
+
+        if (!end)
+            end = p + strlen(p);
+
+        if (size_t(end - p) > module_len + 1 &&
+                !strncmp(p, module, module_len) && p[module_len] == '.') {
+            ext::string option;
+
+            if (unlikely(!option.assign_noexcept(p + module_len + 1, end)))
+                return -1;
+
+            if (!bootinfo_parse_option(module, option, parse, arg))
+                return -1;
+
+            ++count;
+        }
+
+        p = end;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        char const *text = argv[i];
+        ext::string option;
+
+        if (unlikely(!option.assign_noexcept(text, text + strlen(text))))
+            return -1;
+
+        if (!bootinfo_parse_option(module, option, parse, arg))
+            return -1;
+
+        ++count;
+    }
+
+    return count;
+}
+
+uint64_t bootinfo_scan_uint(char const **text, bool *ok)
+{
+    char const *p = *text;
+    uint64_t value = 0;
+
+    if (*p < '0' || *p > '9')
+        *ok = false;
+
+    for ( ; *p >= '0' && *p <= '9'; ++p) {
+        unsigned digit = *p - '0';
+
+        if (value > (UINT64_MAX - digit) / 10)
+            *ok = false;
+
+        value = value * 10 + digit;
+    }
+
+    *text = p;
+
+    return value;
+}
+
+uint64_t bootinfo_parse_uint(char const *text, bool *ok)
+{
+    uint64_t value = bootinfo_scan_uint(&text, ok);
+
+    if (*text)
+        *ok = false;
+
+    return value;
+}
+
+uint64_t bootinfo_parse_size(char const *text, bool *ok)
+{
+    uint64_t value = bootinfo_scan_uint(&text, ok);
+    int shift = 0;
+
+    switch (*text) {
+    case 'k': case 'K': shift = 10; ++text; break;
+    case 'm': case 'M': shift = 20; ++text; break;
+    case 'g': case 'G': shift = 30; ++text; break;
+    }
+
+    if (*text || value > (UINT64_MAX >> shift))
+        *ok = false;
+
+    return value << shift;
+}
@@ -25,10 +25,48 @@ enum struct bootparam_t {
     phys_mem_table,
     phys_mem_table_size,
     phys_mapping,
-    phys_mapping_sz
+    phys_mapping_sz,
+
+    // char const *, never null
+    command_line
 };
 
 KERNEL_API uintptr_t bootinfo_parameter(bootparam_t param);
 KERNEL_API void bootinfo_drop_initrd();
 
+// Module options
+//
+// A module takes key=value options as module parameters, or the same
+// options prefixed with the module name and a dot on the boot command
+// line, like ramdisk.size=64m. Module parameters come after the command
+// line, so they override it.
+
+// What a module made of one option
+enum struct bootopt_result_t {
+    ok,
+    invalid,
+    unknown
+};
+
+typedef bootopt_result_t (*bootopt_parser_t)(
+        void *arg, char const *key, char const *value);
+
+// Call parse with each option of module, stopping at the first mistake,
+// which is reported as "module: ...". Returns the number of options,
+// or -1 for a mistake or when out of memory
+_use_result
+KERNEL_API int bootinfo_parse_options(char const *module,
+                                      int argc, char const * const *argv,
+                                      bootopt_parser_t parse, void *arg);
+
+// The decimal number at *text, advancing *text past it.
+// Clears *ok when there are no digits or it overflows
+KERNEL_API uint64_t bootinfo_scan_uint(char const **text, bool *ok);
+
+// All of text as a decimal number, clears *ok otherwise
+KERNEL_API uint64_t bootinfo_parse_uint(char const *text, bool *ok);
+
+// Like bootinfo_parse_uint, with an optional k, m or g suffix
+KERNEL_API uint64_t bootinfo_parse_size(char const *text, bool *ok);
+
 __END_DECLS
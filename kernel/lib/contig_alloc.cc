@@ -5,6 +5,10 @@
 #include "inttypes.h"
 #include "atomic.h"
 #include "mmu.h"
+#include "string.h"
+#include "stdlib.h"
+#include "cpu/thread_impl.h"
+#include "cpu/control_regs.h"
 
 #define DEBUG_LINEAR_SANITY     0
 #define DEBUG_ADDR_ALLOC        1
@@ -98,6 +102,13 @@ uintptr_t contiguous_allocator_t::alloc_linear(size_t size)
 
     assert(!(size & PAGE_MASK));
 
+    if (likely(cache_ready)) {
+        addr = cache_alloc(size);
+
+        if (likely(addr))
+            return addr;
+    }
+
     if (likely(ready)) {
         scoped_lock lock(free_addr_lock);
 
@@ -114,6 +125,15 @@ uintptr_t contiguous_allocator_t::alloc_linear(size_t size)
         // Find the lowest address item that is big enough
         tree_t::iterator place = free_addr_by_size.lower_bound({size, 0});
 
+        // The ranges sitting in the per-CPU caches might coalesce into
+        // something big enough
+        if (unlikely(place == free_addr_by_size.end() && cache_ready)) {
+            lock.unlock();
+            drain_cpu_caches();
+            lock.lock();
+            place = free_addr_by_size.lower_bound({size, 0});
+        }
+
         if (unlikely(place == free_addr_by_size.end()))
             return 0;
 
@@ -241,6 +261,10 @@ uintptr_t contiguous_allocator_t::alloc_linear(size_t size)
 bool contiguous_allocator_t::take_linear(
         linaddr_t addr, size_t size, bool require_free)
 {
+    // The range might be sitting in a cache
+    if (cache_ready)
+        drain_cpu_caches();
+
     scoped_lock lock(free_addr_lock);
 
 #if DEBUG_ADDR_ALLOC
@@ -416,10 +440,21 @@ bool contiguous_allocator_t::take_linear(
     return true;
 }
 
-void contiguous_allocator_t::release_linear(uintptr_t addr, size_t size)
+void contiguous_allocator_t::release_linear(
+        uintptr_t addr, size_t size, bool tlb_dirty)
 {
+    if (likely(cache_ready) && cache_release(addr, size, tlb_dirty))
+        return;
+
+    flush_tlb(tlb_dirty);
+
     scoped_lock lock(free_addr_lock);
+    release_linear_locked(lock, addr, size);
+}
 
+void contiguous_allocator_t::release_linear_locked(
+        scoped_lock &lock, uintptr_t addr, size_t size)
+{
 #if DEBUG_ADDR_ALLOC
     //dump("---- Free %#" PRIx64 " @ %#" PRIx64 "\n", size, addr);
     validate_locked(lock);
@@ -575,6 +610,212 @@ void contiguous_allocator_t::release_linear(uintptr_t addr, size_t size)
 }
 
 
+//
+// Per-CPU range cache
+
+// Class n holds ranges of n+1 pages, the last class holds extra_size ranges
+static constexpr size_t cache_classes =
+        contiguous_allocator_t::cache_max_pages + 1;
+
+struct contiguous_allocator_t::cpu_cache_t {
+    static constexpr size_t dirty_max = cache_depth * 2;
+
+    lock_type lock;
+
+    // Ranges that have been invalidated everywhere, ready for reuse.
+    // Each class is a stack, newest on top
+    uintptr_t clean[cache_classes][cache_depth];
+    uint8_t clean_count[cache_classes];
+
+    // Ranges waiting for a TLB shootdown before they can be reused
+    mmu_range_t dirty[dirty_max];
+    size_t dirty_count;
+};
+
+void contiguous_allocator_t::enable_cpu_cache(
+        size_t extra_size, void (*tlb_flush)(bool))
+{
+    cache_extra_size = extra_size;
+    cache_tlb_flush = tlb_flush;
+    cache_slot = thread_cls_alloc();
+
+    bool ok = true;
+
+    thread_cls_init_each_cpu(cache_slot, false, [&] {
+        void *mem = calloc(1, sizeof(cpu_cache_t));
+        ok = ok && mem;
+        return mem ? (void*)new (mem) cpu_cache_t() : nullptr;
+    });
+
+    cache_ready = ok;
+}
+
+size_t contiguous_allocator_t::cache_class(size_t size) const
+{
+    size_t pages = size >> PAGE_SCALE;
+
+    if (pages && pages <= cache_max_pages)
+        return pages - 1;
+
+    if (size == cache_extra_size)
+        return cache_classes - 1;
+
+    return cache_classes;
+}
+
+uintptr_t contiguous_allocator_t::cache_alloc(size_t size)
+{
+    size_t cls = cache_class(size);
+
+    if (unlikely(cls >= cache_classes))
+        return 0;
+
+    // Migrating after this would just use the other CPU's cache
+    cpu_cache_t *cache = (cpu_cache_t*)thread_cls_get(cache_slot);
+
+    scoped_lock lock(cache->lock);
+
+    if (unlikely(!cache->clean_count[cls]))
+        return 0;
+
+    return cache->clean[cls][--cache->clean_count[cls]];
+}
+
+bool contiguous_allocator_t::cache_release(
+        uintptr_t addr, size_t size, bool tlb_dirty)
+{
+    size_t cls = cache_class(size);
+
+    if (unlikely(cls >= cache_classes))
+        return false;
+
+    cpu_cache_t *cache = (cpu_cache_t*)thread_cls_get(cache_slot);
+
+    mmu_range_t spill[cpu_cache_t::dirty_max + 1];
+    size_t spill_count = 0;
+
+    scoped_lock lock(cache->lock);
+
+    if (tlb_dirty) {
+        if (likely(cache->dirty_count < cpu_cache_t::dirty_max)) {
+            cache->dirty[cache->dirty_count++] = { addr, size };
+            return true;
+        }
+
+        // Overflow, take everything pending and make it all reusable
+        // with a single shootdown
+        mmu_range_t pending[cpu_cache_t::dirty_max + 1];
+        size_t pending_count = cache->dirty_count;
+        memcpy(pending, cache->dirty, sizeof(*pending) * pending_count);
+        pending[pending_count++] = { addr, size };
+        cache->dirty_count = 0;
+
+        // Never wait for other CPUs while holding a spinlock
+        lock.unlock();
+        flush_tlb(true);
+        lock.lock();
+
+        for (size_t i = 0; i < pending_count; ++i) {
+            size_t pending_cls = cache_class(pending[i].size);
+            uint8_t &count = cache->clean_count[pending_cls];
+
+            if (count < cache_depth)
+                cache->clean[pending_cls][count++] = pending[i].base;
+            else
+                spill[spill_count++] = pending[i];
+        }
+    } else {
+        uint8_t &count = cache->clean_count[cls];
+
+        if (unlikely(count == cache_depth)) {
+            // Overflow, send the oldest half back to the trees
+            size_t constexpr half = cache_depth / 2;
+
+            for (size_t i = 0; i < half; ++i)
+                spill[spill_count++] = { cache->clean[cls][i], size };
+
+            memmove(cache->clean[cls], cache->clean[cls] + half,
+                    sizeof(**cache->clean) * (cache_depth - half));
+            count -= half;
+        }
+
+        cache->clean[cls][count++] = addr;
+    }
+
+    lock.unlock();
+
+    release_batch(spill, spill_count);
+
+    return true;
+}
+
+void contiguous_allocator_t::cache_drain_one(cpu_cache_t *cache)
+{
+    mmu_range_t ranges[cpu_cache_t::dirty_max];
+
+    scoped_lock lock(cache->lock);
+
+    size_t count = cache->dirty_count;
+    memcpy(ranges, cache->dirty, sizeof(*ranges) * count);
+    cache->dirty_count = 0;
+
+    lock.unlock();
+
+    if (count) {
+        flush_tlb(true);
+        release_batch(ranges, count);
+    }
+
+    for (size_t cls = 0; cls < cache_classes; ++cls) {
+        size_t size = cls < cache_classes - 1
+                ? (cls + 1) << PAGE_SCALE
+                : cache_extra_size;
+
+        lock.lock();
+
+        count = cache->clean_count[cls];
+        for (size_t i = 0; i < count; ++i)
+            ranges[i] = { cache->clean[cls][i], size };
+        cache->clean_count[cls] = 0;
+
+        lock.unlock();
+
+        release_batch(ranges, count);
+    }
+}
+
+void contiguous_allocator_t::drain_cpu_caches()
+{
+    if (!cache_ready)
+        return;
+
+    thread_cls_for_each_cpu(cache_slot, false,
+                            [](int, void *cache, void *arg, size_t) {
+        ((contiguous_allocator_t*)arg)->cache_drain_one(
+                    (cpu_cache_t*)cache);
+    }, this, 0);
+}
+
+// Insert a batch of ranges into the trees with one lock acquisition
+void contiguous_allocator_t::release_batch(
+        mmu_range_t const *ranges, size_t count)
+{
+    if (!count)
+        return;
+
+    scoped_lock lock(free_addr_lock);
+
+    for (size_t i = 0; i < count; ++i)
+        release_linear_locked(lock, ranges[i].base, ranges[i].size);
+}
+
+void contiguous_allocator_t::flush_tlb(bool tlb_dirty)
+{
+    // Only wait for the other CPUs when it is safe to do so
+    if (tlb_dirty && cache_tlb_flush)
+        cache_tlb_flush(cpu_irq_is_enabled());
+}
+
 
 void contiguous_allocator_t::dump(char const *format, ...) const
 {
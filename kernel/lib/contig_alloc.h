@@ -20,7 +20,22 @@ public:
     void init(linaddr_t addr, size_t size, char const *name);
     uintptr_t alloc_linear(size_t size);
     bool take_linear(linaddr_t addr, size_t size, bool require_free);
-    void release_linear(uintptr_t addr, size_t size);
+
+    // tlb_dirty means other CPUs may still hold TLB entries for the range.
+    // The allocator invokes the tlb_flush handler before the range can be
+    // handed out again. Only the range waits for that, memory that was
+    // mapped there must not be freed until the caller has shot it down
+    void release_linear(uintptr_t addr, size_t size, bool tlb_dirty = false);
+
+    // Keep per-CPU caches of recently released ranges of 1 to
+    // cache_max_pages pages, and of exactly extra_size bytes, so common
+    // allocations avoid the tree lock. Ranges released dirty are batched
+    // until a cache overflows, then one tlb_flush covers all of them.
+    // Must be called after all CPUs are known
+    void enable_cpu_cache(size_t extra_size, void (*tlb_flush)(bool sync));
+
+    // Return every cached range to the trees
+    void drain_cpu_caches();
     void dump(char const *format, ...) const
     _printf_format(2, 3);
     void dumpv(char const *format, va_list ap) const
@@ -36,6 +51,9 @@ public:
     bool validate_locked(scoped_lock &lock) const;
     bool validation_failed(scoped_lock &lock) const;
 
+    static constexpr size_t cache_max_pages = 16;
+    static constexpr size_t cache_depth = 8;
+
     struct mmu_range_t {
         linaddr_t base;
         size_t size;
@@ -52,12 +70,29 @@ public:
     void each_rv(F callback);
 
 private:
+    struct cpu_cache_t;
+
+    void release_linear_locked(scoped_lock &lock,
+                               uintptr_t addr, size_t size);
+    void release_batch(mmu_range_t const *ranges, size_t count);
+    void flush_tlb(bool tlb_dirty);
+    size_t cache_class(size_t size) const;
+    uintptr_t cache_alloc(size_t size);
+    bool cache_release(uintptr_t addr, size_t size, bool tlb_dirty);
+    void cache_drain_one(cpu_cache_t *cache);
+
     lock_type mutable free_addr_lock;
     tree_t free_addr_by_size;
     tree_t free_addr_by_addr;
     linaddr_t *linear_base_ptr = nullptr;
     bool ready = false;
     char const *name = nullptr;
+
+    // Per-CPU cache, see enable_cpu_cache
+    size_t cache_slot = 0;
+    size_t cache_extra_size = 0;
+    void (*cache_tlb_flush)(bool sync) = nullptr;
+    bool cache_ready = false;
 };
 
 template<typename F>
@@ -0,0 +1,295 @@
+#include "dentry_cache.h"
+#include "callout.h"
+#include "vector.h"
+#include "mutex.h"
+#include "hash.h"
+#include "string.h"
+#include "atomic.h"
+#include "printk.h"
+
+#define DEBUG_DCACHE 0
+#if DEBUG_DCACHE
+#define DCACHE_TRACE(...) printdbg("dcache: " __VA_ARGS__)
+#else
+#define DCACHE_TRACE(...) ((void)0)
+#endif
+
+// Number of entries, power of two
+#define DCACHE_CAPACITY 1024
+
+// Generation counters, filesystems are hashed onto them, power of two.
+// Filesystems sharing one only drop some of each other's inserts
+#define DCACHE_GEN_SLOTS 64
+
+__BEGIN_ANONYMOUS
+
+enum dcache_flags_t : uint8_t {
+    // The entry holds a name
+    DCACHE_USED = 0x01,
+
+    // The name does not exist
+    DCACHE_NEGATIVE = 0x02
+};
+
+struct dcache_ent_t {
+    fs_base_t *fs;
+    ino_t dir;
+    uint32_t hash;
+
+    // Next entry in the bucket, or -1
+    int32_t next;
+
+    uint8_t name_len;
+    uint8_t flags;
+
+    // Set by lookups, cleared as the clock hand passes
+    uint8_t referenced;
+
+    char name[DCACHE_NAME_MAX];
+};
+
+C_ASSERT(sizeof(dcache_ent_t) == 128);
+
+using dcache_lock_type = ext::shared_spinlock;
+using dcache_scoped_lock = ext::unique_lock<dcache_lock_type>;
+using dcache_shared_lock = ext::shared_lock<dcache_lock_type>;
+
+__END_ANONYMOUS
+
+// Protects everything below. Lookups hold it shared, and only touch the
+// referenced flags
+static dcache_lock_type dcache_lock;
+static ext::vector<dcache_ent_t> dcache_entries;
+
+// First entry of each bucket, or -1, one bucket per entry
+static ext::vector<int32_t> dcache_buckets;
+
+// Unused entries, chained through next
+static int32_t dcache_free_first = -1;
+
+static uint32_t dcache_hand;
+static uint64_t dcache_gen[DCACHE_GEN_SLOTS];
+static dcache_stats_t dcache_stats;
+
+static void dcache_init(void *)
+{
+    dcache_scoped_lock lock(dcache_lock);
+
+    // The cache is optional, stay empty without memory
+    if (unlikely(!dcache_entries.resize(DCACHE_CAPACITY) ||
+                 !dcache_buckets.resize(DCACHE_CAPACITY, -1))) {
+        dcache_entries.clear();
+        dcache_buckets.clear();
+        printdbg("dcache: out of memory, disabled\n");
+        return;
+    }
+
+    for (size_t i = DCACHE_CAPACITY; i > 0; --i) {
+        dcache_ent_t& ent = dcache_entries[i - 1];
+        ent.flags = 0;
+        ent.next = dcache_free_first;
+        dcache_free_first = int32_t(i - 1);
+    }
+
+    dcache_stats.capacity = DCACHE_CAPACITY;
+}
+
+REGISTER_CALLOUT(dcache_init, nullptr,
+                 callout_type_t::heap_ready, "000");
+
+static uint64_t& dcache_fs_gen(fs_base_t *fs)
+{
+    return dcache_gen[uint32_t(uintptr_t(fs) *
+                               UINT64_C(0x9E3779B97F4A7C15) >> 32) &
+            (DCACHE_GEN_SLOTS - 1)];
+}
+
+static uint32_t dcache_hash(fs_base_t *fs, ino_t dir,
+                            char const *name, size_t len)
+{
+    return hash_32(name, len) ^
+            uint32_t((uintptr_t(fs) ^ dir) * UINT64_C(0x9E3779B97F4A7C15) >>
+                     32);
+}
+
+static int32_t dcache_find(fs_base_t *fs, ino_t dir,
+                           char const *name, size_t len, uint32_t hash)
+{
+    int32_t i = dcache_buckets[hash & (DCACHE_CAPACITY - 1)];
+
+    while (i >= 0) {
+        dcache_ent_t const& ent = dcache_entries[i];
+
+        if (ent.hash == hash && ent.fs == fs && ent.dir == dir &&
+                ent.name_len == len && !memcmp(ent.name, name, len))
+            break;
+
+        i = ent.next;
+    }
+
+    return i;
+}
+
+// Remove entry i from its bucket and put it on the free list
+static void dcache_remove(int32_t i)
+{
+    dcache_ent_t& ent = dcache_entries[i];
+
+    int32_t *link = &dcache_buckets[ent.hash & (DCACHE_CAPACITY - 1)];
+
+    while (*link != i)
+        link = &dcache_entries[*link].next;
+
+    *link = ent.next;
+
+    ent.flags = 0;
+    ent.next = dcache_free_first;
+    dcache_free_first = i;
+
+    --dcache_stats.entry_count;
+}
+
+// Take a free entry, evicting one that wasn't used recently if none
+static int32_t dcache_alloc()
+{
+    if (dcache_free_first < 0) {
+        for (;;) {
+            dcache_ent_t& ent = dcache_entries[dcache_hand];
+            int32_t i = int32_t(dcache_hand);
+
+            dcache_hand = (dcache_hand + 1) & (DCACHE_CAPACITY - 1);
+
+            if (ent.referenced) {
+                ent.referenced = 0;
+                continue;
+            }
+
+            dcache_remove(i);
+            ++dcache_stats.evict_count;
+            break;
+        }
+    }
+
+    int32_t i = dcache_free_first;
+    dcache_free_first = dcache_entries[i].next;
+
+    return i;
+}
+
+dcache_hit_t dcache_lookup(fs_base_t *fs, ino_t dir,
+                           char const *name, size_t len)
+{
+    atomic_inc(&dcache_stats.lookup_count);
+
+    if (unlikely(len > DCACHE_NAME_MAX))
+        return dcache_hit_t::miss;
+
+    uint32_t hash = dcache_hash(fs, dir, name, len);
+
+    dcache_shared_lock lock(dcache_lock);
+
+    if (unlikely(dcache_buckets.empty()))
+        return dcache_hit_t::miss;
+
+    int32_t i = dcache_find(fs, dir, name, len, hash);
+
+    if (i < 0)
+        return dcache_hit_t::miss;
+
+    dcache_ent_t& ent = dcache_entries[i];
+
+    // Avoid dirtying the line when it is already set
+    if (!atomic_ld_acq(&ent.referenced))
+        atomic_st_rel(&ent.referenced, 1);
+
+    atomic_inc(&dcache_stats.hit_count);
+
+    if (ent.flags & DCACHE_NEGATIVE) {
+        atomic_inc(&dcache_stats.negative_hit_count);
+        return dcache_hit_t::negative;
+    }
+
+    return dcache_hit_t::positive;
+}
+
+uint64_t dcache_generation(fs_base_t *fs)
+{
+    return atomic_ld_acq(&dcache_fs_gen(fs));
+}
+
+void dcache_insert(fs_base_t *fs, ino_t dir,
+                   char const *name, size_t len,
+                   bool negative, uint64_t generation)
+{
+    if (unlikely(len > DCACHE_NAME_MAX))
+        return;
+
+    uint32_t hash = dcache_hash(fs, dir, name, len);
+
+    dcache_scoped_lock lock(dcache_lock);
+
+    if (unlikely(dcache_buckets.empty()))
+        return;
+
+    // The namespace changed after the caller looked
+    if (generation != dcache_fs_gen(fs)) {
+        DCACHE_TRACE("dropped stale insert of %.*s\n", int(len), name);
+        return;
+    }
+
+    int32_t i = dcache_find(fs, dir, name, len, hash);
+
+    if (i < 0) {
+        i = dcache_alloc();
+
+        dcache_ent_t& ent = dcache_entries[i];
+        ent.fs = fs;
+        ent.dir = dir;
+        ent.hash = hash;
+        ent.name_len = uint8_t(len);
+        memcpy(ent.name, name, len);
+
+        int32_t& bucket = dcache_buckets[hash & (DCACHE_CAPACITY - 1)];
+        ent.next = bucket;
+        bucket = i;
+
+        ++dcache_stats.entry_count;
+        ++dcache_stats.insert_count;
+    }
+
+    dcache_ent_t& ent = dcache_entries[i];
+    ent.flags = DCACHE_USED | (negative ? DCACHE_NEGATIVE : 0);
+    ent.referenced = 1;
+}
+
+void dcache_invalidate(fs_base_t *fs, bool negative_only)
+{
+    dcache_scoped_lock lock(dcache_lock);
+
+    // Reject inserts from lookups that started before this
+    atomic_st_rel(&dcache_fs_gen(fs), dcache_fs_gen(fs) + 1);
+    ++dcache_stats.invalidate_count;
+
+    for (size_t i = 0, e = dcache_entries.size(); i < e; ++i) {
+        dcache_ent_t const& ent = dcache_entries[i];
+
+        if ((ent.flags & DCACHE_USED) && ent.fs == fs &&
+                (!negative_only || (ent.flags & DCACHE_NEGATIVE)))
+            dcache_remove(int32_t(i));
+    }
+}
+
+void dcache_get_stats(dcache_stats_t *stats)
+{
+    dcache_shared_lock lock(dcache_lock);
+
+    stats->entry_count = dcache_stats.entry_count;
+    stats->capacity = dcache_stats.capacity;
+    stats->lookup_count = atomic_ld_acq(&dcache_stats.lookup_count);
+    stats->hit_count = atomic_ld_acq(&dcache_stats.hit_count);
+    stats->negative_hit_count =
+            atomic_ld_acq(&dcache_stats.negative_hit_count);
+    stats->insert_count = dcache_stats.insert_count;
+    stats->evict_count = dcache_stats.evict_count;
+    stats->invalidate_count = dcache_stats.invalidate_count;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include "types.h"
+#include "dirent.h"
+
+struct fs_base_t;
+
+// Directory entry cache
+//
+// Remembers which names exist (positive entries) and which do not
+// (negative entries), keyed by filesystem, directory inode and the path
+// handed to the filesystem, so repeated opens and stats of the same
+// names, and especially repeated probes of names that don't exist, are
+// answered without asking the filesystem. The number of entries is
+// fixed, the least recently used entries are evicted (clock
+// approximation) to make room. Lookups only take the lock shared.
+//
+// The cache only knows that a name resolved, it does not hold inode
+// attributes. Callers invalidate it when they change the namespace of a
+// filesystem. Each filesystem has a generation, an insert made with a
+// generation older than the filesystem's last invalidation is dropped,
+// so a lookup that raced with a change can't put a stale answer back.
+
+// The directory key when there is no directory file
+#define DCACHE_ROOT_DIR ino_t(-1)
+
+// Longer names are not cached
+#define DCACHE_NAME_MAX 101
+
+enum struct dcache_hit_t {
+    miss,
+    negative,
+    positive
+};
+
+struct dcache_stats_t {
+    uint64_t entry_count;
+    uint64_t capacity;
+
+    // Lifetime counters
+    uint64_t lookup_count;
+    uint64_t hit_count;
+    uint64_t negative_hit_count;
+    uint64_t insert_count;
+    uint64_t evict_count;
+    uint64_t invalidate_count;
+};
+
+KERNEL_API dcache_hit_t dcache_lookup(fs_base_t *fs, ino_t dir,
+                                      char const *name, size_t len);
+
+// Read before asking the filesystem, and pass it to dcache_insert
+KERNEL_API uint64_t dcache_generation(fs_base_t *fs);
+
+KERNEL_API void dcache_insert(fs_base_t *fs, ino_t dir,
+                              char const *name, size_t len,
+                              bool negative, uint64_t generation);
+
+// Forget the entries of fs, or only its negative entries, when names
+// were only added
+KERNEL_API void dcache_invalidate(fs_base_t *fs, bool negative_only);
+
+KERNEL_API void dcache_get_stats(dcache_stats_t *stats);
@@ -1,9 +1,14 @@
 #include "dev_storage.h"
+#include "blk_queue.h"
 
 #include "printk.h"
 #include "string.h"
 #include "assert.h"
 #include "vector.h"
+#include "time.h"
+#include "mm.h"
+#include "work_queue.h"
+#include "user_mem.h"
 
 #include "hash_table.h"
 
@@ -14,6 +19,12 @@
 #define STORAGE_TRACE(...) ((void)0)
 #endif
 
+// Longest a polled wait spins before it starts sleeping between polls
+#define STORAGE_POLL_MAX_SPIN_NS    100000
+
+// Shortest sleep between polls, once the spin is over
+#define STORAGE_POLL_MIN_SLEEP_NS   10000
+
 dev_base_t::major_map_t dev_base_t::dev_lookup;
 
 struct fs_mount_t {
@@ -251,31 +262,86 @@ void part_factory_t::register_factory(void *p)
 }
 
 int storage_dev_base_t::read_blocks(
-        void *data, int64_t count, uint64_t lba)
+        void *data, int64_t count, uint64_t lba, unsigned flags)
 {
     blocking_iocp_t block;
-    errno_t err = read_async(data, count, lba, &block);
+    uint64_t start = (flags & BLK_REQ_HIPRI) ? time_ns() : 0;
+    errno_t err = blk_read_async(this, data, count, lba, &block, flags);
     if (unlikely(err != errno_t::OK))
         return -int64_t(err);
-    auto result = block.wait();
+    blk_flush_plug();
+    auto result = (flags & BLK_REQ_HIPRI)
+            ? wait_polled(block, start)
+            : block.wait();
     if (unlikely(result.first != errno_t::OK))
         return -int64_t(result.first);
     return result.second;
 }
 
 int storage_dev_base_t::write_blocks(
-        void const *data, int64_t count, uint64_t lba, bool fua)
+        void const *data, int64_t count, uint64_t lba, bool fua,
+        unsigned flags)
 {
     blocking_iocp_t block;
-    errno_t err = write_async(data, count, lba, fua, &block);
+    uint64_t start = (flags & BLK_REQ_HIPRI) ? time_ns() : 0;
+    errno_t err = blk_write_async(this, data, count, lba, fua,
+                                  &block, flags);
     if (unlikely(err != errno_t::OK))
         return -int64_t(err);
-    auto result = block.wait();
+    blk_flush_plug();
+    auto result = (flags & BLK_REQ_HIPRI)
+            ? wait_polled(block, start)
+            : block.wait();
     if (unlikely(result.first != errno_t::OK))
         return -int64_t(result.first);
     return result.second;
 }
 
+// Polled queues raise no interrupt. Spin polling for up to twice the usual
+// latency, where most requests will have completed, then alternate between
+// sleeping for half the usual latency and polling again
+dgos::err_sz_pair_t storage_dev_base_t::wait_polled(
+        blocking_iocp_t &block, uint64_t start)
+{
+    if (!info(STORAGE_INFO_HAVE_POLL))
+        return block.wait();
+
+    uint64_t avg = atomic_ld_acq(&poll_latency_ns);
+
+    uint64_t spin_ns = avg
+            ? ext::min(avg * 2, uint64_t(STORAGE_POLL_MAX_SPIN_NS))
+            : uint64_t(STORAGE_POLL_MAX_SPIN_NS);
+
+    uint64_t sleep_ns = ext::max(avg >> 1,
+                                 uint64_t(STORAGE_POLL_MIN_SLEEP_NS));
+
+    for (;;) {
+        poll_completions();
+
+        if (block.wait_until(0))
+            break;
+
+        uint64_t now = time_ns();
+
+        if (now - start < spin_ns) {
+            pause();
+            continue;
+        }
+
+        // Another poller may complete it while sleeping
+        if (block.wait_until(now + sleep_ns))
+            break;
+    }
+
+    // Moving average, each sample weighs 1/8
+    uint64_t latency = time_ns() - start;
+    atomic_st_rel(&poll_latency_ns, avg
+                  ? avg - (avg >> 3) + (latency >> 3)
+                  : latency);
+
+    return block.get_result();
+}
+
 int64_t storage_dev_base_t::trim_blocks(int64_t count, uint64_t lba)
 {
     blocking_iocp_t block;
@@ -491,9 +557,8 @@ void storage_if_factory_t::register_factory()
     storage_if_register_factory(this);
 }
 
-disk_io_plan_t::disk_io_plan_t(void *dest, uint8_t log2_sector_size)
-    : dest(dest)
-    , vec(nullptr)
+disk_io_plan_t::disk_io_plan_t(uint8_t log2_sector_size)
+    : vec(nullptr)
     , count(0)
     , capacity(0)
     , log2_sector_size(log2_sector_size)
@@ -508,26 +573,25 @@ disk_io_plan_t::~disk_io_plan_t()
     capacity = 0;
 }
 
-bool disk_io_plan_t::add(
-        uint32_t lba, uint16_t sector_count,
-        uint16_t sector_ofs, uint16_t byte_count)
+bool disk_io_plan_t::add(void *data, uint64_t lba, uint32_t sector_count,
+                         bool write, bool fua, iocp_t *iocp, bool hipri)
 {
     if (count > 0) {
         // See if we can coalesce with previous entry
 
         disk_vec_t &prev = vec[count - 1];
 
-        uint32_t sector_size = UINT32_C(1) << log2_sector_size;;
-
-        if (prev.lba + prev.count == lba &&
-                prev.sector_ofs == 0 &&
-                sector_ofs == 0 &&
-                prev.byte_count == sector_size &&
-                byte_count == sector_size &&
-                0xFFFFFFFFU - count > prev.count) {
-            // Added entry is a sequential run of full sector-aligned sector
-            // which is contiguous with previous run of full sector-aligned
-            // sectors and the sector count won't overflow
+        if (prev.iocp == iocp &&
+                prev.write == write &&
+                prev.fua == fua &&
+                prev.hipri == hipri &&
+                prev.lba + prev.count == lba &&
+                (char*)prev.data + (uint64_t(prev.count) <<
+                                    log2_sector_size) == data &&
+                UINT32_MAX - sector_count >= prev.count) {
+            // Added entry is a sequential run of sectors which is
+            // contiguous with the previous run on the disk and in memory,
+            // and the sector count won't overflow
             prev.count += sector_count;
             return true;
         }
@@ -546,13 +610,374 @@ bool disk_io_plan_t::add(
     disk_vec_t &item = vec[count++];
 
     item.lba = lba;
+    item.data = data;
     item.count = sector_count;
-    item.sector_ofs = sector_ofs;
-    item.byte_count = byte_count;
+    item.write = write;
+    item.fua = fua;
+    item.hipri = hipri;
+    item.iocp = iocp;
 
     return true;
 }
 
+void disk_io_plan_t::clear()
+{
+    count = 0;
+}
+
+errno_t storage_dev_base_t::submit_plan(disk_io_plan_t *plan)
+{
+    for (uint32_t i = 0; i < plan->count; ++i) {
+        disk_vec_t &item = plan->vec[i];
+
+        errno_t err = item.write
+                ? write_async(item.data, item.count, item.lba,
+                              item.fua, item.iocp)
+                : read_async(item.data, item.count, item.lba, item.iocp);
+
+        if (unlikely(err != errno_t::OK)) {
+            item.iocp->set_result({ err, 0 });
+            item.iocp->set_expect(1);
+            item.iocp->invoke();
+        }
+    }
+
+    return errno_t::OK;
+}
+
+bool storage_dev_base_t::poll_completions()
+{
+    return false;
+}
+
+int storage_direct_io(storage_dev_base_t *drive, void *buf,
+                      int64_t count, uint64_t lba, bool write)
+{
+    uint8_t log2_sector_size = drive->info(STORAGE_INFO_BLOCKSIZE_LOG2);
+    size_t sector_size = size_t(1) << log2_sector_size;
+    size_t size = size_t(count) << log2_sector_size;
+
+    char *data = (char*)buf;
+
+    // Every physical range has to be whole sectors
+    if (unlikely((uintptr_t(data) & (sector_size - 1)) ||
+                 sector_size > PAGE_SIZE))
+        return -int(errno_t::EINVAL);
+
+    if (unlikely(size == 0))
+        return 0;
+
+    // Touch every page, and write to them if the device will, so none
+    // of them is still a demand page sharing the zero page
+    for (uintptr_t page = uintptr_t(data) & -PAGE_SIZE;
+         page < uintptr_t(data) + size; page += PAGE_SIZE) {
+        char *p = ext::max((char*)page, data);
+        char byte;
+
+        if (unlikely(!mm_copy_user(&byte, p, 1) ||
+                     (!write && !mm_copy_user(p, &byte, 1))))
+            return -int(errno_t::EFAULT);
+    }
+
+    int status = mlock(data, size);
+
+    if (unlikely(status < 0))
+        return status;
+
+    // One request per batch of physical ranges
+    mmphysrange_t ranges[16];
+    storage_seg_t segs[countof(ranges)];
+
+    for (size_t done = 0; done < size && status >= 0; ) {
+        size_t n = mphysranges(ranges, countof(ranges),
+                               data + done, size - done, size - done);
+
+        size_t len = 0;
+
+        for (size_t i = 0; i < n; ++i) {
+            if (unlikely(!ranges[i].physaddr)) {
+                n = 0;
+                break;
+            }
+
+            segs[i] = { nullptr, ranges[i].physaddr, ranges[i].size };
+            len += ranges[i].size;
+        }
+
+        if (unlikely(!n)) {
+            status = -int(errno_t::EFAULT);
+            break;
+        }
+
+        blocking_iocp_t block;
+
+        errno_t err = write
+                ? drive->writev_async(segs, n, lba, false, &block)
+                : drive->readv_async(segs, n, lba, &block);
+
+        if (unlikely(err != errno_t::OK)) {
+            status = -int(err);
+            break;
+        }
+
+        auto result = block.wait();
+
+        if (unlikely(result.first != errno_t::OK))
+            status = -int(result.first);
+
+        done += len;
+        lba += len >> log2_sector_size;
+    }
+
+    munlock(data, size);
+
+    return status < 0 ? status : 0;
+}
+
+size_t storage_seg_physranges(
+        mmphysrange_t *ranges, size_t capacity,
+        storage_seg_t const *segs, size_t seg_count,
+        size_t offset, size_t size, size_t max_range)
+{
+    size_t count = 0;
+    mmphysrange_t last{};
+
+    // Append a piece, extending the previous range while it continues it.
+    // Returns false when ranges is full
+    auto add = [&](uintptr_t physaddr, size_t len) -> bool {
+        while (len) {
+            size_t take;
+
+            if (count && last.physaddr + last.size == physaddr &&
+                    last.size < max_range) {
+                take = ext::min(len, max_range - last.size);
+                last.size += take;
+            } else if (ranges && count == capacity) {
+                return false;
+            } else {
+                take = ext::min(len, max_range);
+                last.physaddr = physaddr;
+                last.size = take;
+                ++count;
+            }
+
+            if (ranges)
+                ranges[count - 1] = last;
+
+            physaddr += take;
+            len -= take;
+        }
+
+        return true;
+    };
+
+    for (size_t i = 0; i < seg_count && size; ++i) {
+        storage_seg_t const &seg = segs[i];
+
+        if (offset >= seg.size) {
+            offset -= seg.size;
+            continue;
+        }
+
+        size_t len = ext::min(seg.size - offset, size);
+
+        if (!seg.data) {
+            if (!add(seg.physaddr + offset, len))
+                break;
+        } else {
+            // Translate a few pages at a time
+            mmphysrange_t window[16];
+            char const *data = (char const *)seg.data + offset;
+
+            for (size_t left = len; left; ) {
+                size_t n = mphysranges(window, countof(window),
+                                       data, left, max_range);
+
+                for (size_t k = 0; k < n; ++k) {
+                    if (!add(window[k].physaddr, window[k].size))
+                        return count;
+
+                    data += window[k].size;
+                    left -= window[k].size;
+                }
+            }
+        }
+
+        size -= len;
+        offset = 0;
+    }
+
+    return count;
+}
+
+// A vectored request split into one request per segment,
+// for drivers that can only take one buffer per request
+struct storage_segs_io_t {
+    struct part_t {
+        storage_segs_io_t *owner;
+        iocp_t iocp;
+
+        // Where the segment is, mapped for the duration if it is physical
+        void *data;
+        void *mapping;
+        size_t mapping_size;
+        size_t size;
+    };
+
+    storage_segs_io_t(iocp_t *caller_iocp, size_t part_count)
+        : caller_iocp(caller_iocp)
+        , parts(new (ext::nothrow) part_t[part_count]())
+        , part_count(part_count)
+        , remaining(part_count)
+    {
+    }
+
+    ~storage_segs_io_t()
+    {
+        for (size_t i = 0; parts && i < part_count; ++i) {
+            if (parts[i].mapping)
+                munmap(parts[i].mapping, parts[i].mapping_size);
+        }
+
+        delete[] parts;
+    }
+
+    static void part_done(dgos::err_sz_pair_t const& result, uintptr_t arg);
+
+    iocp_t *caller_iocp;
+    part_t *parts;
+    size_t part_count;
+    size_t remaining;
+    size_t total = 0;
+    errno_t err = errno_t::OK;
+    bool mapped = false;
+    lock_type lock;
+};
+
+void storage_segs_io_t::part_done(
+        dgos::err_sz_pair_t const& result, uintptr_t arg)
+{
+    part_t *part = (part_t*)arg;
+    storage_segs_io_t *state = part->owner;
+
+    scoped_lock hold(state->lock);
+
+    if (unlikely(result.first != errno_t::OK))
+        state->err = result.first;
+    else
+        state->total += part->size;
+
+    if (--state->remaining)
+        return;
+
+    hold.unlock();
+
+    state->caller_iocp->set_result({
+        state->err,
+        state->err == errno_t::OK ? state->total : 0
+    });
+    state->caller_iocp->invoke();
+
+    // Unmapping may need to wait for other CPUs, so not from here
+    if (state->mapped)
+        workq::enqueue([state] { delete state; });
+    else
+        delete state;
+}
+
+errno_t storage_dev_base_t::segs_async(
+        storage_seg_t const *segs, size_t seg_count,
+        uint64_t lba, bool write, bool fua, iocp_t *iocp)
+{
+    uint8_t log2_sector_size = info(STORAGE_INFO_BLOCKSIZE_LOG2);
+    size_t sector_mask = (size_t(1) << log2_sector_size) - 1;
+
+    if (unlikely(!seg_count))
+        return errno_t::EINVAL;
+
+    for (size_t i = 0; i < seg_count; ++i) {
+        if (unlikely(!segs[i].size || (segs[i].size & sector_mask)))
+            return errno_t::EINVAL;
+    }
+
+    storage_segs_io_t *state = new (ext::nothrow)
+            storage_segs_io_t(iocp, seg_count);
+
+    if (unlikely(!state || !state->parts)) {
+        delete state;
+        return errno_t::ENOMEM;
+    }
+
+    for (size_t i = 0; i < seg_count; ++i) {
+        storage_seg_t const &seg = segs[i];
+        storage_segs_io_t::part_t &part = state->parts[i];
+
+        part.owner = state;
+        part.size = seg.size;
+        part.data = seg.data;
+
+        if (!seg.data) {
+            uintptr_t page_ofs = seg.physaddr & (PAGE_SIZE - 1);
+
+            part.mapping_size = (page_ofs + seg.size + PAGE_SIZE - 1) &
+                    -PAGE_SIZE;
+            part.mapping = mmap((void*)(seg.physaddr - page_ofs),
+                                part.mapping_size, PROT_READ | PROT_WRITE,
+                                MAP_PHYSICAL);
+
+            if (unlikely(part.mapping == MAP_FAILED)) {
+                part.mapping = nullptr;
+                delete state;
+                return errno_t::ENOMEM;
+            }
+
+            part.data = (char*)part.mapping + page_ofs;
+            state->mapped = true;
+        }
+
+        part.iocp.reset(&storage_segs_io_t::part_done, uintptr_t(&part));
+    }
+
+    iocp->set_expect(1);
+
+    // The state may be gone as soon as the last part is started
+    storage_segs_io_t::part_t *parts = state->parts;
+
+    for (size_t i = 0; i < seg_count; ++i) {
+        storage_segs_io_t::part_t &part = parts[i];
+        void *data = part.data;
+        int64_t count = part.size >> log2_sector_size;
+
+        errno_t err = write
+                ? write_async(data, count, lba, fua, &part.iocp)
+                : read_async(data, count, lba, &part.iocp);
+
+        if (unlikely(err != errno_t::OK)) {
+            part.iocp.set_result({ err, 0 });
+            part.iocp.set_expect(1);
+            part.iocp.invoke();
+        }
+
+        lba += count;
+    }
+
+    return errno_t::OK;
+}
+
+errno_t storage_dev_base_t::readv_async(
+        storage_seg_t const *segs, size_t seg_count,
+        uint64_t lba, iocp_t *iocp)
+{
+    return segs_async(segs, seg_count, lba, false, false, iocp);
+}
+
+errno_t storage_dev_base_t::writev_async(
+        storage_seg_t const *segs, size_t seg_count,
+        uint64_t lba, bool fua, iocp_t *iocp)
+{
+    return segs_async(segs, seg_count, lba, true, fua, iocp);
+}
+
 storage_dev_base_t::~storage_dev_base_t()
 {
 }
@@ -587,6 +1012,42 @@ fs_base_t::~fs_base_t()
 {
 }
 
+ssize_t fs_base_t::getdents(fs_file_info_t *fi, void *buf,
+                            size_t size, off_t &offset)
+{
+    return getdents_pack(buf, size, offset,
+                         [&](dirent_t *ent, off_t ofs) {
+        return readdir(fi, ent, ofs);
+    });
+}
+
+ssize_t fs_dirent_pack(void *buf, size_t size,
+                       dirent_t const *ent, off_t next)
+{
+    char const *name_end = (char const *)memchr(ent->d_name, 0, NAME_MAX);
+    size_t name_len = name_end ? name_end - ent->d_name : NAME_MAX;
+    size_t reclen = DIRENT_RECLEN(name_len);
+
+    if (reclen > size)
+        return 0;
+
+    dirent_t rec;
+    rec.d_ino = ent->d_ino;
+    rec.d_off = next;
+    rec.d_reclen = reclen;
+    rec.d_type = ent->d_type;
+    memcpy(rec.d_name, ent->d_name, name_len);
+
+    // Terminate the name and clear the alignment padding
+    memset(rec.d_name + name_len, 0,
+           reclen - offsetof(dirent_t, d_name) - name_len);
+
+    if (unlikely(!mm_copy_user(buf, &rec, reclen)))
+        return -int(errno_t::EFAULT);
+
+    return reclen;
+}
+
 //==
 
 void fs_nosys_t::unmount()
@@ -12,38 +12,78 @@
 
 #include "dev_registration.h"
 
+struct mmphysrange_t;
+struct storage_dev_base_t;
+
+// One piece of the buffer of a vectored transfer. It is addressed by
+// its kernel virtual address, or by physaddr when data is nullptr.
+// Every segment is a whole number of sectors
+struct storage_seg_t {
+    void *data;
+    uint64_t physaddr;
+    size_t size;
+};
+
+// Fill ranges with the physically contiguous pieces of size bytes of the
+// segments, starting offset bytes in, no range longer than max_range.
+// Pieces that continue the previous one are merged into it. Stops early
+// when all capacity ranges are used. Returns the number of ranges, or,
+// when ranges is nullptr, the number that would be needed
+KERNEL_API size_t storage_seg_physranges(
+        mmphysrange_t *ranges, size_t capacity,
+        storage_seg_t const *segs, size_t seg_count,
+        size_t offset, size_t size, size_t max_range);
+
+// Transfer count sectors at lba straight between the device and the
+// pages of buf (user or kernel memory), without going through a device
+// mapping. buf must be sector aligned. The pages are faulted in and
+// locked in memory for the duration. Returns 0 or negative errno
+KERNEL_API int storage_direct_io(storage_dev_base_t *drive, void *buf,
+                                 int64_t count, uint64_t lba, bool write);
+
 // Filesystem I/O code builds a list of these to do burst I/O
 struct disk_vec_t {
     // Start LBA of range
     uint64_t lba;
 
+    // Kernel address of the first byte transferred
+    void *data;
+
     // Number of contiguous sectors
     uint32_t count;
 
-    // Offset into first sector to transfer
-    // If this is nonzero, count is guaranteed to be 1
-    uint16_t sector_ofs;
+    bool write;
+
+    // Write through the device cache (writes only)
+    bool fua;
 
-    // Number of bytes to transfer.
-    // If count is nonzero, this field is ignored, and count is the number
-    // of whole sectors to transfer.
-    uint16_t byte_count;
+    // The waiter polls for completion, see BLK_REQ_HIPRI
+    bool hipri;
+
+    // Completed exactly as if the range was passed to read_async
+    // or write_async. An iocp may only be used by one entry
+    iocp_t *iocp;
 };
 
 struct KERNEL_API disk_io_plan_t {
-    void *dest;
     disk_vec_t *vec;
-    uint16_t count;
-    uint16_t capacity;
+    uint32_t count;
+    uint32_t capacity;
     uint8_t log2_sector_size;
 
-    disk_io_plan_t(void *dest, uint8_t log2_sector_size);
+    explicit disk_io_plan_t(uint8_t log2_sector_size);
     disk_io_plan_t(disk_io_plan_t const&) = delete;
     disk_io_plan_t() = delete;
     ~disk_io_plan_t();
 
-    bool add(uint32_t lba, uint16_t sector_count,
-             uint16_t sector_ofs, uint16_t byte_count);
+    // Append a range. A range that continues the previous entry on the
+    // disk and in memory, with the same direction and iocp, is coalesced
+    // into it. Returns false if out of memory
+    _use_result
+    bool add(void *data, uint64_t lba, uint32_t sector_count,
+             bool write, bool fua, iocp_t *iocp, bool hipri = false);
+
+    void clear();
 };
 
 //
@@ -54,7 +94,13 @@ enum storage_dev_info_t : uint32_t {
     STORAGE_INFO_BLOCKSIZE_LOG2,
     STORAGE_INFO_BLOCKSIZE,
     STORAGE_INFO_HAVE_TRIM,
-    STORAGE_INFO_NAME
+    STORAGE_INFO_NAME,
+
+    // Nonzero if poll_completions can complete BLK_REQ_HIPRI requests
+    STORAGE_INFO_HAVE_POLL,
+
+    // Number of blocks on the device, 0 if unknown
+    STORAGE_INFO_BLOCKCOUNT
 };
 
 struct dev_base_t {
@@ -123,6 +169,8 @@ public:
     }
 };
 
+class blk_queue_t;
+
 struct KERNEL_API storage_dev_base_t : public dev_base_t {
     virtual ~storage_dev_base_t() = 0;
 
@@ -132,7 +180,11 @@ struct KERNEL_API storage_dev_base_t : public dev_base_t {
     //
     // Asynchronous I/O plan
 
-    //virtual errno_t io(disk_io_plan_t *plan);
+    // Start every range in the plan. Drivers that can queue several
+    // commands override this to notify the device once for the batch.
+    // A range that fails to start has its iocp completed with the error,
+    // so callers only need to wait on the iocps
+    virtual errno_t submit_plan(disk_io_plan_t *plan);
 
     //
     // Asynchronous I/O
@@ -151,17 +203,46 @@ struct KERNEL_API storage_dev_base_t : public dev_base_t {
 
     virtual errno_t flush_async(iocp_t *iocp) = 0;
 
-    // Synchronous wrappers
+    // Vectored I/O, the segments are transferred in order, to or from
+    // consecutive sectors starting at lba. The segment array only needs
+    // to live until the call returns. Drivers that can describe the whole
+    // list to the device override these, the default issues one request
+    // per segment, mapping physical segments for the duration
+    virtual errno_t readv_async(storage_seg_t const *segs, size_t seg_count,
+                                uint64_t lba, iocp_t *iocp);
+
+    virtual errno_t writev_async(storage_seg_t const *segs, size_t seg_count,
+                                 uint64_t lba, bool fua, iocp_t *iocp);
+
+    // Complete whatever polled requests the device has finished, without
+    // waiting for an interrupt. Returns true if anything completed
+    virtual bool poll_completions();
 
-    int read_blocks(void *data, int64_t count, uint64_t lba);
+    // Synchronous wrappers, flags are BLK_REQ_*
 
-    int write_blocks(void const *data, int64_t count, uint64_t lba, bool fua);
+    int read_blocks(void *data, int64_t count, uint64_t lba,
+                    unsigned flags = 0);
+
+    int write_blocks(void const *data, int64_t count, uint64_t lba, bool fua,
+                     unsigned flags = 0);
 
     virtual int64_t trim_blocks(int64_t count, uint64_t lba);
 
     virtual int flush();
 
     virtual long info(storage_dev_info_t key) = 0;
+
+    // Request queue in front of the driver, created on first use
+    blk_queue_t *blk_queue = nullptr;
+
+    // Moving average of polled request latency, in nanoseconds
+    uint64_t poll_latency_ns = 0;
+
+private:
+    dgos::err_sz_pair_t wait_polled(blocking_iocp_t &block, uint64_t start);
+
+    errno_t segs_async(storage_seg_t const *segs, size_t seg_count,
+                       uint64_t lba, bool write, bool fua, iocp_t *iocp);
 };
 
 #define STORAGE_DEV_IMPL                                \
@@ -229,9 +310,9 @@ KERNEL_API void storage_if_register_factory(storage_if_factory_t *factory);
 typedef int dev_t;
 
 
-size_t storage_dev_count();
-storage_dev_base_t *storage_dev_open(dev_t dev);
-void storage_dev_close(storage_dev_base_t *dev);
+KERNEL_API size_t storage_dev_count();
+KERNEL_API storage_dev_base_t *storage_dev_open(dev_t dev);
+KERNEL_API void storage_dev_close(storage_dev_base_t *dev);
 
 __END_DECLS
 
@@ -323,6 +404,15 @@ struct fs_stat_t {
 
 struct fs_base_t;
 
+// Returned by fs_base_t::openat when O_CREAT created the name
+#define FS_OPEN_CREATED 1
+
+// Store ent at buf (which may be a user address) as a DIRENT_RECLEN sized
+// record, with d_off set to next. Returns the size of the record, 0 if it
+// does not fit in size bytes, or negative errno on fault
+KERNEL_API ssize_t fs_dirent_pack(void *buf, size_t size,
+                                  dirent_t const *ent, off_t next);
+
 struct KERNEL_API fs_factory_t {
     explicit fs_factory_t(char const *factory_name);
     virtual ~fs_factory_t();
@@ -367,6 +457,20 @@ struct fs_base_t {
                             off_t offset) = 0;
     virtual int releasedir(fs_file_info_t *fi) = 0;
 
+    // Store as many packed records (see fs_dirent_pack) as fit in buf,
+    // starting at offset, and advance offset past them. Returns the
+    // number of bytes stored, 0 at the end of the directory.
+    // The default calls readdir once per entry
+    virtual ssize_t getdents(fs_file_info_t *fi, void *buf,
+                             size_t size, off_t &offset);
+
+    // The getdents packing loop, for overrides that hold their lock
+    // across the batch. read_entry(dirent_t *ent, off_t offset) behaves
+    // like readdir. Returns its error only if nothing was stored
+    template<typename F>
+    static ssize_t getdents_pack(void *buf, size_t size, off_t &offset,
+                                 F read_entry);
+
     //
     // Read directory entry information
 
@@ -409,6 +513,8 @@ struct fs_base_t {
     //
     // Open/close files
 
+    // Returns 0, FS_OPEN_CREATED if O_CREAT made a new name,
+    // or negative errno
     virtual int openat(fs_file_info_t **fi,
                        fs_file_info_t *dirfi, fs_cpath_t path,
                        int flags, mode_t mode) = 0;
@@ -482,6 +588,50 @@ struct fs_base_t {
                      fs_pollhandle_t* ph, unsigned* reventsp) = 0;
 };
 
+template<typename F>
+ssize_t fs_base_t::getdents_pack(void *buf, size_t size, off_t &offset,
+                                 F read_entry)
+{
+    char *out = (char*)buf;
+    size_t used = 0;
+    dirent_t ent;
+
+    for (;;) {
+        ent = {};
+
+        ssize_t advance = read_entry(&ent, offset);
+
+        if (advance < 0 && !used)
+            return advance;
+
+        if (advance <= 0)
+            break;
+
+        // Slots that were skipped over have no name
+        if (ent.d_name[0]) {
+            ssize_t stored = fs_dirent_pack(out + used, size - used,
+                                            &ent, offset + advance);
+
+            if (unlikely(stored < 0))
+                return stored;
+
+            if (!stored) {
+                // The buffer can't even hold one entry
+                if (unlikely(!used))
+                    return -int(errno_t::EINVAL);
+
+                break;
+            }
+
+            used += stored;
+        }
+
+        offset += advance;
+    }
+
+    return used;
+}
+
 #define FS_BASE_WR_IMPL                                                       \
     int mknodat(fs_file_info_t *dirfi, fs_cpath_t path,                       \
                 fs_mode_t mode, fs_dev_t rdev) override final;                \
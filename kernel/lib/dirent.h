@@ -14,6 +14,12 @@ struct dirent_t {
     char d_name[NAME_MAX+1];
 };
 
+// Size of a packed dirent_t record, as stored by getdents, holding a name
+// of name_len bytes. The name is nul terminated and the size is rounded
+// up so the next record is 8 byte aligned
+#define DIRENT_RECLEN(name_len) \
+    ((offsetof(dirent_t, d_name) + (name_len) + 1 + 7) & -size_t(8))
+
 //
 // mode_t values
 
@@ -59,3 +65,11 @@ struct dirent_t {
 #define O_TRUNC     0x40000
 #define O_EXEC      0x80000
 #define O_NDELAY    O_NBLOCK
+
+//
+// access modes
+
+#define F_OK        0
+#define X_OK        1
+#define W_OK        2
+#define R_OK        4
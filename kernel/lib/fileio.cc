@@ -8,6 +8,7 @@
 #include "vector.h"
 #include "mutex.h"
 #include "fs/devfs.h"
+#include "dentry_cache.h"
 #include "user_mem.h"
 
 #define DEBUG_FILEHANDLE 1
@@ -182,6 +183,20 @@ bool file_ref_filetab(int id)
 REGISTER_CALLOUT(file_init, nullptr,
                  callout_type_t::heap_ready, "000");
 
+// Get the dentry cache key of the directory a path is relative to,
+// false if the directory has no stable inode and can't be cached
+static bool file_dcache_dir(fs_file_info_t *dirfi, ino_t& dir)
+{
+    if (!dirfi) {
+        dir = DCACHE_ROOT_DIR;
+        return true;
+    }
+
+    dir = dirfi->get_inode();
+
+    return int64_t(dir) >= 0;
+}
+
 int file_creatat(int dirid, char const *path, mode_t mode)
 {
     return file_openat(dirid, path, O_CREAT | O_WRONLY | O_TRUNC, mode);
@@ -207,22 +222,48 @@ int file_openat(int dirid, char const *path, int flags, mode_t mode)
     if (unlikely(!fs))
         return -int(errno_t::ENOENT);
 
+    filetab_t *dirfh = file_fh_from_id(dirid);
+    fs_file_info_t *dirfi = dirfh ? dirfh->fi : nullptr;
+
+    char const *name = path + consumed;
+    size_t name_len = strlen(name);
+
+    ino_t dir;
+    bool cacheable = file_dcache_dir(dirfi, dir);
+    uint64_t generation = dcache_generation(fs);
+
+    // Known not to exist, and not creating it
+    if (cacheable && !(flags & O_CREAT) &&
+            dcache_lookup(fs, dir, name, name_len) ==
+            dcache_hit_t::negative)
+        return -int(errno_t::ENOENT);
+
     filetab_t *fh = file_new_filetab();
 
     if (unlikely(!fh))
         return -int(errno_t::ENFILE);
 
-    filetab_t *dirfh = file_fh_from_id(dirid);
-
-    int status = fs->openat(&fh->fi, dirfh ? dirfh->fi : nullptr,
-                            path + consumed, flags, mode);
+    int status = fs->openat(&fh->fi, dirfi, name, flags, mode);
 
     if (unlikely(status < 0)) {
         FILEHANDLE_TRACE("open failed on %s, status=%d\n", path, status);
         file_del_filetab(fh);
+
+        if (cacheable && status == -int(errno_t::ENOENT))
+            dcache_insert(fs, dir, name, name_len, true, generation);
+        else if ((flags & O_CREAT) && status != -int(errno_t::EEXIST))
+            // The name may have been created before the open failed
+            dcache_invalidate(fs, true);
+
         return status;
     }
 
+    if (status == FS_OPEN_CREATED) {
+        // The name may be cached as missing under another directory key
+        dcache_invalidate(fs, true);
+    } else if (cacheable) {
+        dcache_insert(fs, dir, name, name_len, false, generation);
+    }
 
     fh->fs = fs;
     fh->pos = 0;
@@ -361,6 +402,105 @@ int file_fstatfs(int id, fs_statvfs_t *buf)
     return fh->fs->statfs(buf);
 }
 
+int file_fstat(int id, fs_stat_t *buf)
+{
+    filetab_t *fh = file_fh_from_id(id);
+
+    if (unlikely(!fh))
+        return -int(errno_t::EBADF);
+
+    return fh->fs->fstat(fh->fi, buf);
+}
+
+int file_fstatat(int dirid, char const *path, fs_stat_t *buf)
+{
+    size_t consumed = 0;
+    fs_base_t *fs = file_fs_from_path(dirid, path, consumed);
+
+    if (unlikely(!fs))
+        return -int(errno_t::ENOENT);
+
+    filetab_t *dirfh = file_fh_from_id(dirid);
+    fs_file_info_t *dirfi = dirfh ? dirfh->fi : nullptr;
+
+    char const *name = path + consumed;
+    size_t name_len = strlen(name);
+
+    ino_t dir;
+    bool cacheable = file_dcache_dir(dirfi, dir);
+    uint64_t generation = dcache_generation(fs);
+
+    // The cache holds no attributes, only a negative entry saves the call
+    if (cacheable && dcache_lookup(fs, dir, name, name_len) ==
+            dcache_hit_t::negative)
+        return -int(errno_t::ENOENT);
+
+    int status = fs->getattrat(dirfi, name, buf);
+
+    if (cacheable && (status >= 0 || status == -int(errno_t::ENOENT)))
+        dcache_insert(fs, dir, name, name_len, status < 0, generation);
+
+    return status;
+}
+
+int file_accessat(int dirid, char const *path, int mask)
+{
+    size_t consumed = 0;
+    fs_base_t *fs = file_fs_from_path(dirid, path, consumed);
+
+    if (unlikely(!fs))
+        return -int(errno_t::ENOENT);
+
+    filetab_t *dirfh = file_fh_from_id(dirid);
+    fs_file_info_t *dirfi = dirfh ? dirfh->fi : nullptr;
+
+    char const *name = path + consumed;
+    size_t name_len = strlen(name);
+
+    ino_t dir;
+    bool cacheable = file_dcache_dir(dirfi, dir);
+    uint64_t generation = dcache_generation(fs);
+
+    if (cacheable) {
+        dcache_hit_t hit = dcache_lookup(fs, dir, name, name_len);
+
+        if (hit == dcache_hit_t::negative)
+            return -int(errno_t::ENOENT);
+
+        // Existence is all F_OK asks
+        if (hit == dcache_hit_t::positive && mask == F_OK)
+            return 0;
+    }
+
+    int status = fs->accessat(dirfi, name, mask);
+
+    // Only a result that says whether the name exists can be cached
+    if (cacheable && (status == -int(errno_t::ENOENT) ||
+                      (status >= 0 && mask == F_OK)))
+        dcache_insert(fs, dir, name, name_len, status < 0, generation);
+
+    return status;
+}
+
+int file_inode(int id, fs_base_t **fs, ino_t *ino)
+{
+    filetab_t *fh = file_fh_from_id(id);
+
+    if (unlikely(!fh))
+        return -int(errno_t::EBADF);
+
+    // Device files report a negated errno instead of an inode
+    ino_t inode = fh->fi->get_inode();
+
+    if (unlikely(int64_t(inode) < 0))
+        return -int(errno_t::ENODEV);
+
+    *fs = fh->fs;
+    *ino = inode;
+
+    return 0;
+}
+
 ssize_t file_read(int id, void *buf, size_t bytes)
 {
     filetab_t *fh = file_fh_from_id(id);
@@ -487,6 +627,20 @@ int file_opendirat(int dirid, char const *path)
     if (unlikely(!fs))
         return -int(errno_t::ENOENT);
 
+    filetab_t *dirfh = file_fh_from_id(dirid);
+    fs_file_info_t *dirfi = dirfh ? dirfh->fi : nullptr;
+
+    char const *name = path + consumed;
+    size_t name_len = strlen(name);
+
+    ino_t dir;
+    bool cacheable = file_dcache_dir(dirfi, dir);
+    uint64_t generation = dcache_generation(fs);
+
+    if (cacheable && dcache_lookup(fs, dir, name, name_len) ==
+            dcache_hit_t::negative)
+        return -int(errno_t::ENOENT);
+
     filetab_t *fh = file_new_filetab();
 
     if (unlikely(!fh))
@@ -494,15 +648,19 @@ int file_opendirat(int dirid, char const *path)
 
     fh->fs = fs;
 
-    filetab_t *dirfh = file_fh_from_id(dirid);
-
-    int status = fh->fs->opendirat(&fh->fi, dirfh ? dirfh->fi : nullptr,
-                                   path + consumed);
+    int status = fh->fs->opendirat(&fh->fi, dirfi, name);
     if (unlikely(status < 0)) {
         file_del_filetab(fh);
+
+        if (cacheable && status == -int(errno_t::ENOENT))
+            dcache_insert(fs, dir, name, name_len, true, generation);
+
         return status;
     }
 
+    if (cacheable)
+        dcache_insert(fs, dir, name, name_len, false, generation);
+
     fh->fs = fs;
     fh->pos = 0;
 
@@ -526,6 +684,15 @@ ssize_t file_readdir_r(int id, dirent_t *buf, dirent_t **result)
     return size;
 }
 
+ssize_t file_getdents(int id, void *buf, size_t size)
+{
+    filetab_t *fh = file_fh_from_id(id);
+    if (unlikely(!fh))
+        return -int(errno_t::EBADF);
+
+    return fh->fs->getdents(fh->fi, buf, size, fh->pos);
+}
+
 off_t file_telldir(int id)
 {
     filetab_t *fh = file_fh_from_id(id);
@@ -570,8 +737,13 @@ int file_mkdirat(int dirid, char const *path, mode_t mode)
 
     filetab_t *dirfh = file_fh_from_id(dirid);
 
-    return fs->mkdirat(dirfh ? dirfh->fi : nullptr,
-                       path + consumed, mode);
+    int status = fs->mkdirat(dirfh ? dirfh->fi : nullptr,
+                             path + consumed, mode);
+
+    if (likely(status >= 0))
+        dcache_invalidate(fs, true);
+
+    return status;
 }
 
 int file_rmdirat(int dirid, char const *path)
@@ -584,8 +756,14 @@ int file_rmdirat(int dirid, char const *path)
 
     filetab_t *dirfh = file_fh_from_id(dirid);
 
-    return fs->rmdirat(dirfh ? dirfh->fi : nullptr,
-                       path + consumed);
+    int status = fs->rmdirat(dirfh ? dirfh->fi : nullptr,
+                             path + consumed);
+
+    // Names below the directory are gone too, forget everything
+    if (likely(status >= 0))
+        dcache_invalidate(fs, false);
+
+    return status;
 }
 
 int file_renameat(int olddirid, char const *old_path,
@@ -606,10 +784,16 @@ int file_renameat(int olddirid, char const *old_path,
     filetab_t *olddirfh = file_fh_from_id(olddirid);
     filetab_t *newdirfh = file_fh_from_id(newdirid);
 
-    return fs->renameat(olddirfh ? olddirfh->fi : nullptr,
-                        old_path + old_consumed,
-                        newdirfh ? newdirfh->fi : nullptr,
-                        path + consumed);
+    int status = fs->renameat(olddirfh ? olddirfh->fi : nullptr,
+                              old_path + old_consumed,
+                              newdirfh ? newdirfh->fi : nullptr,
+                              path + consumed);
+
+    // Renaming a directory moves every name below it
+    if (likely(status >= 0))
+        dcache_invalidate(fs, false);
+
+    return status;
 }
 
 int file_unlinkat(int dirid, char const *path)
@@ -622,8 +806,13 @@ int file_unlinkat(int dirid, char const *path)
 
     filetab_t *dirfh = file_fh_from_id(dirid);
 
-    return fs->unlinkat(dirfh ? dirfh->fi : nullptr,
-                        path + consumed);
+    int status = fs->unlinkat(dirfh ? dirfh->fi : nullptr,
+                              path + consumed);
+
+    if (likely(status >= 0))
+        dcache_invalidate(fs, false);
+
+    return status;
 }
 
 int file_fchmod(int id, mode_t mode)
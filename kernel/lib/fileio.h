@@ -88,6 +88,8 @@ struct flock {
 };
 
 struct path_t;
+struct fs_base_t;
+struct fs_stat_t;
 
 __BEGIN_DECLS
 
@@ -111,6 +113,10 @@ KERNEL_API int file_ioctl(int id, int cmd, void* arg, unsigned flags, void *data
 KERNEL_API int file_lock_op(int id, flock &info, bool wait);
 KERNEL_API int file_opendirat(int dirid, char const *path);
 KERNEL_API ssize_t file_readdir_r(int id, dirent_t *buf, dirent_t **result);
+
+// Fill buf with packed DIRENT_RECLEN sized records, buf may be a user
+// address. Returns the number of bytes stored, 0 at the end
+KERNEL_API ssize_t file_getdents(int id, void *buf, size_t size);
 KERNEL_API off_t file_telldir(int id);
 KERNEL_API off_t file_seekdir(int id, off_t ofs);
 KERNEL_API int file_closedir(int id);
@@ -125,6 +131,13 @@ KERNEL_API int file_fchmod(int id, mode_t mode);
 KERNEL_API int file_chown(int id, int uid, int gid);
 
 KERNEL_API int file_fstatfs(int id, fs_statvfs_t *buf);
+KERNEL_API int file_fstat(int id, fs_stat_t *buf);
+KERNEL_API int file_fstatat(int dirid, char const *path, fs_stat_t *buf);
+KERNEL_API int file_accessat(int dirid, char const *path, int mask);
+
+// Get the filesystem and inode number that identify the file behind id,
+// returns -ENODEV if the filesystem has no stable inode numbers
+KERNEL_API int file_inode(int id, fs_base_t **fs, ino_t *ino);
 
 __END_DECLS
 
@@ -0,0 +1,507 @@
+#include "filemap.h"
+#include "fileio.h"
+#include "dev_storage.h"
+#include "process.h"
+#include "thread.h"
+#include "mm.h"
+#include "mmu.h"
+#include "mutex.h"
+#include "vector.h"
+#include "basic_set.h"
+#include "atomic.h"
+#include "printk.h"
+#include "inttypes.h"
+
+#define DEBUG_FILEMAP 0
+#if DEBUG_FILEMAP
+#define FILEMAP_TRACE(...) printdbg("filemap: " __VA_ARGS__)
+#else
+#define FILEMAP_TRACE(...) ((void)0)
+#endif
+
+struct filemap_cache_t {
+    using lock_type = ext::mutex;
+    using scoped_lock = ext::unique_lock<lock_type>;
+
+    fs_base_t *fs = nullptr;
+    ino_t ino = 0;
+
+    // Our own reference to the open file, so the cache
+    // can outlive the descriptor it was mapped through
+    int id = -1;
+
+    // Number of file mappings using the cache,
+    // protected by filemap_caches_lock
+    size_t refcount = 0;
+
+    // Protects pages
+    lock_type lock;
+
+    // Kernel address of each cached page, by page index within the file
+    ext::map<uint64_t, void*> pages;
+
+    // Indexes of pages written through a MAP_SHARED mapping. Other
+    // processes can dirty them again without faulting, so they are
+    // written back by every filemap_sync, protected by lock
+    ext::set<uint64_t> shared_dirty;
+
+    // Serializes filemap_sync, sync_owner is the thread holding it,
+    // so a write back that comes through the file again returns early
+    lock_type sync_lock;
+    thread_t sync_owner = -1;
+};
+
+struct filemap_entry_t {
+    uintptr_t st;
+    uintptr_t en;
+    filemap_cache_t *cache;
+
+    // Page index within the file of st
+    uint64_t index;
+
+    bool shared;
+    bool writable;
+};
+
+struct filemap_list_t {
+    using lock_type = ext::mutex;
+    using scoped_lock = ext::unique_lock<lock_type>;
+
+    lock_type lock;
+    ext::vector<filemap_entry_t> entries;
+};
+
+using filemap_caches_lock_type = ext::mutex;
+using filemap_caches_scoped_lock = ext::unique_lock<filemap_caches_lock_type>;
+static filemap_caches_lock_type filemap_caches_lock;
+static ext::vector<filemap_cache_t*> filemap_caches;
+static uint64_t filemap_page_count;
+
+static filemap_cache_t *filemap_cache_get(int id, errno_t *err)
+{
+    fs_base_t *fs;
+    ino_t ino;
+
+    int status = file_inode(id, &fs, &ino);
+
+    if (unlikely(status < 0)) {
+        *err = errno_t(-status);
+        return nullptr;
+    }
+
+    filemap_caches_scoped_lock lock(filemap_caches_lock);
+
+    for (filemap_cache_t *cache : filemap_caches) {
+        if (cache->fs == fs && cache->ino == ino) {
+            ++cache->refcount;
+            return cache;
+        }
+    }
+
+    filemap_cache_t *cache = new (ext::nothrow) filemap_cache_t{};
+
+    if (unlikely(!cache || !filemap_caches.push_back(cache))) {
+        delete cache;
+        *err = errno_t::ENOMEM;
+        return nullptr;
+    }
+
+    file_ref_filetab(id);
+
+    cache->fs = fs;
+    cache->ino = ino;
+    cache->id = id;
+    cache->refcount = 1;
+
+    FILEMAP_TRACE("new cache for inode %" PRIu64 "\n", uint64_t(ino));
+
+    return cache;
+}
+
+static void filemap_cache_addref(filemap_cache_t *cache)
+{
+    filemap_caches_scoped_lock lock(filemap_caches_lock);
+    ++cache->refcount;
+}
+
+void filemap_release(filemap_cache_t *cache)
+{
+    filemap_caches_scoped_lock lock(filemap_caches_lock);
+
+    if (--cache->refcount)
+        return;
+
+    for (size_t i = 0, e = filemap_caches.size(); i < e; ++i) {
+        if (filemap_caches[i] == cache) {
+            filemap_caches.erase(filemap_caches.begin() + i);
+            break;
+        }
+    }
+
+    lock.unlock();
+
+    FILEMAP_TRACE("dropping cache for inode %" PRIu64 ", %zu pages\n",
+                  uint64_t(cache->ino), cache->pages.size());
+
+    // Pages still mapped somewhere keep their own reference
+    for (auto const& item : cache->pages)
+        munmap(item.second, PAGE_SIZE);
+
+    atomic_add(&filemap_page_count, -uint64_t(cache->pages.size()));
+
+    file_close(cache->id);
+
+    delete cache;
+}
+
+static filemap_list_t *filemap_list(process_t *process, bool create)
+{
+    filemap_list_t *list = atomic_ld_acq(&process->filemaps);
+
+    if (list || !create)
+        return list;
+
+    list = new (ext::nothrow) filemap_list_t{};
+
+    if (unlikely(!list))
+        return nullptr;
+
+    filemap_list_t *existing = atomic_cmpxchg(
+                &process->filemaps, (filemap_list_t*)nullptr, list);
+
+    if (unlikely(existing)) {
+        // Another thread created it first
+        delete list;
+        return existing;
+    }
+
+    return list;
+}
+
+errno_t filemap_insert(process_t *process, uintptr_t base, size_t len,
+                       int id, off_t offset, bool shared, bool writable)
+{
+    filemap_list_t *list = filemap_list(process, true);
+
+    if (unlikely(!list))
+        return errno_t::ENOMEM;
+
+    errno_t err = errno_t::OK;
+    filemap_cache_t *cache = filemap_cache_get(id, &err);
+
+    if (unlikely(!cache))
+        return err;
+
+    filemap_list_t::scoped_lock lock(list->lock);
+
+    if (unlikely(!list->entries.push_back({
+                     base, base + len, cache,
+                     uint64_t(offset) >> PAGE_SIZE_BIT,
+                     shared, writable
+                 }))) {
+        lock.unlock();
+        filemap_release(cache);
+        return errno_t::ENOMEM;
+    }
+
+    return errno_t::OK;
+}
+
+void filemap_remove(process_t *process, uintptr_t st, uintptr_t en)
+{
+    filemap_list_t *list = filemap_list(process, false);
+
+    if (!list)
+        return;
+
+    // Caches are released after dropping the list lock
+    ext::vector<filemap_cache_t*> released;
+
+    filemap_list_t::scoped_lock lock(list->lock);
+
+    for (size_t i = 0; i < list->entries.size(); ) {
+        filemap_entry_t &entry = list->entries[i];
+
+        if (entry.en <= st || entry.st >= en) {
+            ++i;
+            continue;
+        }
+
+        if (entry.st >= st && entry.en <= en) {
+            // Completely removed
+            if (unlikely(!released.push_back(entry.cache)))
+                panic_oom();
+
+            list->entries.erase(list->entries.begin() + i);
+            continue;
+        }
+
+        if (entry.st < st && entry.en > en) {
+            // Punched a hole in the middle, keep the part after the hole
+            filemap_entry_t tail = entry;
+            tail.index += (en - entry.st) >> PAGE_SIZE_BIT;
+            tail.st = en;
+            entry.en = st;
+
+            filemap_cache_addref(tail.cache);
+
+            if (unlikely(!list->entries.push_back(tail)))
+                panic_oom();
+        } else if (entry.st < st) {
+            // Removed the end
+            entry.en = st;
+        } else {
+            // Removed the start
+            entry.index += (en - entry.st) >> PAGE_SIZE_BIT;
+            entry.st = en;
+        }
+
+        ++i;
+    }
+
+    lock.unlock();
+
+    for (filemap_cache_t *cache : released)
+        filemap_release(cache);
+}
+
+errno_t filemap_protect(process_t *process, uintptr_t st, uintptr_t en,
+                        bool writable)
+{
+    filemap_list_t *list = filemap_list(process, false);
+
+    if (!list)
+        return errno_t::OK;
+
+    filemap_list_t::scoped_lock lock(list->lock);
+
+    // At most one split at each end, so the splits below can't fail
+    if (unlikely(!list->entries.reserve(list->entries.size() + 2)))
+        return errno_t::ENOMEM;
+
+    for (size_t i = 0; i < list->entries.size(); ++i) {
+        filemap_entry_t &entry = list->entries[i];
+
+        if (entry.en <= st || entry.st >= en || entry.writable == writable)
+            continue;
+
+        if (entry.st < st) {
+            // Keep the part before st, the split off rest is visited later
+            filemap_entry_t tail = entry;
+            tail.index += (st - entry.st) >> PAGE_SIZE_BIT;
+            tail.st = st;
+            entry.en = st;
+
+            filemap_cache_addref(tail.cache);
+
+            if (unlikely(!list->entries.push_back(tail)))
+                panic_oom();
+            continue;
+        }
+
+        if (entry.en > en) {
+            // Split off the part after en, unchanged
+            filemap_entry_t tail = entry;
+            tail.index += (en - entry.st) >> PAGE_SIZE_BIT;
+            tail.st = en;
+            entry.en = en;
+
+            filemap_cache_addref(tail.cache);
+
+            if (unlikely(!list->entries.push_back(tail)))
+                panic_oom();
+        }
+
+        list->entries[i].writable = writable;
+    }
+
+    return errno_t::OK;
+}
+
+void filemap_destroy(process_t *process)
+{
+    filemap_list_t *list = atomic_xchg(&process->filemaps, nullptr);
+
+    if (!list)
+        return;
+
+    for (filemap_entry_t const& entry : list->entries)
+        filemap_release(entry.cache);
+
+    delete list;
+}
+
+bool filemap_any(process_t *process)
+{
+    return atomic_ld_acq(&process->filemaps) != nullptr;
+}
+
+bool filemap_lookup(process_t *process, uintptr_t addr,
+                    filemap_fault_t *result)
+{
+    filemap_list_t *list = filemap_list(process, false);
+
+    if (unlikely(!list))
+        return false;
+
+    filemap_list_t::scoped_lock lock(list->lock);
+
+    for (filemap_entry_t const& entry : list->entries) {
+        if (addr >= entry.st && addr < entry.en) {
+            filemap_cache_addref(entry.cache);
+
+            result->cache = entry.cache;
+            result->index = entry.index +
+                    ((addr - entry.st) >> PAGE_SIZE_BIT);
+            result->shared = entry.shared;
+            result->writable = entry.writable;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void *filemap_get_page(filemap_cache_t *cache, uint64_t index)
+{
+    filemap_cache_t::scoped_lock lock(cache->lock);
+
+    auto it = cache->pages.find(index);
+
+    if (it != cache->pages.end())
+        return it->second;
+
+    // Populated pages are zeroed, so the part past the end of the file
+    // reads as zero
+    void *page = mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_POPULATE);
+
+    if (unlikely(page == MAP_FAILED))
+        return nullptr;
+
+    ssize_t got = file_pread(cache->id, page, PAGE_SIZE,
+                             off_t(index) << PAGE_SIZE_BIT);
+
+    if (unlikely(got < 0)) {
+        printdbg("filemap: read of page %" PRIu64 " failed, err=%zd\n",
+                 index, got);
+        munmap(page, PAGE_SIZE);
+        return nullptr;
+    }
+
+    if (unlikely(!cache->pages.emplace(index, page).second)) {
+        munmap(page, PAGE_SIZE);
+        return nullptr;
+    }
+
+    atomic_inc(&filemap_page_count);
+
+    FILEMAP_TRACE("read page %" PRIu64 " of inode %" PRIu64 "\n",
+                  index, uint64_t(cache->ino));
+
+    return page;
+}
+
+errno_t filemap_writeback(filemap_cache_t *cache, uint64_t index)
+{
+    fs_stat_t st;
+
+    int status = file_fstat(cache->id, &st);
+
+    if (unlikely(status < 0))
+        return errno_t(-status);
+
+    off_t ofs = off_t(index) << PAGE_SIZE_BIT;
+
+    // Writes past the end of the file are dropped, like other systems
+    if (ofs >= st.st_size)
+        return errno_t::OK;
+
+    size_t len = ext::min(size_t(st.st_size - ofs), size_t(PAGE_SIZE));
+
+    filemap_cache_t::scoped_lock lock(cache->lock);
+
+    auto it = cache->pages.find(index);
+
+    if (unlikely(it == cache->pages.end()))
+        return errno_t::OK;
+
+    ssize_t wrote = file_pwrite(cache->id, it->second, len, ofs);
+
+    if (unlikely(wrote < 0))
+        return errno_t(-wrote);
+
+    FILEMAP_TRACE("wrote page %" PRIu64 " of inode %" PRIu64 "\n",
+                  index, uint64_t(cache->ino));
+
+    return errno_t::OK;
+}
+
+void filemap_mark_dirty(filemap_cache_t *cache, uint64_t index)
+{
+    filemap_cache_t::scoped_lock lock(cache->lock);
+
+    // An index that can't be recorded is still written back
+    // by msync in the process that writes it
+    cache->shared_dirty.insert(index);
+}
+
+errno_t filemap_sync(fs_base_t *fs, ino_t ino)
+{
+    filemap_caches_scoped_lock caches_lock(filemap_caches_lock);
+
+    filemap_cache_t *cache = nullptr;
+
+    for (filemap_cache_t *item : filemap_caches) {
+        if (item->fs == fs && item->ino == ino) {
+            cache = item;
+            break;
+        }
+    }
+
+    if (!cache ||
+            atomic_ld_acq(&cache->sync_owner) == thread_get_id())
+        return errno_t::OK;
+
+    ++cache->refcount;
+
+    caches_lock.unlock();
+
+    filemap_cache_t::scoped_lock sync_lock(cache->sync_lock);
+    atomic_st_rel(&cache->sync_owner, thread_get_id());
+
+    ext::vector<uint64_t> indexes;
+
+    filemap_cache_t::scoped_lock lock(cache->lock);
+
+    errno_t err = indexes.reserve(cache->shared_dirty.size())
+            ? errno_t::OK
+            : errno_t::ENOMEM;
+
+    if (likely(err == errno_t::OK)) {
+        for (uint64_t index : cache->shared_dirty)
+            indexes.push_back(index);
+    }
+
+    lock.unlock();
+
+    for (uint64_t index : indexes) {
+        errno_t page_err = filemap_writeback(cache, index);
+
+        if (unlikely(page_err != errno_t::OK && err == errno_t::OK))
+            err = page_err;
+    }
+
+    atomic_st_rel(&cache->sync_owner, -1);
+    sync_lock.unlock();
+
+    filemap_release(cache);
+
+    return err;
+}
+
+uint64_t filemap_cache_pages()
+{
+    return atomic_ld_acq(&filemap_page_count);
+}
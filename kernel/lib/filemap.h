@@ -0,0 +1,79 @@
+#pragma once
+#include "types.h"
+#include "errno.h"
+#include "dirent.h"
+
+struct process_t;
+struct fs_base_t;
+struct filemap_cache_t;
+
+// File backed mmap for user processes
+//
+// Every mapped file gets one page cache, found by filesystem and inode,
+// shared by all processes that map it. Cache pages are ordinary kernel
+// pages, user page table entries point at the same physical page and
+// hold a reference on it. MAP_SHARED mappings write straight into the
+// cache page and msync writes dirty pages back to the file. MAP_PRIVATE
+// mappings map the cache page read only and get a private copy on the
+// first write.
+
+struct filemap_fault_t {
+    filemap_cache_t *cache;
+
+    // Page index within the file
+    uint64_t index;
+
+    bool shared;
+    bool writable;
+};
+
+// Record a mapping of len bytes of file id at offset, at user address base
+_use_result
+KERNEL_API errno_t filemap_insert(process_t *process,
+                                  uintptr_t base, size_t len,
+                                  int id, off_t offset,
+                                  bool shared, bool writable);
+
+// Forget the file mappings in [st,en), trimming any that straddle the ends
+KERNEL_API void filemap_remove(process_t *process, uintptr_t st, uintptr_t en);
+
+// Allow or deny writes to the file mappings in [st,en), splitting any
+// that straddle the ends
+_use_result
+KERNEL_API errno_t filemap_protect(process_t *process,
+                                   uintptr_t st, uintptr_t en,
+                                   bool writable);
+
+// Forget every file mapping of the process
+void filemap_destroy(process_t *process);
+
+// Unlocked hint, false if the process has never mapped a file
+bool filemap_any(process_t *process);
+
+// Find the file mapping covering addr.
+// On success, result->cache is referenced and must be passed
+// to filemap_release when done
+_use_result
+bool filemap_lookup(process_t *process, uintptr_t addr,
+                    filemap_fault_t *result);
+
+void filemap_release(filemap_cache_t *cache);
+
+// Kernel address of a cache page, read from the file on first use.
+// Returns nullptr on I/O error
+void *filemap_get_page(filemap_cache_t *cache, uint64_t index);
+
+// Write a cache page back to the file, never extending it
+errno_t filemap_writeback(filemap_cache_t *cache, uint64_t index);
+
+// Remember that a MAP_SHARED mapping made a cache page writable
+void filemap_mark_dirty(filemap_cache_t *cache, uint64_t index);
+
+// Write back every cache page of the file that a MAP_SHARED mapping
+// has written, in any process, so I/O that bypasses the page cache
+// sees it. Does nothing if the file is not mapped
+_use_result
+KERNEL_API errno_t filemap_sync(fs_base_t *fs, ino_t ino);
+
+// Number of pages held by all file page caches
+uint64_t filemap_cache_pages();
@@ -81,6 +81,18 @@ struct heap_ext_arena_t {
                         sizeof(size_t)) / sizeof(heap_page_t)];
 };
 
+C_ASSERT(HEAP_STATS_BUCKETS == HEAP_BUCKET_COUNT);
+
+// Usage counters, protected by the heap lock except where noted
+struct heap_counters_t {
+    size_t arena_count[HEAP_BUCKET_COUNT];
+    size_t used_count[HEAP_BUCKET_COUNT];
+
+    // Atomic, large blocks don't take the heap lock
+    size_t large_count;
+    size_t large_bytes;
+};
+
 // The maximum number of arenas without adding extended arenas
 static constexpr const size_t HEAP_MAX_ARENAS =
     ((PAGESIZE -
@@ -88,6 +100,8 @@ static constexpr const size_t HEAP_MAX_ARENAS =
       sizeof(size_t) -                          // arena_count
       sizeof(heap_ext_arena_t*) -               // last_ext_arena
       sizeof(mutex_t) -                         // heap_lock
+      sizeof(void**) - sizeof(size_t) * 2 -     // reserve
+      sizeof(heap_counters_t) -                 // counters
       sizeof(uint32_t)) /                       // id
       sizeof(heap_page_t)) - 1;                 // arenas
 
@@ -116,6 +130,7 @@ public:
     void free(void *block);
     bool maybe_blk(void *block);
     bool validate(bool dump = false) const;
+    void get_stats(heap_stats_t *stats) const;
     bool validate_locked(bool dump, scoped_lock const& lock) const;
     _malloc _assume_aligned(16) _alloc_size(2)
     void *large_alloc(size_t size, uint32_t heap_id);
@@ -150,6 +165,8 @@ public:
     size_t reserve_count;
     size_t reserve_capacity;
 
+    heap_counters_t counters;
+
     uint32_t id;
 private:
     char *alloc_arena(scoped_lock &lock);
@@ -157,6 +174,7 @@ private:
 };
 
 C_ASSERT(sizeof(heap_t) <= PAGESIZE);
+C_ASSERT(sizeof(heapimpl_t) <= PAGESIZE);
 
 static uint32_t next_heap_id;
 
@@ -315,6 +333,8 @@ heap_hdr_t *heapimpl_t::create_arena(uint8_t log2size, scoped_lock &lock)
     arena_list_ptr[slot].mem = arena;
     arena_list_ptr[slot].slot_size = log2size;
 
+    ++counters.arena_count[bucket];
+
     size_t size = size_t(1) << log2size;
 
     heap_hdr_t *hdr = nullptr;
@@ -356,11 +376,17 @@ void *heapimpl_t::large_alloc(size_t size, uint32_t heap_id)
     hdr->sig1 = HEAP_BLK_TYPE_USED;
     hdr->heap_id = heap_id;
 
+    atomic_inc(&counters.large_count);
+    atomic_add(&counters.large_bytes, size);
+
     return hdr + 1;
 }
 
 void heapimpl_t::large_free(heap_hdr_t *hdr, size_t size)
 {
+    atomic_dec(&counters.large_count);
+    atomic_add(&counters.large_bytes, -size);
+
     munmap(hdr, size);
 }
 
@@ -412,6 +438,7 @@ void *heapimpl_t::alloc(size_t size)
 
         // Remove block from chain
         free_chains[bucket] = (heap_hdr_t*)first_free->size_next;
+        ++counters.used_count[bucket];
     }
 
     if (likely(first_free)) {
@@ -465,6 +492,7 @@ void heapimpl_t::free(void *block)
 
         hdr->size_next = uintptr_t(free_chains[bucket]);
         free_chains[bucket] = hdr;
+        --counters.used_count[bucket];
     } else {
         large_free(hdr, hdr->size_next);
     }
@@ -756,6 +784,7 @@ heapimpl_t::heapimpl_t()
     , arenas{}
     , arena_count{}
     , last_ext_arena{}
+    , counters{}
     , id{atomic_xadd(&next_heap_id, 1)}
 {
 }
@@ -945,6 +974,33 @@ bool heap_maybe_blk(heap_t *heap, void *block)
     return static_cast<heapimpl_t*>(heap)->maybe_blk(block);
 }
 
+void heapimpl_t::get_stats(heap_stats_t *stats) const
+{
+    scoped_lock lock(heap_lock);
+
+    stats->heap_id = id;
+    stats->arena_size = HEAP_BUCKET_SIZE;
+
+    for (size_t i = 0; i < HEAP_BUCKET_COUNT; ++i) {
+        heap_bucket_stats_t &bucket = stats->buckets[i];
+        bucket.slot_size = size_t(1) << (i + HEAP_1ST_BUCKET);
+        bucket.arena_count = counters.arena_count[i];
+        bucket.used_count = counters.used_count[i];
+    }
+
+    stats->reserve_count = reserve_count;
+
+    lock.unlock();
+
+    stats->large_count = atomic_ld_acq(&counters.large_count);
+    stats->large_bytes = atomic_ld_acq(&counters.large_bytes);
+}
+
+void heap_get_stats(heap_t *heap, heap_stats_t *stats)
+{
+    static_cast<heapimpl_t const*>(heap)->get_stats(stats);
+}
+
 bool heap_validate(heap_t *heap, bool dump)
 {
     if (likely(heap))
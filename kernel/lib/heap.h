@@ -33,6 +33,38 @@ bool heap_maybe_blk(heap_t *heap, void *block);
 
 bool heap_validate(heap_t *heap, bool dump = false);
 
+#define HEAP_STATS_BUCKETS  12
+
+struct heap_bucket_stats_t {
+    // Size of each slot, including the block header
+    size_t slot_size;
+
+    // Arenas carved into slots of this size
+    size_t arena_count;
+
+    // Slots currently allocated
+    size_t used_count;
+};
+
+struct heap_stats_t {
+    uint32_t heap_id;
+
+    // Size of each arena
+    size_t arena_size;
+
+    heap_bucket_stats_t buckets[HEAP_STATS_BUCKETS];
+
+    // Allocations too large for a bucket, mapped directly
+    size_t large_count;
+    size_t large_bytes;
+
+    // Arenas held in reserve, not carved up yet
+    size_t reserve_count;
+};
+
+// Snapshot the usage of a heap made by heap_create
+void heap_get_stats(heap_t *heap, heap_stats_t *stats);
+
 // Page heap
 
 heap_t *pageheap_create();
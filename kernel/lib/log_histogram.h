@@ -0,0 +1,136 @@
+#pragma once
+#include "types.h"
+#include "bitsearch.h"
+
+// Histogram of 64 bit values with logarithmic buckets
+//
+// Each power of two range is split into sub_count linear buckets,
+// so a value lands in a bucket no wider than 1/sub_count of itself
+// (25% with the default of 4). Values below sub_count get their own
+// bucket. Percentiles report the upper bound of the bucket holding
+// the requested rank, clamped to the largest value recorded.
+template<unsigned sub_log2 = 2>
+class log_histogram_t {
+public:
+    static constexpr size_t sub_count = size_t(1) << sub_log2;
+    static constexpr size_t bucket_count = (64 - sub_log2 + 1) * sub_count;
+
+    void record(uint64_t value)
+    {
+        ++buckets[bucket_of(value)];
+        ++total;
+        sum += value;
+
+        if (value < lo || total == 1)
+            lo = value;
+
+        if (value > hi)
+            hi = value;
+    }
+
+    void merge(log_histogram_t const& rhs)
+    {
+        if (!rhs.total)
+            return;
+
+        for (size_t i = 0; i < bucket_count; ++i)
+            buckets[i] += rhs.buckets[i];
+
+        if (rhs.lo < lo || !total)
+            lo = rhs.lo;
+
+        if (rhs.hi > hi)
+            hi = rhs.hi;
+
+        total += rhs.total;
+        sum += rhs.sum;
+    }
+
+    void clear()
+    {
+        *this = log_histogram_t();
+    }
+
+    uint64_t count() const
+    {
+        return total;
+    }
+
+    uint64_t min() const
+    {
+        return lo;
+    }
+
+    uint64_t max() const
+    {
+        return hi;
+    }
+
+    uint64_t mean() const
+    {
+        return total ? sum / total : 0;
+    }
+
+    // Value at or below which num/den of the recorded values fall,
+    // p99.9 is percentile(999, 1000)
+    uint64_t percentile(uint64_t num, uint64_t den) const
+    {
+        if (!total)
+            return 0;
+
+        // Rank of the value, rounded up, at least the first one
+        uint64_t rank = (total * num + den - 1) / den;
+
+        if (rank == 0)
+            rank = 1;
+
+        uint64_t seen = 0;
+
+        for (size_t i = 0; i < bucket_count; ++i) {
+            seen += buckets[i];
+
+            if (seen >= rank) {
+                uint64_t bound = bucket_max(i);
+                return bound < hi ? bound : hi;
+            }
+        }
+
+        return hi;
+    }
+
+    static size_t bucket_of(uint64_t value)
+    {
+        if (value < sub_count)
+            return value;
+
+        uint8_t msb = bit_msb_set_64(int64_t(value));
+
+        return (msb - sub_log2 + 1) * sub_count +
+                ((value >> (msb - sub_log2)) & (sub_count - 1));
+    }
+
+    static uint64_t bucket_min(size_t bucket)
+    {
+        if (bucket < sub_count)
+            return bucket;
+
+        size_t msb = bucket / sub_count + sub_log2 - 1;
+        size_t sub = bucket & (sub_count - 1);
+
+        return uint64_t(sub_count + sub) << (msb - sub_log2);
+    }
+
+    static uint64_t bucket_max(size_t bucket)
+    {
+        return bucket + 1 < bucket_count
+                ? bucket_min(bucket + 1) - 1
+                : ~uint64_t(0);
+    }
+
+private:
+    uint64_t buckets[bucket_count] = {};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+};
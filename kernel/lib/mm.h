@@ -56,11 +56,17 @@ __BEGIN_DECLS
 /// Not file backed
 #define MAP_ANONYMOUS       0x00000200
 
+/// File mapping, writes go to the file and are seen by other mappings
+#define MAP_SHARED          0x00000400
+
+/// File mapping, writes make a private copy of the page
+#define MAP_PRIVATE         0x00000800
+
 // Undefined flag mask
-#define MAP_INVALID_MASK    0x001FF800
+#define MAP_INVALID_MASK    0x001FF000
 
 // Allowed in user mode
-#define MAP_USER_MASK       0x000003FF
+#define MAP_USER_MASK       0x00000FFF
 
 // Kernel only: Commit no pages
 #define MAP_NOCOMMIT        0x00200000
@@ -227,6 +233,12 @@ int munlock(void const *__addr, size_t __len);
 /// Ensure a range of address space is written back to the device
 KERNEL_API int msync(void const *__addr, size_t __len, int __flags);
 
+/// Discard the cached contents of a range of a device mapping, after
+/// writing back whatever is present, so the next access reads the
+/// device again. The range is widened to the 64KB units the mapping
+/// is read in
+KERNEL_API int mm_device_invalidate(void const *__addr, size_t __len);
+
 /// msync flags
 #define MS_ASYNC        0
 #define MS_SYNC         1
@@ -386,7 +398,7 @@ KERNEL_API void mm_free_contiguous(uintptr_t addr, size_t size);
 KERNEL_API uintptr_t mm_alloc_hole(size_t size);
 KERNEL_API void mm_free_hole(uintptr_t addr, size_t size);
 
-uintptr_t mm_new_process(process_t *process, bool use64);
+KERNEL_API uintptr_t mm_new_process(process_t *process, bool use64);
 
 KERNEL_API void *mmap_window(size_t size);
 KERNEL_API void munmap_window(void *addr, size_t size);
@@ -399,6 +411,42 @@ uintptr_t mm_fork_kernel_text();
 
 void mm_set_master_pagedir();
 
+// Copy one page between a kernel buffer and a physical page
+void mm_copy_from_phys(void *dst, uintptr_t src_physaddr);
+void mm_copy_to_phys(uintptr_t dst_physaddr, void const *src);
+
+// Move up to count cold pages of the current process into the
+// compressed swap pool. Returns the number of pages freed
+KERNEL_API size_t mm_swap_reclaim(size_t count);
+
+// Lifetime totals for munmap and process teardown
+struct mm_unmap_stats_t {
+    uint64_t gather_count;
+    uint64_t shootdown_count;
+    uint64_t page_count;
+    uint64_t table_count;
+};
+
+KERNEL_API void mm_get_unmap_stats(mm_unmap_stats_t *stats);
+
+// Pages of one user process
+struct mm_process_usage_t {
+    // Backed by physical memory
+    uint64_t resident_pages;
+
+    // Reserved by mmap and not yet unmapped
+    uint64_t committed_pages;
+
+    // Held in the compressed swap pool
+    uint64_t swapped_pages;
+};
+
+// Number of pages currently used for page tables
+KERNEL_API uint64_t mm_get_page_table_count();
+
+// Number of present pages in device mappings (framebuffers, MMIO windows)
+KERNEL_API uint64_t mm_get_device_cache_pages();
+
 __END_DECLS
 
 #include "cxxexception.h"
@@ -0,0 +1,199 @@
+#include "name_index.h"
+#include "hash.h"
+#include "string.h"
+#include "atomic.h"
+
+static name_index_stats_t name_index_stats;
+
+void name_index_t::clear()
+{
+    entries.clear();
+    names.clear();
+    slots.clear();
+    dead_count = 0;
+    is_complete = false;
+}
+
+bool name_index_t::insert(char const *name, size_t len, uintptr_t value)
+{
+    // Reclaim erased entries before they outnumber the live ones
+    if (dead_count && dead_count * 2 >= entries.size())
+        compact();
+
+    // Keep the load factor at or below 3/4
+    if ((entries.size() + 1) * 4 > slots.size() * 3) {
+        if (unlikely(!rehash(slots.empty() ? 16 : slots.size() * 2)))
+            return false;
+    }
+
+    entry_t entry;
+    entry.hash = hash_32(name, len);
+    entry.name_ofs = names.size();
+    entry.name_len = len;
+    entry.value = value;
+
+    if (unlikely(!names.resize(entry.name_ofs + len)))
+        return false;
+
+    memcpy(names.data() + entry.name_ofs, name, len);
+
+    if (unlikely(!entries.push_back(entry))) {
+        names.resize(entry.name_ofs);
+        return false;
+    }
+
+    place(entries.size() - 1);
+
+    atomic_inc(&name_index_stats.insert_count);
+
+    return true;
+}
+
+bool name_index_t::lookup(char const *name, size_t len,
+                          uintptr_t& value) const
+{
+    atomic_inc(&name_index_stats.lookup_count);
+
+    if (unlikely(slots.empty()))
+        return false;
+
+    uint32_t hash = hash_32(name, len);
+    size_t mask = slots.size() - 1;
+
+    for (size_t i = hash & mask; slots[i]; i = (i + 1) & mask) {
+        entry_t const& entry = entries[slots[i] - 1];
+
+        if (entry.hash == hash && entry.name_len == len &&
+                !memcmp(names.data() + entry.name_ofs, name, len)) {
+            value = entry.value;
+            atomic_inc(&name_index_stats.hit_count);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool name_index_t::erase(char const *name, size_t len)
+{
+    if (unlikely(slots.empty()))
+        return false;
+
+    uint32_t hash = hash_32(name, len);
+    size_t mask = slots.size() - 1;
+    size_t i;
+
+    for (i = hash & mask; slots[i]; i = (i + 1) & mask) {
+        entry_t const& entry = entries[slots[i] - 1];
+
+        if (entry.hash == hash && entry.name_len == len &&
+                !memcmp(names.data() + entry.name_ofs, name, len))
+            break;
+    }
+
+    if (!slots[i])
+        return false;
+
+    // The entry stays in entries until the next compact, the slot is
+    // released now
+    entries[slots[i] - 1].name_len = UINT32_MAX;
+    ++dead_count;
+
+    // Backward shift deletion, move later entries of the probe
+    // sequence into the hole unless that would put them before their
+    // home slot, so no tombstones are needed
+    for (size_t j = (i + 1) & mask; slots[j]; j = (j + 1) & mask) {
+        size_t home = entries[slots[j] - 1].hash & mask;
+
+        // Leave it when its home is cyclically in (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+
+    slots[i] = 0;
+
+    return true;
+}
+
+size_t name_index_t::size() const
+{
+    return entries.size() - dead_count;
+}
+
+bool name_index_t::complete() const
+{
+    return is_complete;
+}
+
+void name_index_t::set_complete()
+{
+    is_complete = true;
+    atomic_inc(&name_index_stats.build_count);
+}
+
+bool name_index_t::rehash(size_t new_capacity)
+{
+    ext::vector<uint32_t> new_slots;
+
+    if (unlikely(!new_slots.resize(new_capacity, 0)))
+        return false;
+
+    slots.swap(new_slots);
+
+    // Reinsert in insertion order, so earlier duplicates still win
+    for (size_t i = 0, e = entries.size(); i < e; ++i)
+        place(i);
+
+    return true;
+}
+
+void name_index_t::place(uint32_t entry_index)
+{
+    size_t mask = slots.size() - 1;
+    size_t i = entries[entry_index].hash & mask;
+
+    while (slots[i])
+        i = (i + 1) & mask;
+
+    slots[i] = entry_index + 1;
+}
+
+void name_index_t::compact()
+{
+    size_t dst = 0;
+    size_t name_dst = 0;
+
+    // Slide the live entries and their names down, preserving order
+    for (size_t i = 0, e = entries.size(); i < e; ++i) {
+        entry_t entry = entries[i];
+
+        if (entry.name_len == UINT32_MAX)
+            continue;
+
+        memmove(names.data() + name_dst,
+                names.data() + entry.name_ofs, entry.name_len);
+        entry.name_ofs = name_dst;
+        name_dst += entry.name_len;
+
+        entries[dst++] = entry;
+    }
+
+    entries.resize(dst);
+    names.resize(name_dst);
+    dead_count = 0;
+
+    memset(slots.data(), 0, slots.size() * sizeof(*slots.data()));
+
+    for (size_t i = 0; i < dst; ++i)
+        place(i);
+}
+
+void name_index_get_stats(name_index_stats_t *stats)
+{
+    stats->build_count = atomic_ld_acq(&name_index_stats.build_count);
+    stats->insert_count = atomic_ld_acq(&name_index_stats.insert_count);
+    stats->lookup_count = atomic_ld_acq(&name_index_stats.lookup_count);
+    stats->hit_count = atomic_ld_acq(&name_index_stats.hit_count);
+}
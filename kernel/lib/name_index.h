@@ -0,0 +1,70 @@
+#pragma once
+#include "types.h"
+#include "vector.h"
+
+struct name_index_stats_t {
+    // Indexes built from a directory scan
+    uint64_t build_count;
+
+    // Names inserted
+    uint64_t insert_count;
+
+    // Lookups, and how many of them found the name
+    uint64_t lookup_count;
+    uint64_t hit_count;
+};
+
+// Hash index from names to an opaque value, so a filesystem can find a
+// name in a large directory without scanning it. Names are copied into
+// the index, and are compared as bytes, the filesystem decides what the
+// bytes of a name are. The first value inserted for a name wins, like a
+// linear scan. Not internally locked
+class KERNEL_API name_index_t {
+public:
+    name_index_t() = default;
+    name_index_t(name_index_t const&) = delete;
+    name_index_t& operator=(name_index_t const&) = delete;
+
+    void clear();
+
+    _use_result
+    bool insert(char const *name, size_t len, uintptr_t value);
+
+    bool lookup(char const *name, size_t len, uintptr_t& value) const;
+
+    // Remove the name, the entry that lookup would return if there are
+    // duplicates. Never allocates
+    bool erase(char const *name, size_t len);
+
+    size_t size() const;
+
+    // Every name in the directory is in the index, so a miss means
+    // the name does not exist
+    bool complete() const;
+    void set_complete();
+
+private:
+    struct entry_t {
+        uint32_t hash;
+        uint32_t name_ofs;
+        uint32_t name_len;
+        uintptr_t value;
+    };
+
+    bool rehash(size_t new_capacity);
+    void place(uint32_t entry_index);
+    void compact();
+
+    ext::vector<entry_t> entries;
+    ext::vector<char> names;
+
+    // Open addressed, entry index + 1, zero when empty
+    ext::vector<uint32_t> slots;
+
+    // Erased entries still in entries and names, reclaimed by compact
+    size_t dead_count = 0;
+
+    bool is_complete = false;
+};
+
+KERNEL_API void name_index_get_stats(name_index_stats_t *stats);
@@ -1,6 +1,16 @@
 #include "pipe.h"
 #include "stdlib.h"
 #include "export.h"
+#include "atomic.h"
+
+static uint64_t pipe_reserved_bytes;
+static uint64_t pipe_committed_bytes;
+
+void pipe_get_usage(uint64_t *reserved_bytes, uint64_t *committed_bytes)
+{
+    *reserved_bytes = atomic_ld_acq(&pipe_reserved_bytes);
+    *committed_bytes = atomic_ld_acq(&pipe_committed_bytes);
+}
 
 pipe_t::pipe_t()
 {
@@ -23,6 +33,9 @@ void pipe_t::cleanup_buffer(scoped_lock& lock)
     if (page_pool) {
         munmap(page_pool, page_capacity * PAGESIZE);
 
+        atomic_add(&pipe_reserved_bytes, -(page_capacity * PAGESIZE));
+        atomic_add(&pipe_committed_bytes, -(page_bump * PAGESIZE));
+
         page_pool = nullptr;
         page_bump = 0;
         page_capacity = 0;
@@ -56,6 +69,8 @@ pipe_buffer_hdr_t *pipe_t::allocate_page(scoped_lock& lock,
 
             ++page_bump;
 
+            atomic_add(&pipe_committed_bytes, PAGESIZE);
+
             assert(page_bump <= page_capacity);
         } else {
             // Wait for someone to free a page
@@ -92,6 +107,8 @@ bool pipe_t::reserve(size_t pages)
     page_pool = (char*)mem;
     page_capacity = pages;
 
+    atomic_add(&pipe_reserved_bytes, pages * PAGESIZE);
+
     lock.unlock();
     pipe_not_full.notify_all();
 
@@ -13,6 +13,11 @@ struct pipe_buffer_hdr_t {
 
 C_ASSERT_ISPO2(sizeof(pipe_buffer_hdr_t));
 
+// Total bytes of address space reserved for pipe buffers, and how much
+// of it has been touched, across all pipes
+KERNEL_API void pipe_get_usage(uint64_t *reserved_bytes,
+                               uint64_t *committed_bytes);
+
 struct KERNEL_API pipe_t {
     pipe_t();
     ~pipe_t();
@@ -16,6 +16,7 @@
 #include "cpu/isr.h"
 #include "contig_alloc.h"
 #include "user_mem.h"
+#include "filemap.h"
 #include "cpu/except_asm.h"
 #include "utility.h"
 
@@ -856,6 +857,10 @@ void process_t::destroy()
     ext::vector<ext::string> empty_env;
     empty_env.swap(env);
 
+    filemap_destroy(this);
+
+    mem_usage = {};
+
     delete (contiguous_allocator_t*)linear_allocator;
     linear_allocator = nullptr;
 }
@@ -934,6 +939,22 @@ int process_t::wait_for_exit(int pid)
     return 0;
 }
 
+int process_t::get_mem_usage(pid_t pid, mm_process_usage_t *result)
+{
+    scoped_lock lock(processes_lock);
+
+    process_t *p = lookup(pid);
+
+    if (unlikely(!p || p->state == state_t::unused))
+        return -int(errno_t::ESRCH);
+
+    result->resident_pages = atomic_ld_acq(&p->mem_usage.resident_pages);
+    result->committed_pages = atomic_ld_acq(&p->mem_usage.committed_pages);
+    result->swapped_pages = atomic_ld_acq(&p->mem_usage.swapped_pages);
+
+    return 0;
+}
+
 process_t *process_t::lookup(pid_t pid)
 {
     if (unlikely(pid >= int(processes.size())))
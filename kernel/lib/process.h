@@ -11,6 +11,7 @@
 #include "fileio.h"
 #include "cpu/except_asm.h"
 #include "syscall/sys_signal.h"
+#include "mm.h"
 
 struct fd_table_t {
     static constexpr ssize_t max_file = 4096;
@@ -149,6 +150,7 @@ struct file_mapping_t {
 };
 
 struct process_t;
+struct filemap_list_t;
 
 __BEGIN_DECLS
 
@@ -202,6 +204,9 @@ struct process_t
     ext::vector<ext::string> env;
     uintptr_t mmu_context = 0;
     void *linear_allocator = nullptr;
+    uintptr_t swap_hand = 0;
+    filemap_list_t *filemaps = nullptr;
+    mm_process_usage_t mem_usage{};
     uintptr_t tls_addr = 0;
     size_t tls_msize = 0;
     size_t tls_fsize = 0;
@@ -278,6 +283,10 @@ struct process_t
 
     static int kill(int pid, int sig);
 
+    // Snapshot the page counts of process pid, or the current
+    // process if pid is negative
+    static int get_mem_usage(pid_t pid, mm_process_usage_t *result);
+
     int send_signal(int sig);
     int send_signal_to_self(int sig);
 
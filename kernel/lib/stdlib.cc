@@ -111,6 +111,16 @@ bool malloc_validate(bool dump)
 {
     return heap_validate(this_cpu_heap(), dump);
 }
+
+size_t malloc_get_stats(heap_stats_t *stats, size_t count)
+{
+    size_t heaps = atomic_ld_acq(&heap_count);
+
+    for (size_t i = 0; i < heaps && i < count; ++i)
+        heap_get_stats(default_heaps[i], stats + i);
+
+    return heaps;
+}
 #else
 
 bool malloc_validate(bool dump)
@@ -118,6 +128,11 @@ bool malloc_validate(bool dump)
     return true;//not supported
 }
 
+size_t malloc_get_stats(heap_stats_t *stats, size_t count)
+{
+    return 0;//not supported
+}
+
 void malloc_startup(void *p)
 {
     // Create a heap
@@ -18,6 +18,8 @@ struct bad_alloc
 };
 #endif
 
+struct heap_stats_t;
+
 __BEGIN_DECLS
 
 void malloc_startup(void *p);
@@ -35,6 +37,10 @@ KERNEL_API_BUILTIN void free(void *p);
 
 KERNEL_API bool malloc_validate(bool dump);
 
+// Fill up to count entries with the usage of each per-cpu kernel heap,
+// returns the number of heaps
+KERNEL_API size_t malloc_get_stats(heap_stats_t *stats, size_t count);
+
 _malloc _assume_aligned(16)
 KERNEL_API char *strdup(char const *s);
 
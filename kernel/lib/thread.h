@@ -260,6 +260,10 @@ void thread_idle_set_ready(void);
 void *thread_get_exception_top(void);
 void *thread_set_exception_top(void *chain);
 
+// Block I/O plug of the current thread, see blk_queue.h
+KERNEL_API void *thread_get_blk_plug(void);
+KERNEL_API void *thread_set_blk_plug(void *plug);
+
 KERNEL_API process_t *thread_current_process();
 
 // Get the TLB shootdown counter for the specified CPU
@@ -1,6 +1,4 @@
-#if 0
 #include "zlib_helper.h"
-#include "zlib/zlib.h"
 #include "string.h"
 #include "stdlib.h"
 
@@ -14,7 +12,7 @@ void zlib_init(z_stream *strm)
 void *zlib_malloc(void *opaque, unsigned items, unsigned size)
 {
     (void)opaque;
-    return malloc(items * size);
+    return malloc(size_t(items) * size);
 }
 
 void zlib_free(void *opaque, void *p)
@@ -22,4 +20,3 @@ void zlib_free(void *opaque, void *p)
     (void)opaque;
     free(p);
 }
-#endif
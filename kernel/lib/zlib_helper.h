@@ -1,8 +1,11 @@
 #pragma once
-#if 0
+
+// The kernel links a freestanding build of zlib, libzk.a, built with Z_SOLO
+#ifndef Z_SOLO
+#define Z_SOLO
+#endif
 #include "zlib/zlib.h"
 
 void zlib_init(z_stream *strm);
 void *zlib_malloc(void *opaque, unsigned items, unsigned size);
 void zlib_free(void *opaque, void *p);
-#endif
@@ -0,0 +1,526 @@
+#include "zswap.h"
+#include "zlib_helper.h"
+#include "dev_storage.h"
+#include "blk_queue.h"
+#include "mm.h"
+#include "mmu.h"
+#include "mutex.h"
+#include "vector.h"
+#include "stdlib.h"
+#include "string.h"
+#include "printk.h"
+#include "inttypes.h"
+#include "engunit.h"
+
+#define DEBUG_ZSWAP 0
+#if DEBUG_ZSWAP
+#define ZSWAP_TRACE(...) printdbg("zswap: " __VA_ARGS__)
+#else
+#define ZSWAP_TRACE(...) ((void)0)
+#endif
+
+// Pages that compress worse than this are not worth keeping in the pool
+#define ZSWAP_MAX_COMPRESSED    (PAGE_SIZE * 3 / 4)
+
+// Raw deflate, a 4KB window covers the whole page
+#define ZSWAP_WINDOW_BITS       12
+#define ZSWAP_MEM_LEVEL         6
+
+__BEGIN_ANONYMOUS
+
+enum struct zswap_kind_t : uint8_t {
+    unused,
+    filled,     // Every 64 bit word of the page has the same value
+    zlib,       // Raw deflate stream in kernel heap
+    spill       // Uncompressed page on the spill device
+};
+
+struct zswap_slot_t {
+    union {
+        void *data;
+        uint64_t fill;
+        uint64_t spill_index;
+        size_t next_free;
+    };
+    uint32_t size;
+    zswap_kind_t kind;
+};
+
+class zswap_pool_t {
+public:
+    int64_t store(uintptr_t page);
+    errno_t load(uint64_t slot, uintptr_t page);
+    void release(uint64_t slot);
+    errno_t set_spill(storage_dev_base_t *dev, uint64_t lba, uint64_t count);
+    void set_pool_limit(uint64_t bytes);
+    void account_fault(uint64_t ns);
+    void get_stats(zswap_stats_t *result);
+
+private:
+    using lock_type = ext::mutex;
+    using scoped_lock = ext::unique_lock<lock_type>;
+
+    bool init_locked();
+    int64_t alloc_slot_locked();
+    void free_slot_locked(uint64_t slot);
+    int64_t spill_alloc_locked();
+    void spill_free_locked(uint64_t index);
+    int compress_locked();
+    bool decompress_locked(zswap_slot_t const &slot);
+
+    lock_type lock;
+
+    z_stream deflate_stream;
+    z_stream inflate_stream;
+
+    // Uncompressed page being stored or loaded
+    char *scratch = nullptr;
+
+    // Compressor output
+    char *packed = nullptr;
+
+    bool ready = false;
+
+    ext::vector<zswap_slot_t> slots;
+    size_t first_free = SIZE_MAX;
+
+    storage_dev_base_t *spill_dev = nullptr;
+    uint64_t spill_lba = 0;
+    uint32_t spill_blocks_per_page = 0;
+    ext::vector<uint64_t> spill_map;
+    size_t spill_hint = 0;
+
+    zswap_stats_t stats{};
+};
+
+zswap_pool_t zswap_pool;
+
+__END_ANONYMOUS
+
+bool zswap_pool_t::init_locked()
+{
+    if (likely(ready))
+        return true;
+
+    scratch = (char*)malloc(PAGE_SIZE);
+    packed = (char*)malloc(PAGE_SIZE);
+
+    if (unlikely(!scratch || !packed)) {
+        free(scratch);
+        free(packed);
+        scratch = nullptr;
+        packed = nullptr;
+        return false;
+    }
+
+    zlib_init(&deflate_stream);
+    zlib_init(&inflate_stream);
+
+    if (unlikely(deflateInit2(&deflate_stream, Z_BEST_SPEED, Z_DEFLATED,
+                              -ZSWAP_WINDOW_BITS, ZSWAP_MEM_LEVEL,
+                              Z_DEFAULT_STRATEGY) != Z_OK))
+        return false;
+
+    if (unlikely(inflateInit2(&inflate_stream, -ZSWAP_WINDOW_BITS) != Z_OK)) {
+        deflateEnd(&deflate_stream);
+        return false;
+    }
+
+    if (!stats.pool_limit)
+        stats.pool_limit = (mm_get_phys_mem_size() << PAGE_SIZE_BIT) >> 2;
+
+    ready = true;
+
+    return true;
+}
+
+int64_t zswap_pool_t::alloc_slot_locked()
+{
+    if (first_free != SIZE_MAX) {
+        size_t slot = first_free;
+        first_free = slots[slot].next_free;
+        return slot;
+    }
+
+    // The slot number has to fit in the physaddr field of the PTE
+    if (unlikely(slots.size() >= (PTE_ADDR_MASK >> 1)))
+        return -int(errno_t::ENOSPC);
+
+    if (unlikely(!slots.emplace_back()))
+        return -int(errno_t::ENOMEM);
+
+    return slots.size() - 1;
+}
+
+void zswap_pool_t::free_slot_locked(uint64_t slot)
+{
+    zswap_slot_t &item = slots[slot];
+
+    switch (item.kind) {
+    case zswap_kind_t::filled:
+        --stats.filled_pages;
+        break;
+
+    case zswap_kind_t::zlib:
+        --stats.stored_pages;
+        stats.original_bytes -= PAGE_SIZE;
+        stats.compressed_bytes -= item.size;
+        free(item.data);
+        break;
+
+    case zswap_kind_t::spill:
+        --stats.spilled_pages;
+        spill_free_locked(item.spill_index);
+        break;
+
+    case zswap_kind_t::unused:
+        assert(!"Double free of swap slot");
+        return;
+
+    }
+
+    item.kind = zswap_kind_t::unused;
+    item.size = 0;
+    item.next_free = first_free;
+    first_free = slot;
+}
+
+int64_t zswap_pool_t::spill_alloc_locked()
+{
+    size_t words = spill_map.size();
+
+    for (size_t n = 0; n < words; ++n) {
+        size_t i = spill_hint + n;
+        if (i >= words)
+            i -= words;
+
+        uint64_t avail = ~spill_map[i];
+
+        if (avail) {
+            uint8_t bit = __builtin_ctzll(avail);
+            spill_map[i] |= UINT64_C(1) << bit;
+            spill_hint = i;
+            return (i << 6) + bit;
+        }
+    }
+
+    return -int(errno_t::ENOSPC);
+}
+
+void zswap_pool_t::spill_free_locked(uint64_t index)
+{
+    assert(spill_map[index >> 6] & (UINT64_C(1) << (index & 63)));
+    spill_map[index >> 6] &= ~(UINT64_C(1) << (index & 63));
+}
+
+// Returns the compressed size, or 0 if it did not fit in the limit
+int zswap_pool_t::compress_locked()
+{
+    deflateReset(&deflate_stream);
+    deflate_stream.next_in = (Bytef*)scratch;
+    deflate_stream.avail_in = PAGE_SIZE;
+    deflate_stream.next_out = (Bytef*)packed;
+    deflate_stream.avail_out = ZSWAP_MAX_COMPRESSED;
+
+    int status = deflate(&deflate_stream, Z_FINISH);
+
+    if (status != Z_STREAM_END)
+        return 0;
+
+    return ZSWAP_MAX_COMPRESSED - deflate_stream.avail_out;
+}
+
+bool zswap_pool_t::decompress_locked(zswap_slot_t const &slot)
+{
+    inflateReset(&inflate_stream);
+    inflate_stream.next_in = (Bytef*)slot.data;
+    inflate_stream.avail_in = slot.size;
+    inflate_stream.next_out = (Bytef*)scratch;
+    inflate_stream.avail_out = PAGE_SIZE;
+
+    int status = inflate(&inflate_stream, Z_FINISH);
+
+    return status == Z_STREAM_END && inflate_stream.avail_out == 0;
+}
+
+int64_t zswap_pool_t::store(uintptr_t page)
+{
+    scoped_lock hold(lock);
+
+    if (unlikely(!init_locked()))
+        return -int(errno_t::ENOMEM);
+
+    mm_copy_from_phys(scratch, page);
+
+    int64_t slot = alloc_slot_locked();
+
+    if (unlikely(slot < 0)) {
+        ++stats.reject_count;
+        return slot;
+    }
+
+    zswap_slot_t &item = slots[slot];
+
+    // Check for a page filled with one repeating value
+    uint64_t const *words = (uint64_t const *)scratch;
+    uint64_t fill = words[0];
+    size_t i;
+    for (i = 1; i < PAGE_SIZE / sizeof(*words) && words[i] == fill; ++i);
+
+    if (i == PAGE_SIZE / sizeof(*words)) {
+        item.kind = zswap_kind_t::filled;
+        item.fill = fill;
+        item.size = 0;
+        ++stats.filled_pages;
+        ++stats.store_count;
+        return slot;
+    }
+
+    int size = compress_locked();
+
+    if (size > 0 && stats.compressed_bytes + size <= stats.pool_limit) {
+        void *data = malloc(size);
+
+        if (likely(data)) {
+            memcpy(data, packed, size);
+            item.kind = zswap_kind_t::zlib;
+            item.data = data;
+            item.size = size;
+            ++stats.stored_pages;
+            stats.original_bytes += PAGE_SIZE;
+            stats.compressed_bytes += size;
+            ++stats.store_count;
+            return slot;
+        }
+    }
+
+    // Incompressible, or no room in the pool, try the spill device
+    if (spill_dev) {
+        int64_t index = spill_alloc_locked();
+
+        if (index >= 0) {
+            int io = spill_dev->write_blocks(
+                        scratch, spill_blocks_per_page,
+                        spill_lba + index * spill_blocks_per_page, false);
+
+            if (likely(io >= 0)) {
+                item.kind = zswap_kind_t::spill;
+                item.spill_index = index;
+                item.size = PAGE_SIZE;
+                ++stats.spilled_pages;
+                ++stats.store_count;
+                return slot;
+            }
+
+            printdbg("zswap: spill write failed, lba=%" PRIu64 "\n",
+                     spill_lba + index * spill_blocks_per_page);
+
+            spill_free_locked(index);
+        }
+    }
+
+    ZSWAP_TRACE("rejected page %#" PRIx64 ", compressed size %d\n",
+                uint64_t(page), size);
+
+    // Put the slot back on the free chain without touching the stats
+    item.kind = zswap_kind_t::unused;
+    item.next_free = first_free;
+    first_free = slot;
+
+    ++stats.reject_count;
+
+    return -int(errno_t::ENOMEM);
+}
+
+errno_t zswap_pool_t::load(uint64_t slot, uintptr_t page)
+{
+    scoped_lock hold(lock);
+
+    if (unlikely(slot >= slots.size()))
+        return errno_t::EINVAL;
+
+    zswap_slot_t &item = slots[slot];
+
+    switch (item.kind) {
+    case zswap_kind_t::filled:
+        ext::fill_n((uint64_t*)scratch, PAGE_SIZE / sizeof(uint64_t),
+                    item.fill);
+        break;
+
+    case zswap_kind_t::zlib:
+        if (unlikely(!decompress_locked(item))) {
+            printdbg("zswap: corrupt compressed page in slot %" PRIu64 "\n",
+                     slot);
+            return errno_t::EIO;
+        }
+        break;
+
+    case zswap_kind_t::spill:
+    {
+        // Something is faulting on this page, poll for it
+        int io = spill_dev->read_blocks(
+                    scratch, spill_blocks_per_page,
+                    spill_lba + item.spill_index * spill_blocks_per_page,
+                    BLK_REQ_HIPRI);
+
+        if (unlikely(io < 0))
+            return errno_t(-io);
+
+        break;
+    }
+
+    case zswap_kind_t::unused:
+        return errno_t::EINVAL;
+
+    }
+
+    mm_copy_to_phys(page, scratch);
+
+    free_slot_locked(slot);
+
+    ++stats.load_count;
+
+    return errno_t::OK;
+}
+
+void zswap_pool_t::release(uint64_t slot)
+{
+    scoped_lock hold(lock);
+
+    if (likely(slot < slots.size()))
+        free_slot_locked(slot);
+}
+
+errno_t zswap_pool_t::set_spill(storage_dev_base_t *dev,
+                                uint64_t lba, uint64_t count)
+{
+    scoped_lock hold(lock);
+
+    if (unlikely(stats.spilled_pages))
+        return errno_t::EBUSY;
+
+    spill_dev = nullptr;
+    spill_map.clear();
+    spill_hint = 0;
+
+    if (!dev)
+        return errno_t::OK;
+
+    long block_size = dev->info(STORAGE_INFO_BLOCKSIZE);
+
+    if (unlikely(block_size <= 0 || block_size > PAGE_SIZE ||
+                 (PAGE_SIZE % block_size) != 0))
+        return errno_t::EINVAL;
+
+    uint32_t blocks_per_page = PAGE_SIZE / block_size;
+    uint64_t pages = count / blocks_per_page;
+
+    if (unlikely(!pages))
+        return errno_t::EINVAL;
+
+    if (unlikely(!spill_map.resize((pages + 63) >> 6)))
+        return errno_t::ENOMEM;
+
+    // Mark the nonexistent pages past the end of the last word used
+    if (pages & 63)
+        spill_map.back() = ~UINT64_C(0) << (pages & 63);
+
+    spill_dev = dev;
+    spill_lba = lba;
+    spill_blocks_per_page = blocks_per_page;
+
+    printdbg("zswap: spilling up to %" PRIu64 " pages"
+             " to lba %" PRIu64 "\n", pages, lba);
+
+    return errno_t::OK;
+}
+
+void zswap_pool_t::set_pool_limit(uint64_t bytes)
+{
+    scoped_lock hold(lock);
+    stats.pool_limit = bytes;
+}
+
+void zswap_pool_t::account_fault(uint64_t ns)
+{
+    scoped_lock hold(lock);
+    ++stats.fault_count;
+    stats.fault_ns_total += ns;
+    stats.fault_ns_max = ext::max(stats.fault_ns_max, ns);
+}
+
+void zswap_pool_t::get_stats(zswap_stats_t *result)
+{
+    scoped_lock hold(lock);
+    *result = stats;
+}
+
+int64_t zswap_store(uintptr_t page)
+{
+    return zswap_pool.store(page);
+}
+
+errno_t zswap_load(uint64_t slot, uintptr_t page)
+{
+    return zswap_pool.load(slot, page);
+}
+
+void zswap_release(uint64_t slot)
+{
+    zswap_pool.release(slot);
+}
+
+void zswap_account_fault(uint64_t ns)
+{
+    zswap_pool.account_fault(ns);
+}
+
+errno_t zswap_set_spill(storage_dev_base_t *dev, uint64_t lba, uint64_t count)
+{
+    return zswap_pool.set_spill(dev, lba, count);
+}
+
+void zswap_set_pool_limit(uint64_t bytes)
+{
+    zswap_pool.set_pool_limit(bytes);
+}
+
+void zswap_get_stats(zswap_stats_t *stats)
+{
+    zswap_pool.get_stats(stats);
+}
+
+void zswap_dump_stats()
+{
+    zswap_stats_t stats;
+    zswap_get_stats(&stats);
+
+    // Ratio in hundredths, the kernel does not use floating point
+    uint64_t ratio = stats.compressed_bytes
+            ? stats.original_bytes * 100 / stats.compressed_bytes
+            : 0;
+
+    uint64_t fault_avg = stats.fault_count
+            ? stats.fault_ns_total / stats.fault_count
+            : 0;
+
+    printdbg("zswap: %" PRIu64 " compressed, %" PRIu64 " filled,"
+             " %" PRIu64 " spilled pages\n",
+             stats.stored_pages, stats.filled_pages, stats.spilled_pages);
+
+    printdbg("zswap: %sB in %sB of pool (limit %sB),"
+             " ratio %" PRIu64 ".%02" PRIu64 "\n",
+             engineering_t<uint64_t>(stats.original_bytes, 0, true).ptr(),
+             engineering_t<uint64_t>(stats.compressed_bytes, 0, true).ptr(),
+             engineering_t<uint64_t>(stats.pool_limit, 0, true).ptr(),
+             ratio / 100, ratio % 100);
+
+    printdbg("zswap: %" PRIu64 " stores, %" PRIu64 " rejects,"
+             " %" PRIu64 " loads\n",
+             stats.store_count, stats.reject_count, stats.load_count);
+
+    printdbg("zswap: %" PRIu64 " faults, avg %ss, max %ss\n",
+             stats.fault_count,
+             engineering_t<uint64_t>(fault_avg, -3).ptr(),
+             engineering_t<uint64_t>(stats.fault_ns_max, -3).ptr());
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include "types.h"
+#include "errno.h"
+
+struct storage_dev_base_t;
+
+// Compressed in-memory swap pool
+//
+// Cold anonymous pages are compressed with zlib and kept in kernel heap
+// memory until they are touched again. Pages filled with a repeating
+// 64 bit pattern (usually zero) take no pool space at all. Pages that
+// do not compress well, or that arrive while the pool is at its limit,
+// are spilled uncompressed to a storage device range, if one has been
+// provided with zswap_set_spill.
+
+struct zswap_stats_t {
+    // Pages currently held, by representation
+    uint64_t stored_pages;
+    uint64_t filled_pages;
+    uint64_t spilled_pages;
+
+    // Uncompressed and compressed bytes of the zlib pages in the pool
+    uint64_t original_bytes;
+    uint64_t compressed_bytes;
+
+    // Limit on compressed_bytes
+    uint64_t pool_limit;
+
+    // Lifetime counters
+    uint64_t store_count;
+    uint64_t reject_count;
+    uint64_t load_count;
+
+    // Time spent servicing page faults on swapped pages
+    uint64_t fault_count;
+    uint64_t fault_ns_total;
+    uint64_t fault_ns_max;
+};
+
+// Compress the page at physical address page into the pool.
+// Returns the slot number, or a negated errno_t if the page was not stored
+// and must stay resident
+_use_result
+KERNEL_API int64_t zswap_store(uintptr_t page);
+
+// Restore the contents of slot into the page at physical address page
+// and release the slot
+_use_result
+KERNEL_API errno_t zswap_load(uint64_t slot, uintptr_t page);
+
+// Discard a slot without reading it (the mapping went away)
+KERNEL_API void zswap_release(uint64_t slot);
+
+// Record the time taken to resolve a fault on a swapped page
+void zswap_account_fault(uint64_t ns);
+
+// Allow pages to spill to count blocks of dev starting at lba.
+// Pass nullptr to stop spilling (fails while spilled pages are held)
+KERNEL_API errno_t zswap_set_spill(storage_dev_base_t *dev,
+                                   uint64_t lba, uint64_t count);
+
+// Limit the amount of heap memory holding compressed pages
+KERNEL_API void zswap_set_pool_limit(uint64_t bytes);
+
+KERNEL_API void zswap_get_stats(zswap_stats_t *stats);
+
+KERNEL_API void zswap_dump_stats();
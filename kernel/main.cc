@@ -51,7 +51,7 @@ char kernel_stack[kernel_stack_size] _section(".bspstk");
     "' 99=%d\t\t", f, (t)v, 99)
 
 #define ENABLE_SHELL_THREAD         0
-#define ENABLE_READ_STRESS_THREAD   1
+#define ENABLE_READ_STRESS_THREAD   0
 #define ENABLE_SLEEP_THREAD         0
 #define ENABLE_MUTEX_THREAD         0
 #define ENABLE_REGISTER_THREAD      0
@@ -380,7 +380,7 @@ static int register_check(void *p)
 #endif
 
 #if ENABLE_MMAP_STRESS_THREAD > 0
-static int stress_mmap_thread(void *p)
+static intptr_t stress_mmap_thread(void *p)
 {
     uintptr_t id = uintptr_t(p);
 
@@ -416,6 +416,10 @@ static int stress_mmap_thread(void *p)
                          PROT_READ | PROT_WRITE,
                          MAP_UNINITIALIZED | MAP_NOCOMMIT);
 
+            // Touch every page so munmap has something to release
+            for (size_t ofs = 0; ofs < sz; ofs += PAGE_SIZE)
+                ((char volatile*)block)[ofs] = 0;
+
             blocks[current] = {uintptr_t(block), sz};
 
             if (++current == block_count)
@@ -443,6 +447,17 @@ static int stress_mmap_thread(void *p)
                    id,
                    engineering_t<uint64_t>(total_sz, 0, true).ptr(),
                    engineering_t<uint64_t>(time_el, -3).ptr());
+
+            mm_unmap_stats_t unmap_stats;
+            mm_get_unmap_stats(&unmap_stats);
+            printk("%2zu: unmaps: %" PRIu64
+                   ", shootdowns: %" PRIu64
+                   ", pages: %" PRIu64
+                   ", tables: %" PRIu64 "\n",
+                   id, unmap_stats.gather_count,
+                   unmap_stats.shootdown_count,
+                   unmap_stats.page_count,
+                   unmap_stats.table_count);
         }
     }
 
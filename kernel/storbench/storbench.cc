@@ -0,0 +1,632 @@
+// Storage benchmark
+//
+// Drives read_async/write_async of storage devices directly, with a
+// configurable pattern, block size, queue depth, read/write mix and set
+// of CPUs, then reports IOPS, bandwidth and latency percentiles for each
+// device. Options are key=value module parameters, or the same options
+// prefixed with "storbench." on the boot command line, for example
+//
+//   storbench.dev=0 storbench.rw=randread storbench.bs=4k
+//   storbench.iodepth=32 storbench.cpus=0-3 storbench.runtime=10
+//
+// When the module is loaded without parameters and the command line has
+// no storbench options, it does nothing.
+//
+// Options:
+//   dev=N|all       device index, default all, devices run one at a time
+//   rw=PATTERN      read, write, randread, randwrite, rw or randrw
+//   bs=SIZE         bytes per request, k, m and g suffixes, default 4k
+//   iodepth=N       requests in flight per CPU, default 16
+//   rwmixread=N     percentage of reads for rw and randrw, default 50
+//   cpus=LIST       CPUs issuing requests, like 0-3,6, default 0
+//   runtime=N       seconds, default 10
+//   size=SIZE       bytes at the start of the device to use, default all
+//   allow_write=1   required for patterns that write, destroys contents
+
+#include "kmodule.h"
+#include "dev_storage.h"
+#include "bootinfo.h"
+#include "printk.h"
+#include "thread.h"
+#include "time.h"
+#include "mm.h"
+#include "rand.h"
+#include "string.h"
+#include "vector.h"
+#include "cxxstring.h"
+#include "mutex.h"
+#include "inttypes.h"
+#include "engunit.h"
+#include "log_histogram.h"
+
+#define STORBENCH_MAX_IODEPTH   1024
+#define STORBENCH_MAX_BS        (size_t(16) << 20)
+
+__BEGIN_ANONYMOUS
+
+struct storbench_opts_t {
+    ext::string pattern = "randread";
+    int dev = -1;
+    bool random = true;
+    unsigned read_pct = 100;
+    size_t block_size = 4096;
+    unsigned iodepth = 16;
+    unsigned runtime = 10;
+    uint64_t size = 0;
+    bool allow_write = false;
+    ext::vector<unsigned> cpus;
+
+    // rwmixread was given, rw and randrw keep it
+    bool mix_given = false;
+};
+
+struct storbench_job_t;
+
+struct storbench_slot_t {
+    storbench_job_t *job;
+    iocp_t iocp;
+    char *buf;
+    uint64_t start_time;
+    uint64_t end_time;
+    errno_t err;
+    bool write;
+};
+
+struct storbench_job_t {
+    using lock_type = ext::irq_spinlock;
+    using scoped_lock = ext::unique_lock<lock_type>;
+
+    ~storbench_job_t();
+
+    bool init(storbench_opts_t const *opts, storage_dev_base_t *dev,
+              uint64_t span_blocks, unsigned cpu, unsigned index,
+              unsigned job_count);
+
+    static intptr_t worker(void *arg);
+    intptr_t worker();
+
+    static void completion(dgos::err_sz_pair_t const& result, uintptr_t arg);
+
+    errno_t issue(storbench_slot_t *slot);
+
+    storbench_opts_t const *opts = nullptr;
+    storage_dev_base_t *dev = nullptr;
+    unsigned cpu = 0;
+    thread_t tid = -1;
+
+    uint64_t blocks_per_io = 0;
+    uint64_t io_count = 0;
+    uint64_t next_io = 0;
+    rand_lfs113_t rng;
+
+    storbench_slot_t *slots = nullptr;
+    unsigned slot_count = 0;
+
+    // Completed slots, filled by the completion callback
+    lock_type lock;
+    ext::condition_variable done_cond;
+    storbench_slot_t **done = nullptr;
+    unsigned done_count = 0;
+
+    // Worker's copy of done
+    storbench_slot_t **completed = nullptr;
+
+    // Results
+    log_histogram_t<> read_lat;
+    log_histogram_t<> write_lat;
+    uint64_t read_bytes = 0;
+    uint64_t write_bytes = 0;
+    uint64_t error_count = 0;
+    errno_t first_err = errno_t::OK;
+    uint64_t elapsed_ns = 0;
+};
+
+static bool storbench_parse_cpus(ext::vector<unsigned> &cpus,
+                                 char const *text)
+{
+    size_t cpu_count = thread_get_cpu_count();
+
+    cpus.clear();
+
+    for (char const *p = text; *p; ) {
+        bool ok = true;
+        uint64_t st = bootinfo_scan_uint(&p, &ok);
+        uint64_t en = st;
+
+        if (*p == '-') {
+            ++p;
+            en = bootinfo_scan_uint(&p, &ok);
+        }
+
+        if (*p == ',')
+            ++p;
+        else if (*p)
+            return false;
+
+        if (!ok || en < st || en >= cpu_count)
+            return false;
+
+        for (unsigned cpu = st; cpu <= en; ++cpu) {
+            if (unlikely(!cpus.push_back(cpu)))
+                return false;
+        }
+    }
+
+    return !cpus.empty();
+}
+
+static bootopt_result_t storbench_parse_option(
+        void *arg, char const *key, char const *value)
+{
+    storbench_opts_t &opts = *(storbench_opts_t*)arg;
+    bool ok = true;
+
+    if (!strcmp(key, "dev")) {
+        if (!strcmp(value, "all")) {
+            opts.dev = -1;
+        } else {
+            uint64_t dev = bootinfo_parse_uint(value, &ok);
+            ok = ok && dev <= INT_MAX;
+            opts.dev = int(dev);
+        }
+    } else if (!strcmp(key, "rw")) {
+        opts.pattern = value;
+    } else if (!strcmp(key, "bs")) {
+        opts.block_size = bootinfo_parse_size(value, &ok);
+        ok = ok && opts.block_size && opts.block_size <= STORBENCH_MAX_BS;
+    } else if (!strcmp(key, "iodepth")) {
+        uint64_t iodepth = bootinfo_parse_uint(value, &ok);
+        ok = ok && iodepth && iodepth <= STORBENCH_MAX_IODEPTH;
+        opts.iodepth = unsigned(iodepth);
+    } else if (!strcmp(key, "rwmixread")) {
+        uint64_t read_pct = bootinfo_parse_uint(value, &ok);
+        ok = ok && read_pct <= 100;
+        opts.read_pct = unsigned(read_pct);
+        opts.mix_given = true;
+    } else if (!strcmp(key, "cpus")) {
+        ok = storbench_parse_cpus(opts.cpus, value);
+    } else if (!strcmp(key, "runtime")) {
+        uint64_t runtime = bootinfo_parse_uint(value, &ok);
+        ok = ok && runtime && runtime <= UINT_MAX;
+        opts.runtime = unsigned(runtime);
+    } else if (!strcmp(key, "size")) {
+        opts.size = bootinfo_parse_size(value, &ok);
+    } else if (!strcmp(key, "allow_write")) {
+        opts.allow_write = bootinfo_parse_uint(value, &ok) != 0;
+    } else {
+        return bootopt_result_t::unknown;
+    }
+
+    return ok ? bootopt_result_t::ok : bootopt_result_t::invalid;
+}
+
+// Apply the rw pattern, after every option is known
+static bool storbench_parse_pattern(storbench_opts_t &opts)
+{
+    char const *pattern = opts.pattern.c_str();
+
+    opts.random = !strncmp(pattern, "rand", 4);
+
+    if (opts.random)
+        pattern += 4;
+
+    if (!strcmp(pattern, "read")) {
+        opts.read_pct = 100;
+    } else if (!strcmp(pattern, "write")) {
+        opts.read_pct = 0;
+    } else if (!strcmp(pattern, "rw")) {
+        if (!opts.mix_given)
+            opts.read_pct = 50;
+    } else {
+        printdbg("storbench: unknown pattern %s\n", opts.pattern.c_str());
+        return false;
+    }
+
+    if (opts.read_pct < 100 && !opts.allow_write) {
+        printdbg("storbench: pattern %s writes,"
+                 " destroying device contents, needs allow_write=1\n",
+                 opts.pattern.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+storbench_job_t::~storbench_job_t()
+{
+    for (unsigned i = 0; slots && i < slot_count; ++i) {
+        if (slots[i].buf)
+            munmap(slots[i].buf, opts->block_size);
+    }
+
+    delete[] slots;
+    delete[] done;
+    delete[] completed;
+}
+
+bool storbench_job_t::init(storbench_opts_t const *opts,
+                           storage_dev_base_t *dev, uint64_t span_blocks,
+                           unsigned cpu, unsigned index, unsigned job_count)
+{
+    this->opts = opts;
+    this->dev = dev;
+    this->cpu = cpu;
+
+    long log2_sector_size = dev->info(STORAGE_INFO_BLOCKSIZE_LOG2);
+
+    blocks_per_io = opts->block_size >> log2_sector_size;
+    io_count = span_blocks / blocks_per_io;
+
+    // Sequential jobs sharing a device start evenly spaced through it
+    next_io = io_count * index / job_count;
+
+    // Same sequence every run
+    rng.seed(index + 1);
+
+    slots = new (ext::nothrow) storbench_slot_t[opts->iodepth]();
+    done = new (ext::nothrow) storbench_slot_t*[opts->iodepth];
+    completed = new (ext::nothrow) storbench_slot_t*[opts->iodepth];
+
+    if (unlikely(!slots || !done || !completed))
+        return false;
+
+    slot_count = opts->iodepth;
+
+    for (unsigned i = 0; i < slot_count; ++i) {
+        storbench_slot_t &slot = slots[i];
+
+        slot.job = this;
+        slot.iocp.reset(&storbench_job_t::completion, uintptr_t(&slot));
+        slot.buf = (char*)mmap(nullptr, opts->block_size,
+                               PROT_READ | PROT_WRITE, MAP_POPULATE);
+
+        if (unlikely(slot.buf == MAP_FAILED)) {
+            slot.buf = nullptr;
+            return false;
+        }
+
+        memset(slot.buf, int(0xA5 ^ i), opts->block_size);
+    }
+
+    return true;
+}
+
+void storbench_job_t::completion(
+        dgos::err_sz_pair_t const& result, uintptr_t arg)
+{
+    storbench_slot_t *slot = (storbench_slot_t*)arg;
+    storbench_job_t *job = slot->job;
+
+    slot->end_time = time_ns();
+    slot->err = result.first;
+
+    scoped_lock hold(job->lock);
+    job->done[job->done_count++] = slot;
+    job->done_cond.notify_one();
+}
+
+errno_t storbench_job_t::issue(storbench_slot_t *slot)
+{
+    uint64_t io;
+
+    if (opts->random) {
+        uint64_t r = (uint64_t(rng.lfsr113_rand()) << 32) |
+                rng.lfsr113_rand();
+        io = r % io_count;
+    } else {
+        io = next_io;
+
+        if (++next_io == io_count)
+            next_io = 0;
+    }
+
+    slot->write = opts->read_pct < 100 &&
+            (opts->read_pct == 0 || rng.lfsr113_rand() % 100 >=
+             opts->read_pct);
+
+    slot->iocp.reset(&storbench_job_t::completion, uintptr_t(slot));
+    slot->start_time = time_ns();
+
+    uint64_t lba = io * blocks_per_io;
+
+    if (slot->write) {
+        return dev->write_async(slot->buf, blocks_per_io, lba,
+                                false, &slot->iocp);
+    }
+
+    return dev->read_async(slot->buf, blocks_per_io, lba, &slot->iocp);
+}
+
+intptr_t storbench_job_t::worker(void *arg)
+{
+    return ((storbench_job_t*)arg)->worker();
+}
+
+intptr_t storbench_job_t::worker()
+{
+    uint64_t start_time = time_ns();
+    uint64_t deadline = start_time + opts->runtime * UINT64_C(1000000000);
+    uint64_t last_time = start_time;
+    unsigned in_flight = 0;
+    bool stopping = false;
+
+    for (unsigned i = 0; i < slot_count; ++i) {
+        errno_t err = issue(&slots[i]);
+
+        if (unlikely(err != errno_t::OK)) {
+            ++error_count;
+            first_err = err;
+            stopping = true;
+            break;
+        }
+
+        ++in_flight;
+    }
+
+    while (in_flight) {
+        unsigned count;
+
+        scoped_lock hold(lock);
+
+        while (!done_count)
+            done_cond.wait(hold);
+
+        count = done_count;
+        memcpy(completed, done, count * sizeof(*completed));
+        done_count = 0;
+
+        hold.unlock();
+
+        for (unsigned i = 0; i < count; ++i) {
+            storbench_slot_t *slot = completed[i];
+
+            --in_flight;
+
+            if (last_time < slot->end_time)
+                last_time = slot->end_time;
+
+            if (unlikely(slot->err != errno_t::OK)) {
+                if (!error_count++)
+                    first_err = slot->err;
+                stopping = true;
+                continue;
+            }
+
+            uint64_t latency = slot->end_time - slot->start_time;
+
+            if (slot->write) {
+                write_lat.record(latency);
+                write_bytes += opts->block_size;
+            } else {
+                read_lat.record(latency);
+                read_bytes += opts->block_size;
+            }
+
+            if (stopping || slot->end_time >= deadline) {
+                stopping = true;
+                continue;
+            }
+
+            errno_t err = issue(slot);
+
+            if (unlikely(err != errno_t::OK)) {
+                if (!error_count++)
+                    first_err = err;
+                stopping = true;
+                continue;
+            }
+
+            ++in_flight;
+        }
+    }
+
+    elapsed_ns = last_time - start_time;
+
+    return 0;
+}
+
+static void storbench_report(char const *direction,
+                             log_histogram_t<> const& lat,
+                             uint64_t bytes, uint64_t elapsed_us)
+{
+    if (!lat.count())
+        return;
+
+    uint64_t iops = lat.count() * UINT64_C(1000000) / elapsed_us;
+    uint64_t bw = bytes * UINT64_C(1000000) / elapsed_us;
+
+    printdbg("  %s: IOPS=%s BW=%siB/s ios=%" PRIu64 "\n",
+             direction,
+             engineering_t<uint64_t>(iops).ptr(),
+             engineering_t<uint64_t>(bw, 0, true).ptr(),
+             lat.count());
+
+    printdbg("    lat: min=%ss mean=%ss max=%ss\n",
+             engineering_t<uint64_t>(lat.min(), -3).ptr(),
+             engineering_t<uint64_t>(lat.mean(), -3).ptr(),
+             engineering_t<uint64_t>(lat.max(), -3).ptr());
+
+    printdbg("    lat: p50=%ss p99=%ss p99.9=%ss\n",
+             engineering_t<uint64_t>(lat.percentile(50, 100), -3).ptr(),
+             engineering_t<uint64_t>(lat.percentile(99, 100), -3).ptr(),
+             engineering_t<uint64_t>(lat.percentile(999, 1000), -3).ptr());
+}
+
+static void storbench_run_dev(storbench_opts_t const& opts, int dev_index)
+{
+    storage_dev_base_t *dev = storage_dev_open(dev_index);
+
+    if (unlikely(!dev)) {
+        printdbg("storbench: no device %d\n", dev_index);
+        return;
+    }
+
+    char const *name = (char const *)dev->info(STORAGE_INFO_NAME);
+    long log2_sector_size = dev->info(STORAGE_INFO_BLOCKSIZE_LOG2);
+    uint64_t block_count = uint64_t(dev->info(STORAGE_INFO_BLOCKCOUNT));
+    uint64_t span_blocks = opts.size >> log2_sector_size;
+
+    if (!span_blocks || (block_count && span_blocks > block_count))
+        span_blocks = block_count;
+
+    if (opts.block_size & ((size_t(1) << log2_sector_size) - 1)) {
+        printdbg("storbench: dev %d (%s) bs=%zu is not a multiple"
+                 " of the %zu byte sector size\n",
+                 dev_index, name, opts.block_size,
+                 size_t(1) << log2_sector_size);
+        storage_dev_close(dev);
+        return;
+    }
+
+    if ((span_blocks << log2_sector_size) < opts.block_size) {
+        printdbg("storbench: dev %d (%s) size unknown or too small,"
+                 " use size=\n", dev_index, name);
+        storage_dev_close(dev);
+        return;
+    }
+
+    size_t job_count = opts.cpus.size();
+    ext::vector<storbench_job_t*> jobs;
+
+    if (unlikely(!jobs.reserve(job_count))) {
+        storage_dev_close(dev);
+        return;
+    }
+
+    for (size_t i = 0; i < job_count; ++i) {
+        storbench_job_t *job = new (ext::nothrow) storbench_job_t();
+
+        if (unlikely(!job || !jobs.push_back(job))) {
+            delete job;
+            job_count = 0;
+            break;
+        }
+
+        if (unlikely(!job->init(&opts, dev, span_blocks, opts.cpus[i],
+                                i, job_count))) {
+            job_count = 0;
+            break;
+        }
+    }
+
+    if (unlikely(!job_count))
+        printdbg("storbench: out of memory\n");
+
+    for (size_t i = 0; i < job_count; ++i) {
+        storbench_job_t *job = jobs[i];
+
+        job->tid = thread_create(nullptr, &storbench_job_t::worker, job,
+                                 "storbench", 0, false, false,
+                                 thread_cpu_mask_t(job->cpu));
+    }
+
+    log_histogram_t<> read_lat;
+    log_histogram_t<> write_lat;
+    uint64_t read_bytes = 0;
+    uint64_t write_bytes = 0;
+    uint64_t error_count = 0;
+    uint64_t elapsed_ns = 0;
+    errno_t first_err = errno_t::OK;
+
+    for (size_t i = 0; i < job_count; ++i) {
+        storbench_job_t *job = jobs[i];
+
+        thread_wait(job->tid);
+        thread_close(job->tid);
+
+        read_lat.merge(job->read_lat);
+        write_lat.merge(job->write_lat);
+        read_bytes += job->read_bytes;
+        write_bytes += job->write_bytes;
+
+        if (job->error_count && !error_count)
+            first_err = job->first_err;
+
+        error_count += job->error_count;
+
+        if (elapsed_ns < job->elapsed_ns)
+            elapsed_ns = job->elapsed_ns;
+    }
+
+    for (storbench_job_t *job : jobs)
+        delete job;
+
+    storage_dev_close(dev);
+
+    if (!job_count)
+        return;
+
+    uint64_t elapsed_us = elapsed_ns / 1000;
+
+    if (!elapsed_us)
+        elapsed_us = 1;
+
+    printdbg("storbench: dev %d (%s) rw=%s bs=%zu iodepth=%u"
+             " jobs=%zu size=%siB time=%" PRIu64 "ms\n",
+             dev_index, name, opts.pattern.c_str(), opts.block_size,
+             opts.iodepth,
+             job_count,
+             engineering_t<uint64_t>(span_blocks << log2_sector_size,
+                                     0, true).ptr(),
+             elapsed_us / 1000);
+
+    storbench_report("read", read_lat, read_bytes, elapsed_us);
+    storbench_report("write", write_lat, write_bytes, elapsed_us);
+
+    if (error_count) {
+        printdbg("  errors=%" PRIu64 ", first error %d\n",
+                 error_count, int(first_err));
+    }
+}
+
+static intptr_t storbench_thread(void *arg)
+{
+    storbench_opts_t *opts = (storbench_opts_t*)arg;
+
+    if (opts->dev >= 0) {
+        storbench_run_dev(*opts, opts->dev);
+    } else {
+        int dev_count = int(storage_dev_count());
+
+        for (int i = 0; i < dev_count; ++i)
+            storbench_run_dev(*opts, i);
+    }
+
+    delete opts;
+
+    return 0;
+}
+
+__END_ANONYMOUS
+
+int module_main(int argc, char const * const * argv)
+{
+    storbench_opts_t *opts = new (ext::nothrow) storbench_opts_t();
+
+    if (unlikely(!opts))
+        return 0;
+
+    int option_count = bootinfo_parse_options(
+                "storbench", argc, argv, storbench_parse_option, opts);
+
+    bool ok = option_count > 0;
+
+    ok = ok && storbench_parse_pattern(*opts);
+
+    if (ok && opts->cpus.empty())
+        ok = opts->cpus.push_back(0);
+
+    // Nothing to do, or a mistake in the options, which is reported,
+    // not fatal to the loader
+    if (!ok) {
+        delete opts;
+        return 0;
+    }
+
+    thread_t tid = thread_create(nullptr, storbench_thread, opts,
+                                 "storbench", 0, false, false);
+
+    thread_close(tid);
+
+    return 0;
+}
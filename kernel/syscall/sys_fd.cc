@@ -274,6 +274,24 @@ int sys_readdir_r(int fd, dirent_t *buf)
     return sizeof(*buf);
 }
 
+ssize_t sys_getdents64(int fd, void *buf, size_t size)
+{
+    if (unlikely(!mm_is_user_range(buf, size)))
+        return fault_err();
+
+    int id = id_from_fd(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    ssize_t status = file_getdents(id, buf, size);
+
+    if (likely(status >= 0))
+        return status;
+
+    return err(status);
+}
+
 int sys_closedir(int fd)
 {
     int id = id_from_fd(fd);
@@ -690,11 +708,24 @@ int sys_listxattrat(int dirfd, char const *path,
     return nosys_err();
 }
 
-int sys_accessat(int dirfd, char const *path,
+int sys_accessat(int dirfd, char const *pathname,
                  int mask)
 {
-    // FIXME: implement me
-    return nosys_err();
+    user_str_t path(pathname);
+
+    if (unlikely(!path))
+        return path.err_int();
+
+    process_t *p = fast_cur_process();
+
+    int dirid = p->dirfd_to_id(dirfd);
+
+    int status = file_accessat(dirid, path, mask);
+
+    if (likely(status >= 0))
+        return status;
+
+    return err(status);
 }
 
 int sys_readlinkat(int dirfd, char const *path,
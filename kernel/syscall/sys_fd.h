@@ -31,6 +31,7 @@ ssize_t sys_pread64(int fd, void *bufaddr,
 ssize_t sys_pwrite64(int fd, void const *bufaddr,
                      size_t count, off_t ofs);
 int sys_readdir_r(int fd, dirent_t *buf);
+ssize_t sys_getdents64(int fd, void *buf, size_t size);
 int sys_opendirat(int dirfd, char const *pathname);
 int sys_closedir(int fd);
 int sys_fsync(int fd);
@@ -1,6 +1,7 @@
 #include "sys_mem.h"
 #include "mm.h"
 #include "thread.h"
+#include "process.h"
 
 static bool validate_user_mmop(
         void const *addr, size_t len, int prot, int flags)
@@ -24,7 +25,17 @@ void *sys_mmap(void *addr, size_t len, int prot,
     if (unlikely(!validate_user_mmop(addr, len, prot, flags)))
         return (void*)errno_t::EINVAL;
 
-    void *result = mmap(addr, len, prot, flags | MAP_USER, fd, offset);
+    // The kernel mmap takes a file id, not a descriptor
+    int id = -1;
+
+    if (!(flags & MAP_ANONYMOUS) && fd >= 0) {
+        id = fast_cur_process()->fd_to_id(fd);
+
+        if (unlikely(id < 0))
+            return (void*)errno_t::EBADF;
+    }
+
+    void *result = mmap(addr, len, prot, flags | MAP_USER, id, offset);
 
     if (likely(result != MAP_FAILED))
         return result;
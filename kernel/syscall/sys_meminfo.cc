@@ -0,0 +1,99 @@
+#include "sys_meminfo.h"
+#include "errno.h"
+#include "mm.h"
+#include "heap.h"
+#include "stdlib.h"
+#include "pipe.h"
+#include "zswap.h"
+#include "filemap.h"
+#include "process.h"
+#include "vector.h"
+#include "user_mem.h"
+#include "cpu/thread_impl.h"
+
+C_ASSERT(MEMINFO_HEAP_BUCKETS == HEAP_STATS_BUCKETS);
+
+int sys_meminfo(pid_t pid, meminfo_t *info,
+                meminfo_heap_t *heaps, size_t heap_count)
+{
+    if (unlikely(!mm_is_user_range(info, sizeof(*info))))
+        return -int(errno_t::EFAULT);
+
+    if (unlikely(heap_count > (SIZE_MAX / sizeof(*heaps)) ||
+                 (heap_count &&
+                  !mm_is_user_range(heaps, sizeof(*heaps) * heap_count))))
+        return -int(errno_t::EFAULT);
+
+    meminfo_t result{};
+
+    mm_process_usage_t usage;
+
+    // Zero and negative pids mean the caller
+    int status = process_t::get_mem_usage(pid > 0 ? pid : -1, &usage);
+
+    if (unlikely(status < 0))
+        return status;
+
+    result.resident_pages = usage.resident_pages;
+    result.committed_pages = usage.committed_pages;
+    result.swapped_pages = usage.swapped_pages;
+
+    result.total_pages = mm_get_phys_mem_size() >> PAGE_SCALE;
+    result.free_pages = mm_get_free_page_count();
+    result.page_table_pages = mm_get_page_table_count();
+    result.device_cache_pages = mm_get_device_cache_pages();
+    result.filemap_cache_pages = filemap_cache_pages();
+    result.thread_stack_bytes = thread_stack_usage();
+
+    pipe_get_usage(&result.pipe_reserved_bytes,
+                   &result.pipe_committed_bytes);
+
+    zswap_stats_t swap_stats;
+    zswap_get_stats(&swap_stats);
+    result.swap_stored_pages = swap_stats.stored_pages;
+    result.swap_compressed_bytes = swap_stats.compressed_bytes;
+
+    ext::vector<heap_stats_t> stats;
+
+    size_t count = malloc_get_stats(nullptr, 0);
+
+    if (unlikely(!stats.resize(count)))
+        return -int(errno_t::ENOMEM);
+
+    // More heaps may have been created since it was counted
+    count = ext::min(count, malloc_get_stats(stats.data(), count));
+
+    for (size_t i = 0; i < count; ++i) {
+        heap_stats_t const& heap = stats[i];
+
+        meminfo_heap_t item{};
+
+        item.arena_size = heap.arena_size;
+        item.reserve_count = heap.reserve_count;
+        item.large_count = heap.large_count;
+        item.large_bytes = heap.large_bytes;
+
+        for (size_t b = 0; b < HEAP_STATS_BUCKETS; ++b) {
+            heap_bucket_stats_t const& bucket = heap.buckets[b];
+
+            item.buckets[b].slot_size = bucket.slot_size;
+            item.buckets[b].arena_count = bucket.arena_count;
+            item.buckets[b].used_count = bucket.used_count;
+
+            result.heap_arena_bytes += bucket.arena_count * heap.arena_size;
+            result.heap_used_bytes += bucket.used_count * bucket.slot_size;
+        }
+
+        result.heap_arena_bytes += heap.reserve_count * heap.arena_size;
+        result.heap_large_bytes += heap.large_bytes;
+
+        if (i < heap_count &&
+                unlikely(!mm_copy_user(heaps + i, &item, sizeof(item))))
+            return -int(errno_t::EFAULT);
+    }
+
+    if (unlikely(!mm_copy_user(info, &result, sizeof(result))))
+        return -int(errno_t::EFAULT);
+
+    return int(count);
+}
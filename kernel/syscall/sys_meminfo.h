@@ -0,0 +1,59 @@
+#pragma once
+#include "types.h"
+
+#define MEMINFO_HEAP_BUCKETS    12
+
+struct meminfo_bucket_t {
+    // Size of each slot, including the block header
+    uint64_t slot_size;
+
+    // Arenas carved into slots of this size
+    uint64_t arena_count;
+
+    // Slots currently allocated
+    uint64_t used_count;
+};
+
+// One per-cpu kernel heap
+struct meminfo_heap_t {
+    // Size of each arena
+    uint64_t arena_size;
+
+    // Arenas held in reserve, not carved up yet
+    uint64_t reserve_count;
+
+    // Allocations too large for a bucket, mapped directly
+    uint64_t large_count;
+    uint64_t large_bytes;
+
+    meminfo_bucket_t buckets[MEMINFO_HEAP_BUCKETS];
+};
+
+struct meminfo_t {
+    // Physical memory
+    uint64_t total_pages;
+    uint64_t free_pages;
+
+    // Kernel memory, by subsystem
+    uint64_t page_table_pages;
+    uint64_t device_cache_pages;
+    uint64_t filemap_cache_pages;
+    uint64_t heap_arena_bytes;
+    uint64_t heap_used_bytes;
+    uint64_t heap_large_bytes;
+    uint64_t thread_stack_bytes;
+    uint64_t pipe_reserved_bytes;
+    uint64_t pipe_committed_bytes;
+    uint64_t swap_stored_pages;
+    uint64_t swap_compressed_bytes;
+
+    // The process selected by pid
+    uint64_t resident_pages;
+    uint64_t committed_pages;
+    uint64_t swapped_pages;
+
+    uint64_t reserved[8];
+};
+
+int sys_meminfo(pid_t pid, meminfo_t *info,
+                meminfo_heap_t *heaps, size_t heap_count);
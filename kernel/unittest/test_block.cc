@@ -0,0 +1,643 @@
+#include "unittest.h"
+#include "blk_queue.h"
+#include "bcache.h"
+#include "dev_storage.h"
+#include "string.h"
+#include "mm.h"
+#include "log_histogram.h"
+
+__BEGIN_ANONYMOUS
+
+// Storage device backed by a small array, completing every request
+// before returning
+class test_ram_dev_t final : public storage_dev_base_t {
+public:
+    static constexpr size_t sector_count = 64;
+
+    STORAGE_DEV_IMPL
+
+    errno_t submit_plan(disk_io_plan_t *plan) override final
+    {
+        ++plan_count;
+        last_plan_count = plan->count;
+        last_plan_sectors = plan->count ? plan->vec[0].count : 0;
+
+        // Polled requests are held until the waiter polls
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < plan->count; ++i) {
+            if (plan->vec[i].hipri && polled_count < countof(polled))
+                polled[polled_count++] = plan->vec[i];
+            else
+                plan->vec[kept++] = plan->vec[i];
+        }
+        plan->count = kept;
+
+        return storage_dev_base_t::submit_plan(plan);
+    }
+
+    bool poll_completions() override final
+    {
+        ++poll_count;
+
+        // Complete them on the second poll, so the waiter has to retry
+        if (!polled_count || ++polls_pending < 2)
+            return false;
+
+        polls_pending = 0;
+
+        for (size_t i = 0; i < polled_count; ++i) {
+            disk_vec_t &item = polled[i];
+            errno_t err = io(item.data, item.count, item.lba,
+                             item.write, item.iocp);
+            if (unlikely(err != errno_t::OK)) {
+                item.iocp->set_result({ err, 0 });
+                item.iocp->set_expect(1);
+                item.iocp->invoke();
+            }
+        }
+
+        polled_count = 0;
+
+        return true;
+    }
+
+    errno_t io(void *data, int64_t count, uint64_t lba,
+               bool write, iocp_t *iocp)
+    {
+        if (lba + count > sector_count)
+            return errno_t::EINVAL;
+
+        if (write)
+            memcpy(sectors[lba], data, count << 9);
+        else
+            memcpy(data, sectors[lba], count << 9);
+
+        iocp->set_result({ errno_t::OK, size_t(count) << 9 });
+        iocp->set_expect(1);
+        iocp->invoke();
+
+        return errno_t::OK;
+    }
+
+    size_t plan_count = 0;
+    size_t last_plan_count = 0;
+    size_t last_plan_sectors = 0;
+
+    disk_vec_t polled[4];
+    size_t polled_count = 0;
+    size_t poll_count = 0;
+    size_t polls_pending = 0;
+
+    char sectors[sector_count][512];
+};
+
+void test_ram_dev_t::cleanup_dev()
+{
+}
+
+errno_t test_ram_dev_t::read_async(
+        void *data, int64_t count, uint64_t lba, iocp_t *iocp)
+{
+    return io(data, count, lba, false, iocp);
+}
+
+errno_t test_ram_dev_t::write_async(
+        void const *data, int64_t count, uint64_t lba, bool, iocp_t *iocp)
+{
+    return io(const_cast<void*>(data), count, lba, true, iocp);
+}
+
+errno_t test_ram_dev_t::flush_async(iocp_t *)
+{
+    return errno_t::ENOSYS;
+}
+
+errno_t test_ram_dev_t::trim_async(int64_t, uint64_t, iocp_t *)
+{
+    return errno_t::ENOSYS;
+}
+
+errno_t test_ram_dev_t::cancel_io(iocp_t *)
+{
+    return errno_t::ENOSYS;
+}
+
+long test_ram_dev_t::info(storage_dev_info_t key)
+{
+    switch (key) {
+    case STORAGE_INFO_BLOCKSIZE:
+        return 512;
+
+    case STORAGE_INFO_BLOCKSIZE_LOG2:
+        return 9;
+
+    case STORAGE_INFO_NAME:
+        return long("TESTRAM");
+
+    case STORAGE_INFO_BLOCKCOUNT:
+        return sector_count;
+
+    case STORAGE_INFO_HAVE_POLL:
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+// The queue outlives every test, so the device must too
+test_ram_dev_t *test_ram_dev()
+{
+    static test_ram_dev_t *dev = new (ext::nothrow) test_ram_dev_t();
+    return dev;
+}
+
+UNITTEST(test_disk_io_plan_coalesce)
+{
+    disk_io_plan_t plan(9);
+    iocp_t iocp;
+    char buf[2048];
+
+    // Contiguous on disk and in memory with the same iocp
+    eq(true, plan.add(buf, 10, 1, false, false, &iocp));
+    eq(true, plan.add(buf + 512, 11, 2, false, false, &iocp));
+    eq(uint32_t(1), plan.count);
+    eq(uint32_t(3), plan.vec[0].count);
+
+    // Contiguous on disk only
+    eq(true, plan.add(buf, 13, 1, false, false, &iocp));
+    eq(uint32_t(2), plan.count);
+
+    // Other direction
+    eq(true, plan.add(buf + 512, 14, 1, true, false, &iocp));
+    eq(uint32_t(3), plan.count);
+
+    plan.clear();
+    eq(uint32_t(0), plan.count);
+}
+
+UNITTEST(test_blk_queue_roundtrip)
+{
+    test_ram_dev_t *dev = test_ram_dev();
+    char buf[4 << 9];
+
+    for (size_t i = 0; i < sizeof(buf); ++i)
+        buf[i] = char(i * 7);
+
+    eq(int(sizeof(buf)), dev->write_blocks(buf, 4, 8, false));
+
+    memset(buf, 0, sizeof(buf));
+
+    eq(int(sizeof(buf)), dev->read_blocks(buf, 4, 8));
+
+    for (size_t i = 0; i < sizeof(buf); ++i)
+        eq(char(i * 7), buf[i]);
+
+    // Out of range requests fail through the iocp
+    lt(dev->read_blocks(buf, 4, test_ram_dev_t::sector_count), 0);
+}
+
+UNITTEST(test_blk_queue_plug_merge)
+{
+    test_ram_dev_t *dev = test_ram_dev();
+    char buf[4 << 9];
+
+    for (size_t i = 0; i < test_ram_dev_t::sector_count; ++i)
+        memset(dev->sectors[i], int(i), 512);
+
+    blk_queue_stats_t before;
+    blk_get_stats(dev, &before);
+
+    size_t plans_before = dev->plan_count;
+
+    blocking_iocp_t iocp[4];
+
+    {
+        blk_plug_t plug;
+
+        // Out of order, with a gap filled last
+        eq(int(errno_t::OK), int(blk_read_async(
+                                     dev, buf + (1 << 9), 1, 21, &iocp[1])));
+        eq(int(errno_t::OK), int(blk_read_async(
+                                     dev, buf + (3 << 9), 1, 23, &iocp[3])));
+        eq(int(errno_t::OK), int(blk_read_async(
+                                     dev, buf + (0 << 9), 1, 20, &iocp[0])));
+        eq(int(errno_t::OK), int(blk_read_async(
+                                     dev, buf + (2 << 9), 1, 22, &iocp[2])));
+
+        // Nothing reaches the driver while plugged
+        eq(plans_before, dev->plan_count);
+    }
+
+    for (size_t i = 0; i < 4; ++i) {
+        auto result = iocp[i].wait();
+        eq(int(errno_t::OK), int(result.first));
+        eq(size_t(512), result.second);
+    }
+
+    // One plan with one command covering all four
+    eq(plans_before + 1, dev->plan_count);
+    eq(size_t(1), dev->last_plan_count);
+    eq(size_t(4), dev->last_plan_sectors);
+
+    for (size_t i = 0; i < sizeof(buf); ++i)
+        eq(char(20 + (i >> 9)), buf[i]);
+
+    blk_queue_stats_t after;
+    blk_get_stats(dev, &after);
+    eq(before.request_count + 4, after.request_count);
+    eq(before.merge_count + 3, after.merge_count);
+    eq(before.dispatch_count + 1, after.dispatch_count);
+    eq(before.batch_count + 1, after.batch_count);
+    eq(uint64_t(0), after.depth);
+    le(uint64_t(1), after.max_depth);
+}
+
+UNITTEST(test_blk_queue_deferred_reads)
+{
+    test_ram_dev_t *dev = test_ram_dev();
+    char buf[3 << 9];
+
+    for (size_t i = 40; i < 43; ++i)
+        memset(dev->sectors[i], int(i), 512);
+
+    memset(buf, 0, sizeof(buf));
+
+    size_t plans_before = dev->plan_count;
+
+    {
+        blk_plug_t plug(true);
+
+        // Synchronous looking reads only start
+        eq(512, blk_read_blocks(dev, buf + (2 << 9), 1, 42));
+        eq(512, blk_read_blocks(dev, buf + (0 << 9), 1, 40));
+        eq(512, blk_read_blocks(dev, buf + (1 << 9), 1, 41));
+
+        eq(plans_before, dev->plan_count);
+        eq(0, buf[0]);
+
+        eq(int(errno_t::OK), int(plug.wait()));
+
+        // All of them went in one plan, merged into one command
+        eq(plans_before + 1, dev->plan_count);
+        eq(size_t(1), dev->last_plan_count);
+        eq(size_t(3), dev->last_plan_sectors);
+
+        for (size_t i = 0; i < sizeof(buf); ++i)
+            eq(char(40 + (i >> 9)), buf[i]);
+
+        // Errors are reported by wait
+        eq(512, blk_read_blocks(dev, buf, 1, 42));
+        eq(512, blk_read_blocks(dev, buf, 1, test_ram_dev_t::sector_count));
+        eq(int(errno_t::EINVAL), int(plug.wait()));
+    }
+
+    // Without a deferring plug it waits as usual
+    blk_plug_t plug;
+    memset(buf, 0, 512);
+    eq(512, blk_read_blocks(dev, buf, 1, 41));
+    eq(char(41), buf[0]);
+}
+
+UNITTEST(test_blk_queue_deferred_many)
+{
+    test_ram_dev_t *dev = test_ram_dev();
+    char buf[12 << 9];
+
+    for (size_t i = 0; i < 12; ++i)
+        memset(dev->sectors[48 + i], int(48 + i), 512);
+
+    size_t plans_before = dev->plan_count;
+
+    // The plug holds no slot per read, a long burst is still one batch
+    for (size_t pass = 0; pass < 2; ++pass) {
+        memset(buf, 0, sizeof(buf));
+
+        blk_plug_t plug(true);
+
+        for (size_t i = 12; i > 0; --i)
+            eq(512, blk_read_blocks(dev, buf + ((i - 1) << 9),
+                                    1, 48 + i - 1));
+
+        eq(int(errno_t::OK), int(plug.wait()));
+
+        eq(plans_before + pass + 1, dev->plan_count);
+        eq(size_t(1), dev->last_plan_count);
+        eq(size_t(12), dev->last_plan_sectors);
+
+        for (size_t i = 0; i < sizeof(buf); ++i)
+            eq(char(48 + (i >> 9)), buf[i]);
+    }
+}
+
+UNITTEST(test_blk_queue_hipri_poll)
+{
+    test_ram_dev_t *dev = test_ram_dev();
+    char buf[2 << 9];
+
+    memset(dev->sectors[30], 'p', 512 * 2);
+    memset(buf, 0, sizeof(buf));
+
+    size_t polls_before = dev->poll_count;
+
+    // Only completes when polled
+    eq(int(sizeof(buf)), dev->read_blocks(buf, 2, 30, BLK_REQ_HIPRI));
+    eq('p', buf[0]);
+    eq('p', buf[sizeof(buf) - 1]);
+    le(polls_before + 2, dev->poll_count);
+    eq(size_t(0), dev->polled_count);
+
+    // A polled request is not merged with a normal one
+    blocking_iocp_t iocp[2];
+    blk_queue_stats_t before;
+    blk_get_stats(dev, &before);
+
+    {
+        blk_plug_t plug;
+
+        eq(int(errno_t::OK), int(blk_read_async(
+                                     dev, buf, 1, 30, &iocp[0])));
+        eq(int(errno_t::OK), int(blk_read_async(
+                                     dev, buf + 512, 1, 31, &iocp[1],
+                                     BLK_REQ_HIPRI)));
+    }
+
+    eq(int(errno_t::OK), int(iocp[0].wait().first));
+
+    while (!iocp[1].wait_until(0))
+        dev->poll_completions();
+
+    eq(int(errno_t::OK), int(iocp[1].get_result().first));
+
+    blk_queue_stats_t after;
+    blk_get_stats(dev, &after);
+    eq(before.merge_count, after.merge_count);
+    eq(before.dispatch_count + 2, after.dispatch_count);
+}
+
+UNITTEST(test_storage_seg_physranges)
+{
+    storage_seg_t segs[] = {
+        { nullptr, 0x10000, 0x1000 },
+        // Continues the first
+        { nullptr, 0x11000, 0x1000 },
+        { nullptr, 0x20000, 0x3000 }
+    };
+
+    mmphysrange_t ranges[4];
+
+    // Merged, then split at max_range
+    eq(size_t(3), storage_seg_physranges(
+           ranges, countof(ranges), segs, countof(segs), 0, 0x5000, 0x2000));
+    eq(uintptr_t(0x10000), ranges[0].physaddr);
+    eq(size_t(0x2000), ranges[0].size);
+    eq(uintptr_t(0x20000), ranges[1].physaddr);
+    eq(size_t(0x2000), ranges[1].size);
+    eq(uintptr_t(0x22000), ranges[2].physaddr);
+    eq(size_t(0x1000), ranges[2].size);
+
+    // Starting part way in
+    eq(size_t(2), storage_seg_physranges(
+           ranges, countof(ranges), segs, countof(segs), 0x1800, 0x1000,
+           0x10000));
+    eq(uintptr_t(0x11800), ranges[0].physaddr);
+    eq(size_t(0x800), ranges[0].size);
+    eq(uintptr_t(0x20000), ranges[1].physaddr);
+    eq(size_t(0x800), ranges[1].size);
+
+    // Counting only, and running out of ranges
+    eq(size_t(3), storage_seg_physranges(
+           nullptr, 0, segs, countof(segs), 0, 0x5000, 0x2000));
+    eq(size_t(1), storage_seg_physranges(
+           ranges, 1, segs, countof(segs), 0, 0x5000, 0x2000));
+    eq(size_t(0x2000), ranges[0].size);
+}
+
+UNITTEST(test_storage_readv_fallback)
+{
+    test_ram_dev_t *dev = test_ram_dev();
+
+    for (size_t i = 0; i < 4; ++i)
+        memset(dev->sectors[50 + i], int('v' + i), 512);
+
+    char first[512];
+    char middle[1024];
+
+    // A physical segment is mapped for the duration
+    char *page = (char*)mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_POPULATE);
+    ne(MAP_FAILED, (void*)page);
+    memset(page, 0, PAGE_SIZE);
+
+    storage_seg_t segs[] = {
+        { first, 0, sizeof(first) },
+        { middle, 0, sizeof(middle) },
+        { nullptr, mphysaddr(page), 512 }
+    };
+
+    blocking_iocp_t iocp;
+    eq(int(errno_t::OK), int(dev->readv_async(
+                                 segs, countof(segs), 50, &iocp)));
+
+    auto result = iocp.wait();
+    eq(int(errno_t::OK), int(result.first));
+    eq(size_t(4 << 9), result.second);
+
+    eq('v', first[0]);
+    eq(char('v' + 1), middle[0]);
+    eq(char('v' + 2), middle[sizeof(middle) - 1]);
+    eq(char('v' + 3), page[0]);
+    eq(char('v' + 3), page[511]);
+    eq(char(0), page[512]);
+
+    // Write them back in the other order
+    storage_seg_t rev[] = { segs[2], segs[0] };
+
+    iocp.reset();
+    eq(int(errno_t::OK), int(dev->writev_async(
+                                 rev, countof(rev), 54, false, &iocp)));
+    eq(int(errno_t::OK), int(iocp.wait().first));
+
+    eq(char('v' + 3), dev->sectors[54][0]);
+    eq('v', dev->sectors[55][0]);
+
+    // Segments must be whole sectors
+    storage_seg_t bad = { first, 0, 100 };
+    eq(int(errno_t::EINVAL), int(dev->readv_async(&bad, 1, 50, &iocp)));
+
+    munmap(page, PAGE_SIZE);
+}
+
+UNITTEST(test_storage_direct_io)
+{
+    test_ram_dev_t *dev = test_ram_dev();
+
+    for (size_t i = 0; i < 8; ++i)
+        memset(dev->sectors[56 + i], int('d' + i), 512);
+
+    // Not populated, the pages have to be faulted in first, and the
+    // buffer straddles a page boundary
+    char *pages = (char*)mmap(nullptr, PAGE_SIZE * 2,
+                              PROT_READ | PROT_WRITE, 0);
+    ne(MAP_FAILED, (void*)pages);
+
+    char *buf = pages + PAGE_SIZE - 1024;
+
+    eq(0, storage_direct_io(dev, buf, 8, 56, false));
+    eq('d', buf[0]);
+    eq(char('d' + 2), buf[1024]);
+    eq(char('d' + 7), buf[(8 << 9) - 1]);
+
+    buf[0] = 'w';
+    buf[(8 << 9) - 1] = 'z';
+
+    eq(0, storage_direct_io(dev, buf, 8, 56, true));
+    eq('w', dev->sectors[56][0]);
+    eq(char('d' + 2), dev->sectors[58][0]);
+    eq('z', dev->sectors[63][511]);
+
+    // Sectors would straddle physical ranges
+    eq(-int(errno_t::EINVAL), storage_direct_io(dev, buf + 1, 1, 56, false));
+
+    munmap(pages, PAGE_SIZE * 2);
+}
+
+UNITTEST(test_log_histogram)
+{
+    using hist_t = log_histogram_t<>;
+
+    // Buckets are contiguous and each value is within its bucket
+    for (uint64_t v = 0; v < 4096; ++v) {
+        size_t bucket = hist_t::bucket_of(v);
+        le(hist_t::bucket_min(bucket), v);
+        le(v, hist_t::bucket_max(bucket));
+    }
+
+    eq(hist_t::bucket_count - 1, hist_t::bucket_of(~uint64_t(0)));
+    eq(~uint64_t(0), hist_t::bucket_max(hist_t::bucket_count - 1));
+
+    hist_t *hist = new (ext::nothrow) hist_t();
+    hist_t *other = new (ext::nothrow) hist_t();
+
+    // 1..1000 split across two histograms
+    for (uint64_t v = 1; v <= 1000; ++v)
+        (v & 1 ? hist : other)->record(v);
+
+    hist->merge(*other);
+
+    eq(uint64_t(1000), hist->count());
+    eq(uint64_t(1), hist->min());
+    eq(uint64_t(1000), hist->max());
+    eq(uint64_t(500), hist->mean());
+
+    // Reported bound is at most a quarter above the exact value
+    uint64_t p50 = hist->percentile(50, 100);
+    le(uint64_t(500), p50);
+    le(p50, uint64_t(625));
+
+    uint64_t p99 = hist->percentile(99, 100);
+    le(uint64_t(990), p99);
+    le(p99, uint64_t(1000));
+
+    eq(uint64_t(1000), hist->percentile(999, 1000));
+    eq(uint64_t(1), hist->percentile(0, 100));
+
+    delete other;
+    delete hist;
+}
+
+UNITTEST(test_bcache_hit_miss)
+{
+    test_ram_dev_t *dev = test_ram_dev();
+
+    memset(dev->sectors[40], 'a', 512);
+    memset(dev->sectors[41], 'b', 512);
+
+    bcache_stats_t before;
+    bcache_get_stats(&before);
+
+    errno_t err = errno_t::OK;
+    bcache_buf_t *buf = bcache_read(dev, 40, 1024, &err);
+
+    eq(int(errno_t::OK), int(err));
+    ne(nullptr, buf);
+    eq('a', buf->data[0]);
+    eq('b', buf->data[1023]);
+
+    // The device changing behind the cache is not seen
+    memset(dev->sectors[40], 'c', 512);
+
+    bcache_buf_t *again = bcache_read(dev, 40, 1024, &err);
+    eq(buf, again);
+    eq('a', again->data[0]);
+
+    bcache_release(again);
+    bcache_release(buf);
+
+    bcache_stats_t after;
+    bcache_get_stats(&after);
+    eq(before.miss_count + 1, after.miss_count);
+    eq(before.hit_count + 1, after.hit_count);
+
+    // Forgotten, so the next read sees the device
+    eq(int(errno_t::OK), int(bcache_invalidate(dev)));
+
+    buf = bcache_read(dev, 40, 1024, &err);
+    ne(nullptr, buf);
+    eq('c', buf->data[0]);
+    bcache_release(buf);
+
+    // Not a whole number of sectors
+    eq((bcache_buf_t*)nullptr, bcache_read(dev, 40, 100, &err));
+    eq(int(errno_t::EINVAL), int(err));
+
+    eq(int(errno_t::OK), int(bcache_invalidate(dev)));
+}
+
+UNITTEST(test_bcache_dirty_sync)
+{
+    test_ram_dev_t *dev = test_ram_dev();
+
+    memset(dev->sectors[44], 0, 512 * 4);
+
+    bcache_stats_t before;
+    bcache_get_stats(&before);
+
+    // Dirty two blocks, out of order
+    for (uint64_t lba : { 46, 44 }) {
+        bcache_buf_t *buf = bcache_get(dev, lba, 1024);
+        ne(nullptr, buf);
+        memset(buf->data, int('0' + lba), 1024);
+        bcache_mark_dirty(buf);
+        bcache_release(buf);
+    }
+
+    bcache_stats_t mid;
+    bcache_get_stats(&mid);
+    eq(before.dirty_count + 2, mid.dirty_count);
+
+    // Nothing written until synced
+    eq(char(0), dev->sectors[44][0]);
+
+    size_t plans_before = dev->plan_count;
+
+    eq(int(errno_t::OK), int(bcache_sync(dev)));
+
+    // Both in a single batch
+    eq(plans_before + 1, dev->plan_count);
+    eq(size_t(2), dev->last_plan_count);
+
+    eq(char('0' + 44), dev->sectors[44][0]);
+    eq(char('0' + 44), dev->sectors[45][511]);
+    eq(char('0' + 46), dev->sectors[46][0]);
+    eq(char('0' + 46), dev->sectors[47][511]);
+
+    bcache_stats_t after;
+    bcache_get_stats(&after);
+    eq(before.dirty_count, after.dirty_count);
+    eq(before.writeback_count + 2, after.writeback_count);
+
+    eq(int(errno_t::OK), int(bcache_invalidate(dev)));
+}
+
+__END_ANONYMOUS
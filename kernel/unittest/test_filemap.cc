@@ -0,0 +1,242 @@
+#include "unittest.h"
+#include "fileio.h"
+#include "filemap.h"
+#include "process.h"
+#include "mm.h"
+#include "mmu.h"
+#include "user_mem.h"
+#include "cpu/thread_impl.h"
+
+__BEGIN_ANONYMOUS
+
+// Gives the test thread a user address space of its own, like a process,
+// so it can make MAP_USER file mappings and reach them with mm_copy_user.
+// Tearing it down writes back the shared pages, like a process exiting
+class test_user_space_t {
+public:
+    test_user_space_t()
+        : kernel_process(thread_current_process())
+        , process(new (ext::nothrow) process_t())
+    {
+        if (unlikely(!process))
+            panic_oom();
+
+        thread_set_process(-1, process);
+        process->mmu_context = mm_new_process(process, true);
+    }
+
+    ~test_user_space_t()
+    {
+        mm_destroy_process();
+        thread_set_process(-1, kernel_process);
+        process->destroy();
+        delete process;
+    }
+
+private:
+    process_t *kernel_process;
+    process_t *process;
+};
+
+// A two page file, the first page filled with 'a', the second with 'b'
+static int test_filemap_file(char const *path)
+{
+    int fd = file_openat(AT_FDCWD, path, O_CREAT | O_EXCL | O_RDWR, 0644);
+
+    if (unlikely(fd < 0))
+        return fd;
+
+    char *page = (char*)mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_POPULATE);
+
+    for (size_t i = 0; i < 2; ++i) {
+        memset(page, 'a' + i, PAGE_SIZE);
+        file_pwrite(fd, page, PAGE_SIZE, off_t(i * PAGE_SIZE));
+    }
+
+    munmap(page, PAGE_SIZE);
+
+    return fd;
+}
+
+static int test_filemap_load(char const *addr)
+{
+    char value;
+    return mm_copy_user(&value, addr, 1) ? value : -1;
+}
+
+static bool test_filemap_store(char *addr, char value)
+{
+    return mm_copy_user(addr, &value, 1);
+}
+
+static int test_filemap_file_byte(int fd, off_t ofs)
+{
+    char value;
+    return file_pread(fd, &value, 1, ofs) == 1 ? value : -1;
+}
+
+UNITTEST(test_filemap_shared)
+{
+    int fd = test_filemap_file("/filemap_shared");
+    le(0, fd);
+
+    {
+        test_user_space_t user_space;
+
+        char *a = (char*)mmap(nullptr, PAGE_SIZE * 2,
+                              PROT_READ | PROT_WRITE,
+                              MAP_USER | MAP_SHARED, fd, 0);
+        ne(MAP_FAILED, (void*)a);
+
+        char *b = (char*)mmap(nullptr, PAGE_SIZE * 2,
+                              PROT_READ | PROT_WRITE,
+                              MAP_USER | MAP_SHARED, fd, 0);
+        ne(MAP_FAILED, (void*)b);
+
+        eq('a', test_filemap_load(a));
+        eq('b', test_filemap_load(a + PAGE_SIZE));
+
+        // Both mappings write into the same cache page
+        eq(true, test_filemap_store(a + 1, 'x'));
+        eq('x', test_filemap_load(b + 1));
+
+        // msync writes it to the file
+        eq(0, msync(a, PAGE_SIZE * 2, MS_SYNC));
+        eq('x', test_filemap_file_byte(fd, 1));
+
+        // munmap writes back what msync has not
+        eq(true, test_filemap_store(b + PAGE_SIZE, 'y'));
+        eq(0, munmap(b, PAGE_SIZE * 2));
+        eq('y', test_filemap_file_byte(fd, PAGE_SIZE));
+
+        eq(0, munmap(a, PAGE_SIZE * 2));
+    }
+
+    eq(0, file_close(fd));
+    eq(0, file_unlinkat(AT_FDCWD, "/filemap_shared"));
+}
+
+UNITTEST(test_filemap_sync)
+{
+    int fd = test_filemap_file("/filemap_sync");
+    le(0, fd);
+
+    fs_base_t *fs;
+    ino_t ino;
+    eq(0, file_inode(fd, &fs, &ino));
+
+    {
+        test_user_space_t user_space;
+
+        char *a = (char*)mmap(nullptr, PAGE_SIZE * 2,
+                              PROT_READ | PROT_WRITE,
+                              MAP_USER | MAP_SHARED, fd, 0);
+        ne(MAP_FAILED, (void*)a);
+
+        // Read first, so the write finds the page already present
+        eq('a', test_filemap_load(a));
+        eq('b', test_filemap_load(a + PAGE_SIZE));
+        eq(true, test_filemap_store(a + 1, 'x'));
+
+        // The page only read is left alone, not written over the file
+        char value = 'z';
+        eq(1, file_pwrite(fd, &value, 1, PAGE_SIZE));
+
+        // Written back without msync from this process
+        eq(0, int(filemap_sync(fs, ino)));
+        eq('x', test_filemap_file_byte(fd, 1));
+        eq('z', test_filemap_file_byte(fd, PAGE_SIZE));
+
+        eq(0, munmap(a, PAGE_SIZE * 2));
+    }
+
+    eq(0, file_close(fd));
+    eq(0, file_unlinkat(AT_FDCWD, "/filemap_sync"));
+}
+
+UNITTEST(test_filemap_private)
+{
+    int fd = test_filemap_file("/filemap_private");
+    le(0, fd);
+
+    {
+        test_user_space_t user_space;
+
+        char *shared = (char*)mmap(nullptr, PAGE_SIZE * 2, PROT_READ,
+                                   MAP_USER | MAP_SHARED, fd, 0);
+        ne(MAP_FAILED, (void*)shared);
+
+        char *priv = (char*)mmap(nullptr, PAGE_SIZE * 2,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_USER | MAP_PRIVATE, fd, 0);
+        ne(MAP_FAILED, (void*)priv);
+
+        // Read first, so it maps the cache page, then copied on write
+        eq('a', test_filemap_load(priv));
+        eq(true, test_filemap_store(priv, 'p'));
+        eq('p', test_filemap_load(priv));
+        eq('a', test_filemap_load(shared));
+
+        // Written before it was read
+        eq(true, test_filemap_store(priv + PAGE_SIZE, 'q'));
+        eq('q', test_filemap_load(priv + PAGE_SIZE));
+        eq('b', test_filemap_load(shared + PAGE_SIZE));
+
+        // Private copies never reach the file
+        eq(0, msync(priv, PAGE_SIZE * 2, MS_SYNC));
+        eq(0, munmap(priv, PAGE_SIZE * 2));
+        eq('a', test_filemap_file_byte(fd, 0));
+        eq('b', test_filemap_file_byte(fd, PAGE_SIZE));
+
+        eq(0, munmap(shared, PAGE_SIZE * 2));
+    }
+
+    eq(0, file_close(fd));
+    eq(0, file_unlinkat(AT_FDCWD, "/filemap_private"));
+}
+
+UNITTEST(test_filemap_private_mprotect)
+{
+    int fd = test_filemap_file("/filemap_mprotect");
+    le(0, fd);
+
+    {
+        test_user_space_t user_space;
+
+        char *shared = (char*)mmap(nullptr, PAGE_SIZE, PROT_READ,
+                                   MAP_USER | MAP_SHARED, fd, 0);
+        ne(MAP_FAILED, (void*)shared);
+
+        char *priv = (char*)mmap(nullptr, PAGE_SIZE, PROT_READ,
+                                 MAP_USER | MAP_PRIVATE, fd, 0);
+        ne(MAP_FAILED, (void*)priv);
+
+        // Mapped read only, so it maps the cache page
+        eq('a', test_filemap_load(priv));
+
+        // Allowing writes must not hand out the cache page writable,
+        // the write still gets a private copy
+        eq(0, mprotect(priv, PAGE_SIZE, PROT_READ | PROT_WRITE));
+        eq(true, test_filemap_store(priv, 'p'));
+        eq('p', test_filemap_load(priv));
+        eq('a', test_filemap_load(shared));
+
+        // Taking writes away and back keeps the copy
+        eq(0, mprotect(priv, PAGE_SIZE, PROT_READ));
+        eq(0, mprotect(priv, PAGE_SIZE, PROT_READ | PROT_WRITE));
+        eq(true, test_filemap_store(priv + 1, 'r'));
+        eq('p', test_filemap_load(priv));
+        eq('a', test_filemap_load(shared + 1));
+
+        eq(0, munmap(priv, PAGE_SIZE));
+        eq(0, munmap(shared, PAGE_SIZE));
+    }
+
+    eq('a', test_filemap_file_byte(fd, 0));
+
+    eq(0, file_close(fd));
+    eq(0, file_unlinkat(AT_FDCWD, "/filemap_mprotect"));
+}
+
+__END_ANONYMOUS
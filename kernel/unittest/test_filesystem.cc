@@ -1,8 +1,15 @@
 #include "unittest.h"
 #include "fileio.h"
+#include "dev_storage.h"
 #include "vector.h"
 #include "printk.h"
 #include "rand.h"
+#include "name_index.h"
+#include "dentry_cache.h"
+#include "string.h"
+#include "time.h"
+#include "mmu.h"
+#include "inttypes.h"
 
 __BEGIN_ANONYMOUS
 
@@ -20,6 +27,55 @@ UNITTEST(test_filesystem_opendir)
     file_closedir(od);
 }
 
+UNITTEST(test_filesystem_getdents)
+{
+    int od = file_opendirat(AT_FDCWD, "/");
+    lt(0, od);
+
+    dirent_t de;
+    dirent_t *dep;
+    ext::vector<ext::string> names;
+    while (file_readdir_r(od, &de, &dep) > 0) {
+        if (de.d_name[0])
+            eq(true, names.emplace_back(de.d_name));
+    }
+    file_closedir(od);
+
+    od = file_opendirat(AT_FDCWD, "/");
+    lt(0, od);
+
+    // Small enough to take several calls for most directories
+    alignas(8) char buf[DIRENT_RECLEN(NAME_MAX) * 2];
+
+    size_t count = 0;
+    ssize_t size;
+    while ((size = file_getdents(od, buf, sizeof(buf))) > 0) {
+        for (ssize_t pos = 0; pos < size; pos += dep->d_reclen) {
+            dep = (dirent_t*)(buf + pos);
+
+            eq(0, dep->d_reclen & 7);
+            le(DIRENT_RECLEN(strlen(dep->d_name)), size_t(dep->d_reclen));
+            lt(count, names.size());
+            if (count < names.size())
+                eq(0, strcmp(names[count].c_str(), dep->d_name));
+            ++count;
+        }
+    }
+    eq(0, size);
+    eq(names.size(), count);
+
+    file_closedir(od);
+
+    if (names.empty())
+        return;
+
+    // Failing before storing anything is an error, not the end
+    od = file_opendirat(AT_FDCWD, "/");
+    lt(0, od);
+    eq(-int(errno_t::EINVAL), int(file_getdents(od, buf, 8)));
+    file_closedir(od);
+}
+
 // Disabled because this now runs too early for a writable filesystem
 DISABLED_UNITTEST(test_filesystem_create_unlink_churn)
 {
@@ -63,4 +119,259 @@ DISABLED_UNITTEST(test_filesystem_create_unlink_churn)
     }
 }
 
+UNITTEST(test_tmpfs_files)
+{
+    eq(0, file_mkdirat(AT_FDCWD, "/tmpfs_test", 0755));
+
+    int fd = file_openat(AT_FDCWD, "/tmpfs_test/a",
+                         O_CREAT | O_EXCL | O_RDWR, 0644);
+    le(0, fd);
+
+    eq(-int(errno_t::EEXIST),
+       file_openat(AT_FDCWD, "/tmpfs_test/a",
+                   O_CREAT | O_EXCL | O_RDWR, 0644));
+
+    // Write across a page boundary far past the end
+    eq(ssize_t(5), file_pwrite(fd, "hello", 5, 3 * PAGE_SIZE - 2));
+
+    fs_stat_t st;
+    eq(0, file_fstat(fd, &st));
+    eq(off_t(3 * PAGE_SIZE + 3), st.st_size);
+
+    // Only the two pages that were written hold memory
+    eq(blkcnt_t(2 * (PAGE_SIZE >> 9)), st.st_blocks);
+
+    // The hole reads as zeros
+    char buf[8];
+    eq(ssize_t(sizeof(buf)), file_pread(fd, buf, sizeof(buf), PAGE_SIZE));
+    for (char c : buf)
+        eq(0, c);
+
+    // Shrinking then growing again reads zeros past the old end
+    eq(0, file_ftruncate(fd, 3 * PAGE_SIZE - 1));
+    eq(0, file_ftruncate(fd, 3 * PAGE_SIZE + 3));
+    eq(ssize_t(5), file_pread(fd, buf, sizeof(buf), 3 * PAGE_SIZE - 2));
+    eq('h', buf[0]);
+    for (size_t i = 1; i < 5; ++i)
+        eq(0, buf[i]);
+
+    eq(0, file_renameat(AT_FDCWD, "/tmpfs_test/a",
+                        AT_FDCWD, "/tmpfs_test/b"));
+    eq(-int(errno_t::ENOENT), file_fstatat(AT_FDCWD, "/tmpfs_test/a", &st));
+    eq(0, file_fstatat(AT_FDCWD, "/tmpfs_test/b", &st));
+
+    eq(-int(errno_t::ENOTEMPTY), file_rmdirat(AT_FDCWD, "/tmpfs_test"));
+
+    // The contents outlive the name while the file is open
+    eq(0, file_unlinkat(AT_FDCWD, "/tmpfs_test/b"));
+    eq(ssize_t(1), file_pread(fd, buf, 1, 3 * PAGE_SIZE - 2));
+    eq('h', buf[0]);
+    eq(0, file_close(fd));
+
+    eq(0, file_rmdirat(AT_FDCWD, "/tmpfs_test"));
+}
+
+// Small file churn, the rate is printed to compare with other filesystems
+UNITTEST(test_tmpfs_churn)
+{
+    static constexpr size_t live_count = 256;
+    static constexpr size_t op_count = 16384;
+
+    eq(0, file_mkdirat(AT_FDCWD, "/tmpfs_churn", 0755));
+
+    rand_lfs113_t r;
+    ext::vector<int> live(live_count, -1);
+    char name[32];
+    char data[512];
+    memset(data, 'x', sizeof(data));
+
+    uint64_t st = time_ns();
+
+    for (size_t i = 0; i < op_count; ++i) {
+        int& slot = live[r.lfsr113_rand() & (live_count - 1)];
+
+        if (slot >= 0) {
+            snprintf(name, sizeof(name), "/tmpfs_churn/f%d", slot);
+            eq(0, file_unlinkat(AT_FDCWD, name));
+        }
+
+        slot = int(i);
+        snprintf(name, sizeof(name), "/tmpfs_churn/f%d", slot);
+
+        int fd = file_creatat(AT_FDCWD, name, 0644);
+        le(0, fd);
+        eq(ssize_t(sizeof(data)), file_write(fd, data, sizeof(data)));
+        eq(0, file_close(fd));
+    }
+
+    uint64_t elapsed = time_ns() - st;
+
+    for (int slot : live) {
+        if (slot >= 0) {
+            snprintf(name, sizeof(name), "/tmpfs_churn/f%d", slot);
+            eq(0, file_unlinkat(AT_FDCWD, name));
+        }
+    }
+
+    eq(0, file_rmdirat(AT_FDCWD, "/tmpfs_churn"));
+
+    printdbg("tmpfs: %zu create/write/close/unlink in %" PRIu64 "us\n",
+             op_count, elapsed / 1000);
+}
+
+UNITTEST(test_name_index)
+{
+    name_index_stats_t before;
+    name_index_get_stats(&before);
+
+    name_index_t index;
+    uintptr_t value = 0;
+
+    eq(false, index.lookup("a", 1, value));
+    eq(false, index.complete());
+
+    // Enough names to rehash several times
+    char name[16];
+    for (uintptr_t i = 0; i < 1000; ++i) {
+        int len = snprintf(name, sizeof(name), "file%zu", size_t(i));
+        eq(true, index.insert(name, len, i));
+    }
+
+    index.set_complete();
+    eq(true, index.complete());
+    eq(size_t(1000), index.size());
+
+    for (uintptr_t i = 0; i < 1000; ++i) {
+        int len = snprintf(name, sizeof(name), "file%zu", size_t(i));
+        eq(true, index.lookup(name, len, value));
+        eq(i, value);
+    }
+
+    // Prefixes and near misses are not found
+    eq(false, index.lookup("file", 4, value));
+    eq(false, index.lookup("file1000", 8, value));
+
+    // The first duplicate wins, like a directory scan
+    eq(true, index.insert("file7", 5, 12345));
+    eq(true, index.lookup("file7", 5, value));
+    eq(uintptr_t(7), value);
+
+    // Names are bytes, not strings
+    eq(true, index.insert("x\0y", 3, 42));
+    eq(false, index.lookup("x", 1, value));
+    eq(true, index.lookup("x\0y", 3, value));
+    eq(uintptr_t(42), value);
+
+    // Erasing a duplicate uncovers the later one
+    eq(true, index.erase("file7", 5));
+    eq(true, index.lookup("file7", 5, value));
+    eq(uintptr_t(12345), value);
+    eq(true, index.erase("file7", 5));
+    eq(false, index.erase("file7", 5));
+    eq(false, index.lookup("file7", 5, value));
+    eq(true, index.insert("file7", 5, 7));
+
+    // Erase every even name, the odd ones must survive the shifting
+    for (uintptr_t i = 0; i < 1000; i += 2) {
+        int len = snprintf(name, sizeof(name), "file%zu", size_t(i));
+        eq(true, index.erase(name, len));
+    }
+
+    // The odd names and x\0y remain
+    eq(size_t(501), index.size());
+
+    // Reinserting compacts the erased entries away
+    for (uintptr_t i = 0; i < 1000; i += 2) {
+        int len = snprintf(name, sizeof(name), "file%zu", size_t(i));
+        eq(true, index.insert(name, len, i + 1000));
+    }
+
+    for (uintptr_t i = 0; i < 1000; ++i) {
+        int len = snprintf(name, sizeof(name), "file%zu", size_t(i));
+        eq(true, index.lookup(name, len, value));
+        eq(i & 1 ? i : i + 1000, value);
+    }
+
+    name_index_stats_t after;
+    name_index_get_stats(&after);
+
+    le(before.build_count + 1, after.build_count);
+    le(before.insert_count + 1002, after.insert_count);
+    le(before.hit_count + 1002, after.hit_count);
+
+    index.clear();
+    eq(size_t(0), index.size());
+    eq(false, index.complete());
+    eq(false, index.lookup("file7", 5, value));
+}
+
+UNITTEST(test_dentry_cache)
+{
+    // Only used as keys, never called
+    static char fake_fs[2];
+    fs_base_t *fs = reinterpret_cast<fs_base_t*>(&fake_fs[0]);
+    fs_base_t *other_fs = reinterpret_cast<fs_base_t*>(&fake_fs[1]);
+
+    auto hit = [&](ino_t dir, char const *name) {
+        return int(dcache_lookup(fs, dir, name, strlen(name)));
+    };
+
+    dcache_stats_t before;
+    dcache_get_stats(&before);
+
+    // Nothing to test without memory for the cache
+    if (before.capacity == 0)
+        return;
+
+    eq(int(dcache_hit_t::miss), hit(2, "a"));
+
+    uint64_t generation = dcache_generation(fs);
+    dcache_insert(fs, 2, "a", 1, false, generation);
+    dcache_insert(fs, 2, "missing", 7, true, generation);
+
+    eq(int(dcache_hit_t::positive), hit(2, "a"));
+    eq(int(dcache_hit_t::negative), hit(2, "missing"));
+
+    // The directory is part of the key
+    eq(int(dcache_hit_t::miss), hit(3, "a"));
+
+    // Creating names only drops negative entries
+    dcache_invalidate(fs, true);
+    eq(int(dcache_hit_t::positive), hit(2, "a"));
+    eq(int(dcache_hit_t::miss), hit(2, "missing"));
+
+    // An insert from before the invalidation is stale
+    dcache_insert(fs, 2, "missing", 7, true, generation);
+    eq(int(dcache_hit_t::miss), hit(2, "missing"));
+
+    dcache_invalidate(fs, false);
+    eq(int(dcache_hit_t::miss), hit(2, "a"));
+
+    // Changes to another filesystem don't make this one's inserts stale
+    generation = dcache_generation(fs);
+    dcache_invalidate(other_fs, false);
+    eq(generation, dcache_generation(fs));
+    dcache_insert(fs, 2, "a", 1, false, generation);
+    eq(int(dcache_hit_t::positive), hit(2, "a"));
+
+    dcache_invalidate(fs, false);
+
+    // Twice as many names as fit, the cache stays bounded
+    char name[16];
+    generation = dcache_generation(fs);
+    for (uint64_t i = 0; i < before.capacity * 2; ++i) {
+        int len = snprintf(name, sizeof(name), "file%zu", size_t(i));
+        dcache_insert(fs, 2, name, len, true, generation);
+    }
+
+    dcache_stats_t after;
+    dcache_get_stats(&after);
+
+    le(after.entry_count, after.capacity);
+    le(before.evict_count + before.capacity, after.evict_count);
+    le(before.negative_hit_count + 1, after.negative_hit_count);
+
+    dcache_invalidate(fs, false);
+}
+
 __END_ANONYMOUS
@@ -8,6 +8,8 @@
 #include "contig_alloc.h"
 #include "unique_ptr.h"
 #include "cpu/phys_alloc.h"
+#include "thread.h"
+#include "heap.h"
 
 __BEGIN_ANONYMOUS
 
@@ -514,4 +516,100 @@ DISABLED_UNITTEST(test_mmap_oom)
     }
 }
 
+UNITTEST(test_linear_cpu_cache)
+{
+    // Stay on one CPU so both allocations see the same cache
+    thread_t tid = thread_get_id();
+    thread_cpu_mask_t old_affinity = *thread_get_affinity(tid);
+    thread_set_affinity(tid, thread_cpu_mask_t(thread_cpu_number()));
+
+    // A released window is handed straight back
+    void *window = mmap_window(PAGE_SIZE * 3);
+    ne(nullptr, window);
+    munmap_window(window, PAGE_SIZE * 3);
+
+    void *again = mmap_window(PAGE_SIZE * 3);
+    eq(window, again);
+    munmap_window(again, PAGE_SIZE * 3);
+
+    // Populated kernel memory is reusable after its shootdown is deferred
+    for (size_t i = 0; i < 64; ++i) {
+        uint8_t *mem = (uint8_t*)mmap(nullptr, PAGE_SIZE * 2,
+                                      PROT_READ | PROT_WRITE, MAP_POPULATE);
+        ne(MAP_FAILED, (void*)mem);
+        mem[0] = uint8_t(i);
+        mem[PAGE_SIZE] = uint8_t(i);
+        eq(uint8_t(i), mem[0]);
+        eq(uint8_t(i), mem[PAGE_SIZE]);
+        munmap(mem, PAGE_SIZE * 2);
+    }
+
+    thread_set_affinity(tid, old_affinity);
+}
+
+UNITTEST(test_munmap_gather)
+{
+    size_t constexpr pages = 40;
+
+    mm_unmap_stats_t before;
+    mm_get_unmap_stats(&before);
+
+    char *mem = (char*)mmap(nullptr, PAGE_SIZE * pages,
+                            PROT_READ | PROT_WRITE, MAP_POPULATE);
+    ne(MAP_FAILED, (void*)mem);
+
+    for (size_t i = 0; i < pages; ++i)
+        mem[i * PAGE_SIZE] = char(i);
+
+    eq(0, munmap(mem, PAGE_SIZE * pages));
+
+    mm_unmap_stats_t after;
+    mm_get_unmap_stats(&after);
+
+    // Every page went back through the gather
+    le(before.gather_count + 1, after.gather_count);
+    le(before.page_count + pages, after.page_count);
+}
+
+static size_t heap_stats_used(heap_stats_t const& stats)
+{
+    size_t used = 0;
+    for (size_t i = 0; i < HEAP_STATS_BUCKETS; ++i)
+        used += stats.buckets[i].used_count;
+    return used;
+}
+
+UNITTEST(test_heap_stats)
+{
+    heap_t *heap = heap_create(4);
+
+    heap_stats_t before;
+    heap_get_stats(heap, &before);
+
+    eq(size_t(0), heap_stats_used(before));
+    eq(size_t(0), before.large_count);
+
+    void *small = heap_alloc(heap, 40);
+    void *large = heap_alloc(heap, 1 << 20);
+
+    heap_stats_t during;
+    heap_get_stats(heap, &during);
+
+    eq(size_t(1), heap_stats_used(during));
+    eq(size_t(1), during.large_count);
+    le(size_t(1 << 20), during.large_bytes);
+
+    heap_free(heap, small);
+    heap_free(heap, large);
+
+    heap_stats_t after;
+    heap_get_stats(heap, &after);
+
+    eq(size_t(0), heap_stats_used(after));
+    eq(size_t(0), after.large_count);
+    eq(size_t(0), after.large_bytes);
+
+    heap_destroy(heap);
+}
+
 __END_ANONYMOUS
@@ -0,0 +1,124 @@
+#include "unittest.h"
+#include "../device/virtio-base/virtio-base.h"
+
+__BEGIN_ANONYMOUS
+
+// Eight entry packed ring, filled with chains of three descriptors
+struct test_packed_ring_t {
+    static constexpr uint8_t log2_queue_size = 3;
+
+    uint16_t pos = 0;
+    bool wrap = true;
+    uint32_t added = 0;
+
+    void add_chain(unsigned descriptors)
+    {
+        virtio_packed_advance(pos, wrap, descriptors, log2_queue_size);
+        added += descriptors;
+    }
+
+    bool kick(uint16_t event_pos, bool event_wrap,
+              uint16_t flags = VIRTQ_EVENT_F_DESC)
+    {
+        uint16_t off_wrap = event_pos |
+                (uint16_t(event_wrap) << VIRTQ_EVENT_WRAP_BIT);
+
+        bool need_notify = virtio_packed_need_notify(
+                    off_wrap, flags, pos, wrap, added, log2_queue_size);
+
+        added = 0;
+
+        return need_notify;
+    }
+};
+
+__END_ANONYMOUS
+
+UNITTEST(test_virtio_packed_advance)
+{
+    uint16_t pos = 0;
+    bool wrap = true;
+
+    virtio_packed_advance(pos, wrap, 3, 3);
+    eq(uint16_t(3), pos);
+    eq(true, wrap);
+
+    virtio_packed_advance(pos, wrap, 5, 3);
+    eq(uint16_t(0), pos);
+    eq(false, wrap);
+
+    virtio_packed_advance(pos, wrap, 6, 3);
+    virtio_packed_advance(pos, wrap, 3, 3);
+    eq(uint16_t(1), pos);
+    eq(true, wrap);
+}
+
+UNITTEST(test_virtio_packed_notify_chains)
+{
+    test_packed_ring_t ring;
+
+    // One chain of three, the device wants to hear about position 0.
+    // Counting the chain as one ring position would miss it
+    ring.add_chain(3);
+    eq(true, ring.kick(0, true));
+
+    // Asking about the last descriptor of the chain
+    ring.add_chain(3);
+    eq(true, ring.kick(5, true));
+
+    // Asking about a position not made available yet
+    ring.add_chain(1);
+    eq(uint16_t(7), ring.pos);
+    eq(false, ring.kick(7, true));
+}
+
+UNITTEST(test_virtio_packed_notify_wrap)
+{
+    test_packed_ring_t ring;
+
+    ring.add_chain(3);
+    eq(true, ring.kick(0, true));
+
+    // Two more chains wrap the ring to position 1 of the next lap
+    ring.add_chain(3);
+    ring.add_chain(3);
+    eq(uint16_t(1), ring.pos);
+    eq(false, ring.wrap);
+
+    // Event before the wrap, after the last kick
+    eq(true, ring.kick(3, true));
+
+    ring.add_chain(3);
+    ring.add_chain(3);
+    eq(uint16_t(7), ring.pos);
+
+    // Event on this lap, after the last kick
+    eq(true, ring.kick(2, false));
+
+    // Event already passed at the last kick
+    ring.add_chain(3);
+    eq(uint16_t(2), ring.pos);
+    eq(true, ring.wrap);
+    eq(false, ring.kick(6, false));
+
+    // Event exactly at the position made available next
+    ring.add_chain(3);
+    eq(false, ring.kick(5, true));
+}
+
+UNITTEST(test_virtio_packed_notify_flags)
+{
+    test_packed_ring_t ring;
+
+    ring.add_chain(3);
+    eq(true, ring.kick(0, true, VIRTQ_EVENT_F_ENABLE));
+
+    ring.add_chain(3);
+    eq(false, ring.kick(0, true, VIRTQ_EVENT_F_DISABLE));
+
+    // A whole lap without a kick passes every event
+    ring.add_chain(3);
+    ring.add_chain(3);
+    ring.add_chain(3);
+    eq(true, ring.kick(ring.pos, ring.wrap));
+}
@@ -0,0 +1,100 @@
+#include "unittest.h"
+#include "zswap.h"
+#include "mm.h"
+#include "mmu.h"
+#include "string.h"
+
+__BEGIN_ANONYMOUS
+
+class zswap_page_t {
+public:
+    zswap_page_t()
+        : data((uint8_t*)mmap(nullptr, PAGE_SIZE,
+                              PROT_READ | PROT_WRITE, MAP_POPULATE))
+        , physaddr(mphysaddr(data))
+    {
+    }
+
+    ~zswap_page_t()
+    {
+        munmap(data, PAGE_SIZE);
+    }
+
+    uint8_t *data;
+    uintptr_t physaddr;
+};
+
+UNITTEST(test_zswap_filled_roundtrip)
+{
+    zswap_page_t page;
+
+    memset(page.data, 0x5A, PAGE_SIZE);
+
+    int64_t slot = zswap_store(page.physaddr);
+    le(0, slot);
+
+    memset(page.data, 0, PAGE_SIZE);
+
+    eq(int(errno_t::OK), int(zswap_load(slot, page.physaddr)));
+
+    for (size_t i = 0; i < PAGE_SIZE; ++i)
+        eq(0x5A, page.data[i]);
+}
+
+UNITTEST(test_zswap_compressed_roundtrip)
+{
+    zswap_page_t page;
+
+    for (size_t i = 0; i < PAGE_SIZE; ++i)
+        page.data[i] = uint8_t(i % 17);
+
+    zswap_stats_t before;
+    zswap_get_stats(&before);
+
+    int64_t slot = zswap_store(page.physaddr);
+    le(0, slot);
+
+    zswap_stats_t after;
+    zswap_get_stats(&after);
+    eq(before.stored_pages + 1, after.stored_pages);
+    lt(after.compressed_bytes, before.compressed_bytes + PAGE_SIZE / 4);
+
+    memset(page.data, 0, PAGE_SIZE);
+
+    eq(int(errno_t::OK), int(zswap_load(slot, page.physaddr)));
+
+    for (size_t i = 0; i < PAGE_SIZE; ++i)
+        eq(uint8_t(i % 17), page.data[i]);
+
+    zswap_get_stats(&after);
+    eq(before.stored_pages, after.stored_pages);
+    eq(before.compressed_bytes, after.compressed_bytes);
+}
+
+UNITTEST(test_zswap_release)
+{
+    zswap_page_t page;
+
+    for (size_t i = 0; i < PAGE_SIZE; ++i)
+        page.data[i] = uint8_t(i >> 4);
+
+    zswap_stats_t before;
+    zswap_get_stats(&before);
+
+    int64_t slot = zswap_store(page.physaddr);
+    le(0, slot);
+
+    zswap_release(slot);
+
+    zswap_stats_t after;
+    zswap_get_stats(&after);
+    eq(before.stored_pages, after.stored_pages);
+    eq(before.compressed_bytes, after.compressed_bytes);
+
+    // Released slot is reused
+    int64_t again = zswap_store(page.physaddr);
+    eq(slot, again);
+    zswap_release(again);
+}
+
+__END_ANONYMOUS
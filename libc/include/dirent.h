@@ -43,4 +43,9 @@ int readdir_r(DIR *__dirp, struct dirent *__entry, struct dirent **result);
 void seekdir(DIR *__dirp, off_t __ofs);
 off_t telldir(DIR *__dirp);
 
+// Fill __dirp with packed struct dirent records, each d_reclen bytes long
+// and holding a nul terminated name. Returns the number of bytes stored,
+// 0 at the end of the directory
+ssize_t getdents64(int __fd, void *__dirp, size_t __count);
+
 __END_DECLS
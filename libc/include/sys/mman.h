@@ -23,8 +23,10 @@ __BEGIN_DECLS
 #define MAP_UNINITIALIZED   0x00000080
 #define MAP_32BIT           0x00000100
 #define MAP_ANONYMOUS       0x00000200
-#define MAP_INVALID_MASK    0x003FFC00
-#define MAP_USER_MASK       0x000003FF
+#define MAP_SHARED          0x00000400
+#define MAP_PRIVATE         0x00000800
+#define MAP_INVALID_MASK    0x003FF000
+#define MAP_USER_MASK       0x00000FFF
 
 /// Ignored. Redundant.
 #define MAP_DENYWRITE       0
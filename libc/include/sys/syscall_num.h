@@ -338,3 +338,4 @@
 #define SYS_detach                  327
 #define SYS_is_joinable             328
 #define SYS_sigreturn               329
+#define SYS_meminfo                 330
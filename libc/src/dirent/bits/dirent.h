@@ -1,5 +1,16 @@
 #pragma once
 
+#include <stddef.h>
+
+// Bytes of entries fetched per getdents64 call
+#define __DIRSTREAM_BUFSIZE 32768
+
 struct __dirstream {
     int dirfd;
+
+    // Entries from the last getdents64 call are buf[pos] to buf[size]
+    size_t pos;
+    size_t size;
+
+    alignas(8) char buf[__DIRSTREAM_BUFSIZE];
 };
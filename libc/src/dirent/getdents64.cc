@@ -0,0 +1,17 @@
+#include <dirent.h>
+#include <errno.h>
+#include <sys/likely.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+
+ssize_t getdents64(int __fd, void *__dirp, size_t __count)
+{
+    long status = syscall3(__fd, uintptr_t(__dirp), __count, SYS_getdents64);
+
+    if (likely(status >= 0))
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
@@ -20,5 +20,7 @@ DIR *opendir(char const *__pathname)
     }
 
     dir->dirfd = _opendir(__pathname);
+    dir->pos = 0;
+    dir->size = 0;
     return dir;
 }
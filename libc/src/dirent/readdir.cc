@@ -1,33 +1,25 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/likely.h>
-#include <sys/syscall.h>
-#include <sys/syscall_num.h>
 #include "bits/dirent.h"
 
-static __thread dirent_t current_dirent;
-
-int readdir_r(int dirfd, dirent_t *buf, dirent_t **result)
+struct dirent *readdir(DIR *__dirp)
 {
-    long err = syscall2(dirfd, uintptr_t(buf), SYS_readdir_r);
-
-    if (unlikely(err < 0)) {
-        errno = -err;
-        return -1;
-    }
+    // Refill the buffer with as many entries as fit
+    if (__dirp->pos >= __dirp->size) {
+        ssize_t size = getdents64(__dirp->dirfd, __dirp->buf,
+                                  sizeof(__dirp->buf));
 
-    *result = buf;
+        if (unlikely(size <= 0))
+            return nullptr;
 
-    return int(err);
-}
+        __dirp->pos = 0;
+        __dirp->size = size_t(size);
+    }
 
-struct dirent *readdir(DIR *__dirp)
-{
-    dirent_t *result = nullptr;
-    dirent_t *buf = &current_dirent;
+    dirent_t *result = (dirent_t*)(__dirp->buf + __dirp->pos);
 
-    if (unlikely(readdir_r(__dirp->dirfd, buf, &result) == 0))
-        return nullptr;
+    __dirp->pos += result->d_reclen;
 
     return result;
 }
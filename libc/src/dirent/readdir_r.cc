@@ -1,9 +1,28 @@
 #include <dirent.h>
 #include <errno.h>
+#include <string.h>
 #include "bits/dirent.h"
 
 int readdir_r(DIR *__dirp, struct dirent *__entry, struct dirent **result)
 {
-    errno = ENOSYS;
-    return -1;
+    int saved_errno = errno;
+
+    errno = 0;
+
+    struct dirent *ent = readdir(__dirp);
+
+    if (!ent) {
+        int err = errno;
+        errno = saved_errno;
+        *result = nullptr;
+        return err;
+    }
+
+    errno = saved_errno;
+
+    // The packed entry is no larger than struct dirent
+    memcpy(__entry, ent, ent->d_reclen);
+    *result = __entry;
+
+    return 0;
 }
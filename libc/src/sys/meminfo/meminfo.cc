@@ -0,0 +1,19 @@
+#include <sys/meminfo.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <sys/likely.h>
+
+long meminfo(pid_t pid, meminfo_t *info,
+             meminfo_heap_t *heaps, size_t heap_count)
+{
+    long result = syscall4(scp_t(pid), scp_t(info), scp_t(heaps),
+                           scp_t(heap_count), SYS_meminfo);
+
+    if (unlikely(result < 0)) {
+        errno = -result;
+        return -1;
+    }
+
+    return result;
+}
@@ -933,6 +933,11 @@ int main(int argc, char **argv, char **envp)
     load_module("boot/gpt.km");
     load_module("boot/mbr.km");
 
+    // These do nothing unless the command line has their options
+    load_module("boot/ramdisk.km");
+    load_module("boot/raid.km");
+    load_module("boot/storbench.km");
+
     if (probe_pci_for(0x10EC, 0x8139,
                       PCI_DEV_CLASS_NETWORK,
                       PCI_SUBCLASS_NETWORK_ETHERNET, -1))